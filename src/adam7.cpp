@@ -0,0 +1,169 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <omp.h>
+
+#include "adam7.h"
+#include "processImage.h"
+#include "expandKernels.h"
+#include "trace.h"
+
+static const int passXStart[ADAM7_PASSES] = {0, 4, 0, 2, 0, 1, 0};
+static const int passYStart[ADAM7_PASSES] = {0, 0, 4, 0, 2, 0, 1};
+static const int passXStep[ADAM7_PASSES] = {8, 8, 4, 4, 2, 2, 1};
+static const int passYStep[ADAM7_PASSES] = {8, 8, 8, 4, 4, 2, 2};
+
+// Spacing of the decoded pixels once passes 1..N are done, indexed by N - 1.
+static const int previewXStep[ADAM7_PASSES] = {8, 4, 4, 2, 2, 1, 1};
+static const int previewYStep[ADAM7_PASSES] = {8, 8, 4, 4, 2, 2, 1};
+
+size_t getAdam7Passes(int width, int height, int bitsPerPixel, struct adam7Pass passes[ADAM7_PASSES]) {
+    size_t offset = 0;
+
+    for (int p = 0; p < ADAM7_PASSES; p++) {
+        struct adam7Pass &pass = passes[p];
+        pass.xStart = passXStart[p];
+        pass.yStart = passYStart[p];
+        pass.xStep = passXStep[p];
+        pass.yStep = passYStep[p];
+        pass.width = width > pass.xStart ? (width - pass.xStart + pass.xStep - 1) / pass.xStep : 0;
+        pass.height = height > pass.yStart ? (height - pass.yStart + pass.yStep - 1) / pass.yStep : 0;
+        pass.offset = offset;
+        pass.size = pass.width == 0 || pass.height == 0 ? 0 : (size_t) pass.height * (getRowBytes(pass.width, bitsPerPixel) + 1);
+        offset += pass.size;
+    }
+    return offset;
+}
+
+// Writes 'count' consecutive pixels from 'src' to every xStep-th pixel of 'dst'.
+template <int BYTES_PER_PIXEL>
+static void scatterPixels(unsigned char *dst, const unsigned char *src, int count, int xStep) {
+    size_t dstStride = (size_t) xStep * BYTES_PER_PIXEL;
+    for (int x = 0; x < count; x++) {
+        std::memcpy(dst + x * dstStride, src + x * BYTES_PER_PIXEL, BYTES_PER_PIXEL);
+    }
+}
+
+static void scatterPixels(unsigned char *dst, const unsigned char *src, int count, int xStep, int bytesPerPixel) {
+    switch (bytesPerPixel) {
+        case 1: scatterPixels<1>(dst, src, count, xStep); break;
+        case 2: scatterPixels<2>(dst, src, count, xStep); break;
+        case 3: scatterPixels<3>(dst, src, count, xStep); break;
+        case 4: scatterPixels<4>(dst, src, count, xStep); break;
+        case 6: scatterPixels<6>(dst, src, count, xStep); break;
+        case 8: scatterPixels<8>(dst, src, count, xStep); break;
+        default:
+            for (int x = 0; x < count; x++) {
+                std::memcpy(dst + (size_t) x * xStep * bytesPerPixel, src + (size_t) x * bytesPerPixel, bytesPerPixel);
+            }
+    }
+}
+
+/**
+ * Fills the pixels of rows [firstRow, endRow) that the passes decoded so far have not reached,
+ * each from the decoded pixel at the top left of its xStep x yStep cell. firstRow must be a
+ * multiple of yStep so the cell's decoded row is inside the range.
+*/
+static void fillPreviewRows(unsigned char *image, size_t stride, int width, int bytesPerPixel, int firstRow, int endRow, int xStep, int yStep) {
+    size_t rowBytes = (size_t) width * bytesPerPixel;
+
+    for (int y = firstRow; y < endRow; y++) {
+        unsigned char *row = image + y * stride;
+        int sourceRow = y & ~(yStep - 1);
+
+        if (sourceRow != y) {
+            std::memcpy(row, image + sourceRow * stride, rowBytes);
+            continue;
+        }
+        for (int x = 0; x < width; x++) {
+            if (x & (xStep - 1)) {
+                std::memcpy(row + (size_t) x * bytesPerPixel, row + (size_t) (x & ~(xStep - 1)) * bytesPerPixel, bytesPerPixel);
+            }
+        }
+    }
+}
+
+bool defilterAdam7(const std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, const struct ihdr &ihdrData, int lastPass, int threads) {
+    defilteredData.resize((size_t) ihdrData.width * ihdrData.height * DECODED_BYTES_PER_PIXEL);
+    struct outputDescriptor output = {defilteredData.data(), (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL, PIXEL_RGBA8};
+    return defilterAdam7(decompressedData.data(), decompressedData.size(), output, ihdrData, lastPass, threads);
+}
+
+bool defilterAdam7(const unsigned char *decompressedData, size_t decompressedSize, const struct outputDescriptor &output, const struct ihdr &ihdrData, int lastPass, int threads) {
+    TRACE_SCOPE("defilterAdam7");
+    struct adam7Pass passes[ADAM7_PASSES];
+    struct rowExpander expander;
+    int width = ihdrData.width, height = ihdrData.height;
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+
+    if (bitsPerPixel == -1 || !buildRowExpander(ihdrData, expander, output.format)) {
+        std::cerr << "Unsupported color type " << ihdrData.colorType << " with bit depth " << ihdrData.channelDepth << std::endl;
+        return false;
+    }
+    const struct rowExpander *passExpander = getActiveExpander(expander);
+    // the passes come out of defilterSubImage already converted to the output format
+    int bytesPerPixel = expander.outBytesPerPixel;
+    lastPass = std::min(std::max(lastPass, 1), ADAM7_PASSES);
+    threads = threads > 0 ? threads : omp_get_max_threads();
+
+    getAdam7Passes(width, height, bitsPerPixel, passes);
+    size_t neededSize = passes[lastPass - 1].offset + passes[lastPass - 1].size;
+    if (decompressedSize < neededSize) {
+        std::cerr << "Decompressed data too short for Adam7 passes 1-" << lastPass << " of a " << width << " x " << height << " image" << std::endl;
+        return false;
+    }
+
+    // Defilter the passes into their own buffers, largest (latest) first so the dynamic schedule balances.
+    // The buffers belong to the calling thread and keep their capacity for its next image.
+    static thread_local std::vector<unsigned char> threadPassData[ADAM7_PASSES];
+    // taken here: inside the parallel regions the name would refer to each worker's own copy
+    std::vector<unsigned char> *passData = threadPassData;
+    bool failed = false;
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (int p = lastPass - 1; p >= 0; p--) {
+        const struct adam7Pass &pass = passes[p];
+        if (pass.size == 0) {
+            continue;
+        }
+        TRACE_SCOPE_ARG("defilterAdam7Pass", "pass", p + 1);
+        passData[p].resize((size_t) pass.width * pass.height * bytesPerPixel);
+        if (!defilterSubImage(decompressedData + pass.offset, passData[p].data(), pass.width, pass.height, bitsPerPixel, passExpander)) {
+            #pragma omp atomic write
+            failed = true;
+        }
+    }
+    if (failed) {
+        return false;
+    }
+
+    size_t stride = output.stride;
+    int bandCount = (height + ADAM7_BAND_ROWS - 1) / ADAM7_BAND_ROWS;
+    unsigned char *image = output.pixels;
+
+    // Scatter band by band: all passes write into a band of output rows before moving to the next.
+    #pragma omp parallel for schedule(static) num_threads(threads)
+    for (int band = 0; band < bandCount; band++) {
+        int firstRow = band * ADAM7_BAND_ROWS;
+        int endRow = std::min(firstRow + ADAM7_BAND_ROWS, height);
+
+        for (int p = 0; p < lastPass; p++) {
+            const struct adam7Pass &pass = passes[p];
+            if (pass.size == 0) {
+                continue;
+            }
+            size_t passRowBytes = (size_t) pass.width * bytesPerPixel;
+            // yStart < yStep, and every yStep divides the band height, so each band starts a pass row cycle
+            for (int y = firstRow + pass.yStart; y < endRow; y += pass.yStep) {
+                const unsigned char *src = passData[p].data() + (size_t) ((y - pass.yStart) / pass.yStep) * passRowBytes;
+                scatterPixels(image + y * stride + (size_t) pass.xStart * bytesPerPixel, src, pass.width, pass.xStep, bytesPerPixel);
+            }
+        }
+
+        if (lastPass < ADAM7_PASSES) {
+            fillPreviewRows(image, stride, width, bytesPerPixel, firstRow, endRow, previewXStep[lastPass - 1], previewYStep[lastPass - 1]);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef _ADAM7_H_
+#define _ADAM7_H_
+
+#include <vector>
+#include <cstddef>
+
+#include "readImage.h"
+#include "expandKernels.h"
+
+#define ADAM7_PASSES 7
+
+// Output rows handled together when scattering passes into the image: one Adam7 block row.
+#define ADAM7_BAND_ROWS 8
+
+/**
+ * One of the seven reduced images of an Adam7 interlaced PNG. Pass pixel (x, y) belongs at image
+ * pixel (xStart + x * xStep, yStart + y * yStep). Passes that are empty for small images have
+ * width or height 0 and take up no bytes, not even filter bytes.
+*/
+struct adam7Pass {
+    int xStart, yStart, xStep, yStep;
+    int width, height;
+    // where the pass's filtered rows start in the inflated data, and how many bytes they take
+    size_t offset;
+    size_t size;
+};
+
+/**
+ * Locates the seven passes of a width x height image in the inflated IDAT data.
+ *
+ * @return the inflated size of the whole image.
+*/
+size_t getAdam7Passes(int width, int height, int bitsPerPixel, struct adam7Pass passes[ADAM7_PASSES]);
+
+/**
+ * Decodes an Adam7 interlaced image into a regular RGBA8 image, expanding other formats as
+ * defilterIDAT does.
+ *
+ * The passes are independent once inflated, so they are defiltered concurrently (OpenMP), each
+ * into its own buffer. They are then scattered into 'defilteredData' one ADAM7_BAND_ROWS band at
+ * a time, so every pass writes into the band while it is in cache.
+ *
+ * @param lastPass Stop after this pass (1 to 7). Only the data of passes 1..lastPass needs to be
+ *                 present, and every pixel not yet decoded is copied from the decoded pixel above
+ *                 and to the left of it, which gives a blocky low-resolution preview.
+ * @param threads Threads to use; 0 for the OpenMP default, 1 to stay on the calling thread.
+*/
+bool defilterAdam7(const std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, const struct ihdr &ihdrData, int lastPass = ADAM7_PASSES, int threads = 0);
+
+// Same as above into the caller's buffer, in the descriptor's format and row stride.
+bool defilterAdam7(const unsigned char *decompressedData, size_t decompressedSize, const struct outputDescriptor &output, const struct ihdr &ihdrData, int lastPass = ADAM7_PASSES, int threads = 0);
+
+#endif
@@ -0,0 +1,577 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+
+// io_uring through its system calls, and the blocking fallback
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "asyncReader.h"
+#include "printUtils.h"
+#include "timer.h"
+#include "trace.h"
+
+// Longest single read handed to the kernel; longer files take several.
+#define ASYNC_READ_MAX_OPERATION_BYTES ((size_t) 1 << 30)
+
+// What a completion belongs to, kept in the top half of its user_data; the bottom half is the slot.
+enum uringOperation {
+    URING_OPEN = 1,
+    URING_READ,
+    URING_CLOSE
+};
+
+// The rings shared with the kernel, as mapped after io_uring_setup.
+struct uringQueue {
+    int fd = -1;
+    unsigned entries = 0;
+    void *sqMapping = MAP_FAILED;
+    void *cqMapping = MAP_FAILED;
+    size_t sqMappingSize = 0, cqMappingSize = 0;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *) MAP_FAILED;
+    size_t sqesSize = 0;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // queue entries filled in locally; the kernel sees them at the next submit
+    unsigned localTail = 0;
+    unsigned unsubmitted = 0;
+    // the slot buffers are registered, so reads into them can be IORING_OP_READ_FIXED
+    bool fixedBuffers = false;
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, const void *arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void closeUring(struct uringQueue &ring);
+
+/**
+ * Asks the kernel which operations the ring supports. io_uring itself came in 5.1, but opening
+ * and closing files through it (and the probe) only in 5.6, so a ring without the probe is no use
+ * here either. READ_FIXED is optional; reads fall back to IORING_OP_READ without it.
+*/
+static bool probeUringOperations(struct uringQueue &ring, bool &readFixed, std::atomic<long> &syscalls) {
+    size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    std::vector<unsigned char> probeMemory(probeSize, 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *) probeMemory.data();
+
+    bool probed = uringRegister(ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    syscalls++;
+    auto supported = [probe](int opcode) {
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    };
+    readFixed = probed && supported(IORING_OP_READ_FIXED);
+    return probed && supported(IORING_OP_OPENAT) && supported(IORING_OP_READ) && supported(IORING_OP_CLOSE);
+}
+
+/**
+ * Creates the ring and maps its queues. 'syscalls' counts the calls made.
+ *
+ * @return false if the kernel has no io_uring, or does not let this process use it.
+*/
+static bool openUring(struct uringQueue &ring, unsigned entries, std::atomic<long> &syscalls) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    ring.fd = uringSetup(entries, &params);
+    syscalls++;
+    if (ring.fd < 0) {
+        return false;
+    }
+    ring.entries = params.sq_entries;
+
+    ring.sqMappingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqMappingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMapping) {
+        ring.sqMappingSize = ring.cqMappingSize = std::max(ring.sqMappingSize, ring.cqMappingSize);
+    }
+
+    ring.sqMapping = mmap(NULL, ring.sqMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    syscalls++;
+    if (ring.sqMapping == MAP_FAILED) {
+        closeUring(ring);
+        return false;
+    }
+    if (singleMapping) {
+        ring.cqMapping = ring.sqMapping;
+    } else {
+        ring.cqMapping = mmap(NULL, ring.cqMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        syscalls++;
+    }
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *) mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    syscalls++;
+    if (ring.cqMapping == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        closeUring(ring);
+        return false;
+    }
+
+    unsigned char *sq = (unsigned char *) ring.sqMapping, *cq = (unsigned char *) ring.cqMapping;
+    ring.sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring.sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring.cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring.cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring.localTail = *ring.sqTail;
+    return true;
+}
+
+static void closeUring(struct uringQueue &ring) {
+    if (ring.sqes != MAP_FAILED) {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    if (ring.cqMapping != MAP_FAILED && ring.cqMapping != ring.sqMapping) {
+        munmap(ring.cqMapping, ring.cqMappingSize);
+    }
+    if (ring.sqMapping != MAP_FAILED) {
+        munmap(ring.sqMapping, ring.sqMappingSize);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    ring.fd = -1;
+    ring.sqMapping = ring.cqMapping = MAP_FAILED;
+    ring.sqes = (struct io_uring_sqe *) MAP_FAILED;
+}
+
+// The next free submission queue entry, zeroed, or NULL when the queue is full.
+static struct io_uring_sqe *nextSQE(struct uringQueue &ring) {
+    unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    if (ring.localTail - head >= ring.entries) {
+        return NULL;
+    }
+    unsigned index = ring.localTail & *ring.sqMask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ring.sqArray[index] = index;
+    ring.localTail++;
+    ring.unsubmitted++;
+    return sqe;
+}
+
+/**
+ * Hands the queued entries to the kernel and, with 'waitFor' above 0, waits for that many
+ * completions in the same call.
+ *
+ * @return false if io_uring_enter failed for good.
+*/
+static bool submitUring(struct uringQueue &ring, unsigned waitFor, std::atomic<long> &syscalls) {
+    __atomic_store_n(ring.sqTail, ring.localTail, __ATOMIC_RELEASE);
+    while (true) {
+        int submitted = uringEnter(ring.fd, ring.unsubmitted, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+        syscalls++;
+        if (submitted >= 0) {
+            ring.unsubmitted -= submitted;
+            return true;
+        }
+        // the completion queue is full or the kernel is short of memory: reap and come back
+        if (errno == EAGAIN || errno == EBUSY) {
+            return true;
+        }
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+static uint64_t getUserData(enum uringOperation operation, int slot) {
+    return ((uint64_t) operation << 32) | (uint32_t) slot;
+}
+
+AsyncBatchReader::AsyncBatchReader(enum asyncReadBackend backend, int slots, size_t slotBytes)
+    : ring(NULL), slots(std::max(slots, 1)), slotBytes(slotBytes), slotMemory(NULL), syscalls(0), operations(0), files(0), failed(0), bytes(0), seconds(0) {
+    // page aligned, so the kernel can pin the buffers whole
+    void *memory = mmap(NULL, (size_t) this->slots * slotBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    slotMemory = memory == MAP_FAILED ? NULL : (unsigned char *) memory;
+    for (int slot = this->slots - 1; slot >= 0; slot--) {
+        freeSlots.push_back(slot);
+    }
+
+    if (backend == ASYNC_READ_PREAD || slotMemory == NULL) {
+        return;
+    }
+    // an open, a read and a close per file at most, with room to queue the next batch meanwhile
+    ring = new uringQueue();
+    bool readFixed = false;
+    if (!openUring(*ring, 4 * this->slots, syscalls) || !probeUringOperations(*ring, readFixed, syscalls)) {
+        if (backend == ASYNC_READ_IO_URING) {
+            std::cerr << "io_uring is not available, reading with pread instead" << std::endl;
+        }
+        closeUring(*ring);
+        delete ring;
+        ring = NULL;
+        return;
+    }
+
+    std::vector<struct iovec> buffers(this->slots);
+    for (int slot = 0; slot < this->slots; slot++) {
+        buffers[slot].iov_base = slotMemory + slot * slotBytes;
+        buffers[slot].iov_len = slotBytes;
+    }
+    // Without registration (for instance over the locked memory limit) plain reads into the same buffers still work.
+    if (readFixed) {
+        ring->fixedBuffers = uringRegister(ring->fd, IORING_REGISTER_BUFFERS, buffers.data(), this->slots) == 0;
+        syscalls++;
+    }
+}
+
+AsyncBatchReader::~AsyncBatchReader() {
+    if (ring != NULL) {
+        closeUring(*ring);
+        delete ring;
+    }
+    if (slotMemory != NULL) {
+        munmap(slotMemory, (size_t) slots * slotBytes);
+    }
+}
+
+int AsyncBatchReader::takeSlot(bool wait) {
+    std::unique_lock<std::mutex> guard(slotLock);
+    if (wait) {
+        slotFreed.wait(guard, [this]() { return !freeSlots.empty(); });
+    } else if (freeSlots.empty()) {
+        return -1;
+    }
+    int slot = freeSlots.back();
+    freeSlots.pop_back();
+    return slot;
+}
+
+void AsyncBatchReader::returnSlot(int slot) {
+    {
+        std::lock_guard<std::mutex> guard(slotLock);
+        freeSlots.push_back(slot);
+    }
+    slotFreed.notify_one();
+}
+
+AsyncFilePtr AsyncBatchReader::makeFile(asyncFile *file) {
+    if (file->ok) {
+        files++;
+        bytes += file->size;
+    } else {
+        failed++;
+    }
+    return AsyncFilePtr(file, [this](const asyncFile *done) {
+        if (done->slot != -1) {
+            returnSlot(done->slot);
+        }
+        delete done;
+    });
+}
+
+void AsyncBatchReader::readFiles(const std::vector<std::string> &files, const AsyncFileHandler &onFile) {
+    TRACE_SCOPE("asyncReadFiles");
+    double start, end;
+    GET_TIME(start);
+    if (slotMemory == NULL) {
+        std::cerr << "Error allocating the read buffers" << std::endl;
+        for (size_t index = 0; index < files.size(); index++) {
+            asyncFile *file = new asyncFile();
+            file->index = index;
+            onFile(makeFile(file));
+        }
+    } else if (ring != NULL) {
+        readWithUring(files, onFile);
+    } else {
+        readWithPread(files, onFile);
+    }
+    GET_TIME(end);
+    seconds += end - start;
+}
+
+void AsyncBatchReader::readWithUring(const std::vector<std::string> &files, const AsyncFileHandler &onFile) {
+    // a file between its open and its close
+    struct uringFile {
+        bool active;
+        size_t index;
+        int fd;
+        size_t done;
+        // set once the file turned out larger than its slot
+        bool inHeap;
+        std::vector<unsigned char> heap;
+    };
+    std::vector<uringFile> inFlight(slots);
+    size_t next = 0;
+    long operationsInFlight = 0;
+    bool broken = false;
+
+    // entries are only short while the kernel has not consumed the last submit
+    auto getSQE = [&]() {
+        struct io_uring_sqe *sqe;
+        while ((sqe = nextSQE(*ring)) == NULL) {
+            submitUring(*ring, 0, syscalls);
+        }
+        operationsInFlight++;
+        return sqe;
+    };
+    auto queueRead = [&](int slot) {
+        uringFile &file = inFlight[slot];
+        struct io_uring_sqe *sqe = getSQE();
+        unsigned char *buffer = file.inHeap ? file.heap.data() : slotMemory + slot * slotBytes;
+        size_t length = (file.inHeap ? file.heap.size() : slotBytes) - file.done;
+        sqe->opcode = !file.inHeap && ring->fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = file.fd;
+        sqe->addr = (uint64_t) (uintptr_t) (buffer + file.done);
+        sqe->len = (uint32_t) std::min(length, ASYNC_READ_MAX_OPERATION_BYTES);
+        sqe->off = file.done;
+        sqe->buf_index = file.inHeap ? 0 : slot;
+        sqe->user_data = getUserData(URING_READ, slot);
+    };
+    // Closes the file without waiting for it, then hands it over.
+    auto finishFile = [&](int slot, bool ok) {
+        uringFile &file = inFlight[slot];
+        if (file.fd >= 0) {
+            struct io_uring_sqe *sqe = getSQE();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = file.fd;
+            sqe->user_data = getUserData(URING_CLOSE, slot);
+        }
+        file.active = false;
+
+        asyncFile *done = new asyncFile();
+        done->index = file.index;
+        done->ok = ok;
+        if (!ok) {
+            std::cerr << "Error reading " << files[file.index] << std::endl;
+            returnSlot(slot);
+        } else if (file.inHeap) {
+            done->heapData.swap(file.heap);
+            done->heapData.resize(file.done);
+            done->data = done->heapData.data();
+            done->size = file.done;
+            returnSlot(slot);
+        } else {
+            done->slot = slot;
+            done->data = slotMemory + slot * slotBytes;
+            done->size = file.done;
+        }
+        file.heap = std::vector<unsigned char>();
+        onFile(makeFile(done));
+    };
+
+    while (!broken && (next < files.size() || operationsInFlight > 0)) {
+        // Open as many files as there are free slots. With nothing left in flight there is nothing
+        // to reap either, so wait for the caller to let go of a file.
+        while (next < files.size()) {
+            int slot = takeSlot(operationsInFlight == 0);
+            if (slot == -1) {
+                break;
+            }
+            inFlight[slot].active = true;
+            inFlight[slot].index = next;
+            inFlight[slot].fd = -1;
+            inFlight[slot].done = 0;
+            inFlight[slot].inHeap = false;
+            struct io_uring_sqe *sqe = getSQE();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t) (uintptr_t) files[next].c_str();
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = getUserData(URING_OPEN, slot);
+            next++;
+        }
+
+        if (!submitUring(*ring, 1, syscalls)) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            broken = true;
+            break;
+        }
+
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe &cqe = ring->cqes[head & *ring->cqMask];
+            enum uringOperation operation = (enum uringOperation) (cqe.user_data >> 32);
+            int slot = (int) (uint32_t) cqe.user_data;
+            int result = cqe.res;
+            head++;
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            operationsInFlight--;
+            operations++;
+
+            uringFile &file = inFlight[slot];
+            if (operation == URING_CLOSE) {
+                continue;
+            }
+            if (result < 0) {
+                finishFile(slot, false);
+                continue;
+            }
+            if (operation == URING_OPEN) {
+                file.fd = result;
+                queueRead(slot);
+                continue;
+            }
+
+            file.done += result;
+            if (file.inHeap) {
+                if (result == 0 || file.done == file.heap.size()) {
+                    finishFile(slot, true);
+                } else {
+                    queueRead(slot);
+                }
+                continue;
+            }
+            // Only a read returning nothing is the end of the file: a short one is continued where
+            // it stopped, and a full slot may have more behind it.
+            if (result == 0) {
+                finishFile(slot, true);
+                continue;
+            }
+            if (file.done < slotBytes) {
+                queueRead(slot);
+                continue;
+            }
+            struct stat fileStat;
+            bool statted = fstat(file.fd, &fileStat) == 0;
+            syscalls++;
+            if (!statted) {
+                finishFile(slot, false);
+            } else if ((size_t) fileStat.st_size <= file.done) {
+                finishFile(slot, true);
+            } else {
+                file.heap.resize(fileStat.st_size);
+                std::memcpy(file.heap.data(), slotMemory + slot * slotBytes, file.done);
+                file.inHeap = true;
+                queueRead(slot);
+            }
+        }
+    }
+
+    if (broken) {
+        // nothing more will complete; close what is open and report the rest as failed
+        for (int slot = 0; slot < slots; slot++) {
+            if (inFlight[slot].active) {
+                if (inFlight[slot].fd >= 0) {
+                    close(inFlight[slot].fd);
+                    syscalls++;
+                    inFlight[slot].fd = -1;
+                }
+                finishFile(slot, false);
+            }
+        }
+        for (size_t index = next; index < files.size(); index++) {
+            asyncFile *file = new asyncFile();
+            file->index = index;
+            onFile(makeFile(file));
+        }
+    }
+}
+
+// Opens, sizes and reads one file with blocking calls.
+static bool preadFile(const char *filename, unsigned char *buffer, size_t bufferBytes, asyncFile &file, std::atomic<long> &syscalls) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    syscalls++;
+    if (fd == -1) {
+        return false;
+    }
+    struct stat fileStat;
+    bool ok = fstat(fd, &fileStat) == 0;
+    syscalls++;
+    if (ok) {
+        size_t size = fileStat.st_size;
+        if (size > bufferBytes) {
+            file.heapData.resize(size);
+            buffer = file.heapData.data();
+        }
+        size_t done = 0;
+        while (ok && done < size) {
+            ssize_t result = pread(fd, buffer + done, std::min(size - done, ASYNC_READ_MAX_OPERATION_BYTES), done);
+            syscalls++;
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = result > 0;
+            done += ok ? result : 0;
+        }
+        file.data = buffer;
+        file.size = done;
+    }
+    close(fd);
+    syscalls++;
+    return ok;
+}
+
+void AsyncBatchReader::readWithPread(const std::vector<std::string> &files, const AsyncFileHandler &onFile) {
+    std::atomic<size_t> next(0);
+    auto reader = [&]() {
+        size_t index;
+        while ((index = next++) < files.size()) {
+            asyncFile *file = new asyncFile();
+            file->index = index;
+            file->slot = takeSlot(true);
+            file->ok = preadFile(files[index].c_str(), slotMemory + file->slot * slotBytes, slotBytes, *file, syscalls);
+            if (!file->ok) {
+                std::cerr << "Error reading " << files[index] << std::endl;
+            }
+            if (!file->ok || !file->heapData.empty()) {
+                returnSlot(file->slot);
+                file->slot = -1;
+            }
+            onFile(makeFile(file));
+        }
+    };
+
+    int threads = (int) std::min((size_t) std::min(ASYNC_READ_PREAD_THREADS, slots), files.size());
+    std::vector<std::thread> readers;
+    for (int i = 1; i < threads; i++) {
+        readers.emplace_back(reader);
+    }
+    reader();
+    for (std::thread &thread : readers) {
+        thread.join();
+    }
+}
+
+struct asyncReadStats AsyncBatchReader::getStats() const {
+    struct asyncReadStats stats;
+    stats.backend = ring == NULL ? "pread" : ring->fixedBuffers ? "io_uring, registered buffers" : "io_uring";
+    stats.files = files.load();
+    stats.failed = failed.load();
+    stats.bytes = bytes.load();
+    stats.syscalls = syscalls.load();
+    stats.operations = operations.load();
+    stats.seconds = seconds;
+    return stats;
+}
+
+void printAsyncReadStats(const struct asyncReadStats &stats) {
+    long images = stats.files + stats.failed;
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Reader summary (" << stats.backend << ")" << std::endl;
+    std::cout << "\tFiles read: " << stats.files << " (" << stats.failed << " failed), " << stats.bytes / (1024 * 1024) << " MiB" << std::endl;
+    std::cout << "\tSystem calls: " << stats.syscalls;
+    if (images > 0) {
+        std::cout << " (" << (double) stats.syscalls / images << " per image)";
+    }
+    std::cout << std::endl;
+    if (stats.operations > 0) {
+        std::cout << "\tio_uring operations: " << stats.operations << std::endl;
+    }
+    if (stats.seconds > 0) {
+        std::cout << "\tRead MB/s: " << stats.bytes / stats.seconds / 1e6 << std::endl;
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef _ASYNC_READER_H_
+#define _ASYNC_READER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Files in flight at once, each with a buffer of its own.
+#define ASYNC_READ_SLOTS 32
+// Files up to this size are read with a single operation into their slot's buffer; larger ones
+// are finished in a heap buffer once their size is known.
+#define ASYNC_READ_SLOT_BYTES ((size_t) 1024 * 1024)
+// Threads issuing the blocking reads when io_uring is not available.
+#define ASYNC_READ_PREAD_THREADS 4
+
+enum asyncReadBackend {
+    // io_uring when the kernel allows it, pread otherwise
+    ASYNC_READ_AUTO,
+    ASYNC_READ_IO_URING,
+    ASYNC_READ_PREAD
+};
+
+// The io_uring queues, kept to asyncReader.cpp.
+struct uringQueue;
+
+// One file as read. 'data' is valid for as long as the file is held.
+struct asyncFile {
+    // position in the list given to readFiles
+    size_t index = 0;
+    const unsigned char *data = NULL;
+    size_t size = 0;
+    bool ok = false;
+
+    // the slot whose buffer holds the data, or -1 when it is in heapData
+    int slot = -1;
+    std::vector<unsigned char> heapData;
+};
+
+// The file's buffer goes back to the reader when the last holder lets go of it.
+typedef std::shared_ptr<const asyncFile> AsyncFilePtr;
+
+/**
+ * Receives each file as soon as it has been read, failed ones included (with 'ok' false). Called
+ * on a reading thread; hand the file on rather than decoding it there, or the reads stall.
+*/
+typedef std::function<void(AsyncFilePtr file)> AsyncFileHandler;
+
+struct asyncReadStats {
+    const char *backend = "";
+    long files = 0;
+    long failed = 0;
+    size_t bytes = 0;
+    // system calls made by the reader, setting up the ring included
+    long syscalls = 0;
+    // io_uring operations (open, read and close) completed
+    long operations = 0;
+    double seconds = 0;
+};
+
+/**
+ * Reads whole files for batch decoding with as few system calls as possible.
+ *
+ * On io_uring, the open, read and close of up to ASYNC_READ_SLOTS files are queued together and
+ * submitted with one io_uring_enter, which also waits for the next completions. Each file is read
+ * straight into a slot buffer registered with the ring (IORING_OP_READ_FIXED), so the signature,
+ * every chunk header and all the IDAT payloads arrive together and are indexed in memory
+ * afterwards (indexPNGBuffer). A read is queued again from where it stopped until one returns 0
+ * at the end of the file. A full slot means the file may be longer: it is then stat'ed and the
+ * rest read into a heap buffer.
+ *
+ * Without io_uring, ASYNC_READ_PREAD_THREADS threads open, fstat, pread and close the files
+ * instead, into the same slot buffers. That covers kernels without io_uring or with it disabled,
+ * and 5.1 to 5.5, whose rings cannot open or close files (checked with IORING_REGISTER_PROBE).
+ *
+ * The reader must outlive every file it hands out.
+*/
+class AsyncBatchReader {
+public:
+    explicit AsyncBatchReader(enum asyncReadBackend backend = ASYNC_READ_AUTO, int slots = ASYNC_READ_SLOTS, size_t slotBytes = ASYNC_READ_SLOT_BYTES);
+    ~AsyncBatchReader();
+
+    bool usingIoUring() const { return ring != NULL; }
+
+    /**
+     * Reads every file in 'files', passing each to 'onFile' in completion order. Returns once all
+     * have been handed out; when every slot is held by the caller it waits for one to be let go.
+    */
+    void readFiles(const std::vector<std::string> &files, const AsyncFileHandler &onFile);
+
+    struct asyncReadStats getStats() const;
+
+private:
+    int takeSlot(bool wait);
+    void returnSlot(int slot);
+    AsyncFilePtr makeFile(asyncFile *file);
+
+    void readWithUring(const std::vector<std::string> &files, const AsyncFileHandler &onFile);
+    void readWithPread(const std::vector<std::string> &files, const AsyncFileHandler &onFile);
+
+    struct uringQueue *ring;
+    int slots;
+    size_t slotBytes;
+    unsigned char *slotMemory;
+
+    std::mutex slotLock;
+    std::condition_variable slotFreed;
+    std::vector<int> freeSlots;
+
+    std::atomic<long> syscalls, operations, files, failed;
+    std::atomic<size_t> bytes;
+    double seconds;
+};
+
+void printAsyncReadStats(const struct asyncReadStats &stats);
+
+#endif
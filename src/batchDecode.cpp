@@ -0,0 +1,468 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+
+// directory listing
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "batchDecode.h"
+#include "processImage.h"
+#include "threadPool.h"
+#include "adam7.h"
+#include "printUtils.h"
+#include "timer.h"
+
+struct batchFile {
+    std::string name;
+    size_t size;
+};
+
+// Shared by the tasks working on one image; the last one to finish hands the image off.
+struct imageJob {
+    std::string filename;
+    size_t fileSize;
+    struct ihdr ihdrData;
+    std::vector<unsigned char> decompressedData, defilteredData;
+    double readSeconds, inflateSeconds;
+    // defilter time of the sub-tasks, in microseconds so it can be summed atomically
+    std::atomic<long> defilterMicros;
+    std::atomic<int> remaining;
+    std::atomic<bool> failed;
+};
+
+// Collects results from all workers.
+struct batchState {
+    std::mutex lock;
+    struct batchStats stats;
+    const ImageSink *sink;
+};
+
+static bool hasPNGExtension(const std::string &name) {
+    if (name.size() < 4) {
+        return false;
+    }
+    std::string extension = name.substr(name.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".png";
+}
+
+bool collectBatchFiles(const char *path, std::vector<std::string> &files) {
+    struct stat pathStat;
+
+    if (stat(path, &pathStat) != 0) {
+        std::cerr << "Cannot access " << path << std::endl;
+        return false;
+    }
+
+    if (S_ISDIR(pathStat.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            std::cerr << "Cannot open directory " << path << std::endl;
+            return false;
+        }
+        std::string prefix = std::string(path) + "/";
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (hasPNGExtension(entry->d_name)) {
+                files.push_back(prefix + entry->d_name);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        return true;
+    }
+
+    // otherwise a manifest, one path per line
+    std::ifstream manifest(path);
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        files.push_back(line);
+    }
+    return true;
+}
+
+// A chain of dependent rows cut into bands of rows and blocks of columns, defiltered in place
+// tile by tile (see defilterTileInPlace). A tile runs once the tiles left of it and above it are done.
+struct defilterGrid {
+    int firstRow, endRow, bandRows, bands;
+    int blockBytes, blocks;
+    int bytesPerPixel;
+    std::shared_ptr<rowExpander> expander;
+    // per tile, how many of the tiles it waits on are not done yet
+    std::unique_ptr<std::atomic<int>[]> waiting;
+};
+
+static void finishImage(imageJob &job, batchState &state) {
+    {
+        std::lock_guard<std::mutex> guard(state.lock);
+
+        if (job.failed) {
+            std::cerr << "Failed to decode " << job.filename << std::endl;
+            state.stats.failed++;
+            return;
+        }
+
+        state.stats.images++;
+        state.stats.readSeconds += job.readSeconds;
+        state.stats.inflateSeconds += job.inflateSeconds;
+        state.stats.defilterSeconds += job.defilterMicros / 1e6;
+        state.stats.fileBytes += job.fileSize;
+        state.stats.decodedBytes += job.defilteredData.size();
+    }
+    // outside the lock, so a slow sink does not hold up the other workers
+    if (*state.sink) {
+        (*state.sink)(job.filename, job.ihdrData, job.defilteredData);
+    }
+}
+
+static std::shared_ptr<imageJob> newImageJob(const std::string &filename, size_t fileSize) {
+    std::shared_ptr<imageJob> job = std::make_shared<imageJob>();
+    job->filename = filename;
+    job->fileSize = fileSize;
+    job->failed = false;
+    job->readSeconds = 0;
+    job->inflateSeconds = 0;
+    job->defilterMicros = 0;
+    return job;
+}
+
+// Inflates the image's IDAT data into the job, wherever 'image' points: a mapping or a read buffer.
+static bool inflateImage(imageJob &job, const struct mappedPNG &image, int &bitsPerPixel) {
+    double start, end;
+    job.ihdrData = image.ihdrData;
+    bitsPerPixel = getBitsPerPixel(image.ihdrData.colorType, image.ihdrData.channelDepth);
+    // The yiDX index would have decompressIDAT start its own OpenMP team inside a pool worker,
+    // so it is left out and the serial inflate is used here; restart segments still begin
+    // independent row ranges.
+    GET_TIME(start);
+    bool ok = bitsPerPixel != -1 && decompressIDAT(image.base, image.idatSpans, std::vector<restartPoint>(), image.ihdrData, job.decompressedData);
+    GET_TIME(end);
+    job.inflateSeconds = end - start;
+    return ok;
+}
+
+static void defilterImage(std::shared_ptr<imageJob> job, int bitsPerPixel, batchState &state, WorkStealingPool &pool);
+
+// Adds a defilter sub-task's time to the job; the last sub-task to finish finishes the image.
+static void finishDefilterTask(imageJob &job, batchState &state, double start) {
+    double end;
+    GET_TIME(end);
+    job.defilterMicros += (long) ((end - start) * 1e6);
+    if (--job.remaining == 0) {
+        job.decompressedData.clear();
+        job.decompressedData.shrink_to_fit();
+        finishImage(job, state);
+    }
+}
+
+// Writes rows [firstRow, endRow), defiltered in place, to the image in its output format.
+static void writeBandRows(imageJob &job, const defilterGrid &grid, int firstRow, int endRow) {
+    int width = job.ihdrData.width;
+    size_t rowBytes = (size_t) width * grid.bytesPerPixel;
+    const rowExpander *expander = grid.expander.get();
+    size_t outStride = expander != NULL ? (size_t) width * expander->outBytesPerPixel : rowBytes;
+    // kept per thread so repeated bands reuse it instead of allocating
+    static thread_local std::vector<unsigned char> scratch;
+    scratch.resize((size_t) width * DECODED_BYTES_PER_PIXEL);
+
+    for (int row = firstRow; row < endRow; row++) {
+        const unsigned char *in = job.decompressedData.data() + row * (rowBytes + 1) + 1;
+        unsigned char *out = job.defilteredData.data() + row * outStride;
+        if (expander != NULL) {
+            expandRow(*expander, out, in, width, scratch.data());
+        } else {
+            std::memcpy(out, in, rowBytes);
+        }
+    }
+}
+
+/**
+ * Queues one tile of a defilterGrid. Once it is done it queues whichever of the tiles right of it
+ * and below it no longer wait on anything, so the tiles run as a wavefront. The last block of a
+ * band also writes the band's rows out.
+*/
+static void submitTile(std::shared_ptr<imageJob> job, std::shared_ptr<defilterGrid> grid, int band, int block, batchState &state, WorkStealingPool &pool) {
+    pool.submit([job, grid, band, block, &state, &pool]() {
+        double start;
+        GET_TIME(start);
+        int width = job->ihdrData.width;
+        int firstRow = grid->firstRow + band * grid->bandRows;
+        int endRow = std::min(firstRow + grid->bandRows, grid->endRow);
+        int begin = block * grid->blockBytes;
+        int end = std::min(begin + grid->blockBytes, width * grid->bytesPerPixel);
+
+        // after a failure the remaining tiles only pass the wave on, so every one still finishes
+        if (!job->failed) {
+            if (!defilterTileInPlace(job->decompressedData, width, grid->bytesPerPixel, firstRow, endRow, begin, end)) {
+                job->failed = true;
+            } else if (block == grid->blocks - 1) {
+                writeBandRows(*job, *grid, firstRow, endRow);
+            }
+        }
+
+        if (block + 1 < grid->blocks && --grid->waiting[band * grid->blocks + block + 1] == 0) {
+            submitTile(job, grid, band, block + 1, state, pool);
+        }
+        if (band + 1 < grid->bands && --grid->waiting[(band + 1) * grid->blocks + block] == 0) {
+            submitTile(job, grid, band + 1, block, state, pool);
+        }
+        finishDefilterTask(*job, state, start);
+    });
+}
+
+/**
+ * Reads and inflates one image, then defilters it: inline for small images, or as one
+ * sub-task per independent row range for large ones.
+*/
+static void decodeImage(const batchFile &file, batchState &state, WorkStealingPool &pool) {
+    std::shared_ptr<imageJob> job = newImageJob(file.name, file.size);
+    struct mappedPNG image;
+    int bitsPerPixel = -1;
+    double start, end;
+
+    GET_TIME(start);
+    bool ok = mapPNGImage(file.name.c_str(), image);
+    GET_TIME(end);
+    job->readSeconds = end - start;
+
+    if (ok) {
+        ok = inflateImage(*job, image, bitsPerPixel);
+        unmapPNGImage(image);
+    }
+    job->failed = !ok;
+    defilterImage(job, bitsPerPixel, state, pool);
+}
+
+// As decodeImage, for a file the AsyncBatchReader has already read. Its buffer is let go of once inflated.
+static void decodeReadImage(const std::string &filename, AsyncFilePtr file, batchState &state, WorkStealingPool &pool) {
+    std::shared_ptr<imageJob> job = newImageJob(filename, file->size);
+    struct mappedPNG image;
+    int bitsPerPixel = -1;
+
+    bool ok = file->ok && indexPNGBuffer(file->data, file->size, image) && inflateImage(*job, image, bitsPerPixel);
+    file.reset();
+    job->failed = !ok;
+    defilterImage(job, bitsPerPixel, state, pool);
+}
+
+// Defilters an inflated image, or finishes it straight away if it has already failed.
+static void defilterImage(std::shared_ptr<imageJob> job, int bitsPerPixel, batchState &state, WorkStealingPool &pool) {
+    double start, end;
+
+    if (job->failed || job->decompressedData.size() < getInflatedSize(job->ihdrData)) {
+        job->failed = true;
+        finishImage(*job, state);
+        return;
+    }
+
+    int width = job->ihdrData.width, height = job->ihdrData.height;
+
+    // Interlaced images are defiltered pass by pass on this worker; the pool already keeps the others busy.
+    if (job->ihdrData.interlaceMethod == 1) {
+        GET_TIME(start);
+        job->failed = !defilterAdam7(job->decompressedData, job->defilteredData, job->ihdrData, ADAM7_PASSES, 1);
+        GET_TIME(end);
+        job->defilterMicros = (long) ((end - start) * 1e6);
+        finishImage(*job, state);
+        return;
+    }
+
+    // Sub-byte rows have no whole-pixel filter stride to split chains on, and are small; decode them in one go.
+    if (bitsPerPixel < 8) {
+        GET_TIME(start);
+        job->failed = !defilterIDAT(job->decompressedData, job->defilteredData, job->ihdrData, std::vector<restartPoint>(), 1);
+        GET_TIME(end);
+        job->defilterMicros = (long) ((end - start) * 1e6);
+        finishImage(*job, state);
+        return;
+    }
+
+    int bytesPerPixel = bitsPerPixel / 8;
+    size_t rowBytes = (size_t) width * bytesPerPixel;
+    // shared by the chain tasks; the job keeps it alive until the last one finishes
+    std::shared_ptr<rowExpander> expander = std::make_shared<rowExpander>();
+    if (!buildRowExpander(job->ihdrData, *expander)) {
+        job->failed = true;
+        finishImage(*job, state);
+        return;
+    }
+    if (getActiveExpander(*expander) == NULL) {
+        expander.reset();
+    }
+
+    job->defilteredData.resize((size_t) width * height * DECODED_BYTES_PER_PIXEL);
+
+    if (rowBytes * height <= BATCH_LARGE_IMAGE_BYTES) {
+        GET_TIME(start);
+        job->failed = !defilterRowRange(job->decompressedData, job->defilteredData, width, bytesPerPixel, 0, height, expander.get());
+        GET_TIME(end);
+        job->defilterMicros = (long) ((end - start) * 1e6);
+        finishImage(*job, state);
+        return;
+    }
+
+    int minRows = std::max((size_t) 1, BATCH_SUBTASK_BYTES / rowBytes);
+    std::vector<int> chainRows = findDefilterChains(job->decompressedData, width, height, bytesPerPixel, minRows);
+    int chainCount = chainRows.size() - 1;
+
+    // A chain up to one sub-task long is one task. Longer ones hold dependent rows that cannot
+    // start on their own, so they are cut into bands of minRows rows and BATCH_WAVEFRONT_BLOCKS
+    // column blocks; each band trails the one above it by a block.
+    int blockBytes = ((int) rowBytes + BATCH_WAVEFRONT_BLOCKS - 1) / BATCH_WAVEFRONT_BLOCKS;
+    blockBytes = (blockBytes + bytesPerPixel - 1) / bytesPerPixel * bytesPerPixel;
+    std::vector<std::shared_ptr<defilterGrid>> grids(chainCount);
+    int tasks = 0;
+    for (int chain = 0; chain < chainCount; chain++) {
+        int chainLength = chainRows[chain + 1] - chainRows[chain];
+        if (chainLength <= minRows) {
+            tasks++;
+            continue;
+        }
+        std::shared_ptr<defilterGrid> grid = std::make_shared<defilterGrid>();
+        grid->firstRow = chainRows[chain];
+        grid->endRow = chainRows[chain + 1];
+        grid->bandRows = minRows;
+        grid->bands = (chainLength + minRows - 1) / minRows;
+        grid->blockBytes = blockBytes;
+        grid->blocks = ((int) rowBytes + blockBytes - 1) / blockBytes;
+        grid->bytesPerPixel = bytesPerPixel;
+        grid->expander = expander;
+        grid->waiting.reset(new std::atomic<int>[grid->bands * grid->blocks]);
+        for (int band = 0; band < grid->bands; band++) {
+            for (int block = 0; block < grid->blocks; block++) {
+                grid->waiting[band * grid->blocks + block] = (band > 0) + (block > 0);
+            }
+        }
+        grids[chain] = grid;
+        tasks += grid->bands * grid->blocks;
+    }
+
+    job->remaining = tasks;
+    for (int chain = 0; chain < chainCount; chain++) {
+        if (grids[chain] != NULL) {
+            submitTile(job, grids[chain], 0, 0, state, pool);
+            continue;
+        }
+        int firstRow = chainRows[chain], endRow = chainRows[chain + 1];
+        pool.submit([job, &state, expander, width, bytesPerPixel, firstRow, endRow]() {
+            double chainStart;
+            GET_TIME(chainStart);
+            if (!defilterRowRange(job->decompressedData, job->defilteredData, width, bytesPerPixel, firstRow, endRow, expander.get())) {
+                job->failed = true;
+            }
+            finishDefilterTask(*job, state, chainStart);
+        });
+    }
+}
+
+bool batchDecode(const std::vector<std::string> &files, int threads, struct batchStats &stats, const ImageSink &sink) {
+    std::vector<batchFile> batchFiles;
+    batchState state;
+    double start, end;
+
+    state.sink = &sink;
+
+    for (const std::string &name : files) {
+        struct stat fileStat;
+        size_t size = stat(name.c_str(), &fileStat) == 0 ? fileStat.st_size : 0;
+        batchFiles.push_back({name, size});
+    }
+
+    // largest first, so the long tasks are not the ones left over at the end
+    std::sort(batchFiles.begin(), batchFiles.end(), [](const batchFile &a, const batchFile &b) {
+        return a.size > b.size;
+    });
+
+    GET_TIME(start);
+    {
+        WorkStealingPool pool(threads);
+        size_t index = 0;
+
+        while (index < batchFiles.size()) {
+            // one task per large file, or a group of small files up to BATCH_GROUP_BYTES
+            size_t groupEnd = index + 1;
+            size_t groupBytes = batchFiles[index].size;
+            if (batchFiles[index].size < BATCH_SMALL_FILE_BYTES) {
+                while (groupEnd < batchFiles.size() && groupBytes + batchFiles[groupEnd].size <= BATCH_GROUP_BYTES) {
+                    groupBytes += batchFiles[groupEnd].size;
+                    groupEnd++;
+                }
+            }
+
+            pool.submit([&batchFiles, &state, &pool, index, groupEnd]() {
+                for (size_t i = index; i < groupEnd; i++) {
+                    decodeImage(batchFiles[i], state, pool);
+                }
+            });
+            index = groupEnd;
+        }
+
+        pool.wait();
+    }
+    GET_TIME(end);
+
+    stats = state.stats;
+    stats.seconds = end - start;
+
+    return stats.failed == 0;
+}
+
+bool batchDecodeAsync(const std::vector<std::string> &files, int threads, enum asyncReadBackend backend, struct batchStats &stats,
+                      struct asyncReadStats &readStats, const ImageSink &sink) {
+    batchState state;
+    double start, end;
+
+    state.sink = &sink;
+
+    GET_TIME(start);
+    {
+        // declared first so the pool, and every file its tasks still hold, goes before it
+        AsyncBatchReader reader(backend);
+        WorkStealingPool pool(threads);
+
+        reader.readFiles(files, [&files, &state, &pool](AsyncFilePtr file) {
+            pool.submit([&files, &state, &pool, file]() mutable {
+                const std::string &filename = files[file->index];
+                decodeReadImage(filename, std::move(file), state, pool);
+            });
+        });
+
+        pool.wait();
+        readStats = reader.getStats();
+    }
+    GET_TIME(end);
+
+    stats = state.stats;
+    stats.seconds = end - start;
+    // overlapped with the decoding, so the wall time of the read stage
+    stats.readSeconds = readStats.seconds;
+
+    return stats.failed == 0;
+}
+
+void printBatchSummary(const struct batchStats &stats) {
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Batch summary" << std::endl;
+    std::cout << "\tImages decoded: " << stats.images << " (" << stats.failed << " failed)" << std::endl;
+    std::cout << "\tWall time: " << stats.seconds << " s" << std::endl;
+    std::cout << "\tImage reading (summed over tasks): " << stats.readSeconds << " s" << std::endl;
+    std::cout << "\tImage decompression (summed over tasks): " << stats.inflateSeconds << " s" << std::endl;
+    std::cout << "\tImage filtering (summed over tasks): " << stats.defilterSeconds << " s" << std::endl;
+    if (stats.seconds > 0) {
+        std::cout << "\tImages/s: " << stats.images / stats.seconds << std::endl;
+        std::cout << "\tInput MB/s: " << stats.fileBytes / stats.seconds / 1e6 << std::endl;
+        std::cout << "\tDecoded MB/s: " << stats.decodedBytes / stats.seconds / 1e6 << std::endl;
+    }
+}
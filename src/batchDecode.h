@@ -0,0 +1,74 @@
+#ifndef _BATCH_DECODE_H_
+#define _BATCH_DECODE_H_
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "readImage.h"
+#include "asyncReader.h"
+
+// Files smaller than this are grouped into shared tasks...
+#define BATCH_SMALL_FILE_BYTES (256 * 1024)
+// ...of up to this many bytes in total.
+#define BATCH_GROUP_BYTES (1024 * 1024)
+// Images whose defiltered size exceeds this have their defiltering split into sub-tasks...
+#define BATCH_LARGE_IMAGE_BYTES (8 * 1024 * 1024)
+// ...of roughly this many bytes each.
+#define BATCH_SUBTASK_BYTES (2 * 1024 * 1024)
+// Runs of dependent rows longer than a sub-task are also cut into this many column blocks.
+#define BATCH_WAVEFRONT_BLOCKS 8
+
+struct batchStats {
+    int images = 0;
+    int failed = 0;
+    // size of the PNG files read
+    size_t fileBytes = 0;
+    // size of the defiltered pixel data produced
+    size_t decodedBytes = 0;
+    // wall time of the whole batch
+    double seconds = 0;
+    // time spent in each stage, summed over all tasks
+    double readSeconds = 0;
+    double inflateSeconds = 0;
+    double defilterSeconds = 0;
+};
+
+/**
+ * Receives each decoded image. Called from worker threads, possibly concurrently.
+ * The sink may take the pixel data by swapping it out of 'imageData'.
+*/
+typedef std::function<void(const std::string &filename, const struct ihdr &ihdrData, std::vector<unsigned char> &imageData)> ImageSink;
+
+/**
+ * Lists the files to decode. 'path' is either a directory, whose *.png entries are used, or a
+ * manifest file with one path per line (blank lines and lines starting with '#' are skipped).
+*/
+bool collectBatchFiles(const char *path, std::vector<std::string> &files);
+
+/**
+ * Decodes every file on a work-stealing pool of 'threads' workers.
+ *
+ * Files are scheduled largest first. Small files are grouped so one task decodes several of them,
+ * and large images split their defiltering into independent row ranges (see findDefilterChains)
+ * that idle workers can steal. Ranges of dependent rows longer than a sub-task are defiltered as
+ * a wavefront of row bands and column blocks (see defilterTileInPlace). A file that fails to decode is counted in stats.failed.
+ *
+ * @return true if every file decoded.
+*/
+bool batchDecode(const std::vector<std::string> &files, int threads, struct batchStats &stats, const ImageSink &sink = ImageSink());
+
+/**
+ * As batchDecode, but with the files read up front by an AsyncBatchReader (io_uring, or pread on
+ * its own threads) instead of each worker mapping its own. Every file that has been read is
+ * inflated from its buffer by a pool worker while the reader carries on with the next ones, so
+ * the reads of a cold batch overlap each other and the decoding.
+ *
+ * @param readStats The reader's counters, system calls included.
+*/
+bool batchDecodeAsync(const std::vector<std::string> &files, int threads, enum asyncReadBackend backend, struct batchStats &stats,
+                      struct asyncReadStats &readStats, const ImageSink &sink = ImageSink());
+
+void printBatchSummary(const struct batchStats &stats);
+
+#endif
@@ -0,0 +1,2066 @@
+// Microbenchmarks for individual decode stages
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+// sidecar staleness check, page cache eviction
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "timer.h"
+#include "defilterKernels.h"
+#include "processImage.h"
+#include "readImage.h"
+#include "writeImage.h"
+#include "pipelineBench.h"
+#include "batchDecode.h"
+#include "decoder.h"
+#include "regionDecode.h"
+#include "crcKernels.h"
+#include "inflateEngine.h"
+#include "imageCache.h"
+#include "rawSidecar.h"
+#include "asyncReader.h"
+#include "adam7.h"
+#include "expandKernels.h"
+
+// parallelization
+#include <omp.h>
+#include "printUtils.h"
+
+// Heap allocations made through operator new (which std::vector uses), for benchDecoder.
+static std::atomic<long> heapAllocations(0);
+
+/**
+ * Every replaceable form of operator new and delete goes through these two, so each allocation is
+ * counted once and released the way it was made. Kept out of line so the compiler does not pair
+ * the free() it would see inlined into operator delete with the operator new at the call site.
+*/
+__attribute__((noinline)) static void *countedAllocate(size_t size, size_t alignment) {
+    heapAllocations++;
+    if (size == 0) {
+        size = 1;
+    }
+    if (alignment <= alignof(std::max_align_t)) {
+        return malloc(size);
+    }
+    // aligned_alloc wants a multiple of the alignment
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+__attribute__((noinline)) static void countedRelease(void *memory) {
+    free(memory);
+}
+
+static void *countedAllocateOrThrow(size_t size, size_t alignment) {
+    void *memory = countedAllocate(size, alignment);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void *operator new(size_t size) {
+    return countedAllocateOrThrow(size, alignof(std::max_align_t));
+}
+
+void *operator new[](size_t size) {
+    return countedAllocateOrThrow(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, (size_t) alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, (size_t) alignment);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, alignof(std::max_align_t));
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, (size_t) alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, (size_t) alignment);
+}
+
+void operator delete(void *memory) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete(void *memory, size_t, std::align_val_t) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete[](void *memory, size_t, std::align_val_t) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete(void *memory, std::align_val_t, const std::nothrow_t &) noexcept {
+    countedRelease(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t, const std::nothrow_t &) noexcept {
+    countedRelease(memory);
+}
+
+// Previous byte-at-a-time defilter loop, kept as the reference for correctness and speed.
+static void legacyDefilterRow(int filter, unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel, bool firstRow) {
+    for (int colIndex = 0; colIndex < rowBytes; colIndex++) {
+        int left = (colIndex < bytesPerPixel) ? 0 : out[colIndex - bytesPerPixel];
+        int up = firstRow ? 0 : prev[colIndex];
+        int leftUp = (firstRow || colIndex < bytesPerPixel) ? 0 : prev[colIndex - bytesPerPixel];
+        int curr;
+
+        switch (filter) {
+            case 0:
+                curr = in[colIndex];
+                break;
+            case 1:
+                curr = (in[colIndex] + left) % 256;
+                break;
+            case 2:
+                curr = (in[colIndex] + up) % 256;
+                break;
+            case 3:
+                curr = (in[colIndex] + (left + up) / 2) % 256;
+                break;
+            default: {
+                int p = left + up - leftUp;
+                int pa = abs(p - left), pb = abs(p - up), pc = abs(p - leftUp);
+                int predictor = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : leftUp);
+                curr = (in[colIndex] + predictor) % 256;
+                break;
+            }
+        }
+        out[colIndex] = curr;
+    }
+}
+
+static const char *filterNames[5] = {"None", "Sub", "Up", "Average", "Paeth"};
+
+/**
+ * Times every defilter kernel set against the legacy loop, one filter type at a time.
+ * Each pass defilters a full synthetic image in which every row uses the same filter.
+*/
+int benchDefilterKernels(int width, int height, int bytesPerPixel, int trials) {
+    int rowBytes = width * bytesPerPixel;
+    std::vector<unsigned char> filtered((size_t) rowBytes * height), reference((size_t) rowBytes * height), output((size_t) rowBytes * height);
+    std::vector<unsigned char> zeroRow(rowBytes, 0);
+    double start, end;
+    bool allMatched = true;
+
+    srand(1234);
+    for (size_t i = 0; i < filtered.size(); i++) {
+        filtered[i] = rand() & 0xff;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Defilter kernels: " << width << " x " << height << ", " << bytesPerPixel << " bytes/pixel, best of " << trials << std::endl;
+
+    for (int filter = 0; filter < 5; filter++) {
+        double legacyTime = 0;
+
+        for (int trial = 0; trial < trials; trial++) {
+            GET_TIME(start);
+            for (int row = 0; row < height; row++) {
+                const unsigned char *prev = row == 0 ? zeroRow.data() : &reference[(size_t) (row - 1) * rowBytes];
+                legacyDefilterRow(filter, &reference[(size_t) row * rowBytes], &filtered[(size_t) row * rowBytes], prev, rowBytes, bytesPerPixel, row == 0);
+            }
+            GET_TIME(end);
+            if (trial == 0 || end - start < legacyTime) {
+                legacyTime = end - start;
+            }
+        }
+
+        std::cout << PRINT_DIVIDER << std::endl;
+        std::cout << filterNames[filter] << std::endl;
+        std::cout << "\t" << std::left << std::setw(8) << "legacy" << std::fixed << std::setprecision(5) << legacyTime << " s" << std::endl;
+
+        for (int isa = DEFILTER_ISA_SCALAR; isa < DEFILTER_ISA_COUNT; isa++) {
+            DefilterKernels kernels;
+            if (!getDefilterKernelsForIsa((DefilterIsa) isa, kernels)) {
+                continue;
+            }
+            DefilterRowFn defilterRow = getDefilterRowFn(kernels, filter);
+            double kernelTime = 0;
+
+            for (int trial = 0; trial < trials; trial++) {
+                GET_TIME(start);
+                for (int row = 0; row < height; row++) {
+                    const unsigned char *prev = row == 0 ? zeroRow.data() : &output[(size_t) (row - 1) * rowBytes];
+                    defilterRow(&output[(size_t) row * rowBytes], &filtered[(size_t) row * rowBytes], prev, rowBytes, bytesPerPixel);
+                }
+                GET_TIME(end);
+                if (trial == 0 || end - start < kernelTime) {
+                    kernelTime = end - start;
+                }
+            }
+
+            bool matched = output == reference;
+            allMatched = allMatched && matched;
+            std::cout << "\t" << std::setw(8) << kernels.name << kernelTime << " s  x" << std::setprecision(2) << legacyTime / kernelTime << std::setprecision(5);
+            std::cout << (matched ? "" : "  MISMATCH") << std::endl;
+        }
+
+        // the per-bpp table defilterIDAT uses, including its first row variants
+        const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+        double tableTime = 0;
+        for (int trial = 0; trial < trials; trial++) {
+            GET_TIME(start);
+            for (int row = 0; row < height; row++) {
+                unsigned char *out = &output[(size_t) row * rowBytes];
+                const unsigned char *in = &filtered[(size_t) row * rowBytes];
+                if (row == 0) {
+                    rowDecoders.firstRow[filter](out, in, NULL, rowBytes, bytesPerPixel);
+                } else {
+                    rowDecoders.otherRows[filter](out, in, out - rowBytes, rowBytes, bytesPerPixel);
+                }
+            }
+            GET_TIME(end);
+            if (trial == 0 || end - start < tableTime) {
+                tableTime = end - start;
+            }
+        }
+        bool matched = output == reference;
+        allMatched = allMatched && matched;
+        std::cout << "\t" << std::setw(8) << "table" << tableTime << " s  x" << std::setprecision(2) << legacyTime / tableTime << std::setprecision(5);
+        std::cout << (matched ? "" : "  MISMATCH") << std::endl;
+    }
+    std::cout << std::right;
+
+    return allMatched ? 0 : 1;
+}
+
+/**
+ * Compares the two pass decode (decompressIDAT then defilterIDAT) against streamDecodeIDAT
+ * on one image, reporting time and the size of the buffers each keeps alive at its peak.
+*/
+int benchStreamDecode(const char *filename, int trials) {
+    std::vector<unsigned char> compressedIDAT;
+    struct ihdr ihdrData;
+    double start, end, twoPassTime = 0, streamTime = 0;
+    size_t twoPassBytes = 0, streamBytes = 0;
+    std::vector<unsigned char> twoPassOutput, streamOutput;
+
+    if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
+        std::cerr << "Image reading failed" << std::endl;
+        return 1;
+    }
+
+    for (int trial = 0; trial < trials; trial++) {
+        std::vector<unsigned char> decompressedIDAT, defilteredIDAT;
+
+        GET_TIME(start);
+        if (!decompressIDAT(compressedIDAT, decompressedIDAT) ||
+            !defilterIDAT(decompressedIDAT, defilteredIDAT, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth)) {
+            return 1;
+        }
+        GET_TIME(end);
+        if (trial == 0 || end - start < twoPassTime) {
+            twoPassTime = end - start;
+        }
+        twoPassBytes = compressedIDAT.capacity() + decompressedIDAT.capacity() + defilteredIDAT.capacity();
+        twoPassOutput.swap(defilteredIDAT);
+    }
+
+    for (int trial = 0; trial < trials; trial++) {
+        std::vector<unsigned char> defilteredIDAT;
+
+        GET_TIME(start);
+        if (!streamDecodeIDAT(compressedIDAT, defilteredIDAT, ihdrData)) {
+            return 1;
+        }
+        GET_TIME(end);
+        if (trial == 0 || end - start < streamTime) {
+            streamTime = end - start;
+        }
+        // the ring holds two scanlines including their filter bytes
+        streamBytes = compressedIDAT.capacity() + defilteredIDAT.capacity() + 2 * (defilteredIDAT.size() / ihdrData.height + 1);
+        streamOutput.swap(defilteredIDAT);
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Stream decode: " << filename << ", best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+    std::cout << "\tTwo pass:  " << twoPassTime << " s, peak buffers " << twoPassBytes / 1024 << " KiB" << std::endl;
+    std::cout << "\tStreaming: " << streamTime << " s, peak buffers " << streamBytes / 1024 << " KiB" << std::endl;
+
+    if (streamOutput != twoPassOutput) {
+        std::cout << "\tMISMATCH between two pass and streaming output" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compares the pread reader (readPNGImage) against the mmap reader (mapPNGImage), both for the
+ * read stage alone and for read + inflate, where the mapped spans go straight to zlib.
+*/
+int benchReadModes(const char *filename, int trials) {
+    double start, end;
+    double preadTime = 0, mmapTime = 0, preadInflateTime = 0, mmapInflateTime = 0;
+    std::vector<unsigned char> preadOutput, mmapOutput;
+
+    for (int trial = 0; trial < trials; trial++) {
+        std::vector<unsigned char> compressedIDAT, decompressedIDAT;
+        struct ihdr ihdrData;
+
+        GET_TIME(start);
+        if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
+            return 1;
+        }
+        GET_TIME(end);
+        if (trial == 0 || end - start < preadTime) {
+            preadTime = end - start;
+        }
+
+        if (!decompressIDAT(compressedIDAT, decompressedIDAT)) {
+            return 1;
+        }
+        GET_TIME(end);
+        if (trial == 0 || end - start < preadInflateTime) {
+            preadInflateTime = end - start;
+        }
+        preadOutput.swap(decompressedIDAT);
+    }
+
+    for (int trial = 0; trial < trials; trial++) {
+        std::vector<unsigned char> decompressedIDAT;
+        struct mappedPNG image;
+
+        GET_TIME(start);
+        if (!mapPNGImage(filename, image)) {
+            return 1;
+        }
+        GET_TIME(end);
+        if (trial == 0 || end - start < mmapTime) {
+            mmapTime = end - start;
+        }
+
+        if (!decompressIDAT(image.base, image.idatSpans, decompressedIDAT)) {
+            unmapPNGImage(image);
+            return 1;
+        }
+        unmapPNGImage(image);
+        GET_TIME(end);
+        if (trial == 0 || end - start < mmapInflateTime) {
+            mmapInflateTime = end - start;
+        }
+        mmapOutput.swap(decompressedIDAT);
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Read modes: " << filename << ", best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+    std::cout << "\tpread read:           " << preadTime << " s" << std::endl;
+    std::cout << "\tmmap read:            " << mmapTime << " s" << std::endl;
+    std::cout << "\tpread read + inflate: " << preadInflateTime << " s" << std::endl;
+    std::cout << "\tmmap read + inflate:  " << mmapInflateTime << " s" << std::endl;
+
+    if (preadOutput != mmapOutput) {
+        std::cout << "\tMISMATCH between pread and mmap inflate output" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Encodes each image with 1, 2, 4, ... threads up to the number of processors and reports
+ * throughput in MB/s of raw pixel data. Each encode is checked by decoding it again.
+*/
+int benchEncode(char *filenames[], int fileCount, int trials) {
+    int maxThreads = std::max(omp_get_num_procs(), 1);
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Encode throughput, best of " << trials << std::endl;
+
+    for (int file = 0; file < fileCount; file++) {
+        std::vector<unsigned char> compressedIDAT, decompressedIDAT, imageData;
+        struct ihdr ihdrData;
+        double start, end;
+
+        if (!readPNGImage(filenames[file], compressedIDAT, ihdrData) ||
+            !decompressIDAT(compressedIDAT, decompressedIDAT) ||
+            !defilterIDAT(decompressedIDAT, imageData, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth)) {
+            std::cerr << "Failed to decode " << filenames[file] << std::endl;
+            return 1;
+        }
+
+        std::cout << PRINT_DIVIDER << std::endl;
+        std::cout << filenames[file] << " (" << imageData.size() / 1024 << " KiB raw)" << std::endl;
+
+        for (int threads : threadCounts) {
+            struct encodeOptions options;
+            std::vector<unsigned char> pngData;
+            double encodeTime = 0;
+            options.threads = threads;
+
+            for (int trial = 0; trial < trials; trial++) {
+                GET_TIME(start);
+                if (!encodePNG(imageData, ihdrData, options, pngData)) {
+                    return 1;
+                }
+                GET_TIME(end);
+                if (trial == 0 || end - start < encodeTime) {
+                    encodeTime = end - start;
+                }
+            }
+
+            // round trip through the decoder
+            int bytesPerPixel = getBytesPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+            std::vector<unsigned char> filtered, compressed, roundTripFiltered, roundTrip;
+            std::vector<int> noIndependentRows;
+            filterRows(imageData.data(), ihdrData.width, ihdrData.height, bytesPerPixel, noIndependentRows, threads, filtered);
+            bool matched = compressIDAT(filtered, ihdrData.height, options, compressed, NULL) &&
+                           decompressIDAT(compressed, roundTripFiltered) &&
+                           defilterIDAT(roundTripFiltered, roundTrip, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth) &&
+                           roundTrip == imageData;
+
+            std::cout << std::fixed << std::setprecision(5);
+            std::cout << "\t" << threads << " thread(s): " << encodeTime << " s, " << std::setprecision(1)
+                      << imageData.size() / encodeTime / 1e6 << " MB/s, " << pngData.size() / 1024 << " KiB"
+                      << (matched ? "" : "  ROUND TRIP MISMATCH") << std::endl;
+            if (!matched) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Times read, inflate, defilter and the whole pipeline for every image in 'path' (a PNG, a
+ * directory or a manifest), prints median/p95/min and MB/s per stage, optionally writes the
+ * results as JSON and CSV and compares them against a baseline.
+ *
+ * Options: --warmup N, --iterations N, --json FILE, --csv FILE, --baseline FILE, --threshold PERCENT.
+ * @return 1 if an image fails to decode or a stage regressed against the baseline.
+*/
+int benchPipeline(const char *path, int argc, char *argv[]) {
+    struct benchOptions options;
+    const char *jsonPath = NULL, *csvPath = NULL, *baselinePath = NULL;
+    double threshold = BENCH_REGRESSION_THRESHOLD;
+    std::vector<std::string> files;
+    std::vector<imageBenchResult> results;
+
+    for (int i = 0; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        if (option == "--warmup") {
+            options.warmup = std::max(atoi(argv[i + 1]), 0);
+        } else if (option == "--iterations") {
+            options.iterations = std::max(atoi(argv[i + 1]), 1);
+        } else if (option == "--json") {
+            jsonPath = argv[i + 1];
+        } else if (option == "--csv") {
+            csvPath = argv[i + 1];
+        } else if (option == "--baseline") {
+            baselinePath = argv[i + 1];
+        } else if (option == "--threshold") {
+            threshold = atof(argv[i + 1]) / 100;
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (argc % 2) {
+        std::cerr << "Missing value for " << argv[argc - 1] << std::endl;
+        return 1;
+    }
+
+    std::string pathName = path;
+    if (pathName.size() > 4 && pathName.compare(pathName.size() - 4, 4, ".png") == 0) {
+        files.push_back(pathName);
+    } else if (!collectBatchFiles(path, files) || files.empty()) {
+        std::cerr << "No images found in " << path << std::endl;
+        return 1;
+    }
+
+    std::vector<baselineEntry> baseline;
+    if (baselinePath != NULL && !readBaseline(baselinePath, baseline)) {
+        return 1;
+    }
+
+    for (const std::string &file : files) {
+        struct imageBenchResult result;
+        if (!benchmarkImage(file, options, result)) {
+            return 1;
+        }
+        results.push_back(result);
+    }
+
+    printBenchResults(results);
+    if ((jsonPath != NULL && !writeBenchJSON(jsonPath, options, results)) || (csvPath != NULL && !writeBenchCSV(csvPath, results))) {
+        return 1;
+    }
+    if (baselinePath != NULL && compareToBaseline(results, baseline, threshold) > 0) {
+        return 1;
+    }
+    return 0;
+}
+
+// Separate conversion pass from an RGBA8 image, the way consumers converted before outputDescriptor.
+static void convertImage(const std::vector<unsigned char> &rgba, int width, int height, const struct outputDescriptor &output) {
+    int outBytes = getPixelFormatBytes(output.format);
+    bool swap = output.format == PIXEL_BGRA8 || output.format == PIXEL_BGRA8_PREMULTIPLIED;
+    bool premultiplied = output.format == PIXEL_RGBA8_PREMULTIPLIED || output.format == PIXEL_BGRA8_PREMULTIPLIED;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const unsigned char *in = rgba.data() + ((size_t) y * width + x) * 4;
+            unsigned char *out = output.pixels + y * output.stride + (size_t) x * outBytes;
+            for (int c = 0; c < 3; c++) {
+                unsigned char value = in[swap ? 2 - c : c];
+                out[c] = premultiplied ? (value * in[3] + 127) / 255 : value;
+            }
+            if (outBytes == 4) {
+                out[3] = in[3];
+            }
+        }
+    }
+}
+
+/**
+ * Decodes an image into a caller-owned buffer with a padded row stride in each output format,
+ * once with the conversion fused into the defilter (outputDescriptor) and once as an RGBA8 decode
+ * followed by a separate conversion pass, and checks that both give the same pixels.
+*/
+int benchOutputFormats(const char *filename, int trials) {
+    static const enum pixelFormat formats[] = {PIXEL_RGBA8, PIXEL_BGRA8, PIXEL_RGBA8_PREMULTIPLIED, PIXEL_BGRA8_PREMULTIPLIED, PIXEL_RGB8};
+    static const char *formatNames[] = {"RGBA8", "BGRA8", "RGBA8 premultiplied", "BGRA8 premultiplied", "RGB8"};
+    std::vector<unsigned char> compressedIDAT, decompressedIDAT;
+    std::vector<restartPoint> restartPoints;
+    struct ihdr ihdrData;
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    if (!readPNGImage(filename, compressedIDAT, ihdrData, &restartPoints) ||
+        !decompressIDAT(compressedIDAT, restartPoints, ihdrData, decompressedIDAT)) {
+        printSummaries = savedPrintSummaries;
+        return 1;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Output formats: " << filename << ", best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+
+    int mismatches = 0;
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        // pad the rows to a 256 byte stride, as a texture or window surface would
+        size_t stride = ((size_t) ihdrData.width * getPixelFormatBytes(formats[f]) + 255) & ~(size_t) 255;
+        std::vector<unsigned char> fused(stride * ihdrData.height), separate(stride * ihdrData.height);
+        struct outputDescriptor fusedOutput = {fused.data(), stride, formats[f]};
+        struct outputDescriptor separateOutput = {separate.data(), stride, formats[f]};
+        double fusedTime = 0, separateTime = 0, start, end;
+
+        for (int trial = 0; trial < trials; trial++) {
+            std::vector<unsigned char> rgba;
+
+            GET_TIME(start);
+            bool ok = defilterIDAT(decompressedIDAT, ihdrData, restartPoints, fusedOutput);
+            GET_TIME(end);
+            if (trial == 0 || end - start < fusedTime) {
+                fusedTime = end - start;
+            }
+
+            GET_TIME(start);
+            ok = ok && defilterIDAT(decompressedIDAT, rgba, ihdrData, restartPoints);
+            convertImage(rgba, ihdrData.width, ihdrData.height, separateOutput);
+            GET_TIME(end);
+            if (trial == 0 || end - start < separateTime) {
+                separateTime = end - start;
+            }
+
+            if (!ok) {
+                printSummaries = savedPrintSummaries;
+                return 1;
+            }
+        }
+
+        bool matched = fused == separate;
+        mismatches += !matched;
+        std::cout << "\t" << std::left << std::setw(20) << formatNames[f] << std::right << " fused: " << fusedTime << " s, decode + convert: "
+                  << separateTime << " s" << (matched ? "" : "  MISMATCH") << std::endl;
+    }
+    printSummaries = savedPrintSummaries;
+    return mismatches > 0 ? 1 : 0;
+}
+
+// Paeth predictor, as in the PNG spec.
+static int paethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+// Packs 'count' samples of 'depth' bits into a row as PNG stores them: sub-byte samples leftmost in the high bits, 16 bit ones big endian.
+static void packSamples(const int *samples, int count, int depth, unsigned char *row) {
+    for (int i = 0; i < count; i++) {
+        if (depth == 16) {
+            row[i * 2] = samples[i] >> 8;
+            row[i * 2 + 1] = samples[i] & 0xff;
+        } else if (depth == 8) {
+            row[i] = samples[i];
+        } else {
+            int bit = i * depth;
+            row[bit / 8] |= samples[i] << (8 - depth - bit % 8);
+        }
+    }
+}
+
+// Appends a chunk with its length, tag and CRC.
+static void appendChunk(std::vector<unsigned char> &png, const char *tag, const unsigned char *data, size_t size) {
+    unsigned char header[8] = {(unsigned char) (size >> 24), (unsigned char) (size >> 16), (unsigned char) (size >> 8), (unsigned char) size};
+    std::memcpy(header + 4, tag, 4);
+    png.insert(png.end(), header, header + 8);
+    png.insert(png.end(), data, data + size);
+
+    uLong crc = crc32(crc32(0, NULL, 0), header + 4, 4);
+    crc = crc32(crc, data, size);
+    unsigned char crcBytes[4] = {(unsigned char) (crc >> 24), (unsigned char) (crc >> 16), (unsigned char) (crc >> 8), (unsigned char) crc};
+    png.insert(png.end(), crcBytes, crcBytes + 4);
+}
+
+/**
+ * Builds a PNG of random pixels in the given format, along with the RGBA8 it should decode to,
+ * worked out per pixel straight from the spec rather than through expandKernels. Rows cycle
+ * through the five filter types, and the IDAT data is split across two chunks. Palette images
+ * get a tRNS chunk covering half their entries; 'keyed' greyscale and truecolor images get a
+ * colour key that about one pixel in seven matches.
+*/
+static bool buildTestPNG(int width, int height, int colorType, int depth, bool interlaced, bool keyed, unsigned seed, std::vector<unsigned char> &png, std::vector<unsigned char> &reference) {
+    int bitsPerPixel = getBitsPerPixel(colorType, depth);
+    int channels = bitsPerPixel / depth;
+    int maxSample = (1 << depth) - 1;
+    struct ihdr ihdrData;
+    auto random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (int) (seed >> 8);
+    };
+
+    ihdrData.width = width;
+    ihdrData.height = height;
+    ihdrData.channelDepth = depth;
+    ihdrData.colorType = colorType;
+    ihdrData.compressionMethod = 0;
+    ihdrData.filterMethod = 0;
+    ihdrData.interlaceMethod = interlaced ? 1 : 0;
+    if (colorType == 3) {
+        ihdrData.paletteSize = std::min(maxSample + 1, 200);
+        for (int i = 0; i < ihdrData.paletteSize; i++) {
+            for (int c = 0; c < 4; c++) {
+                ihdrData.palette[i][c] = c < 3 || i < ihdrData.paletteSize / 2 ? random() & 0xff : 255;
+            }
+        }
+    }
+
+    std::vector<int> samples((size_t) width * height * channels);
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = random() % (colorType == 3 ? ihdrData.paletteSize : maxSample + 1);
+    }
+    if (keyed && (colorType == 0 || colorType == 2)) {
+        for (int c = 0; c < channels; c++) {
+            ihdrData.transparentKey[c] = samples[c];
+        }
+        for (size_t pixel = 7; pixel < (size_t) width * height; pixel += 7) {
+            std::copy(samples.begin(), samples.begin() + channels, samples.begin() + pixel * channels);
+        }
+    }
+
+    reference.resize((size_t) width * height * 4);
+    for (size_t pixel = 0; pixel < (size_t) width * height; pixel++) {
+        const int *sample = &samples[pixel * channels];
+        unsigned char *rgba = &reference[pixel * 4];
+        unsigned char scaled[4];
+        for (int c = 0; c < channels; c++) {
+            scaled[c] = depth == 16 ? sample[c] >> 8 : sample[c] * 255 / maxSample;
+        }
+
+        bool transparent = ihdrData.transparentKey[0] != -1;
+        for (int c = 0; c < channels && transparent; c++) {
+            transparent = sample[c] == ihdrData.transparentKey[c];
+        }
+        switch (colorType) {
+            case 0: rgba[0] = rgba[1] = rgba[2] = scaled[0]; rgba[3] = transparent ? 0 : 255; break;
+            case 2: std::memcpy(rgba, scaled, 3); rgba[3] = transparent ? 0 : 255; break;
+            case 3: std::memcpy(rgba, ihdrData.palette[sample[0]], 4); break;
+            case 4: rgba[0] = rgba[1] = rgba[2] = scaled[0]; rgba[3] = scaled[1]; break;
+            default: std::memcpy(rgba, scaled, 4); break;
+        }
+    }
+
+    struct adam7Pass passes[ADAM7_PASSES];
+    int passCount = 1;
+    if (interlaced) {
+        getAdam7Passes(width, height, bitsPerPixel, passes);
+        passCount = ADAM7_PASSES;
+    } else {
+        passes[0] = {0, 0, 1, 1, width, height, 0, 0};
+    }
+
+    // filtered scanlines of every pass, in order
+    std::vector<unsigned char> filtered;
+    int bytesPerPixel = std::max(bitsPerPixel / 8, 1);
+    for (int p = 0; p < passCount; p++) {
+        const struct adam7Pass &pass = passes[p];
+        if (pass.width == 0 || pass.height == 0) {
+            continue;
+        }
+        size_t rowBytes = getRowBytes(pass.width, bitsPerPixel);
+        std::vector<unsigned char> row(rowBytes), prev(rowBytes, 0);
+        std::vector<int> rowSamples((size_t) pass.width * channels);
+
+        for (int y = 0; y < pass.height; y++) {
+            for (int x = 0; x < pass.width; x++) {
+                size_t pixel = (size_t) (pass.yStart + y * pass.yStep) * width + pass.xStart + x * pass.xStep;
+                std::copy(&samples[pixel * channels], &samples[pixel * channels] + channels, &rowSamples[(size_t) x * channels]);
+            }
+            std::fill(row.begin(), row.end(), 0);
+            packSamples(rowSamples.data(), rowSamples.size(), depth, row.data());
+
+            int filter = (y + p) % 5;
+            filtered.push_back(filter);
+            for (size_t i = 0; i < rowBytes; i++) {
+                int a = i >= (size_t) bytesPerPixel ? row[i - bytesPerPixel] : 0;
+                int b = prev[i];
+                int c = i >= (size_t) bytesPerPixel ? prev[i - bytesPerPixel] : 0;
+                int predicted[5] = {0, a, b, (a + b) / 2, paethPredictor(a, b, c)};
+                filtered.push_back((unsigned char) (row[i] - predicted[filter]));
+            }
+            row.swap(prev);
+        }
+    }
+
+    std::vector<unsigned char> compressed(compressBound(filtered.size()));
+    uLongf compressedSize = compressed.size();
+    if (compress2(compressed.data(), &compressedSize, filtered.data(), filtered.size(), Z_BEST_SPEED) != Z_OK) {
+        return false;
+    }
+
+    unsigned char signature[8] = PNG_HEADER;
+    unsigned char header[13] = {(unsigned char) (width >> 24), (unsigned char) (width >> 16), (unsigned char) (width >> 8), (unsigned char) width,
+                                (unsigned char) (height >> 24), (unsigned char) (height >> 16), (unsigned char) (height >> 8), (unsigned char) height,
+                                (unsigned char) depth, (unsigned char) colorType, 0, 0, (unsigned char) ihdrData.interlaceMethod};
+    png.assign(signature, signature + 8);
+    appendChunk(png, "IHDR", header, 13);
+    if (colorType == 3) {
+        std::vector<unsigned char> palette, alphas;
+        for (int i = 0; i < ihdrData.paletteSize; i++) {
+            palette.insert(palette.end(), ihdrData.palette[i], ihdrData.palette[i] + 3);
+            if (i < ihdrData.paletteSize / 2) {
+                alphas.push_back(ihdrData.palette[i][3]);
+            }
+        }
+        appendChunk(png, "PLTE", palette.data(), palette.size());
+        appendChunk(png, "tRNS", alphas.data(), alphas.size());
+    } else if (ihdrData.transparentKey[0] != -1) {
+        unsigned char key[6];
+        for (int c = 0; c < channels; c++) {
+            key[c * 2] = ihdrData.transparentKey[c] >> 8;
+            key[c * 2 + 1] = ihdrData.transparentKey[c] & 0xff;
+        }
+        appendChunk(png, "tRNS", key, channels * 2);
+    }
+    appendChunk(png, "IDAT", compressed.data(), compressedSize / 2);
+    appendChunk(png, "IDAT", compressed.data() + compressedSize / 2, compressedSize - compressedSize / 2);
+    appendChunk(png, "IEND", NULL, 0);
+    return true;
+}
+
+/**
+ * Builds small images of every color type and bit depth, plain and Adam7 interlaced, in sizes
+ * from 1x1 up, and checks that defilterIDAT and pipelineDecodeIDAT both decode them to the RGBA8
+ * the spec gives for each pixel.
+*/
+int benchExpand() {
+    static const int formats[][2] = {{0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16}, {2, 8}, {2, 16}, {3, 1}, {3, 2}, {3, 4}, {3, 8}, {4, 8}, {4, 16}, {6, 8}, {6, 16}};
+    static const int sizes[][2] = {{1, 1}, {3, 2}, {13, 11}, {67, 37}};
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Format expansion against reference RGBA8" << std::endl;
+
+    int mismatches = 0;
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        int colorType = formats[f][0], depth = formats[f][1];
+        std::cout << "\tcolor type " << colorType << ", " << std::setw(2) << depth << " bit";
+
+        for (int interlaced = 0; interlaced < 2; interlaced++) {
+            int failed = 0;
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                int width = sizes[s][0], height = sizes[s][1];
+                std::vector<unsigned char> png, reference, inflated, decoded;
+                struct mappedPNG image;
+
+                if (!buildTestPNG(width, height, colorType, depth, interlaced, s % 2 == 1, f * 131 + s * 17 + interlaced, png, reference) ||
+                    !indexPNGBuffer(png.data(), png.size(), image) ||
+                    !decompressIDAT(image.base, image.idatSpans, inflated) ||
+                    !defilterIDAT(inflated, decoded, image.ihdrData, image.restartPoints)) {
+                    failed++;
+                    continue;
+                }
+                failed += decoded != reference;
+
+                std::vector<unsigned char> pipelined(reference.size());
+                struct outputDescriptor output = {pipelined.data(), (size_t) width * 4, PIXEL_RGBA8};
+                failed += !pipelineDecodeIDAT(image.base, image.idatSpans, image.ihdrData, output) || pipelined != reference;
+            }
+            mismatches += failed;
+            std::cout << (interlaced ? "  interlaced: " : "  plain: ") << (failed > 0 ? "MISMATCH" : "ok");
+        }
+        std::cout << std::endl;
+    }
+    printSummaries = savedPrintSummaries;
+    return mismatches > 0 ? 1 : 0;
+}
+
+/**
+ * Times a full decode of the image against region decodes of a band at the top, a crop in the
+ * middle and a band at the bottom, and checks each region against the same pixels of the full
+ * decode. Also reports how much of the IDAT data each region decode read.
+*/
+int benchRegionDecode(const char *filename, int trials) {
+    std::vector<unsigned char> compressedIDAT, decompressedIDAT, fullImage;
+    struct ihdr ihdrData;
+    double fullTime = 0, start, end;
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    for (int trial = 0; trial < trials; trial++) {
+        std::vector<restartPoint> noRestartPoints;
+        compressedIDAT.clear();
+        decompressedIDAT.clear();
+
+        GET_TIME(start);
+        bool ok = readPNGImage(filename, compressedIDAT, ihdrData) && decompressIDAT(compressedIDAT, decompressedIDAT) &&
+                  defilterIDAT(decompressedIDAT, fullImage, ihdrData, noRestartPoints);
+        GET_TIME(end);
+        if (!ok) {
+            printSummaries = savedPrintSummaries;
+            return 1;
+        }
+        if (trial == 0 || end - start < fullTime) {
+            fullTime = end - start;
+        }
+    }
+    printSummaries = savedPrintSummaries;
+
+    int width = ihdrData.width, height = ihdrData.height;
+    int band = std::max(height / 8, 1);
+    struct regionOfInterest regions[] = {
+        {0, 0, width, band},
+        {width / 4, height / 2 - height / 8, std::max(width / 2, 1), std::max(height / 4, 1)},
+        {0, height - band, width, band},
+    };
+    const char *regionNames[] = {"top band", "centre crop", "bottom band"};
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Region decode: " << filename << " (" << compressedIDAT.size() / 1024 << " KiB of IDAT data), best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+    std::cout << "\tfull decode:  " << fullTime << " s" << std::endl;
+
+    int mismatches = 0;
+    for (size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); r++) {
+        const struct regionOfInterest &region = regions[r];
+        size_t stride = (size_t) region.width * DECODED_BYTES_PER_PIXEL;
+        std::vector<unsigned char> pixels(stride * region.height);
+        struct outputDescriptor output = {pixels.data(), stride, PIXEL_RGBA8};
+        struct regionDecodeStats stats;
+        struct ihdr regionHeader;
+        double regionTime = 0;
+
+        for (int trial = 0; trial < trials; trial++) {
+            GET_TIME(start);
+            bool ok = decodeRegion(filename, region, output, regionHeader, &stats);
+            GET_TIME(end);
+            if (!ok) {
+                return 1;
+            }
+            if (trial == 0 || end - start < regionTime) {
+                regionTime = end - start;
+            }
+        }
+
+        bool matched = true;
+        for (int y = 0; y < region.height && matched; y++) {
+            const unsigned char *expected = fullImage.data() + ((size_t) (region.y + y) * width + region.x) * DECODED_BYTES_PER_PIXEL;
+            matched = std::memcmp(pixels.data() + y * stride, expected, stride) == 0;
+        }
+        mismatches += !matched;
+
+        std::cout << "\t" << std::left << std::setw(12) << regionNames[r] << std::right << "  " << regionTime << " s ("
+                  << std::setprecision(1) << 100 * regionTime / fullTime << "% of full), read " << stats.idatBytesRead / 1024 << " KiB, "
+                  << stats.rowsDecoded << " rows" << std::setprecision(5) << (matched ? "" : "  MISMATCH") << std::endl;
+    }
+    return mismatches > 0 ? 1 : 0;
+}
+
+// Separate box filter pass over a full RGBA8 image, the reference for defilterScaled.
+static void boxReduceImage(const std::vector<unsigned char> &rgba, int width, int height, int scale, std::vector<unsigned char> &reduced) {
+    int outWidth = getScaledSize(width, scale), outHeight = getScaledSize(height, scale);
+    reduced.resize((size_t) outWidth * outHeight * DECODED_BYTES_PER_PIXEL);
+
+    for (int outY = 0; outY < outHeight; outY++) {
+        for (int outX = 0; outX < outWidth; outX++) {
+            int endY = std::min((outY + 1) * scale, height), endX = std::min((outX + 1) * scale, width);
+            uint32_t count = (uint32_t) (endY - outY * scale) * (endX - outX * scale);
+            for (int c = 0; c < DECODED_BYTES_PER_PIXEL; c++) {
+                uint32_t sum = 0;
+                for (int y = outY * scale; y < endY; y++) {
+                    for (int x = outX * scale; x < endX; x++) {
+                        sum += rgba[((size_t) y * width + x) * DECODED_BYTES_PER_PIXEL + c];
+                    }
+                }
+                reduced[((size_t) outY * outWidth + outX) * DECODED_BYTES_PER_PIXEL + c] = (sum + count / 2) / count;
+            }
+        }
+    }
+}
+
+/**
+ * Decodes the image at 1/2, 1/4 and 1/8 scale with defilterScaled, and as a full decode followed
+ * by a separate box filter pass, checking that both give the same pixels. Reports the time of
+ * each and the output buffer each needs.
+*/
+int benchDownscale(const char *filename, int trials) {
+    std::vector<unsigned char> compressedIDAT, decompressedIDAT;
+    std::vector<restartPoint> restartPoints;
+    struct ihdr ihdrData;
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    if (!readPNGImage(filename, compressedIDAT, ihdrData, &restartPoints) ||
+        !decompressIDAT(compressedIDAT, restartPoints, ihdrData, decompressedIDAT)) {
+        printSummaries = savedPrintSummaries;
+        return 1;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Downscaled decode: " << filename << " (" << ihdrData.width << " x " << ihdrData.height << "), best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+
+    int mismatches = 0;
+    for (int scale = 2; scale <= MAX_DOWNSCALE; scale *= 2) {
+        int outWidth = getScaledSize(ihdrData.width, scale), outHeight = getScaledSize(ihdrData.height, scale);
+        size_t stride = (size_t) outWidth * DECODED_BYTES_PER_PIXEL;
+        std::vector<unsigned char> fused(stride * outHeight), full, separate;
+        struct outputDescriptor output = {fused.data(), stride, PIXEL_RGBA8};
+        double fusedTime = 0, separateTime = 0, start, end;
+
+        for (int trial = 0; trial < trials; trial++) {
+            GET_TIME(start);
+            bool ok = defilterScaled(decompressedIDAT.data(), decompressedIDAT.size(), ihdrData, scale, output);
+            GET_TIME(end);
+            if (trial == 0 || end - start < fusedTime) {
+                fusedTime = end - start;
+            }
+
+            GET_TIME(start);
+            ok = ok && defilterIDAT(decompressedIDAT, full, ihdrData, restartPoints);
+            boxReduceImage(full, ihdrData.width, ihdrData.height, scale, separate);
+            GET_TIME(end);
+            if (trial == 0 || end - start < separateTime) {
+                separateTime = end - start;
+            }
+
+            if (!ok) {
+                printSummaries = savedPrintSummaries;
+                return 1;
+            }
+        }
+
+        bool matched = fused == separate;
+        mismatches += !matched;
+        std::cout << "\t1/" << scale << " (" << outWidth << " x " << outHeight << ")  fused: " << fusedTime << " s, " << fused.size() / 1024
+                  << " KiB; decode + reduce: " << separateTime << " s, " << (full.size() + separate.size()) / 1024 << " KiB"
+                  << (matched ? "" : "  MISMATCH") << std::endl;
+    }
+    printSummaries = savedPrintSummaries;
+    return mismatches > 0 ? 1 : 0;
+}
+
+/**
+ * Times each CRC-32 kernel (and zlib's crc32) over the image's IDAT payloads and checks that they
+ * agree, then shows what verifyChunkCRCs costs: on the read stage, where readPNGImage checks each
+ * chunk as it reads it, and on a mapped decode, where the IDAT check runs alongside inflate.
+ * Finally checks that a copy of the file with one IDAT byte flipped is rejected.
+*/
+int benchChunkCRCs(const char *filename, int trials) {
+    struct mappedPNG image;
+    if (!mapPNGImage(filename, image)) {
+        return 1;
+    }
+    size_t idatBytes = 0;
+    for (const idatSpan &span : image.idatSpans) {
+        idatBytes += span.length;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Chunk CRCs: " << filename << " (" << image.idatSpans.size() << " IDAT chunks, " << idatBytes / 1024 << " KiB), best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+
+    // zlib's crc32 is the reference every kernel has to match
+    uLong expected = crc32(0L, Z_NULL, 0);
+    for (const idatSpan &span : image.idatSpans) {
+        expected = crc32(expected, image.base + span.offset, span.length);
+    }
+
+    int failures = 0;
+    for (int isa = 0; isa <= CRC32_ISA_COUNT; isa++) {
+        Crc32Kernel kernel;
+        bool isZlib = isa == CRC32_ISA_COUNT;
+        if (!isZlib && !getCrc32KernelForIsa((Crc32Isa) isa, kernel)) {
+            continue;
+        }
+        double best = 0, start, end;
+        uint32_t crc = 0;
+        for (int trial = 0; trial < trials; trial++) {
+            GET_TIME(start);
+            crc = 0;
+            for (const idatSpan &span : image.idatSpans) {
+                crc = isZlib ? crc32(crc, image.base + span.offset, span.length) : kernel.update(crc, image.base + span.offset, span.length);
+            }
+            GET_TIME(end);
+            if (trial == 0 || end - start < best) {
+                best = end - start;
+            }
+        }
+        failures += crc != expected;
+        std::cout << "\t" << std::left << std::setw(14) << (isZlib ? "zlib crc32" : kernel.name) << std::right << best << " s, "
+                  << std::setprecision(2) << idatBytes / best / 1e9 << " GB/s" << std::setprecision(5) << (crc == expected ? "" : "  MISMATCH") << std::endl;
+    }
+
+    bool savedPrintSummaries = printSummaries, savedVerify = verifyChunkCRCs;
+    printSummaries = false;
+    double readTime[2] = {0, 0}, mappedTime[2] = {0, 0};
+    for (int verify = 0; verify < 2; verify++) {
+        verifyChunkCRCs = verify;
+        for (int trial = 0; trial < trials; trial++) {
+            std::vector<unsigned char> compressedIDAT, decompressedIDAT;
+            struct ihdr ihdrData;
+            struct mappedPNG mapped;
+            double start, middle, end;
+
+            GET_TIME(start);
+            bool ok = readPNGImage(filename, compressedIDAT, ihdrData);
+            GET_TIME(middle);
+            ok = ok && mapPNGImage(filename, mapped);
+            ok = ok && decompressIDAT(mapped.base, mapped.idatSpans, decompressedIDAT);
+            GET_TIME(end);
+            unmapPNGImage(mapped);
+            failures += !ok;
+
+            if (trial == 0 || middle - start < readTime[verify]) {
+                readTime[verify] = middle - start;
+            }
+            if (trial == 0 || end - middle < mappedTime[verify]) {
+                mappedTime[verify] = end - middle;
+            }
+        }
+    }
+    std::cout << "\tread stage:    " << readTime[0] << " s, with CRCs " << readTime[1] << " s" << std::endl;
+    std::cout << "\tmap + inflate: " << mappedTime[0] << " s, with CRCs " << mappedTime[1] << " s (checked alongside inflate)" << std::endl;
+
+    // the longest IDAT chunk gets one byte flipped in a private copy of the file
+    std::vector<unsigned char> corrupted(image.base, image.base + image.size);
+    const idatSpan *longest = &image.idatSpans[0];
+    for (const idatSpan &span : image.idatSpans) {
+        longest = span.length > longest->length ? &span : longest;
+    }
+    corrupted[longest->offset + longest->length / 2] ^= 0x10;
+    bool rejected = !verifyIDATSpans(corrupted.data(), image.idatSpans);
+    std::cout << "\tcorrupted copy " << (rejected ? "rejected" : "NOT REJECTED") << std::endl;
+    failures += !rejected;
+
+    verifyChunkCRCs = savedVerify;
+    printSummaries = savedPrintSummaries;
+    unmapPNGImage(image);
+    return failures > 0 ? 1 : 0;
+}
+
+/**
+ * Deflates 'data' with the given zlib settings and lays the stream out like IDAT chunks: spans of
+ * random lengths (1 byte up to about 8 KiB), each followed by four junk bytes where a CRC would be.
+*/
+static bool deflateIntoSpans(const std::vector<unsigned char> &data, int level, int strategy, int windowBits, unsigned seed, std::vector<unsigned char> &file, std::vector<idatSpan> &spans) {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, strategy) != Z_OK) {
+        return false;
+    }
+    std::vector<unsigned char> compressed(deflateBound(&stream, data.size()));
+    stream.next_in = const_cast<unsigned char *>(data.data());
+    stream.avail_in = data.size();
+    stream.next_out = compressed.data();
+    stream.avail_out = compressed.size();
+    bool ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    file.clear();
+    spans.clear();
+    for (size_t offset = 0; ok && offset < compressed.size();) {
+        seed = seed * 1103515245 + 12345;
+        size_t length = std::min((size_t) 1 + (seed >> 8) % ((seed & 1) ? 16 : 8192), compressed.size() - offset);
+        spans.push_back({file.size(), length});
+        file.insert(file.end(), compressed.begin() + offset, compressed.begin() + offset + length);
+        file.insert(file.end(), 4, 0xa5);
+        offset += length;
+    }
+    return ok;
+}
+
+/**
+ * Compares the built-in inflate (inflateEngine.h) against zlib on the image's IDAT data, then
+ * differentially tests it: the inflated data is deflated again at several levels, strategies and
+ * window sizes and split into IDAT-like spans, and both engines must give identical output.
+ * Finally one random bit of a deflated copy is flipped at a time, and both engines must agree on
+ * rejecting it or on what it inflates to.
+*/
+int benchInflate(const char *filename, int trials) {
+    struct mappedPNG image;
+    if (!mapPNGImage(filename, image)) {
+        return 1;
+    }
+    size_t idatBytes = 0;
+    for (const idatSpan &span : image.idatSpans) {
+        idatBytes += span.length;
+    }
+    size_t inflatedSize = getInflatedSize(image.ihdrData);
+
+    bool savedPrintSummaries = printSummaries, savedBuiltin = useBuiltinInflate;
+    printSummaries = false;
+    std::vector<unsigned char> reference;
+    if (inflatedSize == 0 || !decompressIDAT(image.base, image.idatSpans, reference) || reference.size() < inflatedSize) {
+        std::cerr << "Cannot inflate " << filename << " with zlib" << std::endl;
+        printSummaries = savedPrintSummaries;
+        unmapPNGImage(image);
+        return 1;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Inflate: " << filename << " (" << idatBytes / 1024 << " KiB to " << inflatedSize / 1024 << " KiB), best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+
+    // the 4 KiB loop that grows a vector, then both engines into one exactly sized buffer
+    int failures = 0;
+    const char *engineNames[3] = {"zlib, 4 KiB loop", "zlib, one shot", "built-in"};
+    std::vector<unsigned char> out(inflatedSize);
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+    if (inflateInit(&stream) != Z_OK) {
+        printSummaries = savedPrintSummaries;
+        unmapPNGImage(image);
+        return 1;
+    }
+    for (int engine = 0; engine < 3; engine++) {
+        useBuiltinInflate = engine == 2;
+        double best = 0, start, end;
+        bool matches = true;
+        for (int trial = 0; trial < trials; trial++) {
+            std::vector<unsigned char> grown;
+            GET_TIME(start);
+            bool ok = engine == 0 ? decompressIDAT(image.base, image.idatSpans, grown)
+                                  : decompressIDAT(stream, image.base, image.idatSpans, out.data(), out.size());
+            GET_TIME(end);
+            matches = matches && ok && std::memcmp(engine == 0 ? grown.data() : out.data(), reference.data(), inflatedSize) == 0;
+            if (trial == 0 || end - start < best) {
+                best = end - start;
+            }
+        }
+        failures += !matches;
+        std::cout << "\t" << std::left << std::setw(18) << engineNames[engine] << std::right << best << " s, "
+                  << std::setprecision(1) << inflatedSize / best / 1e6 << " MB/s out" << std::setprecision(5) << (matches ? "" : "  MISMATCH") << std::endl;
+    }
+    inflateEnd(&stream);
+
+    // Differential test on streams from every kind of deflate block, split at awkward places.
+    const int levels[4] = {0, 1, 6, 9};
+    const int strategies[5] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED};
+    const int windowBits[2] = {9, 15};
+    int streams = 0, mismatches = 0;
+    for (int level : levels) {
+        for (int strategy : strategies) {
+            for (int bits : windowBits) {
+                std::vector<unsigned char> file;
+                std::vector<idatSpan> spans;
+                size_t produced = 0;
+                if (!deflateIntoSpans(reference, level, strategy, bits, streams, file, spans)) {
+                    continue;
+                }
+                streams++;
+                out.assign(reference.size(), 0);
+                bool ok = builtinInflate(file.data(), spans, out.data(), out.size(), produced);
+                if (!ok || produced != reference.size() || out != reference) {
+                    std::cout << "\tMISMATCH at level " << level << ", strategy " << strategy << ", window bits " << bits << std::endl;
+                    mismatches++;
+                }
+            }
+        }
+    }
+    std::cout << "\tre-deflated:      " << streams - mismatches << " of " << streams << " streams identical" << std::endl;
+    failures += mismatches;
+
+    // Corrupted streams, on at most 256 KiB so each one is quick; the errors both engines report are muted.
+    std::vector<unsigned char> sample(reference.begin(), reference.begin() + std::min(reference.size(), (size_t) 256 * 1024));
+    std::vector<unsigned char> original[2];
+    std::vector<idatSpan> originalSpans[2];
+    deflateIntoSpans(sample, 6, Z_DEFAULT_STRATEGY, 15, 1, original[0], originalSpans[0]);
+    deflateIntoSpans(sample, 6, Z_FIXED, 15, 2, original[1], originalSpans[1]);
+    std::streambuf *savedCerr = std::cerr.rdbuf(NULL);
+    int corrupted = 0, agreed = 0, rejected = 0;
+    unsigned seed = 12345;
+    for (int i = 0; i < 400; i++) {
+        std::vector<unsigned char> file = original[i % 2];
+        const std::vector<idatSpan> &spans = originalSpans[i % 2];
+        seed = seed * 1103515245 + 12345;
+        const idatSpan &span = spans[(seed >> 8) % spans.size()];
+        seed = seed * 1103515245 + 12345;
+        file[span.offset + (seed >> 8) % span.length] ^= 1 << (seed >> 28) % 8;
+
+        std::vector<unsigned char> zlibOut;
+        bool zlibOk = decompressIDAT(file.data(), spans, zlibOut);
+        size_t produced = 0;
+        out.assign(2 * sample.size() + 1024, 0);
+        bool builtinOk = builtinInflate(file.data(), spans, out.data(), out.size(), produced);
+        out.resize(produced);
+
+        corrupted++;
+        agreed += zlibOk == builtinOk && (!zlibOk || zlibOut == out);
+        rejected += !zlibOk;
+    }
+    std::cerr.rdbuf(savedCerr);
+    std::cerr.clear();
+    std::cout << "\tcorrupted:        " << agreed << " of " << corrupted << " agree with zlib (" << rejected << " rejected by both)" << std::endl;
+    failures += corrupted - agreed;
+
+    useBuiltinInflate = savedBuiltin;
+    printSummaries = savedPrintSummaries;
+    unmapPNGImage(image);
+    return failures > 0 ? 1 : 0;
+}
+
+/**
+ * Times defilterIDAT on the image at 1 to 32 threads, where it runs as a wavefront (see
+ * defilterIDAT), and checks every run against the single-threaded output. Then checks the
+ * wavefront on synthetic images of every whole-byte pixel size with random filter types.
+*/
+int benchWavefront(const char *filename, int trials) {
+    std::vector<unsigned char> compressedIDAT, decompressedIDAT;
+    struct ihdr ihdrData;
+    if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
+        std::cerr << "Image reading failed" << std::endl;
+        return 1;
+    }
+    if (ihdrData.interlaceMethod != 0 || getBytesPerPixel(ihdrData.colorType, ihdrData.channelDepth) == -1) {
+        std::cerr << "Wavefront defiltering needs a non-interlaced image with whole-byte pixels" << std::endl;
+        return 1;
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    int savedThreads = omp_get_max_threads();
+    printSummaries = false;
+    if (!decompressIDAT(compressedIDAT, decompressedIDAT)) {
+        printSummaries = savedPrintSummaries;
+        return 1;
+    }
+
+    long dependentRows = 0;
+    size_t colWidth = decompressedIDAT.size() / ihdrData.height;
+    for (int row = 1; row < ihdrData.height; row++) {
+        dependentRows += decompressedIDAT[row * colWidth] >= 2;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Wavefront defilter: " << filename << " (" << dependentRows << " of " << ihdrData.height << " rows Up/Average/Paeth), best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+
+    int failures = 0;
+    std::vector<unsigned char> reference, output;
+    double serialTime = 0, start, end;
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        omp_set_num_threads(threads);
+        double best = 0;
+        bool matches = true;
+        for (int trial = 0; trial < trials; trial++) {
+            GET_TIME(start);
+            bool ok = defilterIDAT(decompressedIDAT, output, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth);
+            GET_TIME(end);
+            if (threads == 1 && trial == 0) {
+                reference = output;
+            }
+            matches = matches && ok && output == reference;
+            if (trial == 0 || end - start < best) {
+                best = end - start;
+            }
+        }
+        if (threads == 1) {
+            serialTime = best;
+        }
+        failures += !matches;
+        std::cout << "\t" << std::setw(2) << threads << " threads: " << best << " s, " << std::setprecision(2) << serialTime / best << "x"
+                  << std::setprecision(5) << (matches ? "" : "  MISMATCH") << std::endl;
+    }
+
+    // color type and bit depth giving 1, 2, 3, 4, 6 and 8 bytes per pixel
+    const int formats[6][2] = {{0, 8}, {4, 8}, {2, 8}, {6, 8}, {2, 16}, {6, 16}};
+    int width = 1000, height = 300, synthetic = 0, syntheticMatches = 0;
+    srand(4321);
+    for (const int *format : formats) {
+        int bytesPerPixel = getBytesPerPixel(format[0], format[1]);
+        std::vector<unsigned char> filtered((size_t) (width * bytesPerPixel + 1) * height);
+        for (size_t i = 0; i < filtered.size(); i++) {
+            filtered[i] = i % (width * bytesPerPixel + 1) == 0 ? rand() % 5 : rand() & 0xff;
+        }
+        omp_set_num_threads(1);
+        defilterIDAT(filtered, reference, width, height, format[0], format[1]);
+        omp_set_num_threads(8);
+        defilterIDAT(filtered, output, width, height, format[0], format[1]);
+        synthetic++;
+        syntheticMatches += output == reference;
+        if (output != reference) {
+            std::cout << "\tMISMATCH on synthetic " << bytesPerPixel << " byte pixels" << std::endl;
+        }
+    }
+    std::cout << "\tsynthetic: " << syntheticMatches << " of " << synthetic << " pixel sizes match" << std::endl;
+    failures += synthetic - syntheticMatches;
+
+    omp_set_num_threads(savedThreads);
+    printSummaries = savedPrintSummaries;
+    return failures > 0 ? 1 : 0;
+}
+
+/**
+ * Times inflate and defilter one after the other (each on one thread) against pipelineDecodeIDAT,
+ * which overlaps them, and checks that both give the same pixels. Then cuts the IDAT data short
+ * and checks that the pipeline fails instead of hanging on a ring that never fills.
+*/
+int benchPipelinedDecode(const char *filename, int trials) {
+    std::vector<unsigned char> compressedIDAT;
+    struct ihdr ihdrData;
+    if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
+        std::cerr << "Image reading failed" << std::endl;
+        return 1;
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    int savedThreads = omp_get_max_threads();
+    printSummaries = false;
+    omp_set_num_threads(1);
+
+    double inflateTime = 0, defilterTime = 0, pipelineTime = 0, start, middle, end;
+    std::vector<unsigned char> sequential, pipelined;
+    bool ok = true;
+    for (int trial = 0; trial < trials && ok; trial++) {
+        std::vector<unsigned char> decompressedIDAT;
+        GET_TIME(start);
+        ok = decompressIDAT(compressedIDAT, decompressedIDAT);
+        GET_TIME(middle);
+        ok = ok && defilterIDAT(decompressedIDAT, sequential, ihdrData, std::vector<restartPoint>());
+        GET_TIME(end);
+        if (trial == 0 || middle - start < inflateTime) {
+            inflateTime = middle - start;
+        }
+        if (trial == 0 || end - middle < defilterTime) {
+            defilterTime = end - middle;
+        }
+
+        GET_TIME(start);
+        ok = ok && pipelineDecodeIDAT(compressedIDAT, ihdrData, pipelined);
+        GET_TIME(end);
+        if (trial == 0 || end - start < pipelineTime) {
+            pipelineTime = end - start;
+        }
+    }
+
+    // a quarter of the data is gone, so the producer stops partway through the image
+    std::vector<unsigned char> truncated(compressedIDAT.begin(), compressedIDAT.begin() + compressedIDAT.size() * 3 / 4), failed;
+    std::streambuf *savedCerr = std::cerr.rdbuf(NULL);
+    bool truncatedRejected = !pipelineDecodeIDAT(truncated, ihdrData, failed);
+    std::cerr.rdbuf(savedCerr);
+    std::cerr.clear();
+
+    omp_set_num_threads(savedThreads);
+    printSummaries = savedPrintSummaries;
+    if (!ok) {
+        std::cerr << "Decoding " << filename << " failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Pipelined decode: " << filename << ", best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+    std::cout << "\tInflate:    " << inflateTime << " s" << std::endl;
+    std::cout << "\tDefilter:   " << defilterTime << " s" << std::endl;
+    std::cout << "\tSequential: " << inflateTime + defilterTime << " s" << std::endl;
+    std::cout << "\tPipelined:  " << pipelineTime << " s, " << std::setprecision(2) << (inflateTime + defilterTime) / pipelineTime << "x, "
+              << pipelineTime / std::max(inflateTime, defilterTime) << "x the slower stage" << std::endl;
+    std::cout << "\tTruncated data " << (truncatedRejected ? "rejected" : "NOT REJECTED") << std::endl;
+
+    if (pipelined != sequential) {
+        std::cout << "\tMISMATCH between sequential and pipelined output" << std::endl;
+        return 1;
+    }
+    return truncatedRejected ? 0 : 1;
+}
+
+/**
+ * Requests the images in 'path' from one ImageCache on several threads, picking them with a skew
+ * towards the first files as a service's popular assets would be, and checks every image handed
+ * out against a direct decode. The budget can be set below the images' total size to exercise
+ * eviction; the threads start together, so the first requests also exercise collapsed misses.
+*/
+int benchImageCache(const char *path, size_t budgetBytes, int threads, int requestsPerThread) {
+    std::vector<std::string> files;
+    if (!collectBatchFiles(path, files) || files.empty()) {
+        std::cerr << "No images found in " << path << std::endl;
+        return 1;
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    std::vector<std::vector<unsigned char> > reference(files.size());
+    double start, end, directSeconds;
+    GET_TIME(start);
+    for (size_t i = 0; i < files.size(); i++) {
+        std::vector<unsigned char> compressedIDAT, decompressedIDAT;
+        std::vector<restartPoint> restartPoints;
+        struct ihdr ihdrData;
+        if (!readPNGImage(files[i].c_str(), compressedIDAT, ihdrData, &restartPoints) ||
+            !decompressIDAT(compressedIDAT, restartPoints, ihdrData, decompressedIDAT) ||
+            !defilterIDAT(decompressedIDAT, reference[i], ihdrData, restartPoints)) {
+            std::cerr << "Cannot decode " << files[i] << std::endl;
+            printSummaries = savedPrintSummaries;
+            return 1;
+        }
+    }
+    GET_TIME(end);
+    directSeconds = (end - start) / files.size();
+
+    ImageCache cache(budgetBytes);
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> workers;
+    GET_TIME(start);
+    for (int thread = 0; thread < threads; thread++) {
+        workers.emplace_back([&, thread]() {
+            unsigned seed = 2654435761u * (thread + 1);
+            for (int request = 0; request < requestsPerThread; request++) {
+                // the smaller of two uniform picks, so low indices come up more often
+                seed = seed * 1103515245 + 12345;
+                size_t first = (seed >> 8) % files.size();
+                seed = seed * 1103515245 + 12345;
+                size_t index = std::min(first, (size_t) (seed >> 8) % files.size());
+                CachedImagePtr image = cache.get(files[index].c_str());
+                if (image == NULL || image->pixels != reference[index]) {
+                    mismatches++;
+                }
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    GET_TIME(end);
+    printSummaries = savedPrintSummaries;
+
+    int requests = threads * requestsPerThread;
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Image cache: " << files.size() << " images, " << threads << " threads, " << requests << " requests" << std::endl;
+    std::cout << std::fixed << std::setprecision(5);
+    std::cout << "\tDirect decode: " << directSeconds << " s per image" << std::endl;
+    std::cout << "\tThrough cache: " << (end - start) / requests << " s per request" << std::endl;
+    printImageCacheStats(cache.getStats());
+    if (mismatches > 0) {
+        std::cout << "\t" << mismatches << " images did not match a direct decode" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Evicts the files' pages, so the next pass reads them from the device. Only clean pages go.
+static void dropFromPageCache(const std::vector<std::string> &files) {
+    for (const std::string &name : files) {
+        int fd = open(name.c_str(), O_RDONLY);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+/**
+ * Reads and decodes a batch on a cold page cache: with every worker mapping its own files
+ * (batchDecode), and with the files read ahead by an AsyncBatchReader on io_uring and on pread.
+ * Each reader also runs without decoding, for its read throughput and system calls per image.
+ * Every decode is checked against the mapped one by the CRC-32 of each image.
+*/
+int benchAsyncRead(const char *path, int threads, int trials) {
+    std::vector<std::string> files;
+    if (!collectBatchFiles(path, files) || files.empty()) {
+        std::cerr << "No images found in " << path << std::endl;
+        return 1;
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    std::mutex checksumLock;
+    std::map<std::string, uint32_t> reference, checksums;
+    ImageSink sink = [&](const std::string &filename, const struct ihdr &, std::vector<unsigned char> &imageData) {
+        uint32_t crc = crc32Update(0, imageData.data(), imageData.size());
+        std::lock_guard<std::mutex> guard(checksumLock);
+        checksums[filename] = crc;
+    };
+
+    struct batchStats mappedStats;
+    bool ok = true;
+    for (int trial = 0; trial < trials; trial++) {
+        struct batchStats stats;
+        dropFromPageCache(files);
+        ok = batchDecode(files, threads, stats, sink) && ok;
+        if (trial == 0 || stats.seconds < mappedStats.seconds) {
+            mappedStats = stats;
+        }
+    }
+    reference.swap(checksums);
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Cold cache batch read: " << files.size() << " images, " << threads << " threads, best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\tmmap per worker:  decode " << mappedStats.images / mappedStats.seconds << " images/s, "
+              << mappedStats.fileBytes / mappedStats.seconds / 1e6 << " MB/s in; 6 system calls per image plus page faults" << std::endl;
+
+    enum asyncReadBackend backends[2] = {ASYNC_READ_IO_URING, ASYNC_READ_PREAD};
+    int mismatches = 0;
+    for (enum asyncReadBackend backend : backends) {
+        double readSeconds = 0, decodeSeconds = 0;
+        struct asyncReadStats readOnly, decoding;
+        for (int trial = 0; trial < trials; trial++) {
+            dropFromPageCache(files);
+            AsyncBatchReader reader(backend);
+            reader.readFiles(files, [](AsyncFilePtr) {});
+            struct asyncReadStats stats = reader.getStats();
+            ok = stats.failed == 0 && ok;
+            if (trial == 0 || stats.seconds < readSeconds) {
+                readSeconds = stats.seconds;
+                readOnly = stats;
+            }
+
+            struct batchStats batch;
+            dropFromPageCache(files);
+            checksums.clear();
+            ok = batchDecodeAsync(files, threads, backend, batch, stats, sink) && ok;
+            if (checksums != reference) {
+                mismatches++;
+            }
+            if (trial == 0 || batch.seconds < decodeSeconds) {
+                decodeSeconds = batch.seconds;
+                decoding = stats;
+            }
+        }
+
+        long images = readOnly.files + readOnly.failed;
+        std::cout << "\t" << readOnly.backend << ":" << std::endl;
+        std::cout << "\t\tread only: " << readOnly.bytes / readSeconds / 1e6 << " MB/s, "
+                  << (double) readOnly.syscalls / images << " system calls per image" << std::endl;
+        std::cout << "\t\tdecode:    " << images / decodeSeconds << " images/s, " << decoding.bytes / decodeSeconds / 1e6 << " MB/s in, "
+                  << (double) decoding.syscalls / images << " system calls per image" << std::endl;
+    }
+    printSummaries = savedPrintSummaries;
+
+    if (!ok) {
+        std::cout << "\tSome images failed to read or decode" << std::endl;
+        return 1;
+    }
+    if (mismatches > 0) {
+        std::cout << "\tMISMATCH between mapped and read-ahead decodes in " << mismatches << " runs" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static bool sameIHDR(const struct ihdr &a, const struct ihdr &b) {
+    return a.width == b.width && a.height == b.height && a.channelDepth == b.channelDepth && a.colorType == b.colorType &&
+           a.compressionMethod == b.compressionMethod && a.filterMethod == b.filterMethod && a.interlaceMethod == b.interlaceMethod;
+}
+
+/**
+ * What a catalog scan pays per file: a header probe and a full chunk table (probePNG) against
+ * reading the image (readPNGImage), each on a cold and on a warm page cache. The probes' IHDR
+ * fields are checked against the read, and the table's IDAT chunks against mapPNGImage's spans.
+*/
+int benchProbe(const char *path, int trials) {
+    std::vector<std::string> files;
+    if (!collectBatchFiles(path, files) || files.empty()) {
+        std::cerr << "No images found in " << path << std::endl;
+        return 1;
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    size_t fileBytes = 0;
+    int mismatches = 0;
+    for (const std::string &name : files) {
+        struct pngProbe header, table;
+        struct mappedPNG mapped;
+        std::vector<unsigned char> compressedIDAT;
+        struct ihdr ihdrData;
+        if (!probePNG(name.c_str(), header, PROBE_HEADER) || !probePNG(name.c_str(), table, PROBE_CHUNK_TABLE) ||
+            !readPNGImage(name.c_str(), compressedIDAT, ihdrData) || !mapPNGImage(name.c_str(), mapped)) {
+            std::cerr << "Cannot read " << name << std::endl;
+            printSummaries = savedPrintSummaries;
+            return 1;
+        }
+        fileBytes += table.fileSize;
+
+        std::vector<idatSpan> spans;
+        for (const chunkEntry &chunk : table.chunks) {
+            if (std::memcmp(chunk.type, "IDAT", 4) == 0) {
+                spans.push_back({chunk.offset + 8, chunk.length});
+            }
+        }
+        bool spansMatch = spans.size() == mapped.idatSpans.size();
+        std::vector<unsigned char> mappedIDAT;
+        for (size_t i = 0; spansMatch && i < spans.size(); i++) {
+            spansMatch = spans[i].offset == mapped.idatSpans[i].offset && spans[i].length == mapped.idatSpans[i].length;
+            mappedIDAT.insert(mappedIDAT.end(), mapped.base + spans[i].offset, mapped.base + spans[i].offset + spans[i].length);
+        }
+        spansMatch = spansMatch && mappedIDAT == compressedIDAT;
+        if (!spansMatch || !sameIHDR(header.ihdrData, ihdrData) || !sameIHDR(table.ihdrData, ihdrData) || header.reads != 1) {
+            std::cout << "\tMISMATCH between the probes and the read of " << name << std::endl;
+            mismatches++;
+        }
+        unmapPNGImage(mapped);
+    }
+
+    const char *names[3] = {"Header probe", "Chunk table", "Full read"};
+    double seconds[3][2];
+    long reads[3] = {0, 0, 0};
+    size_t bytesRead[3] = {0, 0, fileBytes};
+    for (int mode = 0; mode < 3; mode++) {
+        for (int cold = 1; cold >= 0; cold--) {
+            for (int trial = 0; trial < trials; trial++) {
+                double start, end;
+                if (cold) {
+                    dropFromPageCache(files);
+                }
+                if (mode < 2) {
+                    reads[mode] = 0;
+                    bytesRead[mode] = 0;
+                }
+                GET_TIME(start);
+                for (const std::string &name : files) {
+                    if (mode < 2) {
+                        struct pngProbe probe;
+                        probePNG(name.c_str(), probe, mode == 0 ? PROBE_HEADER : PROBE_CHUNK_TABLE);
+                        reads[mode] += probe.reads;
+                        bytesRead[mode] += probe.bytesRead;
+                    } else {
+                        std::vector<unsigned char> compressedIDAT;
+                        struct ihdr ihdrData;
+                        readPNGImage(name.c_str(), compressedIDAT, ihdrData);
+                    }
+                }
+                GET_TIME(end);
+                if (trial == 0 || end - start < seconds[mode][cold]) {
+                    seconds[mode][cold] = end - start;
+                }
+            }
+        }
+    }
+    printSummaries = savedPrintSummaries;
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Probe against read: " << files.size() << " images, " << fileBytes / files.size() << " bytes each on average, best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (int mode = 0; mode < 3; mode++) {
+        std::cout << "\t" << std::left << std::setw(14) << names[mode] << std::right << seconds[mode][1] / files.size() * 1e6 << " us cold, "
+                  << seconds[mode][0] / files.size() * 1e6 << " us warm per file, " << (double) bytesRead[mode] / files.size() / 1024 << " KiB read";
+        if (mode < 2) {
+            std::cout << " in " << (double) reads[mode] / files.size() << " reads";
+        }
+        std::cout << std::endl;
+    }
+    return mismatches > 0 ? 1 : 0;
+}
+
+/**
+ * Measures open-to-first-pixel latency of a raw sidecar against decoding the PNG: in full (the
+ * regular decode to RGBA8), and up to its first row only (streamDecodeIDAT). The sidecar is
+ * written for a copy of the PNG in /tmp, checked against the decode, and checked to be refused
+ * once the copy's mtime changes.
+*/
+int benchSidecar(const char *filename, int trials) {
+    std::string copyPath = "/tmp/yipee-sidecar-" + std::to_string(getpid()) + ".png";
+    {
+        std::ifstream source(filename, std::ios::binary);
+        std::ofstream copy(copyPath, std::ios::binary);
+        copy << source.rdbuf();
+        if (!source || !copy) {
+            std::cerr << "Cannot copy " << filename << " to " << copyPath << std::endl;
+            return 1;
+        }
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    double start, end, decodeTime = 0, firstRowTime = 0, writeTime = 0, openTime = 0, verifiedOpenTime = 0, touchTime = 0;
+    std::vector<unsigned char> decoded;
+    struct ihdr ihdrData = {};
+    bool ok = true;
+    volatile unsigned sink = 0;
+
+    for (int trial = 0; trial < trials && ok; trial++) {
+        struct mappedPNG png;
+        std::vector<unsigned char> inflated;
+        GET_TIME(start);
+        ok = mapPNGImage(copyPath.c_str(), png) &&
+             decompressIDAT(png.base, png.idatSpans, png.restartPoints, png.ihdrData, inflated) &&
+             defilterIDAT(inflated, decoded, png.ihdrData, png.restartPoints);
+        sink = sink + (ok ? decoded[0] : 0);
+        GET_TIME(end);
+        ihdrData = png.ihdrData;
+        unmapPNGImage(png);
+        if (trial == 0 || end - start < decodeTime) {
+            decodeTime = end - start;
+        }
+
+        GET_TIME(start);
+        ok = ok && mapPNGImage(copyPath.c_str(), png) &&
+             streamDecodeIDAT(png.base, png.idatSpans, png.ihdrData, [&sink](int, const unsigned char *row, int) { sink = sink + row[0]; return false; });
+        GET_TIME(end);
+        unmapPNGImage(png);
+        if (trial == 0 || end - start < firstRowTime) {
+            firstRowTime = end - start;
+        }
+
+        GET_TIME(start);
+        ok = ok && writeRawSidecar(copyPath.c_str());
+        GET_TIME(end);
+        if (trial == 0 || end - start < writeTime) {
+            writeTime = end - start;
+        }
+
+        struct rawImage image;
+        GET_TIME(start);
+        ok = ok && openRawSidecar(copyPath.c_str(), image);
+        sink = sink + (ok ? image.pixels[0] : 0);
+        GET_TIME(end);
+        if (trial == 0 || end - start < openTime) {
+            openTime = end - start;
+        }
+
+        // every page of the pixels, as an upload of the whole image would read them
+        GET_TIME(start);
+        for (size_t offset = 0; ok && offset < image.stride * image.ihdrData.height; offset += SIDECAR_PAGE_BYTES) {
+            sink = sink + image.pixels[offset];
+        }
+        GET_TIME(end);
+        if (trial == 0 || end - start < touchTime) {
+            touchTime = end - start;
+        }
+        closeRawSidecar(image);
+
+        GET_TIME(start);
+        ok = ok && openRawSidecar(copyPath.c_str(), image, true);
+        GET_TIME(end);
+        closeRawSidecar(image);
+        if (trial == 0 || end - start < verifiedOpenTime) {
+            verifiedOpenTime = end - start;
+        }
+    }
+
+    // the sidecar holds exactly the decoded rows
+    struct rawImage image;
+    bool matches = ok && openRawSidecar(copyPath.c_str(), image) && image.format == PIXEL_RGBA8;
+    size_t rowBytes = (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL;
+    for (int y = 0; matches && y < ihdrData.height; y++) {
+        matches = std::memcmp(image.pixels + y * image.stride, decoded.data() + y * rowBytes, rowBytes) == 0;
+    }
+    closeRawSidecar(image);
+
+    // a sidecar older than its PNG is refused
+    struct timespec times[2] = {{0, UTIME_OMIT}, {12345, 0}};
+    bool staleRefused = utimensat(AT_FDCWD, copyPath.c_str(), times, 0) == 0 && !openRawSidecar(copyPath.c_str(), image);
+    closeRawSidecar(image);
+
+    unlink(getSidecarPath(copyPath.c_str()).c_str());
+    unlink(copyPath.c_str());
+    printSummaries = savedPrintSummaries;
+    if (!ok) {
+        std::cerr << "Decoding " << filename << " failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Raw sidecar: " << filename << ", best of " << trials << std::endl;
+    std::cout << std::fixed << std::setprecision(6);
+    std::cout << "\tPNG decode, first pixel after full decode: " << decodeTime << " s" << std::endl;
+    std::cout << "\tPNG decode, first row streamed:           " << firstRowTime << " s" << std::endl;
+    std::cout << "\tSidecar write (decode into mapping):      " << writeTime << " s" << std::endl;
+    std::cout << "\tSidecar open, first pixel:                " << openTime << " s, " << std::setprecision(1) << decodeTime / openTime << "x faster" << std::setprecision(6) << std::endl;
+    std::cout << "\tSidecar open verifying source checksum:   " << verifiedOpenTime << " s" << std::endl;
+    std::cout << "\tSidecar, touching every page:             " << touchTime << " s" << std::endl;
+    std::cout << "\tPixels " << (matches ? "match" : "DO NOT MATCH") << " the decode; stale sidecar " << (staleRefused ? "refused" : "NOT REFUSED") << std::endl;
+    return matches && staleRefused ? 0 : 1;
+}
+
+/**
+ * Decodes every image in 'path' once per round, first through a fresh set of vectors per image
+ * (mapPNGImage, decompressIDAT, defilterIDAT) and then through one reused Decoder, and reports
+ * the time and the heap allocations of each round. After the first round the Decoder's pool
+ * already holds buffers for every image, so its later rounds should allocate nothing.
+ *
+ * @return 1 if an image fails to decode or a steady state Decoder round allocated.
+*/
+int benchDecoder(const char *path, int rounds, bool useHugePages) {
+    std::vector<std::string> files;
+    std::string pathName = path;
+    if (pathName.size() > 4 && pathName.compare(pathName.size() - 4, 4, ".png") == 0) {
+        files.push_back(pathName);
+    } else if (!collectBatchFiles(path, files) || files.empty()) {
+        std::cerr << "No images found in " << path << std::endl;
+        return 1;
+    }
+
+    bool savedPrintSummaries = printSummaries;
+    printSummaries = false;
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Decoder reuse: " << files.size() << " image(s), " << rounds << " round(s), huge pages " << (useHugePages ? "on" : "off") << std::endl;
+    std::cout << std::fixed;
+
+    for (int round = 0; round < rounds; round++) {
+        long heapBefore = heapAllocations;
+        size_t decodedBytes = 0;
+        double start, end;
+
+        GET_TIME(start);
+        for (const std::string &file : files) {
+            std::vector<unsigned char> decompressedIDAT, defilteredIDAT;
+            struct mappedPNG image;
+            bool ok = mapPNGImage(file.c_str(), image) && decompressIDAT(image.base, image.idatSpans, decompressedIDAT);
+            unmapPNGImage(image);
+            if (!ok || !defilterIDAT(decompressedIDAT, defilteredIDAT, image.ihdrData, std::vector<restartPoint>())) {
+                std::cerr << "Failed to decode " << file << std::endl;
+                printSummaries = savedPrintSummaries;
+                return 1;
+            }
+            decodedBytes += defilteredIDAT.size();
+        }
+        GET_TIME(end);
+
+        std::cout << "\tvectors round " << round + 1 << ": " << std::setprecision(5) << end - start << " s, " << std::setprecision(1)
+                  << decodedBytes / (end - start) / 1e6 << " MB/s, " << heapAllocations - heapBefore << " heap allocations" << std::endl;
+    }
+
+    Decoder decoder(useHugePages);
+    bool steadyStateAllocated = false;
+
+    for (int round = 0; round < rounds; round++) {
+        struct decoderStats before = decoder.getStats();
+        long heapBefore = heapAllocations;
+        size_t decodedBytes = 0;
+        double start, end;
+
+        GET_TIME(start);
+        for (const std::string &file : files) {
+            struct decodedImage image;
+            if (!decoder.decode(file.c_str(), image)) {
+                std::cerr << "Failed to decode " << file << std::endl;
+                printSummaries = savedPrintSummaries;
+                return 1;
+            }
+            decodedBytes += image.size;
+            decoder.release(image);
+        }
+        GET_TIME(end);
+
+        const struct decoderStats &after = decoder.getStats();
+        long heap = heapAllocations - heapBefore;
+        long poolAllocations = after.poolAllocations - before.poolAllocations;
+        long zlibAllocations = after.zlibAllocations - before.zlibAllocations;
+        if (round > 0 && heap + poolAllocations + zlibAllocations > 0) {
+            steadyStateAllocated = true;
+        }
+
+        std::cout << "\tDecoder round " << round + 1 << ": " << std::setprecision(5) << end - start << " s, " << std::setprecision(1)
+                  << decodedBytes / (end - start) / 1e6 << " MB/s, " << heap << " heap, " << poolAllocations << " pool, "
+                  << zlibAllocations << " zlib allocations" << std::endl;
+    }
+
+    const struct decoderStats &stats = decoder.getStats();
+    std::cout << "\tpool: " << stats.pooledBytes / 1024 << " KiB in " << stats.poolAllocations << " buffers (" << stats.hugePageBuffers
+              << " huge page), " << stats.poolHits << " reuses" << std::endl;
+    if (steadyStateAllocated) {
+        std::cout << "\tDecoder allocated after the first round" << std::endl;
+    }
+    printSummaries = savedPrintSummaries;
+    return steadyStateAllocated ? 1 : 0;
+}
+
+void printBenchUsage() {
+    std::cerr << "Usage: bench defilter [width height bytesPerPixel]" << std::endl;
+    std::cerr << "       bench stream <png>" << std::endl;
+    std::cerr << "       bench read <png>" << std::endl;
+    std::cerr << "       bench encode <png>..." << std::endl;
+    std::cerr << "       bench pipeline <png | directory | manifest> [--warmup N] [--iterations N] [--json FILE] [--csv FILE]" << std::endl;
+    std::cerr << "       bench compare <baseline> <png | directory | manifest> [--threshold PERCENT] [pipeline options]" << std::endl;
+    std::cerr << "       bench decoder <png | directory | manifest> [rounds] [nohuge]" << std::endl;
+    std::cerr << "       bench formats <png>" << std::endl;
+    std::cerr << "       bench expand" << std::endl;
+    std::cerr << "       bench region <png>" << std::endl;
+    std::cerr << "       bench downscale <png>" << std::endl;
+    std::cerr << "       bench crc <png>" << std::endl;
+    std::cerr << "       bench inflate <png>" << std::endl;
+    std::cerr << "       bench wavefront [png]" << std::endl;
+    std::cerr << "       bench pipelined <png>" << std::endl;
+    std::cerr << "       bench cache <png | directory | manifest> [budget MiB] [threads]" << std::endl;
+    std::cerr << "       bench sidecar <png>" << std::endl;
+    std::cerr << "       bench asyncread <directory | manifest> [threads]" << std::endl;
+    std::cerr << "       bench probe <directory | manifest>" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printBenchUsage();
+        return 1;
+    }
+
+    std::string mode = argv[1];
+    if (mode == "defilter") {
+        // defaults match forest-3584x2048.png
+        int width = argc > 2 ? atoi(argv[2]) : 3584;
+        int height = argc > 3 ? atoi(argv[3]) : 2048;
+        int bytesPerPixel = argc > 4 ? atoi(argv[4]) : 4;
+        return benchDefilterKernels(width, height, bytesPerPixel, 5);
+    }
+
+    if (mode == "encode" && argc > 2) {
+        return benchEncode(argv + 2, argc - 2, 3);
+    }
+    if (mode == "read" && argc > 2) {
+        return benchReadModes(argv[2], 5);
+    }
+    if (mode == "pipeline" && argc > 2) {
+        return benchPipeline(argv[2], argc - 3, argv + 3);
+    }
+    if (mode == "compare" && argc > 3) {
+        // same as pipeline with --baseline
+        std::vector<char *> options(argv + 4, argv + argc);
+        char baselineOption[] = "--baseline";
+        options.push_back(baselineOption);
+        options.push_back(argv[2]);
+        return benchPipeline(argv[3], options.size(), options.data());
+    }
+    if (mode == "decoder" && argc > 2) {
+        int rounds = argc > 3 ? std::max(atoi(argv[3]), 1) : 3;
+        bool useHugePages = !(argc > 4 && std::string(argv[4]) == "nohuge");
+        return benchDecoder(argv[2], rounds, useHugePages);
+    }
+    if (mode == "formats" && argc > 2) {
+        return benchOutputFormats(argv[2], 5);
+    }
+    if (mode == "expand") {
+        return benchExpand();
+    }
+    if (mode == "region" && argc > 2) {
+        return benchRegionDecode(argv[2], 5);
+    }
+    if (mode == "downscale" && argc > 2) {
+        return benchDownscale(argv[2], 5);
+    }
+    if (mode == "crc" && argc > 2) {
+        return benchChunkCRCs(argv[2], 5);
+    }
+    if (mode == "inflate" && argc > 2) {
+        return benchInflate(argv[2], 5);
+    }
+    if (mode == "sidecar" && argc > 2) {
+        return benchSidecar(argv[2], 5);
+    }
+    if (mode == "cache" && argc > 2) {
+        size_t budget = argc > 3 ? (size_t) atoi(argv[3]) * 1024 * 1024 : IMAGE_CACHE_DEFAULT_BUDGET;
+        int threads = argc > 4 ? std::max(atoi(argv[4]), 1) : 8;
+        return benchImageCache(argv[2], budget, threads, 200);
+    }
+    if (mode == "probe" && argc > 2) {
+        return benchProbe(argv[2], 5);
+    }
+    if (mode == "asyncread" && argc > 2) {
+        int threads = argc > 3 ? std::max(atoi(argv[3]), 1) : (int) std::max(std::thread::hardware_concurrency(), 1u);
+        return benchAsyncRead(argv[2], threads, 3);
+    }
+    if (mode == "pipelined" && argc > 2) {
+        return benchPipelinedDecode(argv[2], 5);
+    }
+    if (mode == "wavefront") {
+        return benchWavefront(argc > 2 ? argv[2] : "../test-images/forest-3584x2048.png", 5);
+    }
+    if (mode == "stream" && argc > 2) {
+        return benchStreamDecode(argv[2], 5);
+    }
+
+    printBenchUsage();
+    return 1;
+}
@@ -0,0 +1,182 @@
+// CRC-32 kernels with runtime CPU dispatch
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__x86_64__)
+#define CRC_X86 1
+#include <immintrin.h>
+#endif
+
+#include "crcKernels.h"
+
+// Reflected form of the CRC-32 polynomial 0x04c11db7.
+#define CRC32_POLYNOMIAL 0xedb88320u
+
+/*
+ * Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes, so eight input bytes
+ * are folded into the CRC with eight independent lookups instead of a chain of eight.
+ */
+struct slicingTables {
+    uint32_t table[8][256];
+
+    slicingTables() {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t crc = b;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+            }
+            table[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; b++) {
+            for (int k = 1; k < 8; k++) {
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+            }
+        }
+    }
+};
+
+static const slicingTables &getSlicingTables() {
+    static const slicingTables tables;
+    return tables;
+}
+
+static inline uint32_t readLittleEndian32(const unsigned char *data) {
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+// Runs the CRC register (not inverted) over 'size' bytes.
+static uint32_t crc32Slicing8Register(uint32_t crc, const unsigned char *data, size_t size) {
+    const uint32_t (*table)[256] = getSlicingTables().table;
+
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low = readLittleEndian32(data) ^ crc;
+        uint32_t high = readLittleEndian32(data + 4);
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; size > 0; data++, size--) {
+        crc = table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t crc32Slicing8(uint32_t crc, const unsigned char *data, size_t size) {
+    return ~crc32Slicing8Register(~crc, data, size);
+}
+
+#ifdef CRC_X86
+/*
+ * Carry-less multiply folding (Gopal et al., "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction"). Four 128 bit lanes are folded 64 bytes ahead at a time, then into one
+ * lane, down to 64 bits, and Barrett reduced to the 32 bit CRC. The constants are x^n mod P for
+ * the fold distances, bit reflected, and the Barrett pair (P and floor(x^64 / P)).
+ *
+ * Takes the CRC register and a multiple of 16 bytes, at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32FoldRegister(uint32_t crc, const unsigned char *data, size_t size) {
+    const __m128i fold4 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i fold1 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i fold64 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i barrett = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) data), _mm_cvtsi32_si128((int) crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i *) (data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *) (data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *) (data + 48));
+    data += 64;
+    size -= 64;
+
+    for (; size >= 64; data += 64, size -= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, fold4, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, fold4, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, fold4, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, fold4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, fold4, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, fold4, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, fold4, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, fold4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (data + 48)));
+    }
+
+    // fold the four lanes into one, then any remaining 16 byte blocks into it
+    __m128i lanes[3] = {x2, x3, x4};
+    for (int lane = 0; lane < 3; lane++) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, fold1, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, fold1, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[lane]), x5);
+    }
+    for (; size >= 16; data += 16, size -= 16) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, fold1, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, fold1, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) data)), x5);
+    }
+
+    // 128 bits to 64
+    __m128i folded = _mm_clmulepi64_si128(x1, fold1, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), folded);
+    __m128i high = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), fold64, 0x00);
+    x1 = _mm_xor_si128(x1, high);
+
+    // Barrett reduction to 32 bits
+    __m128i quotient = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), barrett, 0x10);
+    quotient = _mm_clmulepi64_si128(_mm_and_si128(quotient, low32), barrett, 0x00);
+    x1 = _mm_xor_si128(x1, quotient);
+    return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char *data, size_t size) {
+    uint32_t state = ~crc;
+    // the folding kernel wants whole 16 byte blocks, at least four of them
+    if (size >= 64) {
+        size_t blockBytes = size & ~(size_t) 15;
+        state = crc32FoldRegister(state, data, blockBytes);
+        data += blockBytes;
+        size -= blockBytes;
+    }
+    return ~crc32Slicing8Register(state, data, size);
+}
+#endif // CRC_X86
+
+bool getCrc32KernelForIsa(Crc32Isa isa, Crc32Kernel &kernel) {
+    switch (isa) {
+        case CRC32_ISA_SLICING8:
+            kernel = {"slicing-by-8", crc32Slicing8};
+            return true;
+#ifdef CRC_X86
+        case CRC32_ISA_PCLMUL:
+            if (!__builtin_cpu_supports("pclmul") || !__builtin_cpu_supports("sse4.1")) {
+                return false;
+            }
+            kernel = {"pclmul", crc32Pclmul};
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static Crc32Kernel selectCrc32Kernel() {
+    Crc32Kernel kernel;
+    for (int isa = CRC32_ISA_COUNT - 1; isa > CRC32_ISA_SLICING8; isa--) {
+        if (getCrc32KernelForIsa((Crc32Isa) isa, kernel)) {
+            return kernel;
+        }
+    }
+    getCrc32KernelForIsa(CRC32_ISA_SLICING8, kernel);
+    return kernel;
+}
+
+const Crc32Kernel &getCrc32Kernel() {
+    static const Crc32Kernel selected = selectCrc32Kernel();
+    return selected;
+}
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t size) {
+    return getCrc32Kernel().update(crc, data, size);
+}
@@ -0,0 +1,40 @@
+#ifndef _CRC_KERNELS_H_
+#define _CRC_KERNELS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Continues a CRC-32 (the PNG and zlib one) over 'size' more bytes. 'crc' is the CRC of the data
+ * so far, 0 for none, as with zlib's crc32(), so results chain across calls.
+*/
+typedef uint32_t (*Crc32Fn)(uint32_t crc, const unsigned char *data, size_t size);
+
+enum Crc32Isa {
+    CRC32_ISA_SLICING8 = 0,
+    CRC32_ISA_PCLMUL,
+    CRC32_ISA_COUNT
+};
+
+struct Crc32Kernel {
+    const char *name;
+    Crc32Fn update;
+};
+
+/**
+ * Returns the CRC kernel for the given instruction set.
+ *
+ * @return false if the ISA was not compiled in or is not supported by this CPU.
+*/
+bool getCrc32KernelForIsa(Crc32Isa isa, Crc32Kernel &kernel);
+
+/**
+ * Returns the fastest CRC kernel supported by this CPU. The choice is made once, on first use,
+ * from CPUID.
+*/
+const Crc32Kernel &getCrc32Kernel();
+
+// CRC-32 with the fastest kernel.
+uint32_t crc32Update(uint32_t crc, const unsigned char *data, size_t size);
+
+#endif
@@ -0,0 +1,171 @@
+#include <iostream>
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+#include "decoder.h"
+#include "processImage.h"
+#include "adam7.h"
+#include "trace.h"
+
+// Index of the smallest class holding 'size' bytes, or -1 if it is larger than every class.
+static int getSizeClass(size_t size) {
+    size_t classBytes = DECODER_MIN_CLASS_BYTES;
+    for (int sizeClass = 0; sizeClass < DECODER_SIZE_CLASSES; sizeClass++, classBytes *= 2) {
+        if (size <= classBytes) {
+            return sizeClass;
+        }
+    }
+    return -1;
+}
+
+BufferPool::BufferPool(bool useHugePages) : useHugePages(useHugePages) {
+    for (int sizeClass = 0; sizeClass < DECODER_SIZE_CLASSES; sizeClass++) {
+        freeLists[sizeClass] = NULL;
+    }
+}
+
+BufferPool::~BufferPool() {
+    size_t classBytes = DECODER_MIN_CLASS_BYTES;
+    for (int sizeClass = 0; sizeClass < DECODER_SIZE_CLASSES; sizeClass++, classBytes *= 2) {
+        while (freeLists[sizeClass] != NULL) {
+            freeBuffer *buffer = freeLists[sizeClass];
+            freeLists[sizeClass] = buffer->next;
+            freeSystemBuffer((unsigned char *) buffer, classBytes);
+        }
+    }
+}
+
+unsigned char *BufferPool::acquire(size_t size, size_t &capacity) {
+    int sizeClass = getSizeClass(size);
+    if (sizeClass == -1) {
+        std::cerr << "Cannot pool a buffer of " << size << " bytes" << std::endl;
+        return NULL;
+    }
+    capacity = (size_t) DECODER_MIN_CLASS_BYTES << sizeClass;
+
+    if (freeLists[sizeClass] != NULL) {
+        freeBuffer *buffer = freeLists[sizeClass];
+        freeLists[sizeClass] = buffer->next;
+        counters.poolHits++;
+        return (unsigned char *) buffer;
+    }
+
+    void *buffer = NULL;
+    // Every class from DECODER_HUGE_PAGE_BYTES up is a multiple of the huge page size, so an
+    // anonymous mapping of it can be backed entirely by transparent huge pages.
+    if (useHugePages && capacity >= DECODER_HUGE_PAGE_BYTES) {
+        buffer = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            std::cerr << "Error mapping a " << capacity << " byte buffer" << std::endl;
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (madvise(buffer, capacity, MADV_HUGEPAGE) == 0) {
+            counters.hugePageBuffers++;
+        }
+#endif
+    } else if (posix_memalign(&buffer, 64, capacity) != 0) {
+        std::cerr << "Error allocating a " << capacity << " byte buffer" << std::endl;
+        return NULL;
+    }
+
+    counters.poolAllocations++;
+    counters.pooledBytes += capacity;
+    return (unsigned char *) buffer;
+}
+
+void BufferPool::release(unsigned char *buffer, size_t capacity) {
+    int sizeClass = getSizeClass(capacity);
+    if (buffer == NULL || sizeClass == -1) {
+        return;
+    }
+    freeBuffer *entry = (freeBuffer *) buffer;
+    entry->next = freeLists[sizeClass];
+    freeLists[sizeClass] = entry;
+}
+
+void BufferPool::freeSystemBuffer(unsigned char *buffer, size_t capacity) {
+    if (useHugePages && capacity >= DECODER_HUGE_PAGE_BYTES) {
+        munmap(buffer, capacity);
+    } else {
+        free(buffer);
+    }
+    counters.pooledBytes -= capacity;
+}
+
+voidpf Decoder::countingAlloc(voidpf opaque, uInt items, uInt size) {
+    ((struct decoderStats *) opaque)->zlibAllocations++;
+    return calloc(items, size);
+}
+
+void Decoder::countingFree(voidpf, voidpf address) {
+    free(address);
+}
+
+Decoder::Decoder(bool useHugePages) : pool(useHugePages) {
+    file.base = NULL;
+    file.size = 0;
+
+    stream.zalloc = countingAlloc;
+    stream.zfree = countingFree;
+    stream.opaque = &pool.stats();
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+    streamReady = inflateInit(&stream) == Z_OK;
+    if (!streamReady) {
+        std::cerr << "Error initializing zlib inflate stream" << std::endl;
+    }
+}
+
+Decoder::~Decoder() {
+    if (streamReady) {
+        inflateEnd(&stream);
+    }
+}
+
+bool Decoder::decode(const char *filename, struct decodedImage &image) {
+    TRACE_SCOPE("decoderDecode");
+    image.pixels = NULL;
+    image.size = 0;
+    image.capacity = 0;
+
+    if (!streamReady || !mapPNGImage(filename, file)) {
+        return false;
+    }
+    image.ihdrData = file.ihdrData;
+
+    size_t inflatedSize = getInflatedSize(file.ihdrData);
+    size_t inflatedCapacity = 0;
+    unsigned char *inflated = pool.acquire(inflatedSize, inflatedCapacity);
+    bool ok = inflated != NULL && decompressIDAT(stream, file.base, file.idatSpans, inflated, inflatedSize);
+    unmapPNGImage(file);
+
+    image.size = (size_t) image.ihdrData.width * image.ihdrData.height * DECODED_BYTES_PER_PIXEL;
+    image.pixels = ok ? pool.acquire(image.size, image.capacity) : NULL;
+    ok = ok && image.pixels != NULL;
+
+    if (ok && image.ihdrData.interlaceMethod == 1) {
+        struct outputDescriptor output = {image.pixels, (size_t) image.ihdrData.width * DECODED_BYTES_PER_PIXEL, PIXEL_RGBA8};
+        ok = defilterAdam7(inflated, inflatedSize, output, image.ihdrData, ADAM7_PASSES, 1);
+    } else if (ok) {
+        int bitsPerPixel = getBitsPerPixel(image.ihdrData.colorType, image.ihdrData.channelDepth);
+        ok = buildRowExpander(image.ihdrData, expander) &&
+             defilterSubImage(inflated, image.pixels, image.ihdrData.width, image.ihdrData.height, bitsPerPixel, getActiveExpander(expander));
+    }
+
+    pool.release(inflated, inflatedCapacity);
+    if (!ok) {
+        release(image);
+        return false;
+    }
+    pool.stats().images++;
+    return true;
+}
+
+void Decoder::release(struct decodedImage &image) {
+    pool.release(image.pixels, image.capacity);
+    image.pixels = NULL;
+    image.size = 0;
+    image.capacity = 0;
+}
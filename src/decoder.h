@@ -0,0 +1,101 @@
+#ifndef _DECODER_H_
+#define _DECODER_H_
+
+#include <cstddef>
+#include <zlib.h>
+
+#include "readImage.h"
+#include "expandKernels.h"
+
+// Smallest pooled buffer; each size class doubles the one before it.
+#define DECODER_MIN_CLASS_BYTES (64 * 1024)
+#define DECODER_SIZE_CLASSES 24
+
+// Buffers of at least this size are mapped on their own and advised MADV_HUGEPAGE.
+#define DECODER_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+// Counters kept by a Decoder. Only the *Allocations fields touch the system allocator.
+struct decoderStats {
+    long images = 0;
+    // buffers handed out from a free list
+    long poolHits = 0;
+    // buffers the pool had to allocate (malloc or mmap)
+    long poolAllocations = 0;
+    long hugePageBuffers = 0;
+    // allocations made by zlib through the decoder's z_stream
+    long zlibAllocations = 0;
+    // bytes held by the pool, whether handed out or free
+    size_t pooledBytes = 0;
+};
+
+/**
+ * Power of two size classes of reusable buffers. Freed buffers go on an intrusive free list
+ * (the link is stored in the buffer itself), so giving them back allocates nothing. Not thread safe.
+*/
+class BufferPool {
+public:
+    explicit BufferPool(bool useHugePages);
+    ~BufferPool();
+
+    // Returns a buffer of at least 'size' bytes and sets 'capacity' to its real size.
+    unsigned char *acquire(size_t size, size_t &capacity);
+
+    // Gives back a buffer from acquire, along with the capacity acquire reported.
+    void release(unsigned char *buffer, size_t capacity);
+
+    struct decoderStats &stats() { return counters; }
+
+private:
+    struct freeBuffer {
+        freeBuffer *next;
+    };
+
+    void freeSystemBuffer(unsigned char *buffer, size_t capacity);
+
+    freeBuffer *freeLists[DECODER_SIZE_CLASSES];
+    bool useHugePages;
+    struct decoderStats counters;
+};
+
+// An RGBA8 image owned by a Decoder's pool until it is given back with Decoder::release.
+struct decodedImage {
+    struct ihdr ihdrData;
+    unsigned char *pixels = NULL;
+    // width * height * DECODED_BYTES_PER_PIXEL
+    size_t size = 0;
+    size_t capacity = 0;
+};
+
+/**
+ * Decodes PNG files to RGBA8 on the calling thread, reusing everything between images: pooled
+ * inflate and output buffers, one z_stream kept across images with inflateReset, and the
+ * mappedPNG's span lists. Once the pool holds buffers as large as an image needs, decoding it
+ * makes no heap allocations, as long as each image is released before the next is decoded.
+ *
+ * Meant for long-running services: use one Decoder per thread.
+*/
+class Decoder {
+public:
+    explicit Decoder(bool useHugePages = true);
+    ~Decoder();
+
+    // Decodes 'filename' into 'image', whose pixels stay valid until release.
+    bool decode(const char *filename, struct decodedImage &image);
+
+    // Returns the image's pixels to the pool.
+    void release(struct decodedImage &image);
+
+    const struct decoderStats &getStats() { return pool.stats(); }
+
+private:
+    static voidpf countingAlloc(voidpf opaque, uInt items, uInt size);
+    static void countingFree(voidpf opaque, voidpf address);
+
+    BufferPool pool;
+    z_stream stream;
+    bool streamReady;
+    struct mappedPNG file;
+    struct rowExpander expander;
+};
+
+#endif
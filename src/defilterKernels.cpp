@@ -0,0 +1,490 @@
+// PNG row defilter kernels with runtime CPU dispatch
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__x86_64__)
+#define DEFILTER_X86 1
+#include <immintrin.h>
+#endif
+
+#include "defilterKernels.h"
+
+/*
+ * Scalar kernels. These handle every bytes-per-pixel value and act as the
+ * fallback for layouts the vector kernels do not cover. The first pixel of a
+ * row has no left neighbour, so it is peeled off before the main loop.
+ */
+
+static void noneRowScalar(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    if (out != in) {
+        std::memcpy(out, in, rowBytes);
+    }
+}
+
+static void subRowScalar(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    int i = 0;
+    for (; i < bytesPerPixel && i < rowBytes; i++) {
+        out[i] = in[i];
+    }
+    for (; i < rowBytes; i++) {
+        out[i] = in[i] + out[i - bytesPerPixel];
+    }
+}
+
+static void upRowScalar(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    for (int i = 0; i < rowBytes; i++) {
+        out[i] = in[i] + prev[i];
+    }
+}
+
+static void averageRowScalar(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    int i = 0;
+    for (; i < bytesPerPixel && i < rowBytes; i++) {
+        out[i] = in[i] + (prev[i] >> 1);
+    }
+    for (; i < rowBytes; i++) {
+        out[i] = in[i] + ((out[i - bytesPerPixel] + prev[i]) >> 1);
+    }
+}
+
+static inline unsigned char paethScalar(int left, int up, int leftUp) {
+    int pa = std::abs(up - leftUp);
+    int pb = std::abs(left - leftUp);
+    int pc = std::abs(left + up - 2 * leftUp);
+    if (pa <= pb && pa <= pc) {
+        return left;
+    } else if (pb <= pc) {
+        return up;
+    }
+    return leftUp;
+}
+
+static void paethRowScalar(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    int i = 0;
+    // with no left or up-left neighbour the predictor always picks 'up'
+    for (; i < bytesPerPixel && i < rowBytes; i++) {
+        out[i] = in[i] + prev[i];
+    }
+    for (; i < rowBytes; i++) {
+        out[i] = in[i] + paethScalar(out[i - bytesPerPixel], prev[i], prev[i - bytesPerPixel]);
+    }
+}
+
+/*
+ * Row decoders specialised on bytes per pixel. With Bpp known at compile time the
+ * first pixel prologue unrolls completely and the steady-state loop has no branches
+ * besides the loop condition. The first row of an image has its own variants since
+ * its 'up' neighbours are all zero: Up degenerates to None, Paeth to Sub, and
+ * Average only halves the left neighbour.
+ */
+
+template <int Bpp>
+static void subRowT(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    for (int i = 0; i < Bpp; i++) {
+        out[i] = in[i];
+    }
+    for (int i = Bpp; i < rowBytes; i++) {
+        out[i] = in[i] + out[i - Bpp];
+    }
+}
+
+template <int Bpp>
+static void averageRowT(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    for (int i = 0; i < Bpp; i++) {
+        out[i] = in[i] + (prev[i] >> 1);
+    }
+    for (int i = Bpp; i < rowBytes; i++) {
+        out[i] = in[i] + ((out[i - Bpp] + prev[i]) >> 1);
+    }
+}
+
+template <int Bpp>
+static void averageFirstRowT(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    for (int i = 0; i < Bpp; i++) {
+        out[i] = in[i];
+    }
+    for (int i = Bpp; i < rowBytes; i++) {
+        out[i] = in[i] + (out[i - Bpp] >> 1);
+    }
+}
+
+template <int Bpp>
+static void paethRowT(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    for (int i = 0; i < Bpp; i++) {
+        out[i] = in[i] + prev[i];
+    }
+    for (int i = Bpp; i < rowBytes; i++) {
+        out[i] = in[i] + paethScalar(out[i - Bpp], prev[i], prev[i - Bpp]);
+    }
+}
+
+static void averageFirstRowScalar(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    int i = 0;
+    for (; i < bytesPerPixel && i < rowBytes; i++) {
+        out[i] = in[i];
+    }
+    for (; i < rowBytes; i++) {
+        out[i] = in[i] + (out[i - bytesPerPixel] >> 1);
+    }
+}
+
+template <int Bpp>
+static RowDecoderTable makeRowDecoderTable() {
+    RowDecoderTable table = {
+        {noneRowScalar, subRowT<Bpp>, noneRowScalar, averageFirstRowT<Bpp>, subRowT<Bpp>},
+        {noneRowScalar, subRowT<Bpp>, upRowScalar, averageRowT<Bpp>, paethRowT<Bpp>}
+    };
+    return table;
+}
+
+#ifdef DEFILTER_X86
+
+/*
+ * x86 vector kernels.
+ *
+ * Up is fully data parallel and is processed 16 (SSE2) or 32 (AVX2) bytes at a time.
+ * Sub, Average and Paeth carry a dependency from each pixel to the next, so they
+ * operate on one whole pixel per step for the 3 and 4 bytes-per-pixel layouts, which
+ * is where nearly all of our images sit. Other layouts use the scalar kernels.
+ */
+
+static inline __m128i load4(const unsigned char *p) {
+    int32_t v;
+    std::memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void store4(unsigned char *p, __m128i x) {
+    int32_t v = _mm_cvtsi128_si32(x);
+    std::memcpy(p, &v, 4);
+}
+
+// 3 byte pixels are widened to 4 bytes with a zero pad so the same lane layout is used.
+static inline __m128i load3(const unsigned char *p) {
+    int32_t v = 0;
+    std::memcpy(&v, p, 3);
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void store3(unsigned char *p, __m128i x) {
+    int32_t v = _mm_cvtsi128_si32(x);
+    std::memcpy(p, &v, 3);
+}
+
+template <int Bpp>
+static inline __m128i loadPixel(const unsigned char *p) {
+    return Bpp == 4 ? load4(p) : load3(p);
+}
+
+template <int Bpp>
+static inline void storePixel(unsigned char *p, __m128i x) {
+    if (Bpp == 4) {
+        store4(p, x);
+    } else {
+        store3(p, x);
+    }
+}
+
+static void upRowSSE2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    int i = 0;
+    for (; i + 16 <= rowBytes; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (prev + i));
+        _mm_storeu_si128((__m128i *) (out + i), _mm_add_epi8(x, b));
+    }
+    for (; i < rowBytes; i++) {
+        out[i] = in[i] + prev[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void upRowAVX2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    int i = 0;
+    for (; i + 32 <= rowBytes; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (in + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (prev + i));
+        _mm256_storeu_si256((__m256i *) (out + i), _mm256_add_epi8(x, b));
+    }
+    for (; i < rowBytes; i++) {
+        out[i] = in[i] + prev[i];
+    }
+}
+
+// 4 byte pixels: running prefix sum across the four pixels of each 16 byte block,
+// then carry the last pixel of the block into the next one.
+static void subRow4SSE2(unsigned char *out, const unsigned char *in, int rowBytes) {
+    __m128i carry = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= rowBytes; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (in + i));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi8(x, carry);
+        _mm_storeu_si128((__m128i *) (out + i), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    for (; i < rowBytes; i += 4) {
+        carry = _mm_add_epi8(load4(in + i), carry);
+        store4(out + i, carry);
+    }
+}
+
+static void subRow3SSE2(unsigned char *out, const unsigned char *in, int rowBytes) {
+    __m128i a = _mm_setzero_si128();
+    for (int i = 0; i < rowBytes; i += 3) {
+        a = _mm_add_epi8(load3(in + i), a);
+        store3(out + i, a);
+    }
+}
+
+static void subRowSSE2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    switch (bytesPerPixel) {
+        case 3:
+            subRow3SSE2(out, in, rowBytes);
+            break;
+        case 4:
+            subRow4SSE2(out, in, rowBytes);
+            break;
+        default:
+            subRowScalar(out, in, prev, rowBytes, bytesPerPixel);
+            break;
+    }
+}
+
+// floor((a + b) / 2) per byte. _mm_avg_epu8 rounds up, so remove the carried low bit.
+template <int Bpp>
+static void averageRowPixelsSSE2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (int i = 0; i < rowBytes; i += Bpp) {
+        __m128i b = loadPixel<Bpp>(prev + i);
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(loadPixel<Bpp>(in + i), avg);
+        storePixel<Bpp>(out + i, a);
+    }
+}
+
+static void averageRowSSE2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    switch (bytesPerPixel) {
+        case 3:
+            averageRowPixelsSSE2<3>(out, in, prev, rowBytes);
+            break;
+        case 4:
+            averageRowPixelsSSE2<4>(out, in, prev, rowBytes);
+            break;
+        default:
+            averageRowScalar(out, in, prev, rowBytes, bytesPerPixel);
+            break;
+    }
+}
+
+static inline __m128i abs16SSE2(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i selectSSE2(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Paeth over one pixel widened to 16 bit lanes. Ties favour left, then up, then up-left.
+// pa = |b - c|, pb = |a - c|, pc = |a + b - 2c| are the distances of p = a + b - c to a, b and c.
+template <int Bpp>
+static void paethRowPixelsSSE2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+    for (int i = 0; i < rowBytes; i += Bpp) {
+        __m128i b = _mm_unpacklo_epi8(loadPixel<Bpp>(prev + i), zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        pa = abs16SSE2(pa);
+        pb = abs16SSE2(pb);
+        pc = abs16SSE2(pc);
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i nearest = selectSSE2(_mm_cmpeq_epi16(smallest, pb), b, c);
+        nearest = selectSSE2(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+
+        __m128i d = _mm_add_epi8(loadPixel<Bpp>(in + i), _mm_packus_epi16(nearest, nearest));
+        storePixel<Bpp>(out + i, d);
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    }
+}
+
+static void paethRowSSE2(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    switch (bytesPerPixel) {
+        case 3:
+            paethRowPixelsSSE2<3>(out, in, prev, rowBytes);
+            break;
+        case 4:
+            paethRowPixelsSSE2<4>(out, in, prev, rowBytes);
+            break;
+        default:
+            paethRowScalar(out, in, prev, rowBytes, bytesPerPixel);
+            break;
+    }
+}
+
+// Same as the SSE2 Paeth kernel but with the SSSE3 abs and SSE4.1 blend instructions.
+template <int Bpp>
+__attribute__((target("sse4.1")))
+static void paethRowPixelsSSE41(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+    for (int i = 0; i < rowBytes; i += Bpp) {
+        __m128i b = _mm_cvtepu8_epi16(loadPixel<Bpp>(prev + i));
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+        pa = _mm_abs_epi16(pa);
+        pb = _mm_abs_epi16(pb);
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i nearest = _mm_blendv_epi8(c, b, _mm_cmpeq_epi16(smallest, pb));
+        nearest = _mm_blendv_epi8(nearest, a, _mm_cmpeq_epi16(smallest, pa));
+
+        __m128i d = _mm_add_epi8(loadPixel<Bpp>(in + i), _mm_packus_epi16(nearest, nearest));
+        storePixel<Bpp>(out + i, d);
+        a = _mm_cvtepu8_epi16(d);
+        c = b;
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void paethRowSSE41(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel) {
+    switch (bytesPerPixel) {
+        case 3:
+            paethRowPixelsSSE41<3>(out, in, prev, rowBytes);
+            break;
+        case 4:
+            paethRowPixelsSSE41<4>(out, in, prev, rowBytes);
+            break;
+        default:
+            paethRowScalar(out, in, prev, rowBytes, bytesPerPixel);
+            break;
+    }
+}
+
+#endif // DEFILTER_X86
+
+bool getDefilterKernelsForIsa(DefilterIsa isa, DefilterKernels &kernels) {
+    switch (isa) {
+        case DEFILTER_ISA_SCALAR:
+            kernels = {"scalar", false, noneRowScalar, subRowScalar, upRowScalar, averageRowScalar, paethRowScalar};
+            return true;
+#ifdef DEFILTER_X86
+        // SSE2 is part of the x86-64 baseline, so it needs no CPUID check.
+        case DEFILTER_ISA_SSE2:
+            kernels = {"sse2", true, noneRowScalar, subRowSSE2, upRowSSE2, averageRowSSE2, paethRowSSE2};
+            return true;
+        case DEFILTER_ISA_SSE41:
+            if (!__builtin_cpu_supports("ssse3") || !__builtin_cpu_supports("sse4.1")) {
+                return false;
+            }
+            kernels = {"sse4.1", true, noneRowScalar, subRowSSE2, upRowSSE2, averageRowSSE2, paethRowSSE41};
+            return true;
+        // Sub, Average and Paeth work one pixel at a time, which a wider register does not help,
+        // so AVX2 only replaces the Up kernel.
+        case DEFILTER_ISA_AVX2:
+            if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("sse4.1")) {
+                return false;
+            }
+            kernels = {"avx2", true, noneRowScalar, subRowSSE2, upRowAVX2, averageRowSSE2, paethRowSSE41};
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static DefilterKernels selectDefilterKernels() {
+    DefilterKernels kernels;
+    for (int isa = DEFILTER_ISA_COUNT - 1; isa > DEFILTER_ISA_SCALAR; isa--) {
+        if (getDefilterKernelsForIsa((DefilterIsa) isa, kernels)) {
+            return kernels;
+        }
+    }
+    getDefilterKernelsForIsa(DEFILTER_ISA_SCALAR, kernels);
+    return kernels;
+}
+
+const DefilterKernels &getDefilterKernels() {
+    static const DefilterKernels selected = selectDefilterKernels();
+    return selected;
+}
+
+DefilterRowFn getDefilterRowFn(const DefilterKernels &kernels, int filter) {
+    switch (filter) {
+        case 0:
+            return kernels.none;
+        case 1:
+            return kernels.sub;
+        case 2:
+            return kernels.up;
+        case 3:
+            return kernels.average;
+        case 4:
+            return kernels.paeth;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Row decoder tables, one per supported bytes-per-pixel value. The compile-time
+ * specialised kernels are the base; the dispatched vector kernels replace them
+ * where they are faster (Up for every layout, the pixel kernels for 3 and 4 bytes).
+ */
+static const int rowDecoderBpps[] = {1, 2, 3, 4, 6, 8};
+static const int rowDecoderBppCount = sizeof(rowDecoderBpps) / sizeof(rowDecoderBpps[0]);
+
+static RowDecoderTable buildRowDecoderTable(int bytesPerPixel, const DefilterKernels &kernels) {
+    RowDecoderTable table;
+
+    switch (bytesPerPixel) {
+        case 1: table = makeRowDecoderTable<1>(); break;
+        case 2: table = makeRowDecoderTable<2>(); break;
+        case 3: table = makeRowDecoderTable<3>(); break;
+        case 4: table = makeRowDecoderTable<4>(); break;
+        case 6: table = makeRowDecoderTable<6>(); break;
+        case 8: table = makeRowDecoderTable<8>(); break;
+        default:
+            table = {
+                {noneRowScalar, subRowScalar, noneRowScalar, averageFirstRowScalar, subRowScalar},
+                {noneRowScalar, subRowScalar, upRowScalar, averageRowScalar, paethRowScalar}
+            };
+            break;
+    }
+
+    table.otherRows[2] = kernels.up;
+    if (kernels.vectorPixels && (bytesPerPixel == 3 || bytesPerPixel == 4)) {
+        table.firstRow[1] = kernels.sub;
+        table.firstRow[4] = kernels.sub;
+        table.otherRows[1] = kernels.sub;
+        table.otherRows[3] = kernels.average;
+        table.otherRows[4] = kernels.paeth;
+    }
+    return table;
+}
+
+static std::vector<RowDecoderTable> buildRowDecoderTables() {
+    std::vector<RowDecoderTable> tables;
+    for (int i = 0; i < rowDecoderBppCount; i++) {
+        tables.push_back(buildRowDecoderTable(rowDecoderBpps[i], getDefilterKernels()));
+    }
+    return tables;
+}
+
+const RowDecoderTable &getRowDecoderTable(int bytesPerPixel) {
+    static const std::vector<RowDecoderTable> tables = buildRowDecoderTables();
+    static const RowDecoderTable generic = buildRowDecoderTable(0, getDefilterKernels());
+
+    for (int i = 0; i < rowDecoderBppCount; i++) {
+        if (rowDecoderBpps[i] == bytesPerPixel) {
+            return tables[i];
+        }
+    }
+    return generic;
+}
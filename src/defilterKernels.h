@@ -0,0 +1,69 @@
+#ifndef _DEFILTER_KERNELS_H_
+#define _DEFILTER_KERNELS_H_
+
+/**
+ * Reverses one PNG filter on a single scanline.
+ *
+ * @param out Destination for the defiltered bytes. May alias 'in'.
+ * @param in The filtered scanline, without its leading filter byte.
+ * @param prev The previous defiltered scanline. For the first scanline this must be a row of zeroes.
+ * @param rowBytes Number of bytes in the scanline (width * bytesPerPixel).
+ * @param bytesPerPixel Distance in bytes to the corresponding byte of the pixel to the left.
+*/
+typedef void (*DefilterRowFn)(unsigned char *out, const unsigned char *in, const unsigned char *prev, int rowBytes, int bytesPerPixel);
+
+enum DefilterIsa {
+    DEFILTER_ISA_SCALAR = 0,
+    DEFILTER_ISA_SSE2,
+    DEFILTER_ISA_SSE41,
+    DEFILTER_ISA_AVX2,
+    DEFILTER_ISA_COUNT
+};
+
+struct DefilterKernels {
+    const char *name;
+    // true if sub, average and paeth are vectorized for 3 and 4 byte pixels
+    bool vectorPixels;
+    DefilterRowFn none;
+    DefilterRowFn sub;
+    DefilterRowFn up;
+    DefilterRowFn average;
+    DefilterRowFn paeth;
+};
+
+/**
+ * Returns the kernel set for the given instruction set.
+ *
+ * @return false if the ISA was not compiled in or is not supported by this CPU.
+*/
+bool getDefilterKernelsForIsa(DefilterIsa isa, DefilterKernels &kernels);
+
+/**
+ * Returns the fastest kernel set supported by this CPU. The choice is made once,
+ * on first use, from CPUID.
+*/
+const DefilterKernels &getDefilterKernels();
+
+/**
+ * Returns the kernel for filter type 0-4, or NULL for an invalid filter type.
+*/
+DefilterRowFn getDefilterRowFn(const DefilterKernels &kernels, int filter);
+
+/**
+ * Row decoders for one bytes-per-pixel value, indexed by filter type.
+ * 'firstRow' holds the variants for the top scanline, which has no row above it;
+ * those may be called with a NULL 'prev'.
+*/
+struct RowDecoderTable {
+    DefilterRowFn firstRow[5];
+    DefilterRowFn otherRows[5];
+};
+
+/**
+ * Returns the row decoders for the given bytes per pixel. Layouts of 1, 2, 3, 4, 6 and 8 bytes
+ * (every 8 and 16 bit format) get kernels specialised at compile time; anything else gets the
+ * generic scalar kernels.
+*/
+const RowDecoderTable &getRowDecoderTable(int bytesPerPixel);
+
+#endif
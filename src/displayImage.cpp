@@ -5,6 +5,9 @@
 #include <vector>
 
 #include "displayImage.h"
+#include "progressiveUpload.h"
+#include "processImage.h"
+#include "trace.h"
 
 void calcOutputWindowSize(const int imageWidth, const int imageHeight, int &windowWidth, int &windowHeight) {
     int heightScale = imageHeight / MAX_WINDOW_HEIGHT;
@@ -15,7 +18,8 @@ void calcOutputWindowSize(const int imageWidth, const int imageHeight, int &wind
         windowWidth = imageWidth;
         return;
     }
-    int scale = std::max(heightScale, widthScale);
+    // images smaller than the window in both directions are shown at their own size
+    int scale = std::max(std::max(heightScale, widthScale), 1);
 
     windowHeight = imageHeight / scale;
     windowWidth = imageWidth / scale;
@@ -23,20 +27,28 @@ void calcOutputWindowSize(const int imageWidth, const int imageHeight, int &wind
 
 void displayDecompressedImage(const std::vector<unsigned char>& imageData, int width, int height) {
     int windowWidth, windowHeight;
+    calcOutputWindowSize(width, height, windowWidth, windowHeight);
+    displayDecompressedImage(imageData, width, height, windowWidth, windowHeight);
+}
+
+/**
+ * Opens a windowWidth x windowHeight window and makes its GL context current.
+ *
+ * @return NULL if GLFW, the window or GLEW could not be set up.
+*/
+static GLFWwindow *createImageWindow(int windowWidth, int windowHeight) {
     // Initialize GLFW
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
-        return;
+        return NULL;
     }
 
-    calcOutputWindowSize(width, height, windowWidth, windowHeight);
-
     // Create a windowed mode window and its OpenGL context
     GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, "Decompressed Image", NULL, NULL);
     if (!window) {
         glfwTerminate();
         std::cerr << "Failed to create GLFW window" << std::endl;
-        return;
+        return NULL;
     }
 
     // Make the window's context current
@@ -44,41 +56,22 @@ void displayDecompressedImage(const std::vector<unsigned char>& imageData, int w
 
     // Initialize GLEW
     if (glewInit() != GLEW_OK) {
+        glfwTerminate();
         std::cerr << "Failed to initialize GLEW" << std::endl;
-        return;
+        return NULL;
     }
+    return window;
+}
 
-    // Enable texture
-    glEnable(GL_TEXTURE_2D);
-
-    // Generate texture ID
-    GLuint textureID;
-    glGenTextures(1, &textureID);
-
-    // Bind texture
-    glBindTexture(GL_TEXTURE_2D, textureID);
-
-    // Set texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    // Upload image data to texture
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, imageData.data());
-
+// Redraws the texture until the window is closed.
+static void runDisplayLoop(GLFWwindow *window, TiledTexture &texture) {
     // Main loop
     while (!glfwWindowShouldClose(window)) {
         // Clear the framebuffer
         glClear(GL_COLOR_BUFFER_BIT);
 
-        // Draw textured quad
-        glBegin(GL_QUADS);
-        glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, -1.0f);
-        glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, -1.0f);
-        glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, 1.0f);
-        glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, 1.0f);
-        glEnd();
+        // Draw the textured tiles
+        texture.draw();
 
         // Swap front and back buffers
         glfwSwapBuffers(window);
@@ -86,10 +79,72 @@ void displayDecompressedImage(const std::vector<unsigned char>& imageData, int w
         // Poll for and process events
         glfwPollEvents();
     }
+}
 
-    // Delete texture
-    glDeleteTextures(1, &textureID);
+void displayDecompressedImage(const std::vector<unsigned char>& imageData, int width, int height, int windowWidth, int windowHeight) {
+    displayDecompressedImage(imageData.data(), (size_t) width * DECODED_BYTES_PER_PIXEL, width, height, windowWidth, windowHeight);
+}
+
+void displayDecompressedImage(const unsigned char *pixels, size_t stride, int width, int height, int windowWidth, int windowHeight) {
+    GLFWwindow *window = createImageWindow(windowWidth, windowHeight);
+    if (window == NULL) {
+        return;
+    }
+
+    // the textures have to go before the context does
+    {
+        // split into tiles if the image is larger than the GL's texture size limit
+        TiledTexture texture(width, height);
+        if (texture.valid()) {
+            bool uploaded;
+            // Upload image data to texture
+            {
+                TRACE_SCOPE("textureUpload");
+                uploaded = texture.uploadRows(pixels, stride, 0, height);
+            }
+            if (uploaded) {
+                runDisplayLoop(window, texture);
+            }
+        }
+    }
 
     // Terminate GLFW
     glfwTerminate();
-}
\ No newline at end of file
+}
+
+bool displayProgressively(const char *filename, int maxTileSize) {
+    struct mappedPNG image;
+    struct progressiveStats stats;
+    std::vector<unsigned char> pixels;
+    int windowWidth, windowHeight;
+
+    if (!mapPNGImage(filename, image)) {
+        return false;
+    }
+    calcOutputWindowSize(image.ihdrData.width, image.ihdrData.height, windowWidth, windowHeight);
+    GLFWwindow *window = createImageWindow(windowWidth, windowHeight);
+    if (window == NULL) {
+        unmapPNGImage(image);
+        return false;
+    }
+
+    bool ok;
+    {
+        TiledTexture texture(image.ihdrData.width, image.ihdrData.height, maxTileSize);
+        ok = texture.valid() && decodeProgressively(image, texture, [window] {
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+            return !glfwWindowShouldClose(window);
+        }, pixels, stats);
+        unmapPNGImage(image);
+
+        if (ok) {
+            std::cout << "\tFirst pixel after " << stats.firstPixel << "s, decoded after " << stats.decoded << "s, shown in full after "
+                      << stats.complete << "s (" << stats.bands << " bands, " << texture.getTileCount() << " tiles)" << std::endl;
+            runDisplayLoop(window, texture);
+        }
+    }
+
+    glfwTerminate();
+    return ok;
+}
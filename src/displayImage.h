@@ -1,7 +1,24 @@
 #include <vector>
+#include <cstddef>
 
 #define MAX_WINDOW_HEIGHT 500
 #define MAX_WINDOW_WIDTH 900
 
 void calcOutputWindowSize(const int imageWidth, const int imageHeight, int &windowWidth, int &windowHeight);
-void displayDecompressedImage(const std::vector<unsigned char>& imageData, int width, int height);
\ No newline at end of file
+void displayDecompressedImage(const std::vector<unsigned char>& imageData, int width, int height);
+
+// Shows a width x height image stretched to a windowWidth x windowHeight window, such as an image
+// decoded with defilterScaled in the window its full size calls for.
+void displayDecompressedImage(const std::vector<unsigned char>& imageData, int width, int height, int windowWidth, int windowHeight);
+
+// As above, with RGBA8 rows 'stride' bytes apart read straight from 'pixels', such as a mapped sidecar (rawSidecar.h).
+void displayDecompressedImage(const unsigned char *pixels, size_t stride, int width, int height, int windowWidth, int windowHeight);
+
+/**
+ * Opens a window for the PNG 'filename' and shows each band of rows as soon as it is decoded,
+ * rather than after the whole image is (see decodeProgressively), then keeps showing the image
+ * until the window is closed. Prints the time to the first pixel.
+ *
+ * @param maxTileSize Largest texture side; 0 for GL_MAX_TEXTURE_SIZE.
+*/
+bool displayProgressively(const char *filename, int maxTileSize = 0);
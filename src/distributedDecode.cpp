@@ -0,0 +1,228 @@
+#include <mpi.h>
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "distributedDecode.h"
+#include "batchDecode.h"
+#include "printUtils.h"
+
+static void addBatchStats(struct batchStats &total, const struct batchStats &part) {
+    total.images += part.images;
+    total.failed += part.failed;
+    total.fileBytes += part.fileBytes;
+    total.decodedBytes += part.decodedBytes;
+    total.readSeconds += part.readSeconds;
+    total.inflateSeconds += part.inflateSeconds;
+    total.defilterSeconds += part.defilterSeconds;
+}
+
+// Rank 0 reads the file list and sends it to every rank as one newline separated string.
+static bool broadcastFileList(const char *path, int rank, std::vector<std::string> &files) {
+    std::string joined;
+    long length = -1;
+
+    if (rank == 0 && collectBatchFiles(path, files) && !files.empty()) {
+        for (const std::string &file : files) {
+            joined += file + "\n";
+        }
+        length = joined.size();
+    }
+
+    MPI_Bcast(&length, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+    if (length <= 0) {
+        return false;
+    }
+
+    joined.resize(length);
+    MPI_Bcast(&joined[0], length, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    if (rank != 0) {
+        size_t begin = 0, end;
+        while ((end = joined.find('\n', begin)) != std::string::npos) {
+            files.push_back(joined.substr(begin, end - begin));
+            begin = end + 1;
+        }
+    }
+    return true;
+}
+
+/**
+ * Takes the next run of files off the size-ordered list: at least one file, and enough to cover
+ * MPI_ASSIGN_FRACTION of the remaining bytes divided by the number of ranks.
+*/
+static std::vector<int> nextAssignment(const std::vector<int> &order, const std::vector<size_t> &sizes, size_t &next, size_t &remainingBytes, int ranks) {
+    std::vector<int> assignment;
+    size_t target = std::max((size_t) (remainingBytes * MPI_ASSIGN_FRACTION / ranks), (size_t) 1);
+    size_t assignedBytes = 0;
+
+    while (next < order.size() && (assignment.empty() || assignedBytes < target)) {
+        assignment.push_back(order[next]);
+        assignedBytes += sizes[order[next]];
+        next++;
+    }
+    remainingBytes -= std::min(assignedBytes, remainingBytes);
+
+    return assignment;
+}
+
+static std::vector<std::string> selectFiles(const std::vector<std::string> &files, const std::vector<int> &indices) {
+    std::vector<std::string> selected;
+    for (int index : indices) {
+        selected.push_back(files[index]);
+    }
+    return selected;
+}
+
+// Rank 0: answer work requests on the main thread while decoding assignments of its own on a helper thread.
+static void dispatchWork(const std::vector<std::string> &files, int ranks, int threads, struct batchStats &localStats) {
+    std::vector<size_t> sizes(files.size());
+    std::vector<int> order(files.size());
+    size_t remainingBytes = 0, next = 0;
+
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat fileStat;
+        sizes[i] = stat(files[i].c_str(), &fileStat) == 0 ? fileStat.st_size : 0;
+        remainingBytes += sizes[i];
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&sizes](int a, int b) {
+        return sizes[a] > sizes[b];
+    });
+
+    int activeWorkers = ranks - 1;
+    std::thread localWorker;
+    std::atomic<bool> localDone(false);
+    bool localBusy = false;
+    struct batchStats assignmentStats;
+
+    while (activeWorkers > 0 || localBusy || next < order.size()) {
+        bool didWork = false;
+
+        if (localBusy && localDone) {
+            localWorker.join();
+            addBatchStats(localStats, assignmentStats);
+            localBusy = false;
+            didWork = true;
+        }
+
+        if (!localBusy && next < order.size()) {
+            std::vector<std::string> selected = selectFiles(files, nextAssignment(order, sizes, next, remainingBytes, ranks));
+            localDone = false;
+            localBusy = true;
+            localWorker = std::thread([selected, threads, &assignmentStats, &localDone]() {
+                batchDecode(selected, threads, assignmentStats);
+                localDone = true;
+            });
+            didWork = true;
+        }
+
+        int pending = 0;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG_WORK_REQUEST, MPI_COMM_WORLD, &pending, &status);
+        if (pending) {
+            MPI_Recv(NULL, 0, MPI_INT, status.MPI_SOURCE, MPI_TAG_WORK_REQUEST, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            // an empty assignment tells the worker there is nothing left
+            std::vector<int> assignment = nextAssignment(order, sizes, next, remainingBytes, ranks);
+            MPI_Send(assignment.data(), assignment.size(), MPI_INT, status.MPI_SOURCE, MPI_TAG_WORK_ASSIGN, MPI_COMM_WORLD);
+            if (assignment.empty()) {
+                activeWorkers--;
+            }
+            didWork = true;
+        }
+
+        if (!didWork) {
+            usleep(200);
+        }
+    }
+}
+
+// Ranks other than 0: keep asking for work until an empty assignment arrives.
+static void requestWork(const std::vector<std::string> &files, int threads, struct batchStats &localStats) {
+    while (true) {
+        MPI_Status status;
+        int count;
+
+        MPI_Send(NULL, 0, MPI_INT, 0, MPI_TAG_WORK_REQUEST, MPI_COMM_WORLD);
+        MPI_Probe(0, MPI_TAG_WORK_ASSIGN, MPI_COMM_WORLD, &status);
+        MPI_Get_count(&status, MPI_INT, &count);
+
+        std::vector<int> assignment(count);
+        MPI_Recv(assignment.data(), count, MPI_INT, 0, MPI_TAG_WORK_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (count == 0) {
+            return;
+        }
+
+        struct batchStats assignmentStats;
+        batchDecode(selectFiles(files, assignment), threads, assignmentStats);
+        addBatchStats(localStats, assignmentStats);
+    }
+}
+
+int distributedDecode(const char *path, int threads) {
+    int rank, ranks;
+    std::vector<std::string> files;
+    struct batchStats localStats, clusterStats;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+    if (!broadcastFileList(path, rank, files)) {
+        if (rank == 0) {
+            std::cerr << "No images found in " << path << std::endl;
+        }
+        return 1;
+    }
+
+    if (rank == 0) {
+        std::cout << "Decoding " << files.size() << " images on " << ranks << " ranks x " << threads << " threads" << std::endl;
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+
+    if (rank == 0) {
+        dispatchWork(files, ranks, threads, localStats);
+    } else {
+        requestWork(files, threads, localStats);
+    }
+
+    double wallTime = MPI_Wtime() - start;
+
+    // Sum the counters and stage times over all ranks; the job takes as long as the slowest rank.
+    double local[7] = {(double) localStats.images, (double) localStats.failed, (double) localStats.fileBytes, (double) localStats.decodedBytes,
+                       localStats.readSeconds, localStats.inflateSeconds, localStats.defilterSeconds};
+    double cluster[7];
+    MPI_Allreduce(local, cluster, 7, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Reduce(&wallTime, &clusterStats.seconds, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    // per rank image count and wall time, to show how even the split was
+    double rankSummary[2] = {(double) localStats.images, wallTime};
+    std::vector<double> rankSummaries(rank == 0 ? 2 * ranks : 0);
+    MPI_Gather(rankSummary, 2, MPI_DOUBLE, rankSummaries.data(), 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    clusterStats.images = (int) cluster[0];
+    clusterStats.failed = (int) cluster[1];
+    clusterStats.fileBytes = (size_t) cluster[2];
+    clusterStats.decodedBytes = (size_t) cluster[3];
+    clusterStats.readSeconds = cluster[4];
+    clusterStats.inflateSeconds = cluster[5];
+    clusterStats.defilterSeconds = cluster[6];
+
+    if (rank == 0) {
+        printBatchSummary(clusterStats);
+        std::cout << PRINT_DIVIDER << std::endl;
+        for (int i = 0; i < ranks; i++) {
+            std::cout << "\tRank " << i << ": " << (int) rankSummaries[2 * i] << " images in " << rankSummaries[2 * i + 1] << " s" << std::endl;
+        }
+    }
+
+    return clusterStats.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#ifndef _DISTRIBUTED_DECODE_H_
+#define _DISTRIBUTED_DECODE_H_
+
+// Message tags between the rank 0 dispatcher and the worker ranks.
+#define MPI_TAG_WORK_REQUEST 1
+#define MPI_TAG_WORK_ASSIGN 2
+
+// Each assignment aims for this share of the bytes still unassigned, divided by the rank count,
+// so early assignments are large and they shrink towards the end of the job (guided scheduling).
+#define MPI_ASSIGN_FRACTION 0.5
+
+/**
+ * Decodes a batch across all MPI ranks. Must be called by every rank of MPI_COMM_WORLD after
+ * MPI_Init_thread with at least MPI_THREAD_FUNNELED.
+ *
+ * Rank 0 reads the directory or manifest, broadcasts the file list and then hands out runs of
+ * files, largest first and weighted by file size, to whichever rank asks next. Rank 0 decodes
+ * too, on a helper thread, while its main thread answers requests. Every rank decodes its
+ * assignments with batchDecode on 'threads' local threads. At the end the per-stage times and
+ * byte counts are combined with MPI_Allreduce and rank 0 prints the cluster-wide report.
+ *
+ * @return 0 on success on every rank.
+*/
+int distributedDecode(const char *path, int threads);
+
+#endif
@@ -0,0 +1,375 @@
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__)
+#define EXPAND_X86 1
+#include <immintrin.h>
+#endif
+
+#include "expandKernels.h"
+
+static uint32_t makePixel(unsigned char r, unsigned char g, unsigned char b, unsigned char a) {
+    unsigned char bytes[4] = {r, g, b, a};
+    uint32_t pixel;
+    std::memcpy(&pixel, bytes, 4);
+    return pixel;
+}
+
+// 1, 2 and 4 bit greyscale or palette: one table lookup per input byte writes all of its pixels.
+template <int PIXELS_PER_BYTE>
+static void expandPackedRow(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &expander) {
+    int fullBytes = width / PIXELS_PER_BYTE;
+
+    for (int i = 0; i < fullBytes; i++) {
+        std::memcpy(out + (size_t) i * PIXELS_PER_BYTE * 4, &expander.table[in[i] * PIXELS_PER_BYTE], PIXELS_PER_BYTE * 4);
+    }
+
+    int remaining = width - fullBytes * PIXELS_PER_BYTE;
+    if (remaining > 0) {
+        std::memcpy(out + (size_t) fullBytes * PIXELS_PER_BYTE * 4, &expander.table[in[fullBytes] * PIXELS_PER_BYTE], remaining * 4);
+    }
+}
+
+// 8 bit greyscale or palette: one table entry per pixel.
+static void expandLookupRow(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &expander) {
+    for (int x = 0; x < width; x++) {
+        std::memcpy(out + (size_t) x * 4, &expander.table[in[x]], 4);
+    }
+}
+
+static void expandGreyAlpha8Row(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &) {
+    for (int x = 0; x < width; x++) {
+        unsigned char grey = in[x * 2];
+        out[x * 4] = grey;
+        out[x * 4 + 1] = grey;
+        out[x * 4 + 2] = grey;
+        out[x * 4 + 3] = in[x * 2 + 1];
+    }
+}
+
+static void expandRGB8Row(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &expander) {
+    if (expander.key[0] == -1) {
+        for (int x = 0; x < width; x++) {
+            out[x * 4] = in[x * 3];
+            out[x * 4 + 1] = in[x * 3 + 1];
+            out[x * 4 + 2] = in[x * 3 + 2];
+            out[x * 4 + 3] = 255;
+        }
+        return;
+    }
+
+    for (int x = 0; x < width; x++) {
+        const unsigned char *pixel = in + x * 3;
+        bool transparent = pixel[0] == expander.key[0] && pixel[1] == expander.key[1] && pixel[2] == expander.key[2];
+        out[x * 4] = pixel[0];
+        out[x * 4 + 1] = pixel[1];
+        out[x * 4 + 2] = pixel[2];
+        out[x * 4 + 3] = transparent ? 0 : 255;
+    }
+}
+
+// 16 bit RGBA: keep the high byte of every sample.
+static void expandRGBA16Row(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &) {
+    for (int i = 0; i < width * 4; i++) {
+        out[i] = in[i * 2];
+    }
+}
+
+// 16 bit greyscale, greyscale with alpha and truecolor, narrowed to their high bytes. The
+// colour key is compared against the full 16 bit samples.
+static void expand16Row(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &expander) {
+    int channels = expander.colorType == 2 ? 3 : (expander.colorType == 4 ? 2 : 1);
+    bool keyed = expander.key[0] != -1;
+
+    for (int x = 0; x < width; x++) {
+        const unsigned char *pixel = in + (size_t) x * channels * 2;
+        unsigned char *rgba = out + (size_t) x * 4;
+
+        if (channels == 3) {
+            rgba[0] = pixel[0];
+            rgba[1] = pixel[2];
+            rgba[2] = pixel[4];
+        } else {
+            rgba[0] = rgba[1] = rgba[2] = pixel[0];
+        }
+
+        if (channels == 2) {
+            rgba[3] = pixel[2];
+        } else {
+            bool transparent = keyed;
+            for (int c = 0; c < channels && transparent; c++) {
+                transparent = ((pixel[c * 2] << 8) | pixel[c * 2 + 1]) == expander.key[c];
+            }
+            rgba[3] = transparent ? 0 : 255;
+        }
+    }
+}
+
+// (value * alpha + 127) / 255 without the division
+static inline unsigned char premultiply(unsigned char value, unsigned char alpha) {
+    unsigned int product = value * alpha + 128;
+    return (product + (product >> 8)) >> 8;
+}
+
+#ifdef EXPAND_X86
+
+// Premultiplies two pixels widened to 16 bit lanes; the alpha lanes come out as garbage.
+static inline __m128i premultiplySSE2(__m128i pixels) {
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i product = _mm_add_epi16(_mm_mullo_epi16(pixels, alpha), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+}
+
+/**
+ * Converts RGBA8 to BGRA8 and/or premultiplied alpha four pixels at a time (SSE2, which every
+ * x86-64 CPU has). Returns the number of pixels done; the caller finishes the rest.
+*/
+template <bool SWAP, bool PREMULTIPLY>
+static int convertPixelsSSE2(unsigned char *out, const unsigned char *rgba, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaMask = _mm_set1_epi32((int) 0xFF000000);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *) (rgba + x * 4));
+        __m128i low = _mm_unpacklo_epi8(pixels, zero);
+        __m128i high = _mm_unpackhi_epi8(pixels, zero);
+
+        if (PREMULTIPLY) {
+            low = premultiplySSE2(low);
+            high = premultiplySSE2(high);
+        }
+        if (SWAP) {
+            low = _mm_shufflehi_epi16(_mm_shufflelo_epi16(low, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+            high = _mm_shufflehi_epi16(_mm_shufflelo_epi16(high, _MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+        }
+
+        __m128i result = _mm_packus_epi16(low, high);
+        if (PREMULTIPLY) {
+            result = _mm_or_si128(_mm_andnot_si128(alphaMask, result), _mm_and_si128(alphaMask, pixels));
+        }
+        _mm_storeu_si128((__m128i *) (out + x * 4), result);
+    }
+    return x;
+}
+
+#else
+
+template <bool SWAP, bool PREMULTIPLY>
+static int convertPixelsSSE2(unsigned char *, const unsigned char *, int) {
+    return 0;
+}
+
+#endif
+
+// The converters may run in place (out == rgba), so each pixel is read before it is written.
+static void convertBGRA8Row(unsigned char *out, const unsigned char *rgba, int width) {
+    for (int x = convertPixelsSSE2<true, false>(out, rgba, width); x < width; x++) {
+        unsigned char red = rgba[x * 4], green = rgba[x * 4 + 1], blue = rgba[x * 4 + 2], alpha = rgba[x * 4 + 3];
+        out[x * 4] = blue;
+        out[x * 4 + 1] = green;
+        out[x * 4 + 2] = red;
+        out[x * 4 + 3] = alpha;
+    }
+}
+
+static void convertRGBA8PremultipliedRow(unsigned char *out, const unsigned char *rgba, int width) {
+    for (int x = convertPixelsSSE2<false, true>(out, rgba, width); x < width; x++) {
+        unsigned char alpha = rgba[x * 4 + 3];
+        out[x * 4] = premultiply(rgba[x * 4], alpha);
+        out[x * 4 + 1] = premultiply(rgba[x * 4 + 1], alpha);
+        out[x * 4 + 2] = premultiply(rgba[x * 4 + 2], alpha);
+        out[x * 4 + 3] = alpha;
+    }
+}
+
+static void convertBGRA8PremultipliedRow(unsigned char *out, const unsigned char *rgba, int width) {
+    for (int x = convertPixelsSSE2<true, true>(out, rgba, width); x < width; x++) {
+        unsigned char red = rgba[x * 4], green = rgba[x * 4 + 1], blue = rgba[x * 4 + 2], alpha = rgba[x * 4 + 3];
+        out[x * 4] = premultiply(blue, alpha);
+        out[x * 4 + 1] = premultiply(green, alpha);
+        out[x * 4 + 2] = premultiply(red, alpha);
+        out[x * 4 + 3] = alpha;
+    }
+}
+
+static void convertRGB8Row(unsigned char *out, const unsigned char *rgba, int width) {
+    for (int x = 0; x < width; x++) {
+        out[x * 3] = rgba[x * 4];
+        out[x * 3 + 1] = rgba[x * 4 + 1];
+        out[x * 3 + 2] = rgba[x * 4 + 2];
+    }
+}
+
+ConvertRowFn getConvertRow(enum pixelFormat format) {
+    switch (format) {
+        case PIXEL_BGRA8: return convertBGRA8Row;
+        case PIXEL_RGBA8_PREMULTIPLIED: return convertRGBA8PremultipliedRow;
+        case PIXEL_BGRA8_PREMULTIPLIED: return convertBGRA8PremultipliedRow;
+        case PIXEL_RGB8: return convertRGB8Row;
+        default: return NULL;
+    }
+}
+
+int getPixelFormatBytes(enum pixelFormat format) {
+    return format == PIXEL_RGB8 ? 3 : 4;
+}
+
+int getBitsPerPixel(int colorType, int channelDepth) {
+    int channels;
+
+    switch (colorType) {
+        case 0: channels = 1; break;
+        case 2: channels = 3; break;
+        case 3: channels = 1; break;
+        case 4: channels = 2; break;
+        case 6: channels = 4; break;
+        default: return -1;
+    }
+    if (channelDepth != 1 && channelDepth != 2 && channelDepth != 4 && channelDepth != 8 && channelDepth != 16) {
+        return -1;
+    }
+    // sub-byte depths are only allowed for single channel formats, 16 bits not for palettes
+    if ((channelDepth < 8 && channels != 1) || (channelDepth == 16 && colorType == 3)) {
+        return -1;
+    }
+    return channels * channelDepth;
+}
+
+size_t getRowBytes(int width, int bitsPerPixel) {
+    return ((size_t) width * bitsPerPixel + 7) / 8;
+}
+
+// Fills the table for greyscale or palette images of up to 8 bits.
+static void buildLookupTable(const struct ihdr &ihdrData, struct rowExpander &expander) {
+    int depth = expander.channelDepth;
+    int mask = (1 << depth) - 1;
+    // scales a sample to 0-255: 255, 85, 17 or 1
+    int scale = 255 / mask;
+
+    for (int byte = 0; byte < 256; byte++) {
+        for (int i = 0; i < expander.pixelsPerByte; i++) {
+            // the leftmost pixel is in the high bits
+            int value = (byte >> (8 - depth * (i + 1))) & mask;
+            uint32_t pixel;
+
+            if (expander.colorType == 3) {
+                pixel = value < ihdrData.paletteSize
+                    ? makePixel(ihdrData.palette[value][0], ihdrData.palette[value][1], ihdrData.palette[value][2], ihdrData.palette[value][3])
+                    : makePixel(0, 0, 0, 255);
+            } else {
+                unsigned char grey = value * scale;
+                pixel = makePixel(grey, grey, grey, value == expander.key[0] ? 0 : 255);
+            }
+            expander.table[byte * expander.pixelsPerByte + i] = pixel;
+        }
+    }
+}
+
+bool buildRowExpander(const struct ihdr &ihdrData, struct rowExpander &expander, enum pixelFormat format) {
+    if (getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth) == -1) {
+        return false;
+    }
+
+    expander.format = format;
+    expander.outBytesPerPixel = getPixelFormatBytes(format);
+    expander.convert = getConvertRow(format);
+    expander.colorType = ihdrData.colorType;
+    expander.channelDepth = ihdrData.channelDepth;
+    expander.pixelsPerByte = ihdrData.channelDepth < 8 ? 8 / ihdrData.channelDepth : 1;
+    for (int i = 0; i < 3; i++) {
+        expander.key[i] = ihdrData.transparentKey[i];
+    }
+
+    int depth = ihdrData.channelDepth;
+    switch (ihdrData.colorType) {
+        case 0:
+        case 3:
+            if (depth == 16) {
+                expander.expand = expand16Row;
+                return true;
+            }
+            buildLookupTable(ihdrData, expander);
+            // 4 byte formats are converted once per table entry instead of once per pixel
+            if (expander.convert != NULL && expander.outBytesPerPixel == 4) {
+                int entries = 256 * expander.pixelsPerByte;
+                expander.convert((unsigned char *) expander.table, (const unsigned char *) expander.table, entries);
+                expander.convert = NULL;
+            }
+            switch (depth) {
+                case 1: expander.expand = expandPackedRow<8>; break;
+                case 2: expander.expand = expandPackedRow<4>; break;
+                case 4: expander.expand = expandPackedRow<2>; break;
+                default: expander.expand = expandLookupRow; break;
+            }
+            return true;
+        case 2:
+            expander.expand = depth == 8 ? expandRGB8Row : expand16Row;
+            return true;
+        case 4:
+            expander.expand = depth == 8 ? expandGreyAlpha8Row : expand16Row;
+            return true;
+        default:
+            expander.expand = depth == 8 ? NULL : expandRGBA16Row;
+            return true;
+    }
+}
+
+const struct rowExpander *getActiveExpander(const struct rowExpander &expander) {
+    return expander.expand != NULL || expander.convert != NULL ? &expander : NULL;
+}
+
+void expandRow(const struct rowExpander &expander, unsigned char *out, const unsigned char *in, int width, unsigned char *scratch) {
+    if (expander.convert == NULL) {
+        expander.expand(out, in, width, expander);
+    } else if (expander.expand == NULL) {
+        expander.convert(out, in, width);
+    } else {
+        expander.expand(scratch, in, width, expander);
+        expander.convert(out, scratch, width);
+    }
+}
+
+// Adds each run of SCALE pixels of an RGBA8 row to the sums of its output pixel.
+template <int SCALE>
+static void accumulateBoxRow(uint32_t *sums, const unsigned char *rgba, int width) {
+    int fullBlocks = width / SCALE;
+
+    for (int block = 0; block < fullBlocks; block++) {
+        const unsigned char *pixel = rgba + (size_t) block * SCALE * 4;
+        uint32_t *sum = sums + (size_t) block * 4;
+        for (int i = 0; i < SCALE; i++) {
+            sum[0] += pixel[i * 4];
+            sum[1] += pixel[i * 4 + 1];
+            sum[2] += pixel[i * 4 + 2];
+            sum[3] += pixel[i * 4 + 3];
+        }
+    }
+    // the last output pixel covers whatever is left of the row
+    for (int x = fullBlocks * SCALE; x < width; x++) {
+        for (int c = 0; c < 4; c++) {
+            sums[(size_t) fullBlocks * 4 + c] += rgba[(size_t) x * 4 + c];
+        }
+    }
+}
+
+void accumulateBoxRow(uint32_t *sums, const unsigned char *rgba, int width, int scale) {
+    switch (scale) {
+        case 2: accumulateBoxRow<2>(sums, rgba, width); break;
+        case 4: accumulateBoxRow<4>(sums, rgba, width); break;
+        case 8: accumulateBoxRow<8>(sums, rgba, width); break;
+        default: accumulateBoxRow<1>(sums, rgba, width); break;
+    }
+}
+
+void averageBoxRow(unsigned char *rgba, uint32_t *sums, int width, int scale, int rows) {
+    int outWidth = (width + scale - 1) / scale;
+
+    for (int x = 0; x < outWidth; x++) {
+        uint32_t count = (uint32_t) std::min(scale, width - x * scale) * rows;
+        for (int c = 0; c < 4; c++) {
+            rgba[x * 4 + c] = (sums[x * 4 + c] + count / 2) / count;
+            sums[x * 4 + c] = 0;
+        }
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef _EXPAND_KERNELS_H_
+#define _EXPAND_KERNELS_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "readImage.h"
+
+// Decoded images come out as 8 bit RGBA unless an outputDescriptor asks for another format.
+#define DECODED_BYTES_PER_PIXEL 4
+
+// 8 bit per channel formats the decoder can write, named in memory order.
+enum pixelFormat {
+    PIXEL_RGBA8,
+    PIXEL_BGRA8,
+    // colour channels multiplied by alpha / 255, rounded
+    PIXEL_RGBA8_PREMULTIPLIED,
+    PIXEL_BGRA8_PREMULTIPLIED,
+    // alpha dropped
+    PIXEL_RGB8
+};
+
+/**
+ * Where and how a decoder writes its pixels: 'height' rows of 'width' pixels in 'format', each
+ * row starting 'stride' bytes after the one before, in memory the caller owns (e.g. a mapped
+ * texture or a window surface). The stride must be at least width * getPixelFormatBytes(format).
+*/
+struct outputDescriptor {
+    unsigned char *pixels;
+    size_t stride;
+    enum pixelFormat format;
+};
+
+int getPixelFormatBytes(enum pixelFormat format);
+
+struct rowExpander;
+
+/**
+ * Converts one defiltered row of 'width' pixels in the image's own format ('in') to RGBA8 ('out').
+*/
+typedef void (*ExpandRowFn)(unsigned char *out, const unsigned char *in, int width, const struct rowExpander &expander);
+
+// Converts a row of RGBA8 pixels to the output format.
+typedef void (*ConvertRowFn)(unsigned char *out, const unsigned char *rgba, int width);
+
+/**
+ * Per-image state for converting defiltered rows to the output format, built once from the IHDR,
+ * PLTE and tRNS data. Rows are expanded to RGBA8 and then converted one at a time as they are
+ * defiltered, while still in cache.
+*/
+struct rowExpander {
+    // NULL when the rows are already RGBA8 (color type 6, depth 8)
+    ExpandRowFn expand;
+    // NULL when the output is RGBA8, or when the conversion is baked into 'table'
+    ConvertRowFn convert;
+    enum pixelFormat format;
+    int outBytesPerPixel;
+    int colorType;
+    int channelDepth;
+    // pixels packed into each input byte: 8 / depth for sub-byte formats, otherwise 1
+    int pixelsPerByte;
+    // Output pixels (in memory order) for each input byte value: RGBA8, or the output format
+    // itself when it has 4 bytes per pixel. Sub-byte formats store the
+    // pixelsPerByte pixels of byte b at b * pixelsPerByte; 8 bit greyscale and palette use one each.
+    uint32_t table[256 * 8];
+    // tRNS colour key for greyscale and truecolor images, -1 if none
+    int key[3];
+};
+
+/**
+ * Bits per pixel of the filtered data (channels times depth), or -1 for an invalid format.
+*/
+int getBitsPerPixel(int colorType, int channelDepth);
+
+// Bytes per filtered row of 'width' pixels, not counting the filter byte.
+size_t getRowBytes(int width, int bitsPerPixel);
+
+/**
+ * Picks the expansion kernel for the image's format and the conversion to 'format', and fills
+ * the lookup table.
+ *
+ * @return false if the format is not supported.
+*/
+bool buildRowExpander(const struct ihdr &ihdrData, struct rowExpander &expander, enum pixelFormat format = PIXEL_RGBA8);
+
+// The expander, or NULL if the defiltered rows are already in the output format.
+const struct rowExpander *getActiveExpander(const struct rowExpander &expander);
+
+/**
+ * Writes one defiltered row ('in') to 'out' in the output format. 'scratch' holds an RGBA8 row
+ * of 'width' pixels for formats that are expanded and converted in two steps.
+*/
+void expandRow(const struct rowExpander &expander, unsigned char *out, const unsigned char *in, int width, unsigned char *scratch);
+
+// The RGBA8 to 'format' row converter, NULL for RGBA8 itself.
+ConvertRowFn getConvertRow(enum pixelFormat format);
+
+/**
+ * Box filter downscaling by 'scale' in both directions, one input row at a time: each row of
+ * 'width' RGBA8 pixels is added to 'sums' (4 per output pixel) with accumulateBoxRow, and once
+ * 'rows' rows are in, averageBoxRow writes the rounded averages as an RGBA8 row of
+ * ceil(width / scale) pixels and clears the sums. Partial blocks at the right and bottom edges
+ * average only the pixels they cover.
+*/
+void accumulateBoxRow(uint32_t *sums, const unsigned char *rgba, int width, int scale);
+
+void averageBoxRow(unsigned char *rgba, uint32_t *sums, int width, int scale, int rows);
+
+#endif
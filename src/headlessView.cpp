@@ -0,0 +1,149 @@
+// Runs the progressive viewer against an offscreen Mesa context (EGL, no window system) and
+// checks what it drew. Works with the software rasterizer: LIBGL_ALWAYS_SOFTWARE=1 headlessView ...
+#define GL_GLEXT_PROTOTYPES
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+
+#include "progressiveUpload.h"
+#include "processImage.h"
+#include "readImage.h"
+#include "timer.h"
+
+// An EGL display and a pbuffer surface standing in for the window.
+struct offscreenContext {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLSurface surface = EGL_NO_SURFACE;
+    EGLContext context = EGL_NO_CONTEXT;
+};
+
+/**
+ * Makes a desktop GL context current on a width x height RGBA8 pbuffer, on Mesa's surfaceless
+ * platform so no display server is needed.
+*/
+static bool createOffscreenContext(int width, int height, struct offscreenContext &offscreen) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    offscreen.display = getPlatformDisplay != NULL ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (offscreen.display == EGL_NO_DISPLAY || !eglInitialize(offscreen.display, NULL, NULL)) {
+        std::cerr << "Error initializing an EGL display: 0x" << std::hex << eglGetError() << std::dec << std::endl;
+        return false;
+    }
+
+    const EGLint configAttributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_NONE
+    };
+    const EGLint surfaceAttributes[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    EGLConfig config;
+    EGLint configCount = 0;
+
+    if (!eglChooseConfig(offscreen.display, configAttributes, &config, 1, &configCount) || configCount == 0 || !eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "No EGL config for an RGBA8 desktop GL pbuffer" << std::endl;
+        return false;
+    }
+    offscreen.surface = eglCreatePbufferSurface(offscreen.display, config, surfaceAttributes);
+    offscreen.context = eglCreateContext(offscreen.display, config, EGL_NO_CONTEXT, NULL);
+    if (offscreen.surface == EGL_NO_SURFACE || offscreen.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(offscreen.display, offscreen.surface, offscreen.surface, offscreen.context)) {
+        std::cerr << "Error creating a " << width << " x " << height << " pbuffer context: 0x" << std::hex << eglGetError() << std::dec << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static void destroyOffscreenContext(struct offscreenContext &offscreen) {
+    if (offscreen.display == EGL_NO_DISPLAY) {
+        return;
+    }
+    eglMakeCurrent(offscreen.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (offscreen.context != EGL_NO_CONTEXT) {
+        eglDestroyContext(offscreen.display, offscreen.context);
+    }
+    if (offscreen.surface != EGL_NO_SURFACE) {
+        eglDestroySurface(offscreen.display, offscreen.surface);
+    }
+    eglTerminate(offscreen.display);
+}
+
+// Rows of the framebuffer (bottom up) that differ from the top down RGBA8 image.
+static int countMismatchedRows(const std::vector<unsigned char> &framebuffer, const std::vector<unsigned char> &pixels, int width, int height) {
+    size_t rowBytes = (size_t) width * DECODED_BYTES_PER_PIXEL;
+    int mismatched = 0;
+    for (int y = 0; y < height; y++) {
+        mismatched += std::memcmp(framebuffer.data() + (size_t) (height - 1 - y) * rowBytes, pixels.data() + (size_t) y * rowBytes, rowBytes) != 0;
+    }
+    return mismatched;
+}
+
+/**
+ * Decodes the image progressively into a pbuffer the size of the image, reports the time to
+ * first pixel, and reads the final frame back to check it against the decoded pixels.
+ *
+ * Usage: headlessView <png> [maxTileSize]
+*/
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: headlessView <png> [maxTileSize]" << std::endl;
+        return 1;
+    }
+    int maxTileSize = argc > 2 ? atoi(argv[2]) : 0;
+    struct mappedPNG image;
+    struct offscreenContext offscreen;
+    double start, ready;
+
+    printSummaries = false;
+    GET_TIME(start);
+    if (!mapPNGImage(argv[1], image)) {
+        return 1;
+    }
+    int width = image.ihdrData.width, height = image.ihdrData.height;
+    if (!createOffscreenContext(width, height, offscreen)) {
+        destroyOffscreenContext(offscreen);
+        unmapPNGImage(image);
+        return 1;
+    }
+    glViewport(0, 0, width, height);
+    GET_TIME(ready);
+
+    std::vector<unsigned char> pixels, framebuffer((size_t) width * height * DECODED_BYTES_PER_PIXEL);
+    struct progressiveStats stats;
+    int frames = 0, mismatchedRows = -1;
+    bool ok;
+    {
+        TiledTexture texture(width, height, maxTileSize);
+        ok = texture.valid() && decodeProgressively(image, texture, [&] {
+            frames++;
+            return true;
+        }, pixels, stats);
+
+        if (ok) {
+            glClear(GL_COLOR_BUFFER_BIT);
+            texture.draw();
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, framebuffer.data());
+            mismatchedRows = countMismatchedRows(framebuffer, pixels, width, height);
+        }
+
+        std::cout << std::fixed << std::setprecision(5);
+        std::cout << argv[1] << " (" << width << " x " << height << ") on " << glGetString(GL_RENDERER) << ", "
+                  << texture.getTileCount() << " tile" << (texture.getTileCount() == 1 ? "" : "s") << std::endl;
+    }
+    destroyOffscreenContext(offscreen);
+    unmapPNGImage(image);
+
+    if (!ok) {
+        std::cerr << "Progressive display failed" << std::endl;
+        return 1;
+    }
+    std::cout << "\tcontext setup:  " << ready - start << " s" << std::endl;
+    std::cout << "\tfirst pixel:    " << stats.firstPixel << " s" << std::endl;
+    std::cout << "\tdecoded:        " << stats.decoded << " s" << std::endl;
+    std::cout << "\tlast band:      " << stats.complete << " s (" << stats.bands << " bands, " << frames << " frames)" << std::endl;
+    std::cout << "\treadback:       " << (mismatchedRows == 0 ? "matches the decoded image" : std::to_string(mismatchedRows) + " rows differ") << std::endl;
+    return mismatchedRows == 0 ? 0 : 1;
+}
@@ -0,0 +1,228 @@
+#include <iostream>
+#include <iomanip>
+#include <climits>
+
+#include <sys/stat.h>
+
+#include "imageCache.h"
+#include "processImage.h"
+#include "crcKernels.h"
+#include "printUtils.h"
+#include "trace.h"
+
+size_t imageKeyHash::operator()(const imageKey &key) const {
+    // 64 bit FNV-1a style mixing of the fields
+    uint64_t fields[5] = {(uint64_t) key.device, (uint64_t) key.inode, (uint64_t) key.mtimeNanoseconds, (uint64_t) key.size, key.contentHash};
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t field : fields) {
+        hash = (hash ^ field) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// CRC-32 of all the IDAT payloads, one after the other.
+static uint32_t hashIDATSpans(const struct mappedPNG &file) {
+    uint32_t crc = 0;
+    for (const idatSpan &span : file.idatSpans) {
+        crc = crc32Update(crc, file.base + span.offset, span.length);
+    }
+    return crc;
+}
+
+// The regular decode: inflate (over the yiDX index when there is one), then defilter to RGBA8.
+static bool decodeMapped(const struct mappedPNG &file, struct cachedImage &image) {
+    TRACE_SCOPE("imageCacheDecode");
+    const struct ihdr &ihdrData = file.ihdrData;
+    std::vector<unsigned char> inflated;
+    image.ihdrData = ihdrData;
+    return decompressIDAT(file.base, file.idatSpans, file.restartPoints, ihdrData, inflated) &&
+           defilterIDAT(inflated, image.pixels, ihdrData, file.restartPoints);
+}
+
+ImageCache::ImageCache(size_t budgetBytes, bool hashContent) : budget(budgetBytes), hashContent(hashContent), bytesCached(0), useClock(0) {
+}
+
+ImageCache::shard &ImageCache::shardFor(const imageKey &key) {
+    return shards[imageKeyHash()(key) % IMAGE_CACHE_SHARDS];
+}
+
+CachedImagePtr ImageCache::get(const char *filename) {
+    TRACE_SCOPE("imageCacheGet");
+    struct stat info;
+    if (stat(filename, &info) != 0) {
+        std::cerr << "Cannot open " << filename << std::endl;
+        return NULL;
+    }
+    imageKey key = {info.st_dev, info.st_ino, (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec, (size_t) info.st_size, 0};
+
+    struct mappedPNG file;
+    bool mapped = false;
+    if (hashContent) {
+        if (!mapPNGImage(filename, file)) {
+            return NULL;
+        }
+        mapped = true;
+        key.contentHash = hashIDATSpans(file);
+    }
+
+    shard &part = shardFor(key);
+    std::unique_lock<std::mutex> guard(part.lock);
+    auto found = part.entries.find(key);
+    if (found != part.entries.end()) {
+        entry &cached = found->second;
+        std::shared_future<CachedImagePtr> image = cached.image;
+        bool ready = cached.ready;
+        if (ready) {
+            cached.lastUse = useClock++;
+            part.lru.splice(part.lru.begin(), part.lru, cached.lruPosition);
+            part.counters.hits++;
+            part.counters.bytesSaved += cached.bytes;
+        }
+        guard.unlock();
+        if (mapped) {
+            unmapPNGImage(file);
+        }
+        if (ready) {
+            return image.get();
+        }
+
+        // another thread is decoding this image; wait for it instead of decoding it again
+        CachedImagePtr result = image.get();
+        guard.lock();
+        part.counters.collapsedMisses++;
+        if (result != NULL) {
+            part.counters.hits++;
+            part.counters.bytesSaved += result->pixels.size();
+        } else {
+            // the decoding thread already counted the failure
+            part.counters.misses++;
+        }
+        return result;
+    }
+
+    // Leave a pending entry so that misses on this key meanwhile wait for this decode. Entries of
+    // an unordered_map do not move, so 'pending' stays valid; nothing erases an entry that is not ready.
+    std::promise<CachedImagePtr> promise;
+    entry *pending = &part.entries[key];
+    pending->image = promise.get_future().share();
+    part.counters.misses++;
+    guard.unlock();
+
+    std::shared_ptr<cachedImage> image = std::make_shared<cachedImage>();
+    if (!mapped) {
+        mapped = mapPNGImage(filename, file);
+    }
+    bool ok = mapped && decodeMapped(file, *image);
+    if (mapped) {
+        unmapPNGImage(file);
+    }
+
+    guard.lock();
+    bool keep = ok && image->pixels.size() <= budget;
+    if (keep) {
+        pending->bytes = image->pixels.size();
+        pending->lastUse = useClock++;
+        pending->ready = true;
+        part.lru.push_front(key);
+        pending->lruPosition = part.lru.begin();
+        bytesCached += pending->bytes;
+    } else {
+        // an image larger than the whole budget would only evict everything else; hand it out uncached
+        part.entries.erase(key);
+        if (!ok) {
+            part.counters.failures++;
+        }
+    }
+    guard.unlock();
+
+    CachedImagePtr result = ok ? CachedImagePtr(image) : CachedImagePtr();
+    promise.set_value(result);
+    if (keep) {
+        evictToBudget();
+    }
+    return result;
+}
+
+/**
+ * Drops least recently used images until the cache is within budget. The oldest image is found
+ * by comparing the tails of the shards' LRU lists, locking one shard at a time.
+*/
+void ImageCache::evictToBudget() {
+    while (bytesCached.load() > budget) {
+        int victim = -1;
+        uint64_t oldest = UINT64_MAX;
+        for (int i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            if (!shards[i].lru.empty()) {
+                uint64_t lastUse = shards[i].entries.find(shards[i].lru.back())->second.lastUse;
+                if (lastUse < oldest) {
+                    oldest = lastUse;
+                    victim = i;
+                }
+            }
+        }
+        if (victim == -1) {
+            return;
+        }
+
+        // the tail may have changed since; whatever is oldest there now goes
+        shard &part = shards[victim];
+        std::lock_guard<std::mutex> guard(part.lock);
+        if (part.lru.empty()) {
+            continue;
+        }
+        auto found = part.entries.find(part.lru.back());
+        bytesCached -= found->second.bytes;
+        part.lru.pop_back();
+        part.entries.erase(found);
+        part.counters.evictions++;
+    }
+}
+
+void ImageCache::clear() {
+    for (shard &part : shards) {
+        std::lock_guard<std::mutex> guard(part.lock);
+        for (const imageKey &key : part.lru) {
+            auto found = part.entries.find(key);
+            bytesCached -= found->second.bytes;
+            part.entries.erase(found);
+        }
+        part.lru.clear();
+    }
+}
+
+struct imageCacheStats ImageCache::getStats() {
+    struct imageCacheStats stats;
+    for (shard &part : shards) {
+        std::lock_guard<std::mutex> guard(part.lock);
+        stats.hits += part.counters.hits;
+        stats.misses += part.counters.misses;
+        stats.collapsedMisses += part.counters.collapsedMisses;
+        stats.evictions += part.counters.evictions;
+        stats.failures += part.counters.failures;
+        stats.bytesSaved += part.counters.bytesSaved;
+        stats.imagesCached += part.lru.size();
+    }
+    stats.bytesCached = bytesCached.load();
+    stats.budget = budget;
+    return stats;
+}
+
+void printImageCacheStats(const struct imageCacheStats &stats) {
+    long lookups = stats.hits + stats.misses;
+    std::ios::fmtflags savedFlags = std::cout.flags();
+    std::streamsize savedPrecision = std::cout.precision();
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Image cache summary" << std::endl;
+    std::cout << "\tLookups: " << lookups << " (" << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.collapsedMisses << " collapsed into another decode, " << stats.failures << " failed)" << std::endl;
+    if (lookups > 0) {
+        std::cout << "\tHit rate: " << std::fixed << std::setprecision(1) << 100.0 * stats.hits / lookups << "%" << std::endl;
+    }
+    std::cout << "\tBytes saved: " << stats.bytesSaved / (1024 * 1024) << " MiB" << std::endl;
+    std::cout << "\tCached: " << stats.imagesCached << " images, " << stats.bytesCached / (1024 * 1024) << " of "
+              << stats.budget / (1024 * 1024) << " MiB (" << stats.evictions << " evicted)" << std::endl;
+    std::cout.flags(savedFlags);
+    std::cout.precision(savedPrecision);
+}
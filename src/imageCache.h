@@ -0,0 +1,135 @@
+#ifndef _IMAGE_CACHE_H_
+#define _IMAGE_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+#include "readImage.h"
+
+// Independently locked parts of the cache; a key always lives in the same one.
+#define IMAGE_CACHE_SHARDS 16
+
+// Budget used by the timing mode.
+#define IMAGE_CACHE_DEFAULT_BUDGET ((size_t) 256 * 1024 * 1024)
+
+/**
+ * Identifies one version of a file: where it lives (device and inode) and its mtime and size,
+ * so a file that is rewritten gets a new key and its old image ages out. With content hashing the
+ * CRC-32 of the IDAT payloads is part of the key too, which catches rewrites that keep the size
+ * and land within the file system's mtime granularity.
+*/
+struct imageKey {
+    dev_t device;
+    ino_t inode;
+    int64_t mtimeNanoseconds;
+    size_t size;
+    // 0 unless the cache hashes content
+    uint32_t contentHash;
+
+    bool operator==(const imageKey &other) const {
+        return device == other.device && inode == other.inode && mtimeNanoseconds == other.mtimeNanoseconds &&
+               size == other.size && contentHash == other.contentHash;
+    }
+};
+
+struct imageKeyHash {
+    size_t operator()(const imageKey &key) const;
+};
+
+// A decoded RGBA8 image, width * height * DECODED_BYTES_PER_PIXEL bytes. Never changed once cached.
+struct cachedImage {
+    struct ihdr ihdrData;
+    std::vector<unsigned char> pixels;
+};
+
+// Stays valid after the image is evicted, until the last holder lets go of it.
+typedef std::shared_ptr<const cachedImage> CachedImagePtr;
+
+struct imageCacheStats {
+    // lookups answered from the cache, including those that waited for another thread's decode
+    long hits = 0;
+    long misses = 0;
+    // misses that found the same image already being decoded and waited for it instead
+    long collapsedMisses = 0;
+    long evictions = 0;
+    // decodes that failed; nothing is cached for them
+    long failures = 0;
+    // decoded bytes handed out without decoding them again
+    size_t bytesSaved = 0;
+    size_t bytesCached = 0;
+    size_t imagesCached = 0;
+    size_t budget = 0;
+};
+
+/**
+ * In-memory cache of decoded images, keyed by file identity (imageKey) and kept under a byte budget.
+ *
+ * Keys are spread over IMAGE_CACHE_SHARDS shards with a mutex each, held only for the map and list
+ * updates, never while decoding. Concurrent misses on one key are collapsed: the first thread
+ * decodes and the others wait on its result. Eviction is least recently used across all shards,
+ * by bytes: after an insert takes the cache over budget, the oldest images go until it fits. An
+ * image larger than the whole budget is returned but not kept.
+ *
+ * Thread safe.
+*/
+class ImageCache {
+public:
+    /**
+     * @param budgetBytes Most decoded bytes to keep.
+     * @param hashContent Also key on the CRC-32 of the IDAT payloads (see imageKey). The file is
+     *                    then mapped on every lookup, hit or not.
+    */
+    explicit ImageCache(size_t budgetBytes, bool hashContent = false);
+
+    /**
+     * Returns the decoded image of 'filename', decoding it (through mapPNGImage, decompressIDAT and
+     * defilterIDAT, using the yiDX index when present) on a miss.
+     *
+     * @return NULL if the file cannot be read or decoded.
+    */
+    CachedImagePtr get(const char *filename);
+
+    // Drops every cached image; decodes in progress still finish.
+    void clear();
+
+    struct imageCacheStats getStats();
+
+private:
+    struct entry {
+        std::shared_future<CachedImagePtr> image;
+        // 0 and not in the LRU list while the image is being decoded
+        size_t bytes = 0;
+        uint64_t lastUse = 0;
+        bool ready = false;
+        std::list<imageKey>::iterator lruPosition;
+    };
+
+    struct shard {
+        std::mutex lock;
+        std::unordered_map<imageKey, entry, imageKeyHash> entries;
+        // most recently used first; only entries that are ready
+        std::list<imageKey> lru;
+        struct imageCacheStats counters;
+    };
+
+    shard &shardFor(const imageKey &key);
+    void evictToBudget();
+
+    size_t budget;
+    bool hashContent;
+    shard shards[IMAGE_CACHE_SHARDS];
+    std::atomic<size_t> bytesCached;
+    std::atomic<uint64_t> useClock;
+};
+
+void printImageCacheStats(const struct imageCacheStats &stats);
+
+#endif
@@ -0,0 +1,198 @@
+// Rewrites a PNG with a yiDX restart index so it can be inflated and defiltered in parallel.
+//
+// The IDAT stream is recompressed with a zlib full flush at every segment boundary and the
+// offset of each boundary is recorded in a yiDX chunk placed before the first IDAT. The first
+// row of every segment is re-filtered to Sub (unless it is already None or Sub) so that it
+// does not depend on the last row of the previous segment. All other chunks are copied as is.
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#include "readImage.h"
+#include "processImage.h"
+
+// IDAT payloads are split into chunks of at most this many bytes.
+#define INDEX_IDAT_CHUNK_SIZE (1 << 20)
+
+static void putBigEndian32(std::vector<unsigned char> &out, size_t value) {
+    out.push_back((value >> 24) & 0xff);
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >> 8) & 0xff);
+    out.push_back(value & 0xff);
+}
+
+static void writeChunk(std::ofstream &file, const char *type, const unsigned char *data, size_t size) {
+    std::vector<unsigned char> header;
+    putBigEndian32(header, size);
+    header.insert(header.end(), type, type + 4);
+
+    uLong crc = crc32(0L, (const Bytef *) type, 4);
+    crc = crc32(crc, data, size);
+    std::vector<unsigned char> trailer;
+    putBigEndian32(trailer, crc);
+
+    file.write((const char *) header.data(), header.size());
+    file.write((const char *) data, size);
+    file.write((const char *) trailer.data(), trailer.size());
+}
+
+/**
+ * Deflates the filtered scanlines, issuing a full flush before the first row of every
+ * segment after the first.
+ *
+ * @param segmentRows First row of each segment, in increasing order and starting at 0.
+ * @param offsets Receives the byte offset of each segment within the zlib stream.
+*/
+static bool deflateSegments(const std::vector<unsigned char> &filtered, size_t colWidth, const std::vector<int> &segmentRows, int height, std::vector<unsigned char> &compressed, std::vector<size_t> &offsets) {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        std::cerr << "Error initializing zlib deflate stream" << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned char> buffer(1 << 16);
+    for (size_t segment = 0; segment < segmentRows.size(); segment++) {
+        bool lastSegment = segment == segmentRows.size() - 1;
+        int endRow = lastSegment ? height : segmentRows[segment + 1];
+
+        // the zlib header is only written with the first output, so segment 0 always starts at 2
+        offsets.push_back(segment == 0 ? 2 : stream.total_out);
+
+        stream.next_in = const_cast<unsigned char *>(filtered.data() + segmentRows[segment] * colWidth);
+        stream.avail_in = (endRow - segmentRows[segment]) * colWidth;
+
+        int flush = lastSegment ? Z_FINISH : Z_FULL_FLUSH;
+        int ret;
+        do {
+            stream.next_out = buffer.data();
+            stream.avail_out = buffer.size();
+            ret = deflate(&stream, flush);
+            if (ret == Z_STREAM_ERROR) {
+                deflateEnd(&stream);
+                return false;
+            }
+            compressed.insert(compressed.end(), buffer.data(), buffer.data() + buffer.size() - stream.avail_out);
+        } while (stream.avail_out == 0 || (lastSegment && ret != Z_STREAM_END));
+    }
+
+    deflateEnd(&stream);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: indexPNG <input.png> <output.png> [segments]" << std::endl;
+        return 1;
+    }
+
+    int segments = argc > 3 ? atoi(argv[3]) : 8;
+    struct mappedPNG image;
+    std::vector<unsigned char> decompressed, defiltered;
+
+    if (!mapPNGImage(argv[1], image)) {
+        return 1;
+    }
+
+    const struct ihdr &ihdrData = image.ihdrData;
+    int bytesPerPixel = getBytesPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bytesPerPixel == -1 || ihdrData.interlaceMethod != 0) {
+        std::cerr << "Only non-interlaced images with whole-byte pixels can be indexed" << std::endl;
+        return 1;
+    }
+
+    if (!decompressIDAT(image.base, image.idatSpans, decompressed) ||
+        !defilterIDAT(decompressed, defiltered, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth)) {
+        std::cerr << "Failed to decode " << argv[1] << std::endl;
+        return 1;
+    }
+
+    size_t rowBytes = (size_t) ihdrData.width * bytesPerPixel;
+    size_t colWidth = rowBytes + 1;
+
+    if (segments < 1) {
+        segments = 1;
+    }
+    if (segments > ihdrData.height) {
+        segments = ihdrData.height;
+    }
+    int rowsPerSegment = (ihdrData.height + segments - 1) / segments;
+
+    std::vector<int> segmentRows;
+    for (int row = 0; row < ihdrData.height; row += rowsPerSegment) {
+        segmentRows.push_back(row);
+
+        // make the segment's first row independent of the row above it
+        unsigned char *filteredRow = &decompressed[row * colWidth];
+        if (row > 0 && filteredRow[0] != 0 && filteredRow[0] != 1) {
+            const unsigned char *pixels = &defiltered[row * rowBytes];
+            filteredRow[0] = 1;
+            for (size_t i = 0; i < rowBytes; i++) {
+                filteredRow[i + 1] = pixels[i] - (i < (size_t) bytesPerPixel ? 0 : pixels[i - bytesPerPixel]);
+            }
+        }
+    }
+
+    std::vector<unsigned char> compressed;
+    std::vector<size_t> offsets;
+    if (!deflateSegments(decompressed, colWidth, segmentRows, ihdrData.height, compressed, offsets)) {
+        std::cerr << "Failed to recompress IDAT data" << std::endl;
+        return 1;
+    }
+
+    std::vector<unsigned char> index;
+    putBigEndian32(index, segmentRows.size());
+    for (size_t i = 0; i < segmentRows.size(); i++) {
+        putBigEndian32(index, segmentRows[i]);
+        putBigEndian32(index, offsets[i]);
+    }
+
+    std::ofstream output(argv[2], std::ios::binary);
+    if (!output) {
+        std::cerr << "Error opening output file" << std::endl;
+        return 1;
+    }
+
+    // copy the signature and every chunk, replacing the IDAT run with yiDX + the new IDATs
+    output.write((const char *) image.base, 8);
+    bool wroteIDAT = false;
+    size_t offset = 8;
+    while (offset + 12 <= image.size) {
+        const unsigned char *chunk = image.base + offset;
+        size_t sizeBytes = ((size_t) chunk[0] << 24) | (chunk[1] << 16) | (chunk[2] << 8) | chunk[3];
+        size_t chunkSize = sizeBytes + 12;
+
+        if (std::memcmp(chunk + 4, "IDAT", 4) == 0) {
+            if (!wroteIDAT) {
+                writeChunk(output, "yiDX", index.data(), index.size());
+                for (size_t i = 0; i < compressed.size(); i += INDEX_IDAT_CHUNK_SIZE) {
+                    writeChunk(output, "IDAT", compressed.data() + i, std::min(compressed.size() - i, (size_t) INDEX_IDAT_CHUNK_SIZE));
+                }
+                wroteIDAT = true;
+            }
+        } else if (std::memcmp(chunk + 4, "yiDX", 4) != 0) {
+            output.write((const char *) chunk, chunkSize);
+        }
+
+        if (std::memcmp(chunk + 4, "IEND", 4) == 0) {
+            break;
+        }
+        offset += chunkSize;
+    }
+
+    unmapPNGImage(image);
+
+    if (!output) {
+        std::cerr << "Error writing output file" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote " << argv[2] << " with " << segmentRows.size() << " restart segments" << std::endl;
+    return 0;
+}
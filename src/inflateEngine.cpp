@@ -0,0 +1,611 @@
+// Built-in DEFLATE decoder for IDAT data, an alternative to zlib's inflate
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <zlib.h>
+
+#include "inflateEngine.h"
+#include "trace.h"
+
+// INFLATE=builtin in the environment switches to the built-in engine for the whole run.
+static bool builtinInflateDefault() {
+    const char *engine = getenv("INFLATE");
+    return engine != NULL && strcmp(engine, "builtin") == 0;
+}
+
+bool useBuiltinInflate = builtinInflateDefault();
+
+// Primary table sizes: codes up to this many bits resolve in one lookup, longer ones go through a
+// subtable. 11 bits also leaves room for two short literal codes in one entry.
+#define LITLEN_TABLE_BITS 11
+#define DIST_TABLE_BITS 8
+#define CODELEN_TABLE_BITS 7
+
+#define MAX_CODE_BITS 15
+#define LITLEN_SYMBOLS 288
+#define DIST_SYMBOLS 32
+#define CODELEN_SYMBOLS 19
+
+// Room for the subtables too. A complete code of 288 symbols needs at most 916 subtable entries
+// beyond the 11 bit primary table, and 30 distance symbols at most 512 beyond the 8 bit one.
+#define LITLEN_TABLE_SIZE ((1 << LITLEN_TABLE_BITS) + 1024)
+#define DIST_TABLE_SIZE ((1 << DIST_TABLE_BITS) + 512)
+
+/*
+ * Table entry layout: bits 0-7 hold the number of input bits the entry's code(s) take, bits 8-11
+ * the extra bits that follow a length or distance code (or a subtable's index bits), bits 12-15
+ * the kind and bits 16-31 the value: a literal, two literals (first in the low byte), a length or
+ * distance base, a code length symbol, or a subtable's offset.
+*/
+enum entryKind {
+    ENTRY_INVALID = 0,
+    ENTRY_LITERAL,
+    ENTRY_LITERAL_PAIR,
+    ENTRY_LENGTH,
+    ENTRY_END_OF_BLOCK,
+    ENTRY_DISTANCE,
+    ENTRY_SUBTABLE
+};
+
+static inline uint32_t makeEntry(int kind, int extraBits, int value) {
+    return (uint32_t) value << 16 | (uint32_t) kind << 12 | (uint32_t) extraBits << 8;
+}
+
+static inline int entryBits(uint32_t entry) { return entry & 0xff; }
+static inline int entryExtraBits(uint32_t entry) { return (entry >> 8) & 0xf; }
+static inline int entryKindOf(uint32_t entry) { return (entry >> 12) & 0xf; }
+static inline int entryValue(uint32_t entry) { return entry >> 16; }
+
+static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order the code length code lengths are stored in a dynamic block header.
+static const uint8_t codeLengthOrder[CODELEN_SYMBOLS] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Table entries (without their bit counts) for every symbol of each alphabet.
+struct symbolEntries {
+    uint32_t litlen[LITLEN_SYMBOLS];
+    uint32_t dist[DIST_SYMBOLS];
+    uint32_t codelen[CODELEN_SYMBOLS];
+
+    symbolEntries() {
+        for (int symbol = 0; symbol < LITLEN_SYMBOLS; symbol++) {
+            if (symbol < 256) {
+                litlen[symbol] = makeEntry(ENTRY_LITERAL, 0, symbol);
+            } else if (symbol == 256) {
+                litlen[symbol] = makeEntry(ENTRY_END_OF_BLOCK, 0, 0);
+            } else if (symbol < 286) {
+                litlen[symbol] = makeEntry(ENTRY_LENGTH, lengthExtra[symbol - 257], lengthBase[symbol - 257]);
+            } else {
+                // 286 and 287 take part in the code but never appear in valid data
+                litlen[symbol] = makeEntry(ENTRY_INVALID, 0, 0);
+            }
+        }
+        for (int symbol = 0; symbol < DIST_SYMBOLS; symbol++) {
+            dist[symbol] = symbol < 30 ? makeEntry(ENTRY_DISTANCE, distExtra[symbol], distBase[symbol]) : makeEntry(ENTRY_INVALID, 0, 0);
+        }
+        for (int symbol = 0; symbol < CODELEN_SYMBOLS; symbol++) {
+            codelen[symbol] = makeEntry(ENTRY_LITERAL, 0, symbol);
+        }
+    }
+};
+
+static const symbolEntries &getSymbolEntries() {
+    static const symbolEntries entries;
+    return entries;
+}
+
+static inline uint32_t reverseBits(uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++, code >>= 1) {
+        reversed = reversed << 1 | (code & 1);
+    }
+    return reversed;
+}
+
+/**
+ * Builds the decode table for a canonical Huffman code. The table is indexed by the next
+ * 'tableBits' bits of input (first bit in the lowest position, as DEFLATE packs them); codes
+ * longer than that lead to a subtable indexed by the bits after them.
+ *
+ * Like zlib, rejects over-subscribed codes and incomplete ones other than a lone one bit code
+ * (which a block with a single distance needs). A code with no symbols at all is accepted and
+ * every lookup in it fails.
+ *
+ * @param entries The entry for each symbol, without its bit count.
+*/
+static bool buildDecodeTable(const uint8_t *lengths, int symbols, const uint32_t *entries, int tableBits, uint32_t *table, bool allowIncomplete) {
+    int lengthCounts[MAX_CODE_BITS + 1] = {0};
+    int maxLength = 0;
+    for (int symbol = 0; symbol < symbols; symbol++) {
+        lengthCounts[lengths[symbol]]++;
+        maxLength = lengths[symbol] > maxLength ? lengths[symbol] : maxLength;
+    }
+
+    int tableSize = 1 << tableBits;
+    for (int i = 0; i < tableSize; i++) {
+        table[i] = makeEntry(ENTRY_INVALID, 0, 0);
+    }
+    if (maxLength == 0) {
+        return true;
+    }
+
+    int left = 1;
+    for (int length = 1; length <= MAX_CODE_BITS; length++) {
+        left = (left << 1) - lengthCounts[length];
+        if (left < 0) {
+            return false;
+        }
+    }
+    if (left > 0 && (!allowIncomplete || maxLength != 1)) {
+        return false;
+    }
+
+    uint32_t firstCode[MAX_CODE_BITS + 1];
+    uint32_t code = 0;
+    lengthCounts[0] = 0;
+    for (int length = 1; length <= MAX_CODE_BITS; length++) {
+        code = (code + lengthCounts[length - 1]) << 1;
+        firstCode[length] = code;
+    }
+
+    // Size each subtable by the longest code under its prefix, then lay them out after the
+    // primary table.
+    uint8_t subtableLength[1 << LITLEN_TABLE_BITS] = {0};
+    uint32_t nextCode[MAX_CODE_BITS + 1];
+    std::memcpy(nextCode, firstCode, sizeof(nextCode));
+    for (int symbol = 0; symbol < symbols; symbol++) {
+        int length = lengths[symbol];
+        if (length > tableBits) {
+            uint32_t prefix = reverseBits(nextCode[length]++, length) & (tableSize - 1);
+            subtableLength[prefix] = length > subtableLength[prefix] ? length : subtableLength[prefix];
+        }
+    }
+    int nextSubtable = tableSize;
+    for (int prefix = 0; prefix < tableSize; prefix++) {
+        if (subtableLength[prefix] > 0) {
+            int subtableBits = subtableLength[prefix] - tableBits;
+            table[prefix] = makeEntry(ENTRY_SUBTABLE, subtableBits, nextSubtable);
+            for (int i = 0; i < 1 << subtableBits; i++) {
+                table[nextSubtable + i] = makeEntry(ENTRY_INVALID, 0, 0);
+            }
+            nextSubtable += 1 << subtableBits;
+        }
+    }
+
+    // A code of 'length' bits fills every entry whose low bits are the code.
+    std::memcpy(nextCode, firstCode, sizeof(nextCode));
+    for (int symbol = 0; symbol < symbols; symbol++) {
+        int length = lengths[symbol];
+        if (length == 0) {
+            continue;
+        }
+        uint32_t reversed = reverseBits(nextCode[length]++, length);
+        uint32_t entry = entries[symbol] | length;
+        if (length <= tableBits) {
+            for (uint32_t i = reversed; i < (uint32_t) tableSize; i += 1 << length) {
+                table[i] = entry;
+            }
+        } else {
+            uint32_t subtable = table[reversed & (tableSize - 1)];
+            int subtableBits = entryExtraBits(subtable);
+            for (uint32_t i = reversed >> tableBits; i < 1u << subtableBits; i += 1 << (length - tableBits)) {
+                table[entryValue(subtable) + i] = entry;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Merges pairs of literals into single entries of the literal/length table: where the first code
+ * is a literal that leaves room in the index for a whole second literal code, the entry emits
+ * both. Runs from the top of the table down, so the entry for the second code is still single.
+*/
+static void pairLiterals(uint32_t *table) {
+    for (int i = (1 << LITLEN_TABLE_BITS) - 1; i >= 0; i--) {
+        uint32_t first = table[i];
+        if (entryKindOf(first) != ENTRY_LITERAL) {
+            continue;
+        }
+        int firstBits = entryBits(first);
+        uint32_t second = table[i >> firstBits];
+        if (entryKindOf(second) == ENTRY_LITERAL && entryBits(second) <= LITLEN_TABLE_BITS - firstBits) {
+            table[i] = makeEntry(ENTRY_LITERAL_PAIR, 0, entryValue(first) | entryValue(second) << 8) | (firstBits + entryBits(second));
+        }
+    }
+}
+
+static bool buildLitlenTable(const uint8_t *lengths, int symbols, uint32_t *table) {
+    if (!buildDecodeTable(lengths, symbols, getSymbolEntries().litlen, LITLEN_TABLE_BITS, table, true)) {
+        return false;
+    }
+    pairLiterals(table);
+    return true;
+}
+
+// Decode tables of the fixed Huffman code (BTYPE 01), built once.
+struct fixedTables {
+    uint32_t litlen[LITLEN_TABLE_SIZE];
+    uint32_t dist[DIST_TABLE_SIZE];
+
+    fixedTables() {
+        uint8_t lengths[LITLEN_SYMBOLS];
+        for (int symbol = 0; symbol < LITLEN_SYMBOLS; symbol++) {
+            lengths[symbol] = symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+        }
+        buildLitlenTable(lengths, LITLEN_SYMBOLS, litlen);
+        for (int symbol = 0; symbol < DIST_SYMBOLS; symbol++) {
+            lengths[symbol] = 5;
+        }
+        buildDecodeTable(lengths, DIST_SYMBOLS, getSymbolEntries().dist, DIST_TABLE_BITS, dist, true);
+    }
+};
+
+static const fixedTables &getFixedTables() {
+    static const fixedTables tables;
+    return tables;
+}
+
+/*
+ * Reads the spans least significant bit first through a 64 bit buffer. Inside a span the buffer
+ * is topped up with one unaligned 8 byte load; the bits above 'count' may then already hold the
+ * next input bytes, which the following load ORs in again unchanged. Near the end of a span it is
+ * filled a byte at a time, continuing into the next span, and past the end of the data with zero
+ * bytes that are counted in 'overrun' so that consuming them can be caught.
+*/
+struct bitReader {
+    const unsigned char *base;
+    const std::vector<idatSpan> *spans;
+    size_t nextSpan;
+    const unsigned char *in;
+    const unsigned char *inEnd;
+    uint64_t bits;
+    int count;
+    size_t overrun;
+};
+
+static inline uint64_t readLittleEndian64(const unsigned char *data) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Moves to the next non-empty span once the current one is used up.
+static inline bool nextInputSpan(struct bitReader &reader) {
+    while (reader.in == reader.inEnd && reader.nextSpan < reader.spans->size()) {
+        const idatSpan &span = (*reader.spans)[reader.nextSpan++];
+        reader.in = reader.base + span.offset;
+        reader.inEnd = reader.in + span.length;
+    }
+    return reader.in < reader.inEnd;
+}
+
+static void refillSlow(struct bitReader &reader) {
+    reader.bits &= ((uint64_t) 1 << reader.count) - 1;
+    while (reader.count <= 55) {
+        uint64_t byte = 0;
+        if (nextInputSpan(reader)) {
+            byte = *reader.in++;
+        } else {
+            reader.overrun++;
+        }
+        reader.bits |= byte << reader.count;
+        reader.count += 8;
+    }
+}
+
+// Leaves at least 56 bits in the buffer.
+static inline void refill(struct bitReader &reader) {
+    if (reader.inEnd - reader.in >= 8) {
+        reader.bits |= readLittleEndian64(reader.in) << reader.count;
+        reader.in += (63 - reader.count) >> 3;
+        reader.count |= 56;
+    } else {
+        refillSlow(reader);
+    }
+}
+
+static inline void consumeBits(struct bitReader &reader, int bits) {
+    reader.bits >>= bits;
+    reader.count -= bits;
+}
+
+static inline uint32_t takeBits(struct bitReader &reader, int bits) {
+    uint32_t value = reader.bits & (((uint64_t) 1 << bits) - 1);
+    consumeBits(reader, bits);
+    return value;
+}
+
+// Whether any of the zero bytes fed past the end of the data have been consumed.
+static inline bool readPastEnd(const struct bitReader &reader) {
+    return reader.overrun * 8 > (size_t) reader.count;
+}
+
+static inline uint32_t lookupEntry(const uint32_t *table, int tableBits, uint64_t bits) {
+    uint32_t entry = table[bits & ((1u << tableBits) - 1)];
+    if (entryKindOf(entry) == ENTRY_SUBTABLE) {
+        entry = table[entryValue(entry) + ((bits >> tableBits) & ((1u << entryExtraBits(entry)) - 1))];
+    }
+    return entry;
+}
+
+/**
+ * Copies a 'length' byte match from 'distance' bytes back. With 16 bytes of room past the end it
+ * goes in whole 8 or 16 byte chunks, which may write beyond the match into bytes not produced
+ * yet. A distance under 8 is first repeated up to a multiple of itself that is at least 8, so
+ * the chunks never read bytes they are still writing.
+*/
+static inline unsigned char *copyMatch(unsigned char *out, size_t distance, size_t length, const unsigned char *outEnd) {
+    const unsigned char *from = out - distance;
+    unsigned char *end = out + length;
+
+    if (outEnd - end < 16) {
+        while (out < end) {
+            *out++ = *from++;
+        }
+        return end;
+    }
+    if (distance >= 16) {
+        do {
+            std::memcpy(out, from, 16);
+            out += 16;
+            from += 16;
+        } while (out < end);
+        return end;
+    }
+    if (distance == 1) {
+        std::memset(out, *from, length);
+        return end;
+    }
+    if (distance < 8) {
+        size_t period = distance;
+        while (period < 8) {
+            period += distance;
+        }
+        for (size_t i = 0; i < period - distance && out < end; i++) {
+            *out++ = *from++;
+        }
+        from = out - period;
+    }
+    while (out < end) {
+        std::memcpy(out, from, 8);
+        out += 8;
+        from += 8;
+    }
+    return end;
+}
+
+static bool inflateError(const char *message) {
+    std::cerr << "Error decompressing IDAT data: " << message << std::endl;
+    return false;
+}
+
+// Decodes one block's Huffman coded data up to its end-of-block code.
+static bool decodeHuffmanBlock(struct bitReader &reader, const uint32_t *litlen, const uint32_t *dist, unsigned char *outStart, unsigned char *&out, unsigned char *outEnd) {
+    for (;;) {
+        // 48 bits cover the longest length and distance pair: 15 + 5 + 15 + 13
+        if (reader.count < 48) {
+            refill(reader);
+        }
+        uint32_t entry = lookupEntry(litlen, LITLEN_TABLE_BITS, reader.bits);
+        consumeBits(reader, entryBits(entry));
+
+        switch (entryKindOf(entry)) {
+            case ENTRY_LITERAL_PAIR:
+                if (outEnd - out < 2) {
+                    return inflateError("more data than the image holds");
+                }
+                out[0] = entryValue(entry) & 0xff;
+                out[1] = entryValue(entry) >> 8;
+                out += 2;
+                break;
+            case ENTRY_LITERAL:
+                if (out == outEnd) {
+                    return inflateError("more data than the image holds");
+                }
+                *out++ = entryValue(entry);
+                break;
+            case ENTRY_LENGTH: {
+                size_t length = entryValue(entry) + takeBits(reader, entryExtraBits(entry));
+                uint32_t distEntry = lookupEntry(dist, DIST_TABLE_BITS, reader.bits);
+                consumeBits(reader, entryBits(distEntry));
+                if (entryKindOf(distEntry) != ENTRY_DISTANCE) {
+                    return inflateError("invalid distance code");
+                }
+                size_t distance = entryValue(distEntry) + takeBits(reader, entryExtraBits(distEntry));
+                if (distance > (size_t) (out - outStart)) {
+                    return inflateError("invalid distance too far back");
+                }
+                if (length > (size_t) (outEnd - out)) {
+                    return inflateError("more data than the image holds");
+                }
+                out = copyMatch(out, distance, length, outEnd);
+                break;
+            }
+            case ENTRY_END_OF_BLOCK:
+                return true;
+            default:
+                return inflateError("invalid literal/length code");
+        }
+    }
+}
+
+// Reads a dynamic block's code lengths and builds its two decode tables.
+static bool readDynamicTables(struct bitReader &reader, uint32_t *litlen, uint32_t *dist) {
+    refill(reader);
+    int litlenCount = takeBits(reader, 5) + 257;
+    int distCount = takeBits(reader, 5) + 1;
+    int codelenCount = takeBits(reader, 4) + 4;
+    if (litlenCount > 286 || distCount > 30) {
+        return inflateError("too many length or distance symbols");
+    }
+
+    uint8_t codelenLengths[CODELEN_SYMBOLS] = {0};
+    for (int i = 0; i < codelenCount; i++) {
+        refill(reader);
+        codelenLengths[codeLengthOrder[i]] = takeBits(reader, 3);
+    }
+    uint32_t codelen[1 << CODELEN_TABLE_BITS];
+    if (!buildDecodeTable(codelenLengths, CODELEN_SYMBOLS, getSymbolEntries().codelen, CODELEN_TABLE_BITS, codelen, false)) {
+        return inflateError("invalid code lengths set");
+    }
+
+    uint8_t lengths[LITLEN_SYMBOLS + DIST_SYMBOLS];
+    int total = litlenCount + distCount;
+    for (int n = 0; n < total;) {
+        refill(reader);
+        uint32_t entry = codelen[reader.bits & ((1 << CODELEN_TABLE_BITS) - 1)];
+        if (entryKindOf(entry) == ENTRY_INVALID) {
+            return inflateError("invalid code lengths set");
+        }
+        consumeBits(reader, entryBits(entry));
+        int symbol = entryValue(entry);
+        if (symbol < 16) {
+            lengths[n++] = symbol;
+            continue;
+        }
+
+        int repeat;
+        uint8_t value = 0;
+        if (symbol == 16) {
+            if (n == 0) {
+                return inflateError("invalid bit length repeat");
+            }
+            value = lengths[n - 1];
+            repeat = 3 + takeBits(reader, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + takeBits(reader, 3);
+        } else {
+            repeat = 11 + takeBits(reader, 7);
+        }
+        if (n + repeat > total) {
+            return inflateError("invalid bit length repeat");
+        }
+        std::memset(lengths + n, value, repeat);
+        n += repeat;
+    }
+
+    if (lengths[256] == 0) {
+        return inflateError("invalid code -- missing end-of-block");
+    }
+    if (!buildLitlenTable(lengths, litlenCount, litlen)) {
+        return inflateError("invalid literal/lengths set");
+    }
+    if (!buildDecodeTable(lengths + litlenCount, distCount, getSymbolEntries().dist, DIST_TABLE_BITS, dist, true)) {
+        return inflateError("invalid distances set");
+    }
+    return true;
+}
+
+// Copies a stored block's bytes: first those already in the bit buffer, then straight from the spans.
+static bool copyStoredBlock(struct bitReader &reader, unsigned char *&out, unsigned char *outEnd) {
+    consumeBits(reader, reader.count & 7);
+    if (reader.count < 32) {
+        refill(reader);
+    }
+    uint32_t length = takeBits(reader, 16);
+    uint32_t complement = takeBits(reader, 16);
+    if (length != (~complement & 0xffff)) {
+        return inflateError("invalid stored block lengths");
+    }
+    if (length > (size_t) (outEnd - out)) {
+        return inflateError("more data than the image holds");
+    }
+
+    for (; length > 0 && reader.count >= 8; length--) {
+        *out++ = takeBits(reader, 8);
+    }
+    if (length == 0) {
+        return true;
+    }
+
+    // the buffer is empty; anything above 'count' is stale once the input moves on
+    reader.bits = 0;
+    while (length > 0) {
+        if (!nextInputSpan(reader)) {
+            return inflateError("IDAT data ended early");
+        }
+        size_t bytes = std::min((size_t) length, (size_t) (reader.inEnd - reader.in));
+        std::memcpy(out, reader.in, bytes);
+        out += bytes;
+        reader.in += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool builtinInflate(const unsigned char *base, const std::vector<idatSpan> &spans, unsigned char *out, size_t outSize, size_t &produced) {
+    TRACE_SCOPE("builtinInflate");
+    struct bitReader reader = {base, &spans, 0, NULL, NULL, 0, 0, 0};
+    unsigned char *outStart = out, *outEnd = out + outSize;
+    produced = 0;
+
+    // zlib header: deflate with a window of at most 32 KiB, no preset dictionary. The whole output
+    // stays addressable, so like zlib any distance back into it is accepted whatever the window.
+    refill(reader);
+    uint32_t method = takeBits(reader, 8);
+    uint32_t flags = takeBits(reader, 8);
+    if ((method & 0xf) != 8 || (method >> 4) > 7 || (method << 8 | flags) % 31 != 0) {
+        return inflateError("incorrect zlib header");
+    }
+    if (flags & 0x20) {
+        return inflateError("preset dictionary not supported");
+    }
+
+    // tables for dynamic blocks, rebuilt for each one; on the stack so a decode allocates nothing
+    uint32_t dynamicLitlen[LITLEN_TABLE_SIZE], dynamicDist[DIST_TABLE_SIZE];
+
+    bool finalBlock = false;
+    while (!finalBlock) {
+        if (reader.count < 3) {
+            refill(reader);
+        }
+        finalBlock = takeBits(reader, 1);
+        int blockType = takeBits(reader, 2);
+
+        bool ok;
+        if (blockType == 0) {
+            ok = copyStoredBlock(reader, out, outEnd);
+        } else if (blockType == 1) {
+            ok = decodeHuffmanBlock(reader, getFixedTables().litlen, getFixedTables().dist, outStart, out, outEnd);
+        } else if (blockType == 2) {
+            ok = readDynamicTables(reader, dynamicLitlen, dynamicDist) &&
+                 decodeHuffmanBlock(reader, dynamicLitlen, dynamicDist, outStart, out, outEnd);
+        } else {
+            ok = inflateError("invalid block type");
+        }
+        produced = out - outStart;
+        if (!ok) {
+            return false;
+        }
+        if (readPastEnd(reader)) {
+            return inflateError("IDAT data ended early");
+        }
+    }
+
+    // adler32 of the inflated data, big endian, from the next byte boundary
+    consumeBits(reader, reader.count & 7);
+    uint32_t expected = 0;
+    for (int i = 0; i < 4; i++) {
+        if (reader.count < 8) {
+            refill(reader);
+        }
+        expected = expected << 8 | takeBits(reader, 8);
+    }
+    if (readPastEnd(reader)) {
+        return inflateError("IDAT data ended early");
+    }
+    if (adler32_z(adler32(0L, Z_NULL, 0), outStart, produced) != expected) {
+        return inflateError("incorrect data check");
+    }
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef _INFLATE_ENGINE_H_
+#define _INFLATE_ENGINE_H_
+
+#include <vector>
+#include <cstddef>
+
+#include "readImage.h"
+
+/**
+ * Whether decompressIDAT uses the built-in inflate (builtinInflate) wherever the inflated size is
+ * known up front; off by default, or on when the INFLATE environment variable is "builtin". zlib is
+ * used otherwise, and inflates the image again whenever the built-in engine rejects it.
+*/
+extern bool useBuiltinInflate;
+
+/**
+ * Inflates the zlib stream split across 'spans' (relative to 'base') into 'out' in a single pass,
+ * without a window or any intermediate buffer: matches are copied straight out of the output.
+ * Huffman codes are decoded through lookup tables that yield two literals at once where both
+ * codes fit, the input is read into a 64 bit bit buffer eight bytes at a time, and matches are
+ * copied in 8 and 16 byte chunks.
+ *
+ * @param outSize Capacity of 'out'. Sized from the IHDR it is exactly the inflated size, so there
+ *                is no slack to reallocate into: data that would run past it is an error.
+ * @param produced Receives the number of bytes written.
+ * @return false if the data is corrupt or ends early, the adler32 does not match, or the output
+ *         does not fit in 'outSize' bytes.
+*/
+bool builtinInflate(const unsigned char *base, const std::vector<idatSpan> &spans, unsigned char *out, size_t outSize, size_t &produced);
+
+#endif
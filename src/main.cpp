@@ -1,105 +1,63 @@
 #include <iostream>
 #include <string>
 #include <iomanip>
+#include <cstdlib>
+#include <thread>
+#include <algorithm>
 
 #include "timer.h"
 #include "processImage.h"
 #include "displayImage.h"
 #include "readImage.h"
 #include "printUtils.h"
+#include "batchDecode.h"
+#include "distributedDecode.h"
+#include "pipelineBench.h"
+#include "adam7.h"
+#include "regionDecode.h"
+#include "imageCache.h"
+#include "rawSidecar.h"
+
+#include <mpi.h>
 
 void printTimeElapsed(std::string taskName, double start, double end) {
     std::cout << "\t" << taskName << " took " << (end - start) << "s or " << (end - start) * 1000 << "ms." << std::endl;
 }
 
 int modeTiming() {
-    double start, end;
-    double startGlobal, endGlobal;
-
-    const char *filename = "../test-images/forest-3584x2048.png"; 
-    const int trials = 7;
-    std::vector<double> readImageTime, decompressImageTime, filterImageTime, globalTime;
-    float avgReadImageTime, avgDecompressImageTime, avgFilterImageTime, avgGlobalTime;
-
-
-    for (int i = 0; i < trials; i++) {
-        std::vector<unsigned char> compressedIDAT, decompressedIDAT, defilteredIDAT;
-        struct ihdr ihdrData;
-
-        std::cout << "Beginning trial " << i << std::endl;
+    const char *filename = "../test-images/forest-3584x2048.png";
+    struct benchOptions options;
+    std::vector<imageBenchResult> results(1);
 
-        GET_TIME(startGlobal);
-
-        // read image bytes
-        GET_TIME(start);
-        if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
-            std::cerr << "Image reading failed" << std::endl;
-            exit(EXIT_FAILURE);
-        }
-        GET_TIME(end);
-        readImageTime.push_back(end - start);
+    // For more images, JSON/CSV output and baseline comparison see 'bench pipeline'.
+    if (!benchmarkImage(filename, options, results[0])) {
+        std::cerr << "Image decoding failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    printBenchResults(results);
 
-        // decompress image data (IDAT chunks)
+    // The same number of decodes through the image cache: the first misses, the rest are hits.
+    ImageCache cache(IMAGE_CACHE_DEFAULT_BUDGET);
+    double start, end, hitSeconds = 0;
+    int runs = options.warmup + options.iterations;
+    printSummaries = false;
+    for (int run = 0; run < runs; run++) {
         GET_TIME(start);
-        if (!decompressIDAT(compressedIDAT, decompressedIDAT)) {
-            std::cerr << "Image decompression failed" << std::endl;
-        };
+        CachedImagePtr image = cache.get(filename);
         GET_TIME(end);
-        decompressImageTime.push_back(end - start);
-
-        // defilter image data (IDAT chunks)
-        GET_TIME(start);
-        if (!defilterIDAT(decompressedIDAT, defilteredIDAT, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth)) {
-            std::cerr << "Defiltering failed" << std::endl;
+        if (image == NULL) {
+            std::cerr << "Image decoding failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (run > 0) {
+            hitSeconds += end - start;
         }
-        GET_TIME(end);
-        filterImageTime.push_back(end - start);
-
-        GET_TIME(endGlobal);
-        globalTime.push_back(endGlobal - startGlobal);
-
-        printTimeElapsed("Trial " + i, startGlobal, endGlobal);
-    }
-
-    // Display image reading times:
-    avgReadImageTime = 0.0;
-    std::cout << "Image reading:\t\t";
-    for (double time: readImageTime) {
-        std::cout << std::setprecision(5) << time << std::fixed << " ";
-        avgReadImageTime += time;
-    }
-    avgReadImageTime = avgReadImageTime / trials;
-    std::cout << " | Avg: " << avgReadImageTime << " s" << std::endl;
-
-    // Display image decompression times:
-    avgDecompressImageTime = 0.0;
-    std::cout << "Image decompression:\t";
-    for (double time: decompressImageTime) {
-        std::cout << time << std::setprecision(5) << std::fixed  << " ";
-        avgDecompressImageTime += time;
-    }
-    avgDecompressImageTime = avgDecompressImageTime / trials;
-    std::cout << " | Avg: " << avgDecompressImageTime << " s" << std::endl;
-
-    // Display image filtering times:
-    avgFilterImageTime = 0.0;
-    std::cout << "Image filtering:\t";
-    for (double time: filterImageTime) {
-        std::cout << time << std::setprecision(5) << std::fixed  << " ";
-        avgFilterImageTime += time;
     }
-    avgFilterImageTime = avgFilterImageTime / trials;
-    std::cout << " | Avg: " << avgFilterImageTime << " s" << std::endl;
-
-    // Display image overall times:
-    avgGlobalTime = 0.0;
-    std::cout << "Image overall:\t\t";
-    for (double time: globalTime) {
-        std::cout << time << std::setprecision(5) << std::fixed  << " ";
-        avgGlobalTime += time;
+    printSummaries = true;
+    printImageCacheStats(cache.getStats());
+    if (runs > 1) {
+        std::cout << "\tMean hit time: " << hitSeconds / (runs - 1) * 1000 << " ms" << std::endl;
     }
-    avgGlobalTime = avgGlobalTime / trials;
-    std::cout << " | Avg: " << avgGlobalTime << " s" << std::endl;
     return 0;
 }
 
@@ -110,13 +68,14 @@ int modeRegular() {
     const char *filename = "../test-images/forest-3584x2048.png"; 
 
     std::vector<unsigned char> compressedIDAT, decompressedIDAT, defilteredIDAT;
+    std::vector<restartPoint> restartPoints;
     struct ihdr ihdrData;
 
     GET_TIME(startGlobal);
 
     // read image bytes
     GET_TIME(start);
-    if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
+    if (!readPNGImage(filename, compressedIDAT, ihdrData, &restartPoints)) {
         std::cerr << "Image reading failed" << std::endl;
         exit(EXIT_FAILURE);
     }
@@ -125,19 +84,35 @@ int modeRegular() {
 
     // decompress image data (IDAT chunks)
     GET_TIME(start);
-    if (!decompressIDAT(compressedIDAT, decompressedIDAT)) {
+    if (!decompressIDAT(compressedIDAT, restartPoints, ihdrData, decompressedIDAT)) {
         std::cerr << "Image decompression failed" << std::endl;
     };
     GET_TIME(end);
     printTimeElapsed("Image decompression", start, end);
 
+    // The window is sized for the full image, so when it is smaller the image is box filtered
+    // down while it is defiltered, by the largest factor that still covers the window.
+    int windowWidth, windowHeight;
+    calcOutputWindowSize(ihdrData.width, ihdrData.height, windowWidth, windowHeight);
+    int scale = chooseDownscale(ihdrData.width, ihdrData.height, windowWidth, windowHeight);
+    int displayWidth = getScaledSize(ihdrData.width, scale);
+    int displayHeight = getScaledSize(ihdrData.height, scale);
+
     // defilter image data (IDAT chunks)
     GET_TIME(start);
-    if (!defilterIDAT(decompressedIDAT, defilteredIDAT, ihdrData.width, ihdrData.height, ihdrData.colorType, ihdrData.channelDepth)) {
+    bool defiltered;
+    if (scale > 1) {
+        defilteredIDAT.resize((size_t) displayWidth * displayHeight * DECODED_BYTES_PER_PIXEL);
+        struct outputDescriptor output = {defilteredIDAT.data(), (size_t) displayWidth * DECODED_BYTES_PER_PIXEL, PIXEL_RGBA8};
+        defiltered = defilterScaled(decompressedIDAT.data(), decompressedIDAT.size(), ihdrData, scale, output);
+    } else {
+        defiltered = defilterIDAT(decompressedIDAT, defilteredIDAT, ihdrData, restartPoints);
+    }
+    if (!defiltered) {
         std::cerr << "Defiltering failed" << std::endl;
     }
     GET_TIME(end);
-    printTimeElapsed("Image defiltering", start, end);
+    printTimeElapsed(scale > 1 ? "Image defiltering at 1/" + std::to_string(scale) + " scale" : "Image defiltering", start, end);
 
     GET_TIME(endGlobal);
 
@@ -146,13 +121,250 @@ int modeRegular() {
     printTimeElapsed("Total processing", startGlobal, endGlobal);
 
     // display image
-    displayDecompressedImage(defilteredIDAT, ihdrData.width, ihdrData.height);
+    displayDecompressedImage(defilteredIDAT, displayWidth, displayHeight, windowWidth, windowHeight);
     
 
     return 0;
 }
 
-int main()
+// modeRegular with inflate and defilter overlapped on two threads (pipelineDecodeIDAT).
+int modePipelined() {
+    double start, end;
+    double startGlobal, endGlobal;
+
+    const char *filename = "../test-images/forest-3584x2048.png";
+
+    std::vector<unsigned char> compressedIDAT, defilteredIDAT;
+    struct ihdr ihdrData;
+
+    GET_TIME(startGlobal);
+
+    GET_TIME(start);
+    if (!readPNGImage(filename, compressedIDAT, ihdrData)) {
+        std::cerr << "Image reading failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    GET_TIME(end);
+    printTimeElapsed("Image reading", start, end);
+
+    GET_TIME(start);
+    if (!pipelineDecodeIDAT(compressedIDAT, ihdrData, defilteredIDAT)) {
+        std::cerr << "Image decoding failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    GET_TIME(end);
+    printTimeElapsed("Pipelined decompression and defiltering", start, end);
+
+    GET_TIME(endGlobal);
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Final summary" << std::endl;
+    printTimeElapsed("Total processing", startGlobal, endGlobal);
+
+    displayDecompressedImage(defilteredIDAT, ihdrData.width, ihdrData.height);
+
+    return 0;
+}
+
+/**
+ * Shows 'filename' from its raw sidecar (rawSidecar.h), decoding the PNG and writing the sidecar
+ * first if there is none yet, so every later run opens the mapped pixels without decoding.
+*/
+int modeSidecar(const char *filename) {
+    double start, end;
+    struct rawImage image;
+
+    GET_TIME(start);
+    // the display takes RGBA8, so a sidecar in another format is written again
+    if (!openOrCreateRawSidecar(filename, image, PIXEL_RGBA8)) {
+        std::cerr << "Image decoding failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    GET_TIME(end);
+    printTimeElapsed("Opening the sidecar (decoding and writing it if needed)", start, end);
+
+    int windowWidth, windowHeight;
+    calcOutputWindowSize(image.ihdrData.width, image.ihdrData.height, windowWidth, windowHeight);
+    displayDecompressedImage(image.pixels, image.stride, image.ihdrData.width, image.ihdrData.height, windowWidth, windowHeight);
+    closeRawSidecar(image);
+    return 0;
+}
+
+/**
+ * Decodes a directory or manifest of images on 'threads' workers. 'reader' is "mmap" (each worker
+ * maps its own files), or "uring" / "pread" to read them ahead with an AsyncBatchReader.
+*/
+int modeBatch(const char *path, int threads, const std::string &reader) {
+    std::vector<std::string> files;
+    struct batchStats stats;
+    struct asyncReadStats readStats;
+
+    if (!collectBatchFiles(path, files) || files.empty()) {
+        std::cerr << "No images found in " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // per-image summaries from several threads would interleave
+    printSummaries = false;
+
+    std::cout << "Decoding " << files.size() << " images on " << threads << " threads" << std::endl;
+    bool success;
+    if (reader == "uring" || reader == "pread") {
+        success = batchDecodeAsync(files, threads, reader == "uring" ? ASYNC_READ_AUTO : ASYNC_READ_PREAD, stats, readStats);
+        printBatchSummary(stats);
+        printAsyncReadStats(readStats);
+    } else {
+        success = batchDecode(files, threads, stats);
+        printBatchSummary(stats);
+    }
+
+    return success ? 0 : EXIT_FAILURE;
+}
+
+/**
+ * Shows an Adam7 interlaced image decoded only up to pass 'lastPass'. Inflating stops once the
+ * data of that pass is out, so early passes give a quick low-resolution preview.
+*/
+int modePreview(const char *filename, int lastPass) {
+    double start, end;
+    struct mappedPNG image;
+    std::vector<unsigned char> decompressedIDAT, defilteredIDAT;
+
+    if (!mapPNGImage(filename, image)) {
+        return EXIT_FAILURE;
+    }
+    const struct ihdr &ihdrData = image.ihdrData;
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bitsPerPixel == -1 || ihdrData.interlaceMethod != 1) {
+        std::cerr << "Previews need an Adam7 interlaced image" << std::endl;
+        unmapPNGImage(image);
+        return EXIT_FAILURE;
+    }
+
+    struct adam7Pass passes[ADAM7_PASSES];
+    getAdam7Passes(ihdrData.width, ihdrData.height, bitsPerPixel, passes);
+    lastPass = std::min(std::max(lastPass, 1), ADAM7_PASSES);
+
+    GET_TIME(start);
+    bool ok = decompressIDAT(image.base, image.idatSpans, decompressedIDAT, passes[lastPass - 1].offset + passes[lastPass - 1].size) &&
+              defilterAdam7(decompressedIDAT, defilteredIDAT, ihdrData, lastPass);
+    GET_TIME(end);
+    unmapPNGImage(image);
+
+    if (!ok) {
+        std::cerr << "Preview decoding failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    printTimeElapsed("Decoding passes 1-" + std::to_string(lastPass), start, end);
+
+    displayDecompressedImage(defilteredIDAT, ihdrData.width, ihdrData.height);
+    return 0;
+}
+
+int modeRegion(const char *filename, const struct regionOfInterest &region) {
+    double start, end;
+    struct ihdr ihdrData;
+    struct regionDecodeStats stats;
+
+    if (region.width <= 0 || region.height <= 0) {
+        std::cerr << "The region needs a positive width and height" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::vector<unsigned char> pixels((size_t) region.width * region.height * DECODED_BYTES_PER_PIXEL);
+    struct outputDescriptor output = {pixels.data(), (size_t) region.width * DECODED_BYTES_PER_PIXEL, PIXEL_RGBA8};
+
+    GET_TIME(start);
+    bool ok = decodeRegion(filename, region, output, ihdrData, &stats);
+    GET_TIME(end);
+    if (!ok) {
+        std::cerr << "Region decoding failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "\tDecoded " << stats.rowsDecoded << " of " << ihdrData.height << " rows from " << stats.idatBytesRead << " bytes of IDAT data" << std::endl;
+    printTimeElapsed("Decoding the region", start, end);
+
+    displayDecompressedImage(pixels, region.width, region.height);
+    return 0;
+}
+
+/**
+ * Decodes a batch across MPI ranks on 'threads' threads per rank. With 'threads' 0 the node's
+ * hardware threads are shared out among the ranks running on it.
+*/
+int modeMPI(const char *path, int threads) {
+    int provided;
+
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+    if (provided < MPI_THREAD_FUNNELED) {
+        std::cerr << "MPI does not provide MPI_THREAD_FUNNELED" << std::endl;
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    if (threads <= 0) {
+        MPI_Comm node;
+        int nodeRanks;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+        MPI_Comm_size(node, &nodeRanks);
+        MPI_Comm_free(&node);
+        threads = std::max((int) std::thread::hardware_concurrency() / nodeRanks, 1);
+    }
+
+    printSummaries = false;
+    int result = distributedDecode(path, threads);
+
+    MPI_Finalize();
+    return result == 0 ? 0 : EXIT_FAILURE;
+}
+
+void printUsage() {
+    std::cerr << "Usage: main [timing]" << std::endl;
+    std::cerr << "       main regular" << std::endl;
+    std::cerr << "       main pipelined" << std::endl;
+    std::cerr << "       main batch <directory | manifest> [threads] [mmap | uring | pread]" << std::endl;
+    std::cerr << "       main preview <interlaced png> <last pass 1-7>" << std::endl;
+    std::cerr << "       main region <png> <x> <y> <width> <height>" << std::endl;
+    std::cerr << "       main view <png> [max tile size]" << std::endl;
+    std::cerr << "       main sidecar <png>" << std::endl;
+    std::cerr << "       mpirun -np <ranks> main mpi <directory | manifest> [threads per rank, default cores / ranks on the node]" << std::endl;
+}
+
+int main(int argc, char *argv[])
 {
-   modeTiming();
+    std::string mode = argc > 1 ? argv[1] : "timing";
+
+    if (mode == "timing") {
+        return modeTiming();
+    }
+    if (mode == "regular") {
+        return modeRegular();
+    }
+    if (mode == "pipelined") {
+        return modePipelined();
+    }
+    if (mode == "batch" && argc > 2) {
+        int threads = argc > 3 ? atoi(argv[3]) : (int) std::thread::hardware_concurrency();
+        return modeBatch(argv[2], threads > 0 ? threads : 1, argc > 4 ? argv[4] : "mmap");
+    }
+
+    if (mode == "preview" && argc > 3) {
+        return modePreview(argv[2], atoi(argv[3]));
+    }
+    if (mode == "region" && argc > 6) {
+        struct regionOfInterest region = {atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), atoi(argv[6])};
+        return modeRegion(argv[2], region);
+    }
+    if (mode == "view" && argc > 2) {
+        return displayProgressively(argv[2], argc > 3 ? atoi(argv[3]) : 0) ? 0 : EXIT_FAILURE;
+    }
+    if (mode == "sidecar" && argc > 2) {
+        return modeSidecar(argv[2]);
+    }
+    if (mode == "mpi" && argc > 2) {
+        // 0 shares the node's hardware threads among its ranks
+        return modeMPI(argv[2], argc > 3 ? std::max(atoi(argv[3]), 1) : 0);
+    }
+
+    printUsage();
+    return EXIT_FAILURE;
 }
\ No newline at end of file
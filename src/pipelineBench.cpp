@@ -0,0 +1,278 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/stat.h>
+
+#include "pipelineBench.h"
+#include "processImage.h"
+#include "readImage.h"
+#include "printUtils.h"
+#include "timer.h"
+
+const char *benchStageNames[BENCH_STAGE_COUNT] = {"read", "inflate", "defilter", "total"};
+
+// Stage labels used in timingResults.txt, in the order of benchStageNames.
+static const char *legacyStageLabels[BENCH_STAGE_COUNT] = {"Image reading:", "Image decompression:", "Image filtering:", "Image overall:"};
+
+static std::string baseName(const std::string &path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Nearest-rank percentile of sorted samples, 'fraction' in (0, 1].
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    size_t rank = (size_t) std::ceil(fraction * sorted.size());
+    return sorted[std::max(rank, (size_t) 1) - 1];
+}
+
+static void summarizeStage(struct stageResult &stage, size_t decodedBytes) {
+    std::vector<double> sorted = stage.samples;
+    std::sort(sorted.begin(), sorted.end());
+
+    size_t count = sorted.size();
+    stage.min = sorted[0];
+    stage.median = count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+    stage.p95 = percentile(sorted, 0.95);
+    stage.mbPerSecond = stage.median > 0 ? decodedBytes / stage.median / 1e6 : 0;
+}
+
+bool benchmarkImage(const std::string &filename, const struct benchOptions &options, struct imageBenchResult &result) {
+    struct stat fileStat;
+    bool savedPrintSummaries = printSummaries;
+
+    result.filename = filename;
+    result.fileBytes = stat(filename.c_str(), &fileStat) == 0 ? fileStat.st_size : 0;
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        result.stages[stage] = stageResult();
+    }
+
+    printSummaries = false;
+    for (int run = 0; run < options.warmup + options.iterations; run++) {
+        std::vector<unsigned char> compressedIDAT, decompressedIDAT, defilteredIDAT;
+        std::vector<restartPoint> restartPoints;
+        struct ihdr ihdrData;
+        double times[BENCH_STAGE_COUNT + 1];
+
+        GET_TIME(times[0]);
+        bool ok = readPNGImage(filename.c_str(), compressedIDAT, ihdrData, &restartPoints);
+        GET_TIME(times[1]);
+        ok = ok && decompressIDAT(compressedIDAT, restartPoints, ihdrData, decompressedIDAT);
+        GET_TIME(times[2]);
+        ok = ok && defilterIDAT(decompressedIDAT, defilteredIDAT, ihdrData, restartPoints);
+        GET_TIME(times[3]);
+
+        if (!ok) {
+            std::cerr << "Failed to decode " << filename << std::endl;
+            printSummaries = savedPrintSummaries;
+            return false;
+        }
+        if (run < options.warmup) {
+            continue;
+        }
+
+        for (int stage = 0; stage < BENCH_STAGE_COUNT - 1; stage++) {
+            result.stages[stage].samples.push_back(times[stage + 1] - times[stage]);
+        }
+        result.stages[BENCH_STAGE_COUNT - 1].samples.push_back(times[3] - times[0]);
+        result.decodedBytes = defilteredIDAT.size();
+    }
+    printSummaries = savedPrintSummaries;
+
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        summarizeStage(result.stages[stage], result.decodedBytes);
+    }
+    return true;
+}
+
+void printBenchResults(const std::vector<imageBenchResult> &results) {
+    std::ios::fmtflags savedFlags = std::cout.flags();
+    std::streamsize savedPrecision = std::cout.precision();
+
+    for (const imageBenchResult &result : results) {
+        std::cout << PRINT_DIVIDER_BIG << std::endl;
+        std::cout << result.filename << " (" << result.fileBytes / 1024 << " KiB file, " << result.decodedBytes / 1024 << " KiB decoded, "
+                  << result.stages[0].samples.size() << " iterations)" << std::endl;
+        std::cout << "\t" << std::left << std::setw(10) << "stage" << std::right << std::setw(12) << "median s" << std::setw(12) << "p95 s"
+                  << std::setw(12) << "min s" << std::setw(10) << "MB/s" << std::endl;
+
+        for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+            const stageResult &timing = result.stages[stage];
+            std::cout << "\t" << std::left << std::setw(10) << benchStageNames[stage] << std::right << std::fixed << std::setprecision(5)
+                      << std::setw(12) << timing.median << std::setw(12) << timing.p95 << std::setw(12) << timing.min
+                      << std::setprecision(1) << std::setw(10) << timing.mbPerSecond << std::endl;
+        }
+    }
+
+    std::cout.flags(savedFlags);
+    std::cout.precision(savedPrecision);
+}
+
+// Escapes the characters JSON does not allow inside a string.
+static std::string jsonString(const std::string &value) {
+    std::string escaped = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char) c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+bool writeBenchJSON(const char *path, const struct benchOptions &options, const std::vector<imageBenchResult> &results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    out << std::setprecision(9);
+    out << "{\n  \"warmup\": " << options.warmup << ",\n  \"iterations\": " << options.iterations << ",\n  \"images\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const imageBenchResult &result = results[i];
+        out << (i ? "," : "") << "\n    {\n      \"file\": " << jsonString(result.filename) << ",\n";
+        out << "      \"fileBytes\": " << result.fileBytes << ",\n      \"decodedBytes\": " << result.decodedBytes << ",\n";
+        out << "      \"stages\": {";
+        for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+            const stageResult &timing = result.stages[stage];
+            out << (stage ? "," : "") << "\n        \"" << benchStageNames[stage] << "\": {\"median\": " << timing.median << ", \"p95\": " << timing.p95
+                << ", \"min\": " << timing.min << ", \"mbPerSecond\": " << timing.mbPerSecond << ", \"samples\": [";
+            for (size_t sample = 0; sample < timing.samples.size(); sample++) {
+                out << (sample ? ", " : "") << timing.samples[sample];
+            }
+            out << "]}";
+        }
+        out << "\n      }\n    }";
+    }
+    out << "\n  ]\n}\n";
+
+    return out.good();
+}
+
+bool writeBenchCSV(const char *path, const std::vector<imageBenchResult> &results) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    out << std::setprecision(9);
+    out << "file,stage,fileBytes,decodedBytes,iterations,median,p95,min,mbPerSecond\n";
+    for (const imageBenchResult &result : results) {
+        for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+            const stageResult &timing = result.stages[stage];
+            out << result.filename << "," << benchStageNames[stage] << "," << result.fileBytes << "," << result.decodedBytes << ","
+                << timing.samples.size() << "," << timing.median << "," << timing.p95 << "," << timing.min << "," << timing.mbPerSecond << "\n";
+        }
+    }
+
+    return out.good();
+}
+
+// Replaces or adds the baseline for one image and stage, so later entries win.
+static void setBaseline(std::vector<baselineEntry> &baseline, const std::string &image, const std::string &stage, double seconds) {
+    for (baselineEntry &entry : baseline) {
+        if (entry.image == image && entry.stage == stage) {
+            entry.seconds = seconds;
+            return;
+        }
+    }
+    baseline.push_back({image, stage, seconds});
+}
+
+bool readBaseline(const char *path, std::vector<baselineEntry> &baseline) {
+    std::ifstream in(path);
+    std::string line, image;
+
+    if (!in) {
+        std::cerr << "Cannot read baseline " << path << std::endl;
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        // CSV from writeBenchCSV: file,stage,fileBytes,decodedBytes,iterations,median,...
+        std::vector<std::string> fields;
+        std::stringstream fieldStream(line);
+        std::string field;
+        while (std::getline(fieldStream, field, ',')) {
+            fields.push_back(field);
+        }
+        if (fields.size() >= 6 && fields[0] != "file") {
+            setBaseline(baseline, baseName(fields[0]), fields[1], atof(fields[5].c_str()));
+            continue;
+        }
+
+        // timingResults.txt: an "image: <name>" line followed by "<label> <times> | Avg: <seconds> s"
+        size_t imagePos = line.find("image:");
+        if (imagePos != std::string::npos) {
+            std::stringstream nameStream(line.substr(imagePos + 6));
+            nameStream >> image;
+            continue;
+        }
+        size_t avgPos = line.find("Avg:");
+        if (avgPos == std::string::npos || image.empty()) {
+            continue;
+        }
+        for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+            if (line.find(legacyStageLabels[stage]) != std::string::npos) {
+                setBaseline(baseline, image, benchStageNames[stage], atof(line.c_str() + avgPos + 4));
+            }
+        }
+    }
+
+    if (baseline.empty()) {
+        std::cerr << "No timings found in baseline " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int compareToBaseline(const std::vector<imageBenchResult> &results, const std::vector<baselineEntry> &baseline, double threshold) {
+    std::ios::fmtflags savedFlags = std::cout.flags();
+    std::streamsize savedPrecision = std::cout.precision();
+    int regressions = 0, compared = 0;
+
+    std::cout << PRINT_DIVIDER_BIG << std::endl;
+    std::cout << "Comparison against baseline (regression above +" << threshold * 100 << "%)" << std::endl;
+
+    for (const imageBenchResult &result : results) {
+        std::string image = baseName(result.filename);
+        for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+            for (const baselineEntry &entry : baseline) {
+                if (entry.image != image || entry.stage != benchStageNames[stage] || entry.seconds <= 0) {
+                    continue;
+                }
+                double change = result.stages[stage].median / entry.seconds - 1;
+                bool regressed = change > threshold;
+                regressions += regressed;
+                compared++;
+
+                std::cout << "\t" << std::left << std::setw(30) << image << std::setw(10) << benchStageNames[stage] << std::right << std::fixed
+                          << std::setprecision(5) << entry.seconds << " s -> " << result.stages[stage].median << " s  " << std::showpos
+                          << std::setprecision(1) << change * 100 << "%" << std::noshowpos << (regressed ? "  REGRESSION" : "") << std::endl;
+            }
+        }
+    }
+
+    std::cout.flags(savedFlags);
+    std::cout.precision(savedPrecision);
+    if (compared == 0) {
+        std::cout << "\tNo images in common with the baseline" << std::endl;
+    } else {
+        std::cout << PRINT_DIVIDER << std::endl;
+        std::cout << "\t" << regressions << " of " << compared << " stage timings regressed" << std::endl;
+    }
+    return regressions;
+}
@@ -0,0 +1,73 @@
+#ifndef _PIPELINE_BENCH_H_
+#define _PIPELINE_BENCH_H_
+
+#include <string>
+#include <vector>
+
+// Stages timed for every image, in pipeline order. "total" covers read through defilter.
+#define BENCH_STAGE_COUNT 4
+extern const char *benchStageNames[BENCH_STAGE_COUNT];
+
+// A stage whose median is this much slower than the baseline is reported as a regression.
+#define BENCH_REGRESSION_THRESHOLD 0.10
+
+struct benchOptions {
+    // untimed runs before the timed ones, to warm the page cache and allocator
+    int warmup = 1;
+    int iterations = 7;
+};
+
+struct stageResult {
+    std::vector<double> samples;
+    double median = 0;
+    double p95 = 0;
+    double min = 0;
+    // decoded image bytes divided by the median time, so the stages can be compared directly
+    double mbPerSecond = 0;
+};
+
+struct imageBenchResult {
+    std::string filename;
+    size_t fileBytes = 0;
+    size_t decodedBytes = 0;
+    struct stageResult stages[BENCH_STAGE_COUNT];
+};
+
+// One baseline timing, from a CSV written by writeBenchCSV or from timingResults.txt.
+struct baselineEntry {
+    std::string image;
+    std::string stage;
+    double seconds;
+};
+
+/**
+ * Decodes 'filename' options.warmup + options.iterations times through the regular pipeline
+ * (readPNGImage, decompressIDAT, defilterIDAT, using the yiDX index when present) and records
+ * the time of each stage. Decoder summaries are switched off so no printing is timed.
+ *
+ * @return false if the image does not decode.
+*/
+bool benchmarkImage(const std::string &filename, const struct benchOptions &options, struct imageBenchResult &result);
+
+void printBenchResults(const std::vector<imageBenchResult> &results);
+
+bool writeBenchJSON(const char *path, const struct benchOptions &options, const std::vector<imageBenchResult> &results);
+
+bool writeBenchCSV(const char *path, const std::vector<imageBenchResult> &results);
+
+/**
+ * Reads baseline timings. Accepts the CSV written by writeBenchCSV (median seconds are used) or
+ * the hand-kept timingResults.txt format, where the "Avg" of the last section for each image wins.
+ * Images are matched by file name without the directory.
+*/
+bool readBaseline(const char *path, std::vector<baselineEntry> &baseline);
+
+/**
+ * Prints every stage that has a baseline next to its current median, marking the ones slower
+ * than the baseline by more than 'threshold' (a fraction, e.g. 0.1 for 10%).
+ *
+ * @return the number of regressions.
+*/
+int compareToBaseline(const std::vector<imageBenchResult> &results, const std::vector<baselineEntry> &baseline, double threshold);
+
+#endif
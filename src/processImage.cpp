@@ -3,25 +3,65 @@
 #include <iostream>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <future>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <omp.h>
 
 #include "processImage.h"
 #include "printUtils.h"
+#include "defilterKernels.h"
+#include "trace.h"
+#include "adam7.h"
+#include "expandKernels.h"
+#include "inflateEngine.h"
+#include "scanlineRing.h"
 
+static const char *filterNames[5] = {"None", "Sub", "Up", "Average", "Paeth"};
+
+// Number of rows using each filter type, indexed by the filter byte.
 struct FilterCounts {
-    int none = 0;
-    int sub = 0;
-    int up = 0;
-    int average = 0;
-    int paeth = 0;
+    long rows[5] = {0, 0, 0, 0, 0};
 };
 
-bool decompressIDAT(const std::vector<unsigned char>& compressedData, std::vector<unsigned char> &decompressedData) {
+// Points the stream at the next non-empty IDAT span once its current input is used up.
+static void feedIDATSpans(z_stream &stream, const unsigned char *base, const std::vector<idatSpan> &spans, size_t &nextSpan) {
+    while (stream.avail_in == 0 && nextSpan < spans.size()) {
+        stream.next_in = const_cast<unsigned char*>(base + spans[nextSpan].offset);
+        stream.avail_in = spans[nextSpan].length;
+        nextSpan++;
+    }
+}
+
+/**
+ * With verifyChunkCRCs set, starts checking the CRCs of the IDAT chunks behind 'spans' on a thread
+ * of its own, so the check runs through the chunks in file order while the caller inflates the
+ * earlier ones. The result is not valid otherwise. Its destructor waits for the check, so the
+ * spans must outlive it.
+*/
+static std::future<bool> startIDATCheck(const unsigned char *base, const std::vector<idatSpan> &spans) {
+    if (!verifyChunkCRCs) {
+        return std::future<bool>();
+    }
+    return std::async(std::launch::async, verifyIDATSpans, base, std::cref(spans));
+}
+
+static bool passedIDATCheck(std::future<bool> &check) {
+    return !check.valid() || check.get();
+}
+
+// decompressIDAT over spans without the CRC check, for spans that are not an image's IDAT chunks.
+static bool inflateSpans(const unsigned char *base, const std::vector<idatSpan> &spans, std::vector<unsigned char> &decompressedData, size_t maxBytes = (size_t) -1) {
+    TRACE_SCOPE("inflate");
+    size_t nextSpan = 0;
     z_stream stream;
     stream.zalloc = Z_NULL;
     stream.zfree = Z_NULL;
     stream.opaque = Z_NULL;
-    stream.avail_in = compressedData.size();
-    stream.next_in = const_cast<unsigned char*>(compressedData.data());
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
 
     // Set up the inflate stream
     if (inflateInit(&stream) != Z_OK) {
@@ -35,6 +75,7 @@ bool decompressIDAT(const std::vector<unsigned char>& compressedData, std::vecto
     // Decompress IDAT data
     int ret;
     do {
+        feedIDATSpans(stream, base, spans, nextSpan);
         stream.avail_out = buffer.size();
         stream.next_out = buffer.data();
         ret = inflate(&stream, Z_NO_FLUSH);
@@ -48,135 +89,1059 @@ bool decompressIDAT(const std::vector<unsigned char>& compressedData, std::vecto
         decompressedData.insert(decompressedData.end(), buffer.begin(), buffer.end() - stream.avail_out);
         buffer.clear();
         buffer.resize(4096);
-    } while (ret != Z_STREAM_END);
+    } while (ret != Z_STREAM_END && decompressedData.size() < maxBytes);
 
     // Clean up and return result
     inflateEnd(&stream);
 
-    printDecompressSummary(compressedData.size(), decompressedData.size());
+    printDecompressSummary(stream.total_in, decompressedData.size());
+
+    return true;
+}
+
+bool decompressIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, std::vector<unsigned char> &decompressedData, size_t maxBytes) {
+    std::future<bool> check = startIDATCheck(base, spans);
+    bool inflated = inflateSpans(base, spans, decompressedData, maxBytes);
+    return passedIDATCheck(check) && inflated;
+}
+
+/**
+ * Inflates what is left of the stream after the last row of the image, which must be nothing but
+ * the end of the deflate data and the adler32 trailer; zlib checks the trailer on reaching
+ * Z_STREAM_END.
+*/
+static bool finishStream(z_stream &stream, const unsigned char *base, const std::vector<idatSpan> &spans, size_t &nextSpan, int ret) {
+    unsigned char extra;
+    while (ret != Z_STREAM_END) {
+        feedIDATSpans(stream, base, spans, nextSpan);
+        stream.next_out = &extra;
+        stream.avail_out = 1;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (stream.avail_out == 0) {
+            std::cerr << "IDAT data continues past the last row" << std::endl;
+            return false;
+        }
+        if (ret == Z_BUF_ERROR && stream.avail_in == 0) {
+            std::cerr << "IDAT data truncated before the end of the stream" << std::endl;
+            return false;
+        }
+        if (ret < 0 && ret != Z_BUF_ERROR) {
+            std::cerr << "Error decompressing IDAT data, ret status: " << ret << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool decompressIDAT(z_stream &stream, const unsigned char *base, const std::vector<idatSpan> &spans, unsigned char *out, size_t outSize) {
+    TRACE_SCOPE("inflate");
+    size_t nextSpan = 0;
+    std::future<bool> check = startIDATCheck(base, spans);
+
+    if (useBuiltinInflate) {
+        size_t produced = 0;
+        if (builtinInflate(base, spans, out, outSize, produced) && produced == outSize) {
+            return passedIDATCheck(check);
+        }
+        std::cerr << "Built-in inflate failed, retrying with zlib" << std::endl;
+    }
+
+    if (inflateReset(&stream) != Z_OK) {
+        std::cerr << "Error resetting zlib inflate stream" << std::endl;
+        return false;
+    }
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+    stream.next_out = out;
+
+    // avail_out is a uInt, so very large images are inflated in pieces
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END && (size_t) (stream.next_out - out) < outSize) {
+        feedIDATSpans(stream, base, spans, nextSpan);
+        size_t remaining = outSize - (stream.next_out - out);
+        stream.avail_out = (uInt) std::min(remaining, (size_t) 1 << 30);
+        ret = inflate(&stream, Z_NO_FLUSH);
+
+        if (ret < 0 && ret != Z_BUF_ERROR) {
+            std::cerr << "Error decompressing IDAT data, ret status: " << ret << std::endl;
+            return false;
+        }
+        // no progress possible: the input has run out
+        if (ret == Z_BUF_ERROR && stream.avail_in == 0 && nextSpan == spans.size()) {
+            break;
+        }
+    }
+
+    if ((size_t) (stream.next_out - out) < outSize) {
+        std::cerr << "IDAT data ended after " << stream.next_out - out << " of " << outSize << " bytes" << std::endl;
+        return false;
+    }
+    // the image is complete, but only the end of the stream proves it intact
+    if (!finishStream(stream, base, spans, nextSpan, ret)) {
+        return false;
+    }
+    return passedIDATCheck(check);
+}
+
+bool decompressIDAT(const std::vector<unsigned char>& compressedData, std::vector<unsigned char> &decompressedData) {
+    std::vector<idatSpan> spans(1, {0, compressedData.size()});
+    return inflateSpans(compressedData.data(), spans, decompressedData);
+}
+
+// Returns the pieces of 'spans' covering bytes [begin, end) of the concatenated IDAT data.
+static std::vector<idatSpan> sliceIDATSpans(const std::vector<idatSpan> &spans, size_t begin, size_t end) {
+    std::vector<idatSpan> slice;
+    size_t spanStart = 0;
+
+    for (const idatSpan &span : spans) {
+        size_t spanEnd = spanStart + span.length;
+        size_t from = std::max(begin, spanStart), to = std::min(end, spanEnd);
+        if (from < to) {
+            slice.push_back({span.offset + (from - spanStart), to - from});
+        }
+        spanStart = spanEnd;
+    }
+    return slice;
+}
+
+/**
+ * Raw-inflates one restart segment into 'out', which must receive exactly 'outSize' bytes.
+ * The last segment ends with the final deflate block; its adler32 trailer follows in the input
+ * and is returned through 'trailer'.
+*/
+static bool inflateRestartSegment(const unsigned char *base, const std::vector<idatSpan> &segmentSpans, unsigned char *out, size_t outSize, bool lastSegment, uLong &trailer) {
+    TRACE_SCOPE_ARG("inflateSegment", "bytes", (long) outSize);
+    size_t nextSpan = 0;
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+
+    // negative window bits: raw deflate data, no zlib header or trailer
+    if (inflateInit2(&stream, -15) != Z_OK) {
+        return false;
+    }
+
+    stream.next_out = out;
+    stream.avail_out = outSize;
+
+    int ret = Z_OK;
+    while (stream.avail_out > 0 && ret != Z_STREAM_END) {
+        feedIDATSpans(stream, base, segmentSpans, nextSpan);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret < 0) {
+            inflateEnd(&stream);
+            return false;
+        }
+    }
+
+    if (stream.avail_out != 0 || (lastSegment && ret != Z_STREAM_END)) {
+        inflateEnd(&stream);
+        return false;
+    }
+
+    if (lastSegment) {
+        // the 4 byte adler32 may itself straddle IDAT chunks
+        unsigned char trailerBytes[4];
+        for (int i = 0; i < 4; i++) {
+            feedIDATSpans(stream, base, segmentSpans, nextSpan);
+            if (stream.avail_in == 0) {
+                inflateEnd(&stream);
+                return false;
+            }
+            trailerBytes[i] = *stream.next_in++;
+            stream.avail_in--;
+        }
+        trailer = ((uLong) trailerBytes[0] << 24) | ((uLong) trailerBytes[1] << 16) | ((uLong) trailerBytes[2] << 8) | trailerBytes[3];
+    }
+
+    inflateEnd(&stream);
+    return true;
+}
+
+/**
+ * Inflates with the built-in engine straight into 'decompressedData', sized once for 'capacity'
+ * bytes and trimmed to what the data holds. Data the engine rejects is inflated again with zlib.
+*/
+static bool inflateSpansInPlace(const unsigned char *base, const std::vector<idatSpan> &spans, size_t capacity, std::vector<unsigned char> &decompressedData) {
+    size_t compressedSize = 0, produced = 0;
+    for (const idatSpan &span : spans) {
+        compressedSize += span.length;
+    }
+
+    decompressedData.resize(capacity);
+    if (!builtinInflate(base, spans, decompressedData.data(), capacity, produced)) {
+        std::cerr << "Built-in inflate failed, retrying with zlib" << std::endl;
+        decompressedData.clear();
+        return inflateSpans(base, spans, decompressedData);
+    }
+    decompressedData.resize(produced);
+
+    printDecompressSummary(compressedSize, produced);
 
     return true;
 }
 
+// decompressIDAT with a restart index, without the CRC check.
+static bool inflateIndexedSpans(const unsigned char *base, const std::vector<idatSpan> &spans, const std::vector<restartPoint> &restartPoints, const struct ihdr &ihdrData, std::vector<unsigned char> &decompressedData) {
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    int height = ihdrData.height;
+    size_t compressedSize = 0;
+
+    for (const idatSpan &span : spans) {
+        compressedSize += span.length;
+    }
+
+    size_t colWidth = bitsPerPixel == -1 ? 0 : getRowBytes(ihdrData.width, bitsPerPixel) + 1;
+
+    // Without a usable index (or with only one segment) there is nothing to parallelise. The
+    // restart index describes rows of a non-interlaced image, so it is ignored for Adam7 ones.
+    if (bitsPerPixel == -1 || ihdrData.interlaceMethod != 0 || restartPoints.size() < 2 || restartPoints.back().offset >= compressedSize) {
+        if (bitsPerPixel == -1 || !useBuiltinInflate) {
+            return inflateSpans(base, spans, decompressedData);
+        }
+        return inflateSpansInPlace(base, spans, getInflatedSize(ihdrData), decompressedData);
+    }
+
+    int segmentCount = restartPoints.size();
+    std::vector<uLong> segmentAdler(segmentCount);
+    uLong trailer = 0;
+    bool failed = false;
+
+    decompressedData.resize(colWidth * height);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int segment = 0; segment < segmentCount; segment++) {
+        bool lastSegment = segment == segmentCount - 1;
+        size_t begin = restartPoints[segment].offset;
+        size_t end = lastSegment ? compressedSize : restartPoints[segment + 1].offset;
+        int firstRow = restartPoints[segment].firstRow;
+        int endRow = lastSegment ? height : restartPoints[segment + 1].firstRow;
+        unsigned char *out = decompressedData.data() + firstRow * colWidth;
+        size_t outSize = (endRow - firstRow) * colWidth;
+
+        if (!inflateRestartSegment(base, sliceIDATSpans(spans, begin, end), out, outSize, lastSegment, trailer)) {
+            #pragma omp atomic write
+            failed = true;
+            continue;
+        }
+        segmentAdler[segment] = adler32_z(adler32(0L, Z_NULL, 0), out, outSize);
+    }
+
+    // The segments together must reproduce the zlib stream's checksum.
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (int segment = 0; segment < segmentCount && !failed; segment++) {
+        int endRow = segment == segmentCount - 1 ? height : restartPoints[segment + 1].firstRow;
+        adler = adler32_combine(adler, segmentAdler[segment], (endRow - restartPoints[segment].firstRow) * colWidth);
+    }
+
+    if (failed || adler != trailer) {
+        std::cerr << "yiDX restart index does not match the IDAT data, falling back to serial inflate" << std::endl;
+        decompressedData.clear();
+        return inflateSpans(base, spans, decompressedData);
+    }
+
+    printDecompressSummary(compressedSize, decompressedData.size());
+
+    return true;
+}
+
+bool decompressIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, const std::vector<restartPoint> &restartPoints, const struct ihdr &ihdrData, std::vector<unsigned char> &decompressedData) {
+    std::future<bool> check = startIDATCheck(base, spans);
+    bool inflated = inflateIndexedSpans(base, spans, restartPoints, ihdrData, decompressedData);
+    return passedIDATCheck(check) && inflated;
+}
+
+bool decompressIDAT(const std::vector<unsigned char>& compressedData, const std::vector<restartPoint> &restartPoints, const struct ihdr &ihdrData, std::vector<unsigned char> &decompressedData) {
+    std::vector<idatSpan> spans(1, {0, compressedData.size()});
+    return inflateIndexedSpans(compressedData.data(), spans, restartPoints, ihdrData, decompressedData);
+}
+
 void printDecompressSummary(int compressedSize, int decompressedSize) {
+    if (!printSummaries) {
+        return;
+    }
+
     std::cout << PRINT_DIVIDER_BIG << std::endl;
     std::cout << "Decompression summary:" << std::endl;
     std::cout << "\tCompressed len: " << compressedSize << std::endl;
     std::cout << "\tDecompressed len: " << decompressedSize << std::endl;
 }
 
-unsigned char paethPredictor(unsigned char left, unsigned char up, unsigned char leftUp) {
-    int p, pa, pb, pc;
-    p = left + up - leftUp;
-    pa = abs(p - left);
-    pb = abs(p - up);
-    pc = abs(p - leftUp);
-    if (pa <= pb && pa <= pc) {
-        return left;
-    } else if (pb <= pc) {
-        return up;
-    } else {
-        return leftUp;
+/**
+ * Defilters rows [firstRow, endRow) into rows 'outStride' bytes apart. Row firstRow - 1 must
+ * already be defiltered unless firstRow is 0.
+ *
+ * With an expander each row is defiltered into a two row ring of the image's own format and
+ * written out in the expander's format right away, 'width' pixels per row. The raw row above is
+ * then only known within the call, so firstRow must be 0 or a row filtered with None or Sub.
+ *
+ * @return -1 on success, otherwise the index of the row with an invalid filter type.
+*/
+static int defilterRows(const unsigned char *filteredData, unsigned char *defilteredData, size_t outStride, int firstRow, int endRow, int rowBytes, int bytesPerPixel, const RowDecoderTable &rowDecoders,
+                        struct FilterCounts &filterCounts, const struct rowExpander *expander = NULL, int width = 0) {
+    TRACE_SCOPE_ARG("defilterRows", "rows", endRow - firstRow);
+    struct FilterCounts bandCounts;
+    int colWidth = rowBytes + 1;
+    const unsigned char *prevRow = firstRow == 0 ? NULL : defilteredData + (size_t) (firstRow - 1) * outStride;
+
+    // kept per thread so repeated decodes reuse it instead of allocating
+    static thread_local std::vector<unsigned char> ring;
+    unsigned char *scratch = NULL;
+    if (expander != NULL) {
+        // the current raw row and the one above it, then an RGBA8 row for two step conversions;
+        // the zeroed row stands in above a chain start
+        ring.assign((size_t) rowBytes * 2 + (size_t) width * DECODED_BYTES_PER_PIXEL, 0);
+        prevRow = firstRow == 0 ? NULL : ring.data() + rowBytes;
+        scratch = ring.data() + (size_t) rowBytes * 2;
     }
+
+    for (int lineIndex = firstRow; lineIndex < endRow; lineIndex++) {
+        const unsigned char *filteredRow = filteredData + (size_t) lineIndex * colWidth;
+        unsigned char *defilteredRow = defilteredData + (size_t) lineIndex * outStride;
+
+        int filter = filteredRow[0]; // get the filter which is located in the first byte of each line
+
+        if (filter > 4) {
+            return lineIndex;
+        }
+
+        if (expander != NULL) {
+            // alternate between the two halves of the ring
+            defilteredRow = ring.data() + ((lineIndex - firstRow) & 1) * rowBytes;
+        }
+
+        // the first row has no row above it, so it gets its own decoders
+        DefilterRowFn defilterRow = lineIndex == 0 ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+
+        // apply filter to current line. we skip the first byte
+        // since it is occupied by the filter data.
+        defilterRow(defilteredRow, filteredRow + 1, prevRow, rowBytes, bytesPerPixel);
+        prevRow = defilteredRow;
+        bandCounts.rows[filter]++;
+
+        if (expander != NULL) {
+            expandRow(*expander, defilteredData + (size_t) lineIndex * outStride, defilteredRow, width, scratch);
+        }
+    }
+
+    TRACE_COUNTERS("filterRows", filterNames, bandCounts.rows, 5);
+    for (int filter = 0; filter < 5; filter++) {
+        filterCounts.rows[filter] += bandCounts.rows[filter];
+    }
+    return -1;
 }
 
-bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int height, int colorType, int channelDepth) {
-    int bytesPerPixel, colWidth;
-    int filter;
-    int currByteIndex;
-    int defilteredCurr, defilteredCurrIndex, defilteredLeft, defilteredUp, defilteredLeftUp;
+// Smallest column block of the wavefront; rows are cut into at most WAVEFRONT_MAX_BLOCKS blocks.
+#define WAVEFRONT_MIN_BLOCK_BYTES 512
+#define WAVEFRONT_MAX_BLOCKS 64
+
+// Images smaller than this are defiltered serially; the threads would cost more than they save.
+#define WAVEFRONT_MIN_IMAGE_BYTES (256 * 1024)
+
+static inline int paethPredictor(int left, int up, int leftUp) {
+    int p = left + up - leftUp;
+    int pa = abs(p - left), pb = abs(p - up), pc = abs(p - leftUp);
+    return (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : leftUp);
+}
+
+/**
+ * Defilters bytes [begin, end) of one row with the whole-row kernel, as if the row started at
+ * 'begin'. The kernel takes the pixel left of the start (and above left of it) to be zero, so the
+ * block's input is copied to 'out' and its first pixel rewritten to give the right bytes with
+ * that prediction, then defiltered in place.
+*/
+static void defilterRowBlock(DefilterRowFn defilterRow, int filter, unsigned char *out, const unsigned char *in, const unsigned char *prev, int begin, int end, int bytesPerPixel) {
+    if (begin == 0) {
+        defilterRow(out, in, prev, end, bytesPerPixel);
+        return;
+    }
+
+    if (out != in) {
+        std::memcpy(out + begin, in + begin, end - begin);
+    }
+    for (int i = begin; i < begin + bytesPerPixel; i++) {
+        int left = out[i - bytesPerPixel];
+        int up = prev == NULL ? 0 : prev[i];
+        int leftUp = prev == NULL ? 0 : prev[i - bytesPerPixel];
+        int actual = 0, assumed = 0;
+        switch (filter) {
+            case 1:
+                actual = left;
+                break;
+            case 2:
+                actual = assumed = up;
+                break;
+            case 3:
+                actual = (left + up) >> 1;
+                assumed = up >> 1;
+                break;
+            case 4:
+                actual = paethPredictor(left, up, leftUp);
+                assumed = up;
+                break;
+        }
+        out[i] = in[i] + actual - assumed;
+    }
+    defilterRow(out + begin, out + begin, prev == NULL ? NULL : prev + begin, end - begin, bytesPerPixel);
+}
+
+/**
+ * Defilters all rows in parallel (OpenMP) as a wavefront. Rows are handed out in order and each
+ * is defiltered in column blocks, publishing how many blocks it has finished. Row 0 and rows
+ * filtered with None or Sub go straight through; an Up, Average or Paeth row waits before each
+ * block only until the row above has finished that block, which holds the bytes above and above
+ * left of it. Filter types must already have been checked.
+*/
+static void defilterWavefront(const unsigned char *filteredData, unsigned char *defilteredData, size_t outStride, int height, int rowBytes, int bytesPerPixel, const RowDecoderTable &rowDecoders, int threads) {
+    TRACE_SCOPE_ARG("defilterWavefront", "rows", height);
+    int colWidth = rowBytes + 1;
+    int blockBytes = std::max(WAVEFRONT_MIN_BLOCK_BYTES, (rowBytes + WAVEFRONT_MAX_BLOCKS - 1) / WAVEFRONT_MAX_BLOCKS);
+    blockBytes = (blockBytes + bytesPerPixel - 1) / bytesPerPixel * bytesPerPixel;
+    int blockCount = (rowBytes + blockBytes - 1) / blockBytes;
+
+    std::unique_ptr<std::atomic<int>[]> blocksDone(new std::atomic<int>[height]);
+    for (int row = 0; row < height; row++) {
+        blocksDone[row].store(0, std::memory_order_relaxed);
+    }
+
+    // schedule(dynamic, 1) hands rows out in order, so the row waited on has always been taken
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (int lineIndex = 0; lineIndex < height; lineIndex++) {
+        const unsigned char *filteredRow = filteredData + (size_t) lineIndex * colWidth;
+        unsigned char *defilteredRow = defilteredData + (size_t) lineIndex * outStride;
+        const unsigned char *prevRow = lineIndex == 0 ? NULL : defilteredRow - outStride;
+        int filter = filteredRow[0];
+        DefilterRowFn defilterRow = lineIndex == 0 ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+        bool dependent = lineIndex > 0 && filter >= 2;
+
+        for (int block = 0; block < blockCount; block++) {
+            if (dependent) {
+                for (int spins = 0; blocksDone[lineIndex - 1].load(std::memory_order_acquire) <= block; spins++) {
+                    if (spins >= 64) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+            int begin = block * blockBytes;
+            defilterRowBlock(defilterRow, filter, defilteredRow, filteredRow + 1, prevRow, begin, std::min(begin + blockBytes, rowBytes), bytesPerPixel);
+            blocksDone[lineIndex].store(block + 1, std::memory_order_release);
+        }
+    }
+}
+
+/**
+ * Shared body of the defilterIDAT overloads: defilters 'height' rows of 'rowBytes' bytes into
+ * rows 'outStride' bytes apart, in parallel over the independent chains of the restart index,
+ * converting them if 'expander' is set. Without an index, unconverted rows are defiltered as a
+ * wavefront (defilterWavefront) instead. Both stay on the calling thread when 'threads' is 1 or
+ * the caller is already inside a parallel region.
+*/
+static bool defilterImage(const std::vector<unsigned char> &decompressedData, unsigned char *defilteredData, size_t outStride, int width, int height, int rowBytes, int bytesPerPixel, const std::vector<restartPoint> &restartPoints,
+                          const struct rowExpander *expander, int threads) {
+    TRACE_SCOPE("defilterIDAT");
     struct FilterCounts filterCounts;
+    const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+
+    // each line is occupied by pixel data + 1 byte for the filter
+    int colWidth = rowBytes + 1;
+
+    if (decompressedData.size() < (size_t) colWidth * height) {
+        std::cerr << "Decompressed data too short for a " << width << " x " << height << " image" << std::endl;
+        return false;
+    }
+
+    // A segment can start on its own if its first row does not look at the row above
+    // (None or Sub). Dependent segments are chained onto the independent one before them.
+    std::vector<int> chainRows(1, 0);
+    for (size_t i = 1; i < restartPoints.size(); i++) {
+        int filter = decompressedData[(size_t) restartPoints[i].firstRow * colWidth];
+        if (filter == 0 || filter == 1) {
+            chainRows.push_back(restartPoints[i].firstRow);
+        }
+    }
+    chainRows.push_back(height);
+
+    int chainCount = chainRows.size() - 1;
+    int badRow = -1;
+    threads = threads > 0 ? threads : omp_get_max_threads();
+    bool parallel = threads > 1 && !omp_in_parallel();
+
+    // With no index to split on, rows kept in the image's own format are defiltered as a wavefront.
+    if (chainCount == 1 && expander == NULL && height > 1 && parallel && (size_t) colWidth * height >= WAVEFRONT_MIN_IMAGE_BYTES) {
+        for (int lineIndex = 0; lineIndex < height; lineIndex++) {
+            int filter = decompressedData[(size_t) lineIndex * colWidth];
+            if (filter > 4) {
+                printGetFilterErr(filter, lineIndex, colWidth, decompressedData);
+                exit(-1);
+            }
+            filterCounts.rows[filter]++;
+        }
+        defilterWavefront(decompressedData.data(), defilteredData, outStride, height, rowBytes, bytesPerPixel, rowDecoders, threads);
+        printFilterSummary(filterCounts);
+        return true;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (chainCount > 1 && parallel)
+    for (int chain = 0; chain < chainCount; chain++) {
+        struct FilterCounts chainCounts;
+        int chainBadRow = defilterRows(decompressedData.data(), defilteredData, outStride, chainRows[chain], chainRows[chain + 1], rowBytes, bytesPerPixel, rowDecoders, chainCounts, expander, width);
+
+        #pragma omp critical
+        {
+            if (chainBadRow != -1 && (badRow == -1 || chainBadRow < badRow)) {
+                badRow = chainBadRow;
+            }
+            for (int filter = 0; filter < 5; filter++) {
+                filterCounts.rows[filter] += chainCounts.rows[filter];
+            }
+        }
+    }
+
+    if (badRow != -1) {
+        printGetFilterErr(decompressedData[(size_t) badRow * colWidth], badRow, colWidth, decompressedData);
+        exit(-1);
+    }
+
+    printFilterSummary(filterCounts);
+
+    return true;
+}
+
+bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int height, int colorType, int channelDepth) {
+    std::vector<restartPoint> noRestartPoints;
+    return defilterIDAT(decompressedData, defilteredData, width, height, colorType, channelDepth, noRestartPoints);
+}
+
+bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int height, int colorType, int channelDepth, const std::vector<restartPoint> &restartPoints) {
+    int bytesPerPixel;
 
     if ((bytesPerPixel = getBytesPerPixel(colorType, channelDepth)) == -1) {
         return false;
     }
+    int rowBytes = width * bytesPerPixel;
+    // The output discards the filter byte at the start of each line.
+    defilteredData.resize((size_t) rowBytes * height);
+    return defilterImage(decompressedData, defilteredData.data(), rowBytes, width, height, rowBytes, bytesPerPixel, restartPoints, NULL, 0);
+}
 
-    // each line is occupied by pixel data + 1 byte for the filter
-    colWidth = width * bytesPerPixel + 1;
+bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, const struct ihdr &ihdrData, const std::vector<restartPoint> &restartPoints, int threads) {
+    defilteredData.resize((size_t) ihdrData.width * ihdrData.height * DECODED_BYTES_PER_PIXEL);
+    struct outputDescriptor output = {defilteredData.data(), (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL, PIXEL_RGBA8};
+    return defilterIDAT(decompressedData, ihdrData, restartPoints, output, threads);
+}
+
+bool defilterIDAT(const std::vector<unsigned char> &decompressedData, const struct ihdr &ihdrData, const std::vector<restartPoint> &restartPoints, const struct outputDescriptor &output, int threads) {
+    if (ihdrData.interlaceMethod == 1) {
+        return defilterAdam7(decompressedData.data(), decompressedData.size(), output, ihdrData, ADAM7_PASSES, threads);
+    }
 
-    // Reserve the output vector. We subtract 'height' to account for  
-    // discarding the filter byte at the start of each line.
-    defilteredData.reserve(colWidth * height - height);
+    struct rowExpander expander;
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bitsPerPixel == -1 || !buildRowExpander(ihdrData, expander, output.format)) {
+        std::cerr << "Unsupported color type " << ihdrData.colorType << " with bit depth " << ihdrData.channelDepth << std::endl;
+        return false;
+    }
+
+    // sub-byte pixels are filtered byte by byte
+    int bytesPerPixel = std::max(bitsPerPixel / 8, 1);
+    int rowBytes = getRowBytes(ihdrData.width, bitsPerPixel);
+    return defilterImage(decompressedData, output.pixels, output.stride, ihdrData.width, ihdrData.height, rowBytes, bytesPerPixel, restartPoints, getActiveExpander(expander), threads);
+}
+
+bool defilterSubImage(const unsigned char *filteredData, unsigned char *defilteredData, int width, int height, int bitsPerPixel, const struct rowExpander *expander, size_t outStride) {
+    struct FilterCounts filterCounts;
+    int bytesPerPixel = std::max(bitsPerPixel / 8, 1);
+    int rowBytes = getRowBytes(width, bitsPerPixel);
+    if (outStride == 0) {
+        outStride = expander != NULL ? (size_t) width * expander->outBytesPerPixel : rowBytes;
+    }
+
+    int badRow = defilterRows(filteredData, defilteredData, outStride, 0, height, rowBytes, bytesPerPixel, getRowDecoderTable(bytesPerPixel), filterCounts, expander, width);
+    if (badRow != -1) {
+        std::cerr << "Error: invalid row filter '" << (int) filteredData[(size_t) badRow * (rowBytes + 1)] << "' at row " << badRow << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool defilterRegion(const unsigned char *filteredData, const struct ihdr &ihdrData, const struct regionOfInterest &region, const struct outputDescriptor &output) {
+    TRACE_SCOPE_ARG("defilterRegion", "rows", region.y + region.height);
+    struct rowExpander expander;
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bitsPerPixel == -1 || !buildRowExpander(ihdrData, expander, output.format)) {
+        std::cerr << "Unsupported color type " << ihdrData.colorType << " with bit depth " << ihdrData.channelDepth << std::endl;
+        return false;
+    }
+
+    int bytesPerPixel = std::max(bitsPerPixel / 8, 1);
+    int rowBytes = getRowBytes(ihdrData.width, bitsPerPixel);
+    int colWidth = rowBytes + 1;
+    const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+    const struct rowExpander *active = getActiveExpander(expander);
+    size_t outBytes = (size_t) region.width * expander.outBytesPerPixel;
+
+    // two raw rows, an RGBA8 scratch row and, for sub-byte formats whose crop may start inside a
+    // byte, one whole converted row to crop from
+    std::vector<unsigned char> ring((size_t) rowBytes * 2 + (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL * 2);
+    unsigned char *scratch = ring.data() + (size_t) rowBytes * 2;
+    unsigned char *wholeRow = scratch + (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL;
+    const unsigned char *prevRow = NULL;
+
+    int endRow = region.y + region.height;
+    for (int lineIndex = 0; lineIndex < endRow; lineIndex++) {
+        const unsigned char *filteredRow = filteredData + (size_t) lineIndex * colWidth;
+        unsigned char *defilteredRow = ring.data() + (lineIndex & 1) * rowBytes;
+        int filter = filteredRow[0];
+
+        if (filter > 4) {
+            std::cerr << "Error: invalid row filter '" << filter << "' at row " << lineIndex << std::endl;
+            return false;
+        }
+        DefilterRowFn defilterRow = lineIndex == 0 ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+        defilterRow(defilteredRow, filteredRow + 1, prevRow, rowBytes, bytesPerPixel);
+        prevRow = defilteredRow;
+
+        if (lineIndex < region.y) {
+            continue;
+        }
+
+        // only the crop's columns are written
+        unsigned char *outRow = output.pixels + (size_t) (lineIndex - region.y) * output.stride;
+        if (bitsPerPixel < 8) {
+            expandRow(expander, wholeRow, defilteredRow, ihdrData.width, scratch);
+            std::memcpy(outRow, wholeRow + (size_t) region.x * expander.outBytesPerPixel, outBytes);
+        } else if (active != NULL) {
+            expandRow(expander, outRow, defilteredRow + (size_t) region.x * bytesPerPixel, region.width, scratch);
+        } else {
+            std::memcpy(outRow, defilteredRow + (size_t) region.x * bytesPerPixel, outBytes);
+        }
+    }
+    return true;
+}
+
+int getScaledSize(int size, int scale) {
+    return (size + scale - 1) / scale;
+}
+
+int chooseDownscale(int imageWidth, int imageHeight, int minWidth, int minHeight) {
+    int scale = 1;
+    while (scale < MAX_DOWNSCALE && imageWidth / (scale * 2) >= minWidth && imageHeight / (scale * 2) >= minHeight) {
+        scale *= 2;
+    }
+    return scale;
+}
+
+bool defilterScaled(const unsigned char *filteredData, size_t filteredSize, const struct ihdr &ihdrData, int scale, const struct outputDescriptor &output) {
+    TRACE_SCOPE_ARG("defilterScaled", "scale", scale);
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        std::cerr << "Unsupported downscale factor " << scale << std::endl;
+        return false;
+    }
+
+    // rows are reduced in RGBA8 and converted to the output format once averaged
+    struct rowExpander expander;
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bitsPerPixel == -1 || !buildRowExpander(ihdrData, expander)) {
+        std::cerr << "Unsupported color type " << ihdrData.colorType << " with bit depth " << ihdrData.channelDepth << std::endl;
+        return false;
+    }
+    const struct rowExpander *active = getActiveExpander(expander);
+    ConvertRowFn convert = getConvertRow(output.format);
+
+    int width = ihdrData.width, height = ihdrData.height;
+    int outWidth = getScaledSize(width, scale);
+    size_t rgbaRowBytes = (size_t) width * DECODED_BYTES_PER_PIXEL;
+    std::vector<uint32_t> sums((size_t) outWidth * DECODED_BYTES_PER_PIXEL, 0);
+    std::vector<unsigned char> averaged((size_t) outWidth * DECODED_BYTES_PER_PIXEL);
+
+    // Adds one RGBA8 image row to the box sums, writing an output row each time a band of 'scale'
+    // rows (or the last, shorter band) is complete.
+    auto reduceRow = [&](const unsigned char *rgba, int lineIndex) {
+        accumulateBoxRow(sums.data(), rgba, width, scale);
+        if ((lineIndex + 1) % scale != 0 && lineIndex != height - 1) {
+            return;
+        }
+        unsigned char *outRow = output.pixels + (size_t) (lineIndex / scale) * output.stride;
+        int bandRows = lineIndex % scale + 1;
+        averageBoxRow(convert != NULL ? averaged.data() : outRow, sums.data(), width, scale, bandRows);
+        if (convert != NULL) {
+            convert(outRow, averaged.data(), outWidth);
+        }
+    };
+
+    if (ihdrData.interlaceMethod == 1) {
+        // Rows of an interlaced image only come together once every pass is in, so the image is
+        // decoded whole and reduced afterwards.
+        std::vector<unsigned char> image((size_t) height * rgbaRowBytes);
+        struct outputDescriptor full = {image.data(), rgbaRowBytes, PIXEL_RGBA8};
+        if (!defilterAdam7(filteredData, filteredSize, full, ihdrData)) {
+            return false;
+        }
+        for (int lineIndex = 0; lineIndex < height; lineIndex++) {
+            reduceRow(image.data() + (size_t) lineIndex * rgbaRowBytes, lineIndex);
+        }
+        return true;
+    }
+
+    int bytesPerPixel = std::max(bitsPerPixel / 8, 1);
+    int rowBytes = getRowBytes(width, bitsPerPixel);
+    int colWidth = rowBytes + 1;
+    if (filteredSize < (size_t) height * colWidth) {
+        std::cerr << "Decompressed data too short for a " << width << " x " << height << " image" << std::endl;
+        return false;
+    }
+    const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+
+    // two raw rows, the expanded RGBA8 row and the expander's own scratch row
+    std::vector<unsigned char> ring((size_t) rowBytes * 2 + rgbaRowBytes * 2);
+    unsigned char *rgbaRow = ring.data() + (size_t) rowBytes * 2;
+    unsigned char *scratch = rgbaRow + rgbaRowBytes;
+    const unsigned char *prevRow = NULL;
 
     for (int lineIndex = 0; lineIndex < height; lineIndex++) {
-        filter = decompressedData[lineIndex * colWidth]; // get the filter which is located in the first byte of each line
+        const unsigned char *filteredRow = filteredData + (size_t) lineIndex * colWidth;
+        unsigned char *defilteredRow = ring.data() + (lineIndex & 1) * rowBytes;
+        int filter = filteredRow[0];
 
-        // apply filter to current line. we skip the first byte
-        // since it is occupied by the filter data.
-        // We perform 256 modulo on each filter calc to ensure
-        // no pixel data overflow.
-        for (int colIndex = 1; colIndex < colWidth; colIndex++) { 
-            currByteIndex = lineIndex * colWidth + colIndex;
-            defilteredCurrIndex = currByteIndex - lineIndex - 1; // Defiltered data does not include the 1 byte filter
-
-            switch (filter) {
-                // no filter -- add byte directly
-                case 0:
-                    defilteredCurr = decompressedData[currByteIndex];
-
-                    filterCounts.none += 1;
-                    break;
-
-                // sub filter: defiltered byte = curr filtered + defiltered left
-                case 1: 
-                    defilteredLeft = (colIndex < bytesPerPixel) ? 0 : defilteredData[defilteredCurrIndex - bytesPerPixel];
-                    defilteredCurr = (decompressedData[currByteIndex] + defilteredLeft) % 256;
-
-                    filterCounts.sub += 1;
-                    break;
-
-                // up filter: defiltered byte = curr filtered + defiltered up
-                case 2:
-                    defilteredUp = (lineIndex == 0) ? 0 : defilteredData[defilteredCurrIndex - width * bytesPerPixel];
-                    defilteredCurr = (decompressedData[currByteIndex] + defilteredUp) % 256; 
-
-                    filterCounts.up += 1;
-                    break;
-
-                // average filter: defiltered byte = curr filtered + floor((defiltered left + defiltered up) / 2)
-                case 3:
-                    defilteredLeft = (colIndex < bytesPerPixel) ? 0 : defilteredData[defilteredCurrIndex - bytesPerPixel];
-                    defilteredUp = (lineIndex == 0) ? 0 : defilteredData[defilteredCurrIndex - width * bytesPerPixel];
-                    defilteredCurr = (decompressedData[currByteIndex] + (defilteredLeft + defilteredUp) / 2) % 256;
-
-                    filterCounts.average += 1;
-                    break;
-
-                // paeth filter: defiltered byte = curr filtered + paethPredictor(defiltered left + defiltered up + defiltered left up (diagonal))
-                case 4:
-                    defilteredLeft = (colIndex < bytesPerPixel) ? 0 : defilteredData[defilteredCurrIndex - bytesPerPixel];
-                    defilteredUp = (lineIndex == 0) ? 0 : defilteredData[defilteredCurrIndex - width * bytesPerPixel];
-                    defilteredLeftUp = (lineIndex == 0 || colIndex < bytesPerPixel) ? 0 : defilteredData[defilteredCurrIndex - width * bytesPerPixel - bytesPerPixel];
-                    defilteredCurr = (decompressedData[currByteIndex] + paethPredictor(defilteredLeft, defilteredUp, defilteredLeftUp)) % 256;
-
-                    filterCounts.paeth += 1;
-                    break;
-
-                default:
-                    printGetFilterErr(filter, lineIndex, colWidth, decompressedData);
-                    exit(-1);
-                    break;
-            }
+        if (filter > 4) {
+            std::cerr << "Error: invalid row filter '" << filter << "' at row " << lineIndex << std::endl;
+            return false;
+        }
+        DefilterRowFn defilterRow = lineIndex == 0 ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+        defilterRow(defilteredRow, filteredRow + 1, prevRow, rowBytes, bytesPerPixel);
+        prevRow = defilteredRow;
 
-            defilteredData.push_back(defilteredCurr);
+        if (active != NULL) {
+            expandRow(expander, rgbaRow, defilteredRow, width, scratch);
+            reduceRow(rgbaRow, lineIndex);
+        } else {
+            reduceRow(defilteredRow, lineIndex);
         }
+    }
+    return true;
+}
+
+size_t getInflatedSize(const struct ihdr &ihdrData) {
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bitsPerPixel == -1) {
+        return 0;
+    }
+    if (ihdrData.interlaceMethod == 1) {
+        struct adam7Pass passes[ADAM7_PASSES];
+        return getAdam7Passes(ihdrData.width, ihdrData.height, bitsPerPixel, passes);
+    }
+    return (size_t) ihdrData.height * (getRowBytes(ihdrData.width, bitsPerPixel) + 1);
+}
+
+/**
+ * Inflates the next 'colWidth' bytes of the stream, one scanline with its filter byte, into 'line'.
+ * 'ret' carries the last inflate status from one row to the next.
+*/
+static bool inflateScanline(z_stream &stream, const unsigned char *base, const std::vector<idatSpan> &spans, size_t &nextSpan, int &ret, unsigned char *line, int colWidth, int lineIndex, int height) {
+    stream.next_out = line;
+    stream.avail_out = colWidth;
 
-        
+    // inflate until the scanline is full
+    while (stream.avail_out > 0) {
+        if (ret == Z_STREAM_END) {
+            std::cerr << "IDAT stream ended early at row " << lineIndex << " of " << height << std::endl;
+            return false;
+        }
+        feedIDATSpans(stream, base, spans, nextSpan);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR && stream.avail_in == 0) {
+            std::cerr << "IDAT data truncated at row " << lineIndex << " of " << height << std::endl;
+            return false;
+        }
+        if (ret < 0) {
+            std::cerr << "Error decompressing IDAT data, ret status: " << ret << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool streamDecodeIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, const struct ihdr &ihdrData, const RowSink &sink) {
+    TRACE_SCOPE("streamDecodeIDAT");
+    int bytesPerPixel, colWidth, rowBytes;
+    int width = ihdrData.width, height = ihdrData.height;
+    size_t nextSpan = 0;
+
+    if ((bytesPerPixel = getBytesPerPixel(ihdrData.colorType, ihdrData.channelDepth)) == -1) {
+        return false;
+    }
+    // the rows of an Adam7 image are spread over seven passes of other widths
+    if (ihdrData.interlaceMethod != 0) {
+        std::cerr << "streamDecodeIDAT does not handle interlaced images" << std::endl;
+        return false;
+    }
+
+    const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+
+    rowBytes = width * bytesPerPixel;
+    colWidth = rowBytes + 1;
+
+    // Two scanline ring: the row being inflated and the defiltered row above it.
+    std::vector<unsigned char> ring((size_t) colWidth * 2);
+    unsigned char *currLine = ring.data();
+    unsigned char *prevLine = ring.data() + colWidth;
+
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+
+    if (inflateInit(&stream) != Z_OK) {
+        std::cerr << "Error initializing zlib inflate stream" << std::endl;
+        return false;
+    }
+
+    int ret = Z_OK;
+    bool stopped = false;
+    for (int lineIndex = 0; lineIndex < height; lineIndex++) {
+        if (!inflateScanline(stream, base, spans, nextSpan, ret, currLine, colWidth, lineIndex, height)) {
+            inflateEnd(&stream);
+            return false;
+        }
+
+        int filter = currLine[0];
+        if (filter > 4) {
+            std::cerr << "Error: invalid row filter '" << filter << "' at row " << lineIndex << std::endl;
+            inflateEnd(&stream);
+            return false;
+        }
+
+        // defilter in place, skipping the filter byte
+        DefilterRowFn defilterRow = lineIndex == 0 ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+        defilterRow(currLine + 1, currLine + 1, prevLine + 1, rowBytes, bytesPerPixel);
+
+        if (!sink(lineIndex, currLine + 1, rowBytes)) {
+            stopped = true;
+            break;
+        }
+
+        std::swap(currLine, prevLine);
+    }
+
+    // a decode the sink stopped early has no use for the trailer
+    bool ok = stopped || finishStream(stream, base, spans, nextSpan, ret);
+    inflateEnd(&stream);
+
+    return ok;
+}
+
+bool streamDecodeIDAT(const std::vector<unsigned char> &compressedData, const struct ihdr &ihdrData, const RowSink &sink) {
+    std::vector<idatSpan> spans(1, {0, compressedData.size()});
+    return streamDecodeIDAT(compressedData.data(), spans, ihdrData, sink);
+}
+
+bool streamDecodeIDAT(const std::vector<unsigned char> &compressedData, std::vector<unsigned char> &defilteredData, const struct ihdr &ihdrData) {
+    int bytesPerPixel = getBytesPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bytesPerPixel == -1) {
+        return false;
+    }
+
+    size_t rowBytes = (size_t) ihdrData.width * bytesPerPixel;
+    defilteredData.resize(rowBytes * ihdrData.height);
+
+    return streamDecodeIDAT(compressedData, ihdrData,
+        [&defilteredData, rowBytes](int rowIndex, const unsigned char *row, int rowLen) {
+            std::copy(row, row + rowLen, defilteredData.begin() + rowIndex * rowBytes);
+            return true;
+        });
+}
+
+/**
+ * Producer side of pipelineDecode: inflates one scanline at a time into the ring until 'height'
+ * rows are out, and stops the ring if the data is bad.
+*/
+static bool inflateIntoRing(const unsigned char *base, const std::vector<idatSpan> &spans, int colWidth, int height, ScanlineRing &ring) {
+    TRACE_SCOPE("inflateIntoRing");
+    size_t nextSpan = 0;
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+
+    if (inflateInit(&stream) != Z_OK) {
+        std::cerr << "Error initializing zlib inflate stream" << std::endl;
+        ring.stop();
+        return false;
+    }
+
+    int ret = Z_OK;
+    bool ok = true;
+    for (int lineIndex = 0; lineIndex < height; lineIndex++) {
+        unsigned char *line = ring.acquireWrite();
+        if (line == NULL) {
+            // the consumer gave up
+            break;
+        }
+        if (!inflateScanline(stream, base, spans, nextSpan, ret, line, colWidth, lineIndex, height)) {
+            ring.stop();
+            ok = false;
+            break;
+        }
+        ring.commitWrite();
+    }
+
+    inflateEnd(&stream);
+    return ok;
+}
+
+// pipelineDecodeIDAT without the CRC check.
+static bool pipelineDecode(const unsigned char *base, const std::vector<idatSpan> &spans, const struct ihdr &ihdrData, const struct outputDescriptor &output) {
+    TRACE_SCOPE("pipelineDecodeIDAT");
+    struct rowExpander expander;
+    int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+    if (bitsPerPixel == -1 || !buildRowExpander(ihdrData, expander, output.format)) {
+        std::cerr << "Unsupported color type " << ihdrData.colorType << " with bit depth " << ihdrData.channelDepth << std::endl;
+        return false;
+    }
+
+    // Adam7 passes are not whole rows of the image; they are inflated first and defiltered per pass.
+    if (ihdrData.interlaceMethod == 1) {
+        std::vector<unsigned char> decompressedData;
+        return inflateSpans(base, spans, decompressedData) && defilterIDAT(decompressedData, ihdrData, std::vector<restartPoint>(), output);
+    }
+
+    int width = ihdrData.width, height = ihdrData.height;
+    int bytesPerPixel = std::max(bitsPerPixel / 8, 1);
+    int rowBytes = getRowBytes(width, bitsPerPixel);
+    int colWidth = rowBytes + 1;
+    const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+    const struct rowExpander *active = getActiveExpander(expander);
+
+    ScanlineRing ring(colWidth, std::max(PIPELINE_RING_BYTES / colWidth, PIPELINE_MIN_RING_ROWS));
+    bool inflated = false;
+    std::thread producer([&]() { inflated = inflateIntoRing(base, spans, colWidth, height, ring); });
+
+    // Converted rows are defiltered into two raw rows of the image's own format (the current one
+    // and the one above it) and an RGBA8 scratch row; otherwise straight into the output.
+    std::vector<unsigned char> rawRows;
+    if (active != NULL) {
+        rawRows.resize((size_t) rowBytes * 2 + (size_t) width * DECODED_BYTES_PER_PIXEL);
+    }
+
+    struct FilterCounts filterCounts;
+    const unsigned char *prevRow = NULL;
+    bool defiltered = true;
+    for (int lineIndex = 0; lineIndex < height; lineIndex++) {
+        const unsigned char *filteredRow = ring.acquireRead();
+        if (filteredRow == NULL) {
+            defiltered = false;
+            break;
+        }
+
+        int filter = filteredRow[0];
+        if (filter > 4) {
+            std::cerr << "Error: invalid row filter '" << filter << "' at row " << lineIndex << std::endl;
+            ring.stop();
+            defiltered = false;
+            break;
+        }
+
+        unsigned char *outRow = output.pixels + (size_t) lineIndex * output.stride;
+        unsigned char *defilteredRow = active != NULL ? rawRows.data() + (lineIndex & 1) * rowBytes : outRow;
+        DefilterRowFn defilterRow = lineIndex == 0 ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+        defilterRow(defilteredRow, filteredRow + 1, prevRow, rowBytes, bytesPerPixel);
+        ring.commitRead();
+        prevRow = defilteredRow;
+        filterCounts.rows[filter]++;
+
+        if (active != NULL) {
+            expandRow(*active, outRow, defilteredRow, width, rawRows.data() + (size_t) rowBytes * 2);
+        }
+    }
+
+    producer.join();
+    if (!inflated || !defiltered) {
+        return false;
     }
 
     printFilterSummary(filterCounts);
+    return true;
+}
+
+bool pipelineDecodeIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, const struct ihdr &ihdrData, const struct outputDescriptor &output) {
+    std::future<bool> check = startIDATCheck(base, spans);
+    bool decoded = pipelineDecode(base, spans, ihdrData, output);
+    return passedIDATCheck(check) && decoded;
+}
 
+bool pipelineDecodeIDAT(const std::vector<unsigned char> &compressedData, const struct ihdr &ihdrData, std::vector<unsigned char> &defilteredData) {
+    defilteredData.resize((size_t) ihdrData.width * ihdrData.height * DECODED_BYTES_PER_PIXEL);
+    struct outputDescriptor output = {defilteredData.data(), (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL, PIXEL_RGBA8};
+    std::vector<idatSpan> spans(1, {0, compressedData.size()});
+    return pipelineDecode(compressedData.data(), spans, ihdrData, output);
+}
+
+std::vector<int> findDefilterChains(const std::vector<unsigned char> &decompressedData, int width, int height, int bytesPerPixel, int minRows) {
+    size_t colWidth = (size_t) width * bytesPerPixel + 1;
+    std::vector<int> chainRows(1, 0);
+
+    for (int row = std::max(minRows, 1); row < height; row++) {
+        int filter = decompressedData[row * colWidth];
+        if ((filter == 0 || filter == 1) && row - chainRows.back() >= minRows) {
+            chainRows.push_back(row);
+        }
+    }
+    chainRows.push_back(height);
+
+    return chainRows;
+}
+
+bool defilterRowRange(const std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int bytesPerPixel, int firstRow, int endRow, const struct rowExpander *expander) {
+    struct FilterCounts filterCounts;
+    int rowBytes = width * bytesPerPixel;
+
+    size_t outStride = expander != NULL ? (size_t) width * expander->outBytesPerPixel : rowBytes;
+
+    int badRow = defilterRows(decompressedData.data(), defilteredData.data(), outStride, firstRow, endRow, rowBytes, bytesPerPixel, getRowDecoderTable(bytesPerPixel), filterCounts, expander, width);
+    if (badRow != -1) {
+        std::cerr << "Error: invalid row filter '" << (int) decompressedData[(size_t) badRow * (rowBytes + 1)] << "' at row " << badRow << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool defilterTileInPlace(std::vector<unsigned char> &data, int width, int bytesPerPixel, int firstRow, int endRow, int begin, int end) {
+    int rowBytes = width * bytesPerPixel;
+    size_t colWidth = (size_t) rowBytes + 1;
+    const RowDecoderTable &rowDecoders = getRowDecoderTable(bytesPerPixel);
+
+    for (int lineIndex = firstRow; lineIndex < endRow; lineIndex++) {
+        unsigned char *row = data.data() + lineIndex * colWidth + 1;
+        int filter = row[-1];
+        if (filter > 4) {
+            std::cerr << "Error: invalid row filter '" << filter << "' at row " << lineIndex << std::endl;
+            return false;
+        }
+        // None and Sub rows do not look up, so they leave the row above alone even while another tile writes it
+        const unsigned char *prevRow = lineIndex == 0 || filter <= 1 ? NULL : row - colWidth;
+        DefilterRowFn defilterRow = prevRow == NULL ? rowDecoders.firstRow[filter] : rowDecoders.otherRows[filter];
+        defilterRowBlock(defilterRow, filter, row, row, prevRow, begin, end, bytesPerPixel);
+    }
     return true;
 }
 
 void printFilterSummary(struct FilterCounts filterCounts) {
+    if (!printSummaries) {
+        return;
+    }
+
     std::cout << PRINT_DIVIDER_BIG << std::endl;
-    std::cout << "Filter summary: " << std::endl;
-    std::cout << "\tNone: " << filterCounts.none << std::endl;
-    std::cout << "\tSub: " << filterCounts.sub << std::endl;
-    std::cout << "\tUp: " << filterCounts.up << std::endl;
-    std::cout << "\tAverage: " << filterCounts.average << std::endl;
-    std::cout << "\tPaeth: " << filterCounts.paeth << std::endl;
+    std::cout << "Filter summary (rows): " << std::endl;
+    for (int filter = 0; filter < 5; filter++) {
+        std::cout << "\t" << filterNames[filter] << ": " << filterCounts.rows[filter] << std::endl;
+    }
 
 }
 
@@ -1,13 +1,219 @@
+#ifndef _PROCESS_IMAGE_H_
+#define _PROCESS_IMAGE_H_
+
 #include <vector>
+#include <functional>
+#include <zlib.h>
+
+#include "readImage.h"
+#include "expandKernels.h"
 
 bool decompressIDAT(const std::vector<unsigned char>& compressedData, std::vector<unsigned char> &decompressedData);
 
+/**
+ * Inflates IDAT data that is split across several spans (e.g. a mappedPNG's idatSpans),
+ * feeding each span to zlib in turn without concatenating them first.
+ *
+ * With verifyChunkCRCs set, the span overloads also check the CRC after every span on another
+ * thread while they inflate (verifyIDATSpans), and fail if one does not match. The spans must
+ * then be the IDAT payloads of a file, not arbitrary pieces of memory. All chunks are checked,
+ * even when maxBytes stops the inflate early.
+ *
+ * @param base The address the span offsets are relative to.
+ * @param maxBytes Stop inflating once this many bytes are out, e.g. when only the first
+ *                 Adam7 passes are wanted. The output may run past it by up to 4 KiB.
+*/
+bool decompressIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, std::vector<unsigned char> &decompressedData, size_t maxBytes = (size_t) -1);
+
+/**
+ * Inflates the IDAT spans straight into 'out' through a stream the caller owns, so nothing is
+ * allocated per image. The stream must be set up with inflateInit and is reset here with
+ * inflateReset, which keeps zlib's window for the next image. With useBuiltinInflate the built-in
+ * engine inflates into 'out' instead, and the stream is only used if the engine fails.
+ *
+ * @return true once 'outSize' bytes are out and the stream has ended with a matching adler32;
+ *         false on a zlib error, if the data ends first or if it holds more than 'outSize' bytes.
+*/
+bool decompressIDAT(z_stream &stream, const unsigned char *base, const std::vector<idatSpan> &spans, unsigned char *out, size_t outSize);
+
+/**
+ * Inflates the segments of a yiDX restart index in parallel (OpenMP), each straight into its
+ * rows of 'decompressedData'. The per-segment adler32s are combined and checked against the
+ * zlib trailer. Falls back to the serial decompressIDAT when there is no index or it does not
+ * match the data. Without an index and with useBuiltinInflate, the built-in engine inflates the
+ * whole image into 'decompressedData' sized from the IHDR (getInflatedSize), so it is never grown.
+*/
+bool decompressIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, const std::vector<restartPoint> &restartPoints, const struct ihdr &ihdrData, std::vector<unsigned char> &decompressedData);
+
+bool decompressIDAT(const std::vector<unsigned char>& compressedData, const std::vector<restartPoint> &restartPoints, const struct ihdr &ihdrData, std::vector<unsigned char> &decompressedData);
+
 void printDecompressSummary(int compressedSize, int decompressedSize);
 
 bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int height, int colorType, int channelDepth);
 
+/**
+ * Defilters using the segments of a yiDX restart index. Segments whose first row uses the None
+ * or Sub filter do not depend on the row above and are defiltered in parallel (OpenMP); any other
+ * segment continues on the same thread as the segment before it. With an empty index, images of
+ * 256 KiB or more are defiltered as a wavefront: rows run on all threads in column blocks, Up,
+ * Average and Paeth rows each trailing the row above by one block.
+*/
+bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int height, int colorType, int channelDepth, const std::vector<restartPoint> &restartPoints);
+
+/**
+ * Finds the rows where defiltering can start without the row above: row 0 and rows filtered with
+ * None or Sub. Starts closer than 'minRows' to the previous one are dropped. The returned list
+ * begins with 0 and ends with 'height', so consecutive entries delimit independent row ranges.
+*/
+std::vector<int> findDefilterChains(const std::vector<unsigned char> &decompressedData, int width, int height, int bytesPerPixel, int minRows);
+
+/**
+ * Defilters rows [firstRow, endRow) into 'defilteredData', which must already be sized for the
+ * whole image. Row firstRow - 1 must already be defiltered unless it starts a chain. Prints no summary.
+ *
+ * @param expander If not NULL, rows are expanded to RGBA8 as they are defiltered (see rowExpander),
+ *                 and firstRow must start a chain.
+*/
+bool defilterRowRange(const std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, int width, int bytesPerPixel, int firstRow, int endRow, const struct rowExpander *expander = NULL);
+
+/**
+ * Defilters bytes [begin, end) of rows [firstRow, endRow) in place: each row's bytes stay where
+ * they are in 'data', after its filter byte. One tile of a wavefront split of the image, so bytes
+ * [0, end) of row firstRow - 1 and bytes [0, begin) of the tile's own rows must already be
+ * defiltered in place. 'begin' must be a multiple of bytesPerPixel.
+ *
+ * @return false if a row has an invalid filter type.
+*/
+bool defilterTileInPlace(std::vector<unsigned char> &data, int width, int bytesPerPixel, int firstRow, int endRow, int begin, int end);
+
+/**
+ * Decodes to RGBA8 whatever the format: palette, 1/2/4 bit greyscale, 16 bit and the other
+ * color types are expanded row by row as they are defiltered (see expandKernels.h). Interlaced
+ * images go through defilterAdam7.
+ *
+ * The overloads taking colorType and channelDepth instead keep the image's own format and only
+ * handle whole-byte pixels.
+ *
+ * @param threads Threads to use; 0 for the OpenMP default, 1 to stay on the calling thread. Called
+ *                from inside a parallel region it always stays on the calling thread.
+*/
+bool defilterIDAT(std::vector<unsigned char> &decompressedData, std::vector<unsigned char> &defilteredData, const struct ihdr &ihdrData, const std::vector<restartPoint> &restartPoints, int threads = 0);
+
+/**
+ * Same as above, but writes straight into the caller's buffer in the descriptor's format and
+ * row stride. The conversion happens per row as the row is defiltered: there is no RGBA8 image
+ * in between and no separate conversion pass.
+*/
+bool defilterIDAT(const std::vector<unsigned char> &decompressedData, const struct ihdr &ihdrData, const std::vector<restartPoint> &restartPoints, const struct outputDescriptor &output, int threads = 0);
+
+/**
+ * Defilters a standalone block of 'height' filtered rows of 'width' pixels, such as one Adam7
+ * pass, from 'filteredData' into 'defilteredData'. Prints no summary.
+ *
+ * @param expander If not NULL, the output is in the expander's format (see rowExpander).
+ * @param outStride Bytes from one output row to the next; 0 for packed rows.
+*/
+bool defilterSubImage(const unsigned char *filteredData, unsigned char *defilteredData, int width, int height, int bitsPerPixel, const struct rowExpander *expander = NULL, size_t outStride = 0);
+
+// A width x height crop whose top left pixel is (x, y).
+struct regionOfInterest {
+    int x, y;
+    int width, height;
+};
+
+/**
+ * Defilters the rows of a non-interlaced image down to the bottom of 'region' and writes only the
+ * region's pixels to 'output', converted to its format. The rows above the region are defiltered,
+ * since the rows below depend on them, but never expanded or written. Prints no summary.
+ *
+ * @param filteredData The inflated rows 0 to region.y + region.height - 1, filter bytes included.
+*/
+bool defilterRegion(const unsigned char *filteredData, const struct ihdr &ihdrData, const struct regionOfInterest &region, const struct outputDescriptor &output);
+
+// Largest box filter reduction defilterScaled supports.
+#define MAX_DOWNSCALE 8
+
+// Pixels left of 'size' once reduced by 'scale'; a partial block at the edge still gives a pixel.
+int getScaledSize(int size, int scale);
+
+/**
+ * Largest downscale factor (1, 2, 4 or 8) that leaves a width x height image at least
+ * minWidth x minHeight, so showing it in a window that size loses nothing to the reduction.
+*/
+int chooseDownscale(int imageWidth, int imageHeight, int minWidth, int minHeight);
+
+/**
+ * Decodes an image reduced by 'scale' in both directions, each output pixel the rounded average of
+ * a scale x scale block of source pixels (partial blocks at the right and bottom average what they
+ * cover). Non-interlaced rows are box filtered as they are defiltered, so the full size image is
+ * never stored: only two raw rows and one row of sums are kept. Interlaced images are decoded
+ * whole first. Prints no summary.
+ *
+ * @param scale 1, 2, 4 or 8.
+ * @param output getScaledSize(width, scale) x getScaledSize(height, scale) pixels.
+*/
+bool defilterScaled(const unsigned char *filteredData, size_t filteredSize, const struct ihdr &ihdrData, int scale, const struct outputDescriptor &output);
+
+/**
+ * Size of the inflated IDAT data (filter bytes included) for the image, taking interlacing into
+ * account. Returns 0 for an unsupported format.
+*/
+size_t getInflatedSize(const struct ihdr &ihdrData);
+
 int getBytesPerPixel(int colorType, int channelDepth);
 
 void printFilterSummary(struct FilterCounts filterCounts);
 
-void printGetFilterErr(int filter, int lineIndex, int colWidth, std::vector<unsigned char> decompressedData);
\ No newline at end of file
+void printGetFilterErr(int filter, int lineIndex, int colWidth, std::vector<unsigned char> decompressedData);
+
+/**
+ * Receives one defiltered scanline. Rows arrive in order and the pointer is only valid
+ * for the duration of the call.
+ *
+ * @return true to continue decoding, false to stop early.
+*/
+typedef std::function<bool(int rowIndex, const unsigned char *row, int rowBytes)> RowSink;
+
+/**
+ * Inflates and defilters the image one scanline at a time, handing each row to 'sink'.
+ *
+ * zlib inflates straight into a ring of two scanlines (the current row and the one above it),
+ * each width * bytesPerPixel + 1 bytes, and the row is defiltered in place while it is still
+ * in cache. The full inflated image is never stored.
+ *
+ * Only non-interlaced images with whole-byte pixels are handled. Once the last row is out the
+ * rest of the stream is inflated too, so the adler32 trailer is checked.
+ *
+ * @return true if every row was decoded and the trailer matches (or the sink stopped early), false
+ *         on a decode error or an interlaced image.
+*/
+bool streamDecodeIDAT(const std::vector<unsigned char> &compressedData, const struct ihdr &ihdrData, const RowSink &sink);
+
+// As above, reading the compressed data from IDAT spans relative to 'base'.
+bool streamDecodeIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, const struct ihdr &ihdrData, const RowSink &sink);
+
+/**
+ * Convenience wrapper around streamDecodeIDAT that collects the rows into 'defilteredData',
+ * producing the same output as decompressIDAT followed by defilterIDAT.
+*/
+bool streamDecodeIDAT(const std::vector<unsigned char> &compressedData, std::vector<unsigned char> &defilteredData, const struct ihdr &ihdrData);
+
+// Rows of inflated data the pipelined decode keeps in flight, and the least it keeps for small images.
+#define PIPELINE_RING_BYTES (512 * 1024)
+#define PIPELINE_MIN_RING_ROWS 4
+
+/**
+ * Decodes with inflate and defilter running at the same time: a second thread inflates scanlines
+ * into a ScanlineRing of about PIPELINE_RING_BYTES while the calling thread defilters them
+ * straight into 'output', converting as defilterIDAT does. The ring is lock free, and the inflate
+ * waits whenever it fills, so the wall time is close to the slower of the two stages rather than
+ * their sum. Interlaced images are inflated whole first.
+ *
+ * The spans overload checks chunk CRCs like decompressIDAT when verifyChunkCRCs is set.
+*/
+bool pipelineDecodeIDAT(const unsigned char *base, const std::vector<idatSpan> &spans, const struct ihdr &ihdrData, const struct outputDescriptor &output);
+
+// As above, decoding to RGBA8 in 'defilteredData' from IDAT data in one buffer.
+bool pipelineDecodeIDAT(const std::vector<unsigned char> &compressedData, const struct ihdr &ihdrData, std::vector<unsigned char> &defilteredData);
+
+#endif
@@ -0,0 +1,263 @@
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include "progressiveUpload.h"
+#include "processImage.h"
+#include "expandKernels.h"
+#include "timer.h"
+#include "trace.h"
+
+// Reads every pending GL error flag, so the next glGetError only reports what comes after.
+// Returns false if any was set.
+static bool clearGLErrors() {
+    bool clean = true;
+    while (glGetError() != GL_NO_ERROR) {
+        clean = false;
+    }
+    return clean;
+}
+
+TiledTexture::TiledTexture(int width, int height, int maxTileSize) : width(width), height(height) {
+    // errors left over from earlier calls are not ours to report
+    clearGLErrors();
+
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    int tileSize = maxTileSize > 0 ? std::min(maxTileSize, (int) maxTextureSize) : maxTextureSize;
+    if (tileSize <= 0 || width <= 0 || height <= 0) {
+        std::cerr << "Cannot tile a " << width << " x " << height << " image into textures of " << tileSize << " pixels" << std::endl;
+        pixelBuffers[0] = pixelBuffers[1] = 0;
+        return;
+    }
+
+    for (int y = 0; y < height; y += tileSize) {
+        for (int x = 0; x < width; x += tileSize) {
+            tile t = {0, x, y, std::min(tileSize, width - x), std::min(tileSize, height - y)};
+            glGenTextures(1, &t.texture);
+            glBindTexture(GL_TEXTURE_2D, t.texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            // storage only; the rows arrive through uploadRows
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, t.width, t.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            tiles.push_back(t);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenBuffers(UPLOAD_PBO_COUNT, pixelBuffers);
+    ready = clearGLErrors();
+    if (!ready) {
+        std::cerr << "Error creating " << tiles.size() << " textures for a " << width << " x " << height << " image" << std::endl;
+    }
+}
+
+TiledTexture::~TiledTexture() {
+    for (const tile &t : tiles) {
+        glDeleteTextures(1, &t.texture);
+    }
+    if (ready) {
+        glDeleteBuffers(UPLOAD_PBO_COUNT, pixelBuffers);
+    }
+}
+
+bool TiledTexture::uploadRows(const unsigned char *rows, size_t stride, int firstRow, int endRow) {
+    TRACE_SCOPE_ARG("uploadRows", "rows", endRow - firstRow);
+    size_t rowBytes = (size_t) width * DECODED_BYTES_PER_PIXEL;
+
+    for (int bandStart = firstRow; bandStart < endRow; bandStart += UPLOAD_BAND_ROWS) {
+        int bandEnd = std::min(bandStart + UPLOAD_BAND_ROWS, endRow);
+        size_t bandBytes = (size_t) (bandEnd - bandStart) * rowBytes;
+
+        // Orphaning the buffer lets the driver hand out fresh storage instead of waiting for the
+        // transfer still reading the old contents, and alternating buffers keeps that transfer
+        // going while this band is copied in.
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[nextBuffer]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, (size_t) UPLOAD_BAND_ROWS * rowBytes, NULL, GL_STREAM_DRAW);
+        unsigned char *mapped = (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bandBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (mapped == NULL) {
+            std::cerr << "Error mapping a pixel buffer for rows " << bandStart << " to " << bandEnd << std::endl;
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            return false;
+        }
+        for (int y = bandStart; y < bandEnd; y++) {
+            std::memcpy(mapped + (size_t) (y - bandStart) * rowBytes, rows + (size_t) (y - firstRow) * stride, rowBytes);
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        // each tile the band crosses takes its columns straight out of the buffer
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+        for (const tile &t : tiles) {
+            int top = std::max(bandStart, t.y), bottom = std::min(bandEnd, t.y + t.height);
+            if (top >= bottom) {
+                continue;
+            }
+            size_t offset = (size_t) (top - bandStart) * rowBytes + (size_t) t.x * DECODED_BYTES_PER_PIXEL;
+            glBindTexture(GL_TEXTURE_2D, t.texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, top - t.y, t.width, bottom - top, GL_RGBA, GL_UNSIGNED_BYTE, (const void *) offset);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        nextBuffer = (nextBuffer + 1) % UPLOAD_PBO_COUNT;
+        uploadedRows = bandEnd;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return true;
+}
+
+void TiledTexture::draw() {
+    glEnable(GL_TEXTURE_2D);
+    for (const tile &t : tiles) {
+        // only the uploaded part of the tile, so the image fills in from the top
+        int rows = std::min(uploadedRows - t.y, t.height);
+        if (rows <= 0) {
+            continue;
+        }
+        float left = -1.0f + 2.0f * t.x / width, right = -1.0f + 2.0f * (t.x + t.width) / width;
+        float top = 1.0f - 2.0f * t.y / height, bottom = 1.0f - 2.0f * (t.y + rows) / height;
+        float bottomTexCoord = (float) rows / t.height;
+
+        glBindTexture(GL_TEXTURE_2D, t.texture);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, bottomTexCoord); glVertex2f(left, bottom);
+        glTexCoord2f(1.0f, bottomTexCoord); glVertex2f(right, bottom);
+        glTexCoord2f(1.0f, 0.0f); glVertex2f(right, top);
+        glTexCoord2f(0.0f, 0.0f); glVertex2f(left, top);
+        glEnd();
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+}
+
+// Rows the decode thread has finished, shared with the thread uploading them.
+struct decodeProgress {
+    std::mutex lock;
+    std::condition_variable changed;
+    int rowsReady = 0;
+    bool done = false;
+    bool ok = false;
+    double decoded = 0;
+};
+
+/**
+ * Decodes 'image' into 'pixels', publishing each band of finished rows to 'progress'. Stops early
+ * once 'stop' is set.
+*/
+static void decodeRows(const struct mappedPNG &image, std::vector<unsigned char> &pixels, struct decodeProgress &progress, const std::atomic<bool> &stop) {
+    TRACE_SCOPE("progressiveDecode");
+    const struct ihdr &ihdrData = image.ihdrData;
+    size_t stride = (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL;
+    bool ok;
+
+    if (ihdrData.interlaceMethod == 0 && ihdrData.channelDepth >= 8) {
+        struct rowExpander expander;
+        ok = buildRowExpander(ihdrData, expander);
+        const struct rowExpander *active = getActiveExpander(expander);
+        std::vector<unsigned char> scratch(stride);
+
+        ok = ok && streamDecodeIDAT(image.base, image.idatSpans, ihdrData,
+            [&](int rowIndex, const unsigned char *row, int rowBytes) {
+                unsigned char *out = pixels.data() + (size_t) rowIndex * stride;
+                if (active != NULL) {
+                    expandRow(expander, out, row, ihdrData.width, scratch.data());
+                } else {
+                    std::memcpy(out, row, rowBytes);
+                }
+                if ((rowIndex + 1) % UPLOAD_BAND_ROWS == 0) {
+                    std::lock_guard<std::mutex> guard(progress.lock);
+                    progress.rowsReady = rowIndex + 1;
+                    progress.changed.notify_one();
+                }
+                return !stop.load(std::memory_order_relaxed);
+            });
+    } else {
+        // Interlaced rows are only complete after the last pass and sub-byte rows cannot be
+        // streamed, so these are decoded whole.
+        std::vector<unsigned char> decompressedIDAT;
+        struct outputDescriptor output = {pixels.data(), stride, PIXEL_RGBA8};
+        ok = decompressIDAT(image.base, image.idatSpans, image.restartPoints, ihdrData, decompressedIDAT) &&
+             defilterIDAT(decompressedIDAT, ihdrData, image.restartPoints, output);
+    }
+
+    std::lock_guard<std::mutex> guard(progress.lock);
+    progress.rowsReady = ok ? ihdrData.height : progress.rowsReady;
+    progress.done = true;
+    progress.ok = ok && !stop.load();
+    GET_TIME(progress.decoded);
+    progress.changed.notify_one();
+}
+
+bool decodeProgressively(const struct mappedPNG &image, TiledTexture &texture, const std::function<bool()> &presentFrame, std::vector<unsigned char> &pixels, struct progressiveStats &stats) {
+    TRACE_SCOPE("decodeProgressively");
+    const struct ihdr &ihdrData = image.ihdrData;
+    size_t stride = (size_t) ihdrData.width * DECODED_BYTES_PER_PIXEL;
+    double start, now;
+
+    GET_TIME(start);
+    stats = progressiveStats();
+    pixels.resize(stride * ihdrData.height);
+
+    struct decodeProgress progress;
+    std::atomic<bool> stop(false);
+    std::thread decoder(decodeRows, std::cref(image), std::ref(pixels), std::ref(progress), std::cref(stop));
+
+    bool open = true, failed = false, uploadFailed = false;
+    while (open && texture.getUploadedRows() < ihdrData.height) {
+        int rowsReady;
+        {
+            // wake up for new rows, or at least once a frame to keep the window responsive
+            std::unique_lock<std::mutex> guard(progress.lock);
+            progress.changed.wait_for(guard, std::chrono::milliseconds(16), [&] {
+                return progress.done || progress.rowsReady > texture.getUploadedRows();
+            });
+            rowsReady = progress.rowsReady;
+            failed = progress.done && !progress.ok;
+        }
+        if (failed) {
+            break;
+        }
+
+        int uploaded = texture.getUploadedRows();
+        if (rowsReady > uploaded) {
+            // a buffer that cannot be mapped now will not be next frame either, so give up on the image
+            if (!texture.uploadRows(pixels.data() + (size_t) uploaded * stride, stride, uploaded, rowsReady)) {
+                uploadFailed = true;
+                break;
+            }
+            stats.bands += (rowsReady - uploaded + UPLOAD_BAND_ROWS - 1) / UPLOAD_BAND_ROWS;
+        }
+
+        glClear(GL_COLOR_BUFFER_BIT);
+        texture.draw();
+        if (stats.firstPixel == 0 && texture.getUploadedRows() > 0) {
+            // wait for the first band to really be drawn, so the time is not just the queueing
+            glFinish();
+            GET_TIME(now);
+            stats.firstPixel = now - start;
+        }
+        open = presentFrame();
+    }
+
+    stop = true;
+    decoder.join();
+    GET_TIME(now);
+    stats.complete = now - start;
+    stats.decoded = progress.decoded - start;
+
+    if (failed || uploadFailed) {
+        std::cerr << "Progressive decoding failed" << std::endl;
+    }
+    return open && progress.ok && !uploadFailed;
+}
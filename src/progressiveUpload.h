@@ -0,0 +1,86 @@
+#ifndef _PROGRESSIVE_UPLOAD_H_
+#define _PROGRESSIVE_UPLOAD_H_
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+#include "readImage.h"
+
+// Rows copied into a pixel buffer object and uploaded together while an image is decoding.
+#define UPLOAD_BAND_ROWS 64
+
+// Pixel buffer objects uploads alternate between, so one is filled while the other is transferred.
+#define UPLOAD_PBO_COUNT 2
+
+/**
+ * An RGBA8 image held in as many textures as it takes to stay under GL_MAX_TEXTURE_SIZE, filled
+ * a band of rows at a time through double-buffered pixel buffer objects. Needs a current GL
+ * context (2.1 or later, compatibility profile) for its whole life.
+*/
+class TiledTexture {
+public:
+    /**
+     * @param maxTileSize Largest tile side; 0 for GL_MAX_TEXTURE_SIZE. Smaller values force
+     *                    tiling of ordinary images, for testing.
+    */
+    TiledTexture(int width, int height, int maxTileSize = 0);
+    ~TiledTexture();
+
+    // False if a tile or pixel buffer could not be created.
+    bool valid() const { return ready; }
+
+    /**
+     * Uploads rows [firstRow, endRow) of the image, 'stride' bytes apart starting at 'rows',
+     * UPLOAD_BAND_ROWS at a time through the pixel buffers. Rows must arrive top to bottom.
+     *
+     * @return false if a pixel buffer could not be mapped; the rows before that band are uploaded.
+    */
+    bool uploadRows(const unsigned char *rows, size_t stride, int firstRow, int endRow);
+
+    // Draws the rows uploaded so far over the current viewport, the image's top at the top.
+    void draw();
+
+    int getTileCount() const { return tiles.size(); }
+    int getUploadedRows() const { return uploadedRows; }
+
+private:
+    struct tile {
+        unsigned int texture;
+        int x, y, width, height;
+    };
+
+    std::vector<tile> tiles;
+    unsigned int pixelBuffers[UPLOAD_PBO_COUNT];
+    int nextBuffer = 0;
+    int width, height;
+    int uploadedRows = 0;
+    bool ready = false;
+};
+
+// Timings of decodeProgressively, in seconds from its start.
+struct progressiveStats {
+    // the first band of the image was on screen
+    double firstPixel = 0;
+    // the decode thread had every row
+    double decoded = 0;
+    // the last band was uploaded and drawn
+    double complete = 0;
+    int bands = 0;
+};
+
+/**
+ * Decodes 'image' to RGBA8 on a background thread while the calling thread, which owns the GL
+ * context, uploads each band of rows into 'texture' as soon as it is defiltered and draws it.
+ * Non-interlaced images of 8 and 16 bit channels are inflated and defiltered a row at a time
+ * (streamDecodeIDAT), so the first band shows long before the last row is inflated; other images
+ * are decoded whole and then uploaded band by band.
+ *
+ * @param presentFrame Called after every draw to show the frame (swap buffers, poll events).
+ *                     Returning false stops the decode early, as when the window is closed.
+ * @param pixels Receives the decoded image, width * DECODED_BYTES_PER_PIXEL bytes per row.
+ * @return false if the image fails to decode or upload, or the decode was stopped.
+*/
+bool decodeProgressively(const struct mappedPNG &image, TiledTexture &texture, const std::function<bool()> &presentFrame, std::vector<unsigned char> &pixels, struct progressiveStats &stats);
+
+#endif
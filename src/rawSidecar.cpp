@@ -0,0 +1,200 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+
+// mapping and file identity
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rawSidecar.h"
+#include "processImage.h"
+#include "crcKernels.h"
+#include "trace.h"
+
+std::string getSidecarPath(const char *pngPath) {
+    return std::string(pngPath) + SIDECAR_SUFFIX;
+}
+
+static int64_t getMtimeNanoseconds(const struct stat &info) {
+    return (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+static uint32_t getHeaderCRC(struct sidecarHeader header) {
+    header.headerCRC = 0;
+    return crc32Update(0, (const unsigned char *) &header, sizeof(header));
+}
+
+// CRC-32 of all the IDAT payloads, one after the other.
+static uint32_t getSourceChecksum(const struct mappedPNG &png) {
+    uint32_t crc = 0;
+    for (const idatSpan &span : png.idatSpans) {
+        crc = crc32Update(crc, png.base + span.offset, span.length);
+    }
+    return crc;
+}
+
+bool writeRawSidecar(const char *pngPath, enum pixelFormat format) {
+    TRACE_SCOPE("writeRawSidecar");
+    struct stat sourceInfo;
+    struct mappedPNG png;
+    if (stat(pngPath, &sourceInfo) != 0 || !mapPNGImage(pngPath, png)) {
+        return false;
+    }
+    const struct ihdr &ihdrData = png.ihdrData;
+
+    struct sidecarHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.version = SIDECAR_VERSION;
+    header.width = ihdrData.width;
+    header.height = ihdrData.height;
+    header.channelDepth = ihdrData.channelDepth;
+    header.colorType = ihdrData.colorType;
+    header.compressionMethod = ihdrData.compressionMethod;
+    header.filterMethod = ihdrData.filterMethod;
+    header.interlaceMethod = ihdrData.interlaceMethod;
+    header.pixelFormat = format;
+    size_t rowBytes = (size_t) ihdrData.width * getPixelFormatBytes(format);
+    header.stride = (rowBytes + SIDECAR_ROW_ALIGNMENT - 1) / SIDECAR_ROW_ALIGNMENT * SIDECAR_ROW_ALIGNMENT;
+    header.pixelOffset = (sizeof(header) + SIDECAR_PAGE_BYTES - 1) / SIDECAR_PAGE_BYTES * SIDECAR_PAGE_BYTES;
+    header.pixelBytes = header.stride * ihdrData.height;
+    header.sourceSize = sourceInfo.st_size;
+    header.sourceMtimeNanoseconds = getMtimeNanoseconds(sourceInfo);
+    header.sourceChecksum = getSourceChecksum(png);
+    header.headerCRC = getHeaderCRC(header);
+
+    // written under a temporary name and renamed into place once complete
+    std::string path = getSidecarPath(pngPath);
+    std::string tempPath = path + ".tmp." + std::to_string(getpid());
+    size_t fileSize = header.pixelOffset + header.pixelBytes;
+    int fd = open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        std::cerr << "Error creating " << tempPath << std::endl;
+        unmapPNGImage(png);
+        return false;
+    }
+    // Reserve the blocks up front: a sparse file would only run out of space on a store through
+    // the mapping, which raises SIGBUS instead of failing a call.
+    int error = posix_fallocate(fd, 0, fileSize);
+    if (error != 0) {
+        std::cerr << "Error allocating " << fileSize << " bytes for " << tempPath << ": " << strerror(error) << std::endl;
+        close(fd);
+        unlink(tempPath.c_str());
+        unmapPNGImage(png);
+        return false;
+    }
+    void *mapping = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error mapping " << tempPath << std::endl;
+        close(fd);
+        unlink(tempPath.c_str());
+        unmapPNGImage(png);
+        return false;
+    }
+
+    // the rows are defiltered straight into the file
+    std::vector<unsigned char> inflated;
+    struct outputDescriptor output = {(unsigned char *) mapping + header.pixelOffset, header.stride, format};
+    bool ok = decompressIDAT(png.base, png.idatSpans, png.restartPoints, ihdrData, inflated) &&
+              defilterIDAT(inflated, ihdrData, png.restartPoints, output);
+    unmapPNGImage(png);
+
+    // The pixels must be on disk before the rename makes the sidecar visible, or a crash could
+    // leave a valid header in front of pixels that were never written.
+    if (ok) {
+        std::memcpy(mapping, &header, sizeof(header));
+        ok = msync(mapping, fileSize, MS_SYNC) == 0;
+    }
+    munmap(mapping, fileSize);
+    close(fd);
+    if (!ok || rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::cerr << "Error writing " << path << std::endl;
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool openRawSidecar(const char *pngPath, struct rawImage &image, bool verifySource) {
+    TRACE_SCOPE("openRawSidecar");
+    image.pixels = NULL;
+    image.mapping = NULL;
+    image.mappingSize = 0;
+
+    struct stat sourceInfo, sidecarInfo;
+    std::string path = getSidecarPath(pngPath);
+    if (stat(pngPath, &sourceInfo) != 0) {
+        return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct sidecarHeader header;
+    bool valid = fstat(fd, &sidecarInfo) == 0 && pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                 std::memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) == 0 && header.version == SIDECAR_VERSION &&
+                 header.headerCRC == getHeaderCRC(header) &&
+                 header.sourceSize == (uint64_t) sourceInfo.st_size && header.sourceMtimeNanoseconds == getMtimeNanoseconds(sourceInfo) &&
+                 header.pixelFormat <= PIXEL_RGB8 && header.pixelOffset % SIDECAR_PAGE_BYTES == 0 &&
+                 header.stride >= (uint64_t) header.width * getPixelFormatBytes((enum pixelFormat) header.pixelFormat) &&
+                 header.pixelBytes == header.stride * header.height &&
+                 (uint64_t) sidecarInfo.st_size >= header.pixelOffset + header.pixelBytes;
+    if (!valid) {
+        close(fd);
+        return false;
+    }
+
+    if (verifySource) {
+        struct mappedPNG png;
+        bool matches = mapPNGImage(pngPath, png) && getSourceChecksum(png) == header.sourceChecksum;
+        unmapPNGImage(png);
+        if (!matches) {
+            close(fd);
+            return false;
+        }
+    }
+
+    size_t fileSize = header.pixelOffset + header.pixelBytes;
+    void *mapping = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error mapping " << path << std::endl;
+        return false;
+    }
+
+    image.mapping = mapping;
+    image.mappingSize = fileSize;
+    image.pixels = (const unsigned char *) mapping + header.pixelOffset;
+    image.stride = header.stride;
+    image.format = (enum pixelFormat) header.pixelFormat;
+    image.ihdrData = ihdr();
+    image.ihdrData.width = header.width;
+    image.ihdrData.height = header.height;
+    image.ihdrData.channelDepth = header.channelDepth;
+    image.ihdrData.colorType = header.colorType;
+    image.ihdrData.compressionMethod = header.compressionMethod;
+    image.ihdrData.filterMethod = header.filterMethod;
+    image.ihdrData.interlaceMethod = header.interlaceMethod;
+    return true;
+}
+
+bool openOrCreateRawSidecar(const char *pngPath, struct rawImage &image, enum pixelFormat format) {
+    if (openRawSidecar(pngPath, image) && image.format == format) {
+        return true;
+    }
+    closeRawSidecar(image);
+    return writeRawSidecar(pngPath, format) && openRawSidecar(pngPath, image);
+}
+
+void closeRawSidecar(struct rawImage &image) {
+    if (image.mapping != NULL) {
+        munmap(image.mapping, image.mappingSize);
+    }
+    image.mapping = NULL;
+    image.mappingSize = 0;
+    image.pixels = NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef _RAW_SIDECAR_H_
+#define _RAW_SIDECAR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "readImage.h"
+#include "expandKernels.h"
+
+// Appended to the PNG's path to name its sidecar.
+#define SIDECAR_SUFFIX ".yiraw"
+#define SIDECAR_MAGIC "YIRAW01\n"
+#define SIDECAR_VERSION 1
+
+// Rows start this many bytes apart at least, so each begins on a cache line.
+#define SIDECAR_ROW_ALIGNMENT 64
+// The pixel rows start at a multiple of this, so they can be mapped on their own.
+#define SIDECAR_PAGE_BYTES 4096
+
+/**
+ * Sidecar file layout: this header at offset 0, in host byte order, then the pixel rows from
+ * 'pixelOffset' on, 'stride' bytes apart. The header is checked with its own CRC-32 and against
+ * the PNG it came from, so a sidecar left behind by an older version of the image is never used.
+*/
+struct sidecarHeader {
+    char magic[8];
+    uint32_t version;
+    // CRC-32 of the header with this field set to 0
+    uint32_t headerCRC;
+
+    // the source image's IHDR fields
+    uint32_t width;
+    uint32_t height;
+    uint8_t channelDepth;
+    uint8_t colorType;
+    uint8_t compressionMethod;
+    uint8_t filterMethod;
+    uint8_t interlaceMethod;
+    // an enum pixelFormat
+    uint8_t pixelFormat;
+    uint8_t reserved[2];
+
+    uint64_t stride;
+    uint64_t pixelOffset;
+    uint64_t pixelBytes;
+
+    // the PNG when the sidecar was written: its size, mtime and the CRC-32 of its IDAT payloads
+    uint64_t sourceSize;
+    int64_t sourceMtimeNanoseconds;
+    uint32_t sourceChecksum;
+    uint32_t reserved2;
+};
+
+// Decoded pixels mapped read-only from a sidecar. Valid until closeRawSidecar.
+struct rawImage {
+    const unsigned char *pixels = NULL;
+    size_t stride = 0;
+    struct ihdr ihdrData;
+    enum pixelFormat format = PIXEL_RGBA8;
+
+    // the whole file as mapped
+    void *mapping = NULL;
+    size_t mappingSize = 0;
+};
+
+std::string getSidecarPath(const char *pngPath);
+
+/**
+ * Decodes the PNG straight into a new sidecar next to it, in 'format'. The file's blocks are
+ * allocated (posix_fallocate) and mapped first, the rows are defiltered into the mapping, and it
+ * is synced to disk and renamed into place once complete, so a reader never sees a partly
+ * written sidecar. Fails without writing anything if the disk is too full to hold it.
+*/
+bool writeRawSidecar(const char *pngPath, enum pixelFormat format = PIXEL_RGBA8);
+
+/**
+ * Opens the PNG's sidecar without decoding anything: checks the header, and that the PNG still
+ * has the size and mtime it had when the sidecar was written, then maps the file read-only.
+ *
+ * @param verifySource Also recompute the CRC-32 of the PNG's IDAT payloads and compare it with the
+ *                     header's; this reads the whole PNG.
+ * @return false, quietly, if there is no sidecar or it does not match the PNG.
+*/
+bool openRawSidecar(const char *pngPath, struct rawImage &image, bool verifySource = false);
+
+// Opens the sidecar, first writing it if it is missing or out of date.
+bool openOrCreateRawSidecar(const char *pngPath, struct rawImage &image, enum pixelFormat format = PIXEL_RGBA8);
+
+void closeRawSidecar(struct rawImage &image);
+
+#endif
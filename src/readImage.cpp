@@ -2,11 +2,15 @@
 
 #include <vector>
 #include <cstring>
+#include <algorithm>
+#include <memory>
 
 // file read
 #include <fstream>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // parallelization
 #include <omp.h>
@@ -14,9 +18,13 @@
 #include <iomanip>
 
 #include "readImage.h"
+#include "crcKernels.h"
 #include "printUtils.h"
+#include "trace.h"
 
 bool printVerbose = false;
+bool printSummaries = true;
+bool verifyChunkCRCs = false;
 
 int compareHeaders(unsigned char header[], std::string headerType)
 {
@@ -40,6 +48,21 @@ int compareHeaders(unsigned char header[], std::string headerType)
         unsigned char iendHeader[4] = IEND_HEADER;
         return std::memcmp(header, iendHeader, 4);
     }
+    else if (headerType == "PLTE")
+    {
+        unsigned char plteHeader[4] = PLTE_HEADER;
+        return std::memcmp(header, plteHeader, 4);
+    }
+    else if (headerType == "tRNS")
+    {
+        unsigned char trnsHeader[4] = TRNS_HEADER;
+        return std::memcmp(header, trnsHeader, 4);
+    }
+    else if (headerType == "yiDX")
+    {
+        unsigned char yidxHeader[4] = YIDX_HEADER;
+        return std::memcmp(header, yidxHeader, 4);
+    }
     else
     {
         std::cerr << "Invalid header supplied" << std::endl;
@@ -59,6 +82,140 @@ int byteArrayToInt(unsigned char byteArr[], int len)
     return result;
 }
 
+static size_t readBigEndian32(const unsigned char *data) {
+    return ((size_t) data[0] << 24) | ((size_t) data[1] << 16) | ((size_t) data[2] << 8) | (size_t) data[3];
+}
+
+// CRC of a chunk's tag and payload, which is what the CRC after the payload covers.
+static uint32_t getChunkCRC(const unsigned char tag[4], const unsigned char *payload, size_t size) {
+    return crc32Update(crc32Update(0, tag, 4), payload, size);
+}
+
+// Compares the CRC stored at 'crcOffset', after a payload, with 'crc'. 'stored' is NULL if it could not be read.
+static bool checkStoredCRC(const unsigned char *stored, size_t crcOffset, uint32_t crc, const unsigned char tag[4]) {
+    if (stored == NULL || readBigEndian32(stored) != crc) {
+        std::cerr << "CRC mismatch in the " << std::string((const char *) tag, 4) << " chunk ending at " << crcOffset << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool checkStoredCRC(int fd, size_t crcOffset, uint32_t crc, const unsigned char tag[4]) {
+    unsigned char stored[4];
+    return checkStoredCRC(pread(fd, stored, 4, crcOffset) == 4 ? stored : NULL, crcOffset, crc, tag);
+}
+
+bool verifyIDATSpans(const unsigned char *base, const std::vector<idatSpan> &spans) {
+    TRACE_SCOPE("verifyIDATSpans");
+    const unsigned char idatTag[4] = IDAT_HEADER;
+    for (const idatSpan &span : spans) {
+        if (getChunkCRC(idatTag, base + span.offset, span.length) != readBigEndian32(base + span.offset + span.length)) {
+            std::cerr << "CRC mismatch in the IDAT chunk at " << span.offset - 8 << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the PLTE payload into ihdrData.palette, all entries opaque.
+static bool parsePalette(const unsigned char *data, size_t size, struct ihdr &ihdrData) {
+    if (size == 0 || size % 3 != 0 || size > 256 * 3) {
+        return false;
+    }
+    ihdrData.paletteSize = size / 3;
+    for (int i = 0; i < ihdrData.paletteSize; i++) {
+        ihdrData.palette[i][0] = data[i * 3];
+        ihdrData.palette[i][1] = data[i * 3 + 1];
+        ihdrData.palette[i][2] = data[i * 3 + 2];
+        ihdrData.palette[i][3] = 255;
+    }
+    return true;
+}
+
+// Reads the tRNS payload: palette alphas for indexed images, a colour key for greyscale and truecolor.
+static bool parseTransparency(const unsigned char *data, size_t size, struct ihdr &ihdrData) {
+    switch (ihdrData.colorType) {
+        case 0:
+            if (size < 2) {
+                return false;
+            }
+            ihdrData.transparentKey[0] = (data[0] << 8) | data[1];
+            return true;
+        case 2:
+            if (size < 6) {
+                return false;
+            }
+            for (int i = 0; i < 3; i++) {
+                ihdrData.transparentKey[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+            }
+            return true;
+        case 3:
+            // alphas beyond the palette are ignored
+            for (size_t i = 0; i < size && (int) i < ihdrData.paletteSize; i++) {
+                ihdrData.palette[i][3] = data[i];
+            }
+            return ihdrData.paletteSize > 0;
+        default:
+            return false;
+    }
+}
+
+// Whether the colour type and bit depth pair is one the PNG spec allows.
+static bool isValidFormat(int colorType, int channelDepth) {
+    switch (colorType) {
+        case 0: return channelDepth == 1 || channelDepth == 2 || channelDepth == 4 || channelDepth == 8 || channelDepth == 16;
+        case 3: return channelDepth == 1 || channelDepth == 2 || channelDepth == 4 || channelDepth == 8;
+        case 2:
+        case 4:
+        case 6: return channelDepth == 8 || channelDepth == 16;
+        default: return false;
+    }
+}
+
+// Checks the format and that indexed images came with a palette.
+static bool checkFormat(const struct ihdr &ihdrData) {
+    if (!isValidFormat(ihdrData.colorType, ihdrData.channelDepth)) {
+        std::cerr << "Unsupported color type " << ihdrData.colorType << " with bit depth " << ihdrData.channelDepth << std::endl;
+        return false;
+    }
+    if (ihdrData.colorType == 3 && ihdrData.paletteSize == 0) {
+        std::cerr << "Indexed color image without a PLTE chunk" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool parseRestartIndex(const unsigned char *data, size_t size, int height, std::vector<restartPoint> &restartPoints)
+{
+    restartPoints.clear();
+
+    if (size < 4) {
+        return false;
+    }
+    size_t count = readBigEndian32(data);
+    if (count == 0 || size != 4 + count * 8) {
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *entry = data + 4 + i * 8;
+        restartPoint point;
+        point.firstRow = (int) readBigEndian32(entry);
+        point.offset = readBigEndian32(entry + 4);
+
+        // rows and offsets must both strictly increase, starting from row 0
+        bool valid = (i == 0) ? point.firstRow == 0
+                              : point.firstRow > restartPoints.back().firstRow && point.offset > restartPoints.back().offset;
+        if (!valid || point.firstRow >= height) {
+            restartPoints.clear();
+            return false;
+        }
+        restartPoints.push_back(point);
+    }
+
+    return true;
+}
+
 void printChunkInfo(int sizeBytes, int offset, unsigned char chunkHeader[])
 {
     if (!printVerbose) {
@@ -72,35 +229,11 @@ void printChunkInfo(int sizeBytes, int offset, unsigned char chunkHeader[])
     std::cout << "Starting at: " << offset << " bytes" << std::endl;
 }
 
-/**
- * Appends IDAT chunk data into the provided vector.
- * 
- * Starts from the actual chunk start, i.e. including the IDAT chunk's metadata (byte size and IDAT tag). 
- * The provided size should NOT include the 4 CRC bytes at the end. PNG chunk size metadata does not count
- * the CRC bytes anyways.
- * 
- * @param fd The file descriptor of the png
- * @param start The starting point of the chunk including its header
- * @param imageRGBA The vector to append data to.
- * @return true if successful. false otherwise.
-*/
-bool readIDAT(int fd, int start, int size, std::vector<unsigned char> &imageRGBA)
-{ 
-    unsigned char buffer[size];
-    
-    // Skip the chunk header (size + tag).
-    start += 8;
-
-    if (pread(fd, &buffer, size, start) != size) {
-        return false;
+void printReadSummary(struct ihdr ihdrData) {
+    if (!printSummaries) {
+        return;
     }
 
-    imageRGBA.insert(imageRGBA.end(), buffer, buffer + size);
-
-    return true;
-}
-
-void printReadSummary(struct ihdr ihdrData) {
     std::cout << PRINT_DIVIDER_BIG << std::endl;
     std::cout << "Image reading summary" << std::endl;
     std::cout << "\tDimensions: " << ihdrData.width << " x " << ihdrData.height << std::endl;
@@ -112,60 +245,169 @@ void printReadSummary(struct ihdr ihdrData) {
 
 }
 
-bool readIHDR(int fd, int start, int size, struct ihdr &ihdrData) {
-    unsigned char widthBuff[4], heightBuff[4];
-    unsigned char channelDepth, colorType, compressionMethod, filterMethod, interlaceMethod;
+// Fills the IHDR fields from the 13 byte IHDR payload.
+static void parseIHDR(const unsigned char *data, struct ihdr &ihdrData) {
+    ihdrData.width = (int) readBigEndian32(data);
+    ihdrData.height = (int) readBigEndian32(data + 4);
+    ihdrData.channelDepth = (int) data[8];
+    ihdrData.colorType = (int) data[9];
+    ihdrData.compressionMethod = (int) data[10];
+    ihdrData.filterMethod = (int) data[11];
+    ihdrData.interlaceMethod = (int) data[12];
+    ihdrData.paletteSize = 0;
+    ihdrData.transparentKey[0] = ihdrData.transparentKey[1] = ihdrData.transparentKey[2] = -1;
+}
+
+// Bytes [begin, end) of a file.
+struct fileRange {
+    size_t begin;
+    size_t end;
+};
 
-    // 'start' begins at the start of the IHDR chunk.
-    // we skip the first 8 bytes (chunk name and chunk size) to get the width.
-    // we skip another 4 bytes to get the height, since image width & height are 4 bytes each.
-    if (pread(fd, &widthBuff, 4, start + 8) != 4) {
+// What a probe read, kept so the payloads in its windows need not be read again.
+struct probeWindows {
+    // one buffer per window, holding the bytes of the range at the same index
+    std::vector<std::unique_ptr<unsigned char[]>> buffers;
+    // in file order; consecutive windows can overlap by a chunk header
+    std::vector<fileRange> ranges;
+};
+
+/**
+ * Builds the chunk table of the open file from a window read at a time: the first read is
+ * PROBE_FIRST_READ_BYTES, and a chunk whose header falls past the window starts a new one of
+ * PROBE_WINDOW_BYTES there, skipping over the payloads in between.
+ *
+ * @param kept If not NULL, each window is read into a buffer of its own and kept there, so what is
+ *             kept is what was read, however large the file.
+*/
+static bool probePNGFile(int fd, struct pngProbe &probe, enum probeDepth depth, struct probeWindows *kept = NULL)
+{
+    TRACE_SCOPE("probePNGFile");
+    unsigned char stackWindow[PROBE_WINDOW_BYTES], pngHeader[8] = PNG_HEADER;
+    unsigned char *window = stackWindow;
+    size_t windowStart = 0, windowSize = 0;
+    struct stat fileStat;
+
+    probe.chunks.clear();
+    probe.complete = false;
+    probe.fileSize = 0;
+    probe.reads = 0;
+    probe.bytesRead = 0;
+
+    if (fstat(fd, &fileStat) != 0) {
+        std::cerr << "Error reading size of image file" << std::endl;
         return false;
     }
-    if (pread(fd, &heightBuff, 4, start + 12) != 4) {
-        return false;
+    probe.fileSize = fileStat.st_size;
+    if (kept != NULL) {
+        kept->buffers.clear();
+        kept->ranges.clear();
     }
 
-    // get bit depth per channel (1 byte)
-    if (pread(fd, &channelDepth, 1, start + 16) != 1) {
-        return false;
-    }
+    // reads up to 'wanted' bytes from 'offset' into the window, stopping at the end of the file
+    auto readWindow = [&](size_t offset, size_t wanted) {
+        wanted = std::min(wanted, probe.fileSize - offset);
+        unsigned char *target = stackWindow;
+        if (kept != NULL) {
+            kept->buffers.emplace_back(new unsigned char[wanted]);
+            target = kept->buffers.back().get();
+        }
+        ssize_t got = pread(fd, target, wanted, offset);
+        probe.reads++;
+        if (got < 0) {
+            if (kept != NULL) {
+                kept->buffers.pop_back();
+            }
+            return false;
+        }
+        probe.bytesRead += got;
+        window = target;
+        windowStart = offset;
+        windowSize = got;
+        if (kept != NULL) {
+            kept->ranges.push_back({offset, offset + got});
+        }
+        return true;
+    };
 
-    // get color type (1 byte)
-    if (pread(fd, &colorType, 1, start + 17) != 1) {
+    if (!readWindow(0, PROBE_FIRST_READ_BYTES) || windowSize < 8 || std::memcmp(window, pngHeader, 8) != 0) {
+        std::cerr << "Mismatching image headers" << std::endl;
         return false;
     }
 
-    // get compression method (1 byte)
-    if (pread(fd, &compressionMethod, 1, start + 18) != 1) {
-        return false;
-    }    
+    bool seenIHDR = false;
+    size_t offset = 8; // First 8 bytes determine the png image format -- we already checked this
+    while (offset + 12 <= probe.fileSize) {
+        // the IHDR payload is needed along with the header; of any other chunk only the header
+        bool inWindow = offset + 8 <= windowStart + windowSize;
+        if (inWindow && std::memcmp(window + (offset - windowStart) + 4, "IHDR", 4) == 0) {
+            inWindow = offset + 8 + 13 <= windowStart + windowSize;
+        }
+        if (!inWindow && (!readWindow(offset, seenIHDR ? PROBE_WINDOW_BYTES : PROBE_FIRST_READ_BYTES) || windowSize < 8)) {
+            std::cerr << "Error reading header of chunk at " << offset << std::endl;
+            return false;
+        }
 
-    // get filter method (1 byte)
-    if (pread(fd, &filterMethod, 1, start + 19) != 1) {
-        return false;
-    }   
+        const unsigned char *header = window + (offset - windowStart);
+        size_t sizeBytes = readBigEndian32(header);
+        if (sizeBytes > probe.fileSize - offset - 12) {
+            std::cerr << "Chunk at " << offset << " runs past the end of the file" << std::endl;
+            return false;
+        }
 
-    // get interlace method (1 byte)
-    if (pread(fd, &interlaceMethod, 1, start + 20) != 1) {
-        return false;
-    }   
+        struct chunkEntry chunk;
+        std::memcpy(chunk.type, header + 4, 4);
+        chunk.offset = offset;
+        chunk.length = sizeBytes;
+        chunk.crcOffset = offset + 8 + sizeBytes;
+        probe.chunks.push_back(chunk);
 
-    ihdrData.width = byteArrayToInt(widthBuff, 4);
-    ihdrData.height = byteArrayToInt(heightBuff, 4);
+        if (std::memcmp(chunk.type, "IHDR", 4) == 0 && sizeBytes >= 13 && !seenIHDR) {
+            if (windowStart + windowSize < offset + 8 + 13) {
+                std::cerr << "Error reading IHDR" << std::endl;
+                return false;
+            }
+            parseIHDR(header + 8, probe.ihdrData);
+            seenIHDR = true;
+            if (depth == PROBE_HEADER) {
+                return true;
+            }
+        } else if (std::memcmp(chunk.type, "IEND", 4) == 0) {
+            probe.complete = true;
+            break;
+        }
 
-    // single byte data can be casted to int
-    ihdrData.channelDepth = (int) channelDepth;
-    ihdrData.colorType = (int) colorType;
-    ihdrData.compressionMethod = (int) compressionMethod;
-    ihdrData.filterMethod = (int) filterMethod;
-    ihdrData.interlaceMethod = (int) interlaceMethod;
+        offset += sizeBytes + 12; // 12 bytes reserved for chunk metadata (size, name, CRC)
+    }
 
+    if (!seenIHDR) {
+        std::cerr << "Failed to find the IHDR chunk" << std::endl;
+        return false;
+    }
+    if (!probe.complete) {
+        std::cerr << "Failed to find the IEND chunk" << std::endl;
+        return false;
+    }
     return true;
 }
 
-bool readPNGImage(const char *filename, std::vector<unsigned char> &imageRGBA, struct ihdr &ihdrData)
+bool probePNG(const char *filename, struct pngProbe &probe, enum probeDepth depth)
 {
+    TRACE_SCOPE("probePNG");
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        std::cerr << "Error opening image file" << std::endl;
+        return false;
+    }
+    bool ok = probePNGFile(fd, probe, depth);
+    close(fd);
+    return ok;
+}
+
+bool readPNGImage(const char *filename, std::vector<unsigned char> &imageRGBA, struct ihdr &ihdrData, std::vector<restartPoint> *restartPoints)
+{
+    TRACE_SCOPE("readPNGImage");
+    struct pngProbe probe;
     int fd = open(filename, O_RDONLY);
 
     if (fd == -1)
@@ -174,92 +416,372 @@ bool readPNGImage(const char *filename, std::vector<unsigned char> &imageRGBA, s
         exit(EXIT_FAILURE);
     }
 
-    // Check PNG and read file signature (first 8 bytes)
-    unsigned char header[8];
-    if (pread(fd, header, 8, 0) != 8 || compareHeaders(header, "PNG") != 0)
-    {
-        std::cerr << "Mismatching image headers" << std::endl;
-        exit(EXIT_FAILURE);
+    if (restartPoints != NULL) {
+        restartPoints->clear();
     }
 
-    bool reachedIDAT = false;
-    int offset = 8; // First 8 bytes determine the png image format -- we already checked this
+    // The chunk table comes from a few large reads, kept window by window; after that only the payload
+    // bytes that fell between the probe's windows are read.
+    struct probeWindows windows;
+    if (!probePNGFile(fd, probe, PROBE_CHUNK_TABLE, &windows)) {
+        close(fd);
+        return false;
+    }
+    ihdrData = probe.ihdrData;
+
+    // Copies file bytes [begin, end) to 'out', from the windows where they cover it and with pread elsewhere.
+    auto copyFileRange = [&](size_t begin, size_t end, unsigned char *out) {
+        size_t position = begin;
+        auto readGap = [&](size_t to) {
+            bool ok = pread(fd, out + (position - begin), to - position, position) == (ssize_t) (to - position);
+            position = to;
+            return ok;
+        };
+        for (size_t i = 0; i < windows.ranges.size(); i++) {
+            const fileRange &range = windows.ranges[i];
+            if (range.end <= position) {
+                continue;
+            }
+            if (range.begin >= end) {
+                break;
+            }
+            if (range.begin > position && !readGap(range.begin)) {
+                return false;
+            }
+            size_t to = std::min(range.end, end);
+            std::memcpy(out + (position - begin), windows.buffers[i].get() + (position - range.begin), to - position);
+            position = to;
+        }
+        return position >= end || readGap(end);
+    };
 
-    // Set all ihdr fields to -1. We check at the end if any values are still -1. If so, we return
-    // in error.
-    ihdrData.width = -1;
-    ihdrData.height = -1;
-    ihdrData.channelDepth = -1;
-    ihdrData.colorType = -1;
-    ihdrData.compressionMethod = -1;
-    ihdrData.filterMethod = -1;
-    ihdrData.interlaceMethod = -1;
+    size_t idatBytes = 0;
+    for (const chunkEntry &chunk : probe.chunks) {
+        if (std::memcmp(chunk.type, "IDAT", 4) == 0) {
+            idatBytes += chunk.length;
+        }
+    }
+    imageRGBA.reserve(imageRGBA.size() + idatBytes);
 
-    // Iterate over file until we encounter the IEND chunk or
-    // the start of the chunk indicates a 0 byte length.
-    // The IEND chunk should normally have a size of 0 bytes.
-    while (1)
-    {
-        unsigned char size[4], chunkHeader[5];
+    for (const chunkEntry &chunk : probe.chunks) {
+        TRACE_SCOPE("readChunk");
+        unsigned char chunkHeader[5] = {0};
+        std::memcpy(chunkHeader, chunk.type, 4);
+        int sizeBytes = chunk.length;
 
-        if (pread(fd, size, 4, offset) != 4)
-        {
-            std::cerr << "Error reading size of chunk" << std::endl;
-            exit(EXIT_FAILURE);
+        // print size and chunk name
+        printChunkInfo(sizeBytes, chunk.offset, chunkHeader);
+
+        bool isIDAT = compareHeaders(chunkHeader, "IDAT") == 0;
+        bool isPalette = compareHeaders(chunkHeader, "PLTE") == 0;
+        bool isTransparency = compareHeaders(chunkHeader, "tRNS") == 0;
+        bool isRestartIndex = restartPoints != NULL && compareHeaders(chunkHeader, "yiDX") == 0;
+        std::vector<unsigned char> payload;
+        const unsigned char *data;
+
+        if (isIDAT) {
+            size_t oldSize = imageRGBA.size();
+            imageRGBA.resize(oldSize + sizeBytes);
+            if (!copyFileRange(chunk.offset + 8, chunk.crcOffset, imageRGBA.data() + oldSize)) {
+                std::cerr << "Error reading IDAT" << std::endl;
+                close(fd);
+                return false;
+            }
+            data = imageRGBA.data() + oldSize;
+        } else if (isPalette || isTransparency || isRestartIndex || verifyChunkCRCs) {
+            payload.resize(sizeBytes);
+            data = payload.data();
+            if (!copyFileRange(chunk.offset + 8, chunk.crcOffset, payload.data())) {
+                std::cerr << "Error reading " << chunkHeader << " chunk" << std::endl;
+                close(fd);
+                return false;
+            }
+            if ((isPalette && !parsePalette(data, sizeBytes, ihdrData)) || (isTransparency && !parseTransparency(data, sizeBytes, ihdrData))) {
+                std::cerr << "Ignoring malformed " << chunkHeader << " chunk" << std::endl;
+            }
+            if (isRestartIndex && !parseRestartIndex(data, sizeBytes, ihdrData.height, *restartPoints)) {
+                std::cerr << "Ignoring malformed yiDX chunk" << std::endl;
+            }
+        } else {
+            continue;
         }
 
-        if (pread(fd, chunkHeader, 4, offset + 4) != 4)
-        {
-            std::cerr << "Error reading header of chunk" << std::endl;
-            exit(EXIT_FAILURE);
+        unsigned char stored[4];
+        if (verifyChunkCRCs && !checkStoredCRC(copyFileRange(chunk.crcOffset, chunk.crcOffset + 4, stored) ? stored : NULL, chunk.crcOffset, getChunkCRC(chunkHeader, data, sizeBytes), chunkHeader)) {
+            close(fd);
+            return false;
         }
+    }
+    close(fd);
+
+    if (!checkFormat(ihdrData)) {
+        return false;
+    }
+
+    printReadSummary(ihdrData);
+
+    return true;
+}
+bool mapPNGImage(const char *filename, struct mappedPNG &image)
+{
+    TRACE_SCOPE("mapPNGImage");
+    struct stat fileStat;
+    int fd = open(filename, O_RDONLY);
 
-        int sizeBytes = byteArrayToInt(size, 4);
+    image.base = NULL;
+    image.size = 0;
+    image.idatSpans.clear();
+    image.restartPoints.clear();
 
+    if (fd == -1) {
+        std::cerr << "Error opening image file" << std::endl;
+        return false;
+    }
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < 8) {
+        std::cerr << "Error reading size of image file" << std::endl;
+        close(fd);
+        return false;
+    }
 
-        if (strcmp((char *) chunkHeader, "IHDR") == 0) {
-            bool success = readIHDR(fd, offset, sizeBytes, ihdrData);
+    size_t fileSize = fileStat.st_size;
+    void *mapping = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
 
-            if (!success) {
-                std::cerr << "Error reading IHDR" << std::endl;
-                exit(EXIT_FAILURE);
-            }
-        }
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Error mapping image file" << std::endl;
+        return false;
+    }
+    madvise(mapping, fileSize, MADV_SEQUENTIAL);
 
-        // print size and chunk name
-        printChunkInfo(sizeBytes, offset, chunkHeader);
+    if (!indexPNGBuffer((const unsigned char *) mapping, fileSize, image)) {
+        munmap(mapping, fileSize);
+        image.base = NULL;
+        image.size = 0;
+        return false;
+    }
+    return true;
+}
 
-        if (strcmp((char *)chunkHeader, "IDAT") == 0)
-        {
-            bool success = readIDAT(fd, offset, sizeBytes, imageRGBA);
+bool indexPNGBuffer(const unsigned char *data, size_t size, struct mappedPNG &image)
+{
+    TRACE_SCOPE("indexPNGBuffer");
+    image.base = data;
+    image.size = size;
+    image.idatSpans.clear();
+    image.restartPoints.clear();
+
+    unsigned char pngHeader[8] = PNG_HEADER;
+    if (size < 8 || std::memcmp(data, pngHeader, 8) != 0) {
+        std::cerr << "Mismatching image headers" << std::endl;
+        return false;
+    }
 
-            if (!success) {
-                std::cerr << "Error reading IDAT" << std::endl;
-                exit(EXIT_FAILURE);
-            }
+    bool seenIHDR = false, seenIEND = false;
+    size_t offset = 8; // First 8 bytes determine the png image format -- we already checked this
+
+    // Walk the chunks in place. Each chunk is a 4 byte length, a 4 byte tag,
+    // the payload and a 4 byte CRC.
+    while (offset + 12 <= size) {
+        TRACE_SCOPE("parseChunk");
+        const unsigned char *chunk = image.base + offset;
+        size_t sizeBytes = readBigEndian32(chunk);
+
+        if (sizeBytes > size - offset - 12) {
+            std::cerr << "Chunk at " << offset << " runs past the end of the file" << std::endl;
+            return false;
         }
 
-        if (strcmp((char *) chunkHeader, "IEND") == 0 || sizeBytes == 0) {
+        // IDAT chunks are left to decompressIDAT, which checks them alongside the inflate
+        bool isIDAT = std::memcmp(chunk + 4, "IDAT", 4) == 0;
+        if (verifyChunkCRCs && !isIDAT && getChunkCRC(chunk + 4, chunk + 8, sizeBytes) != readBigEndian32(chunk + 8 + sizeBytes)) {
+            std::cerr << "CRC mismatch in the " << std::string((const char *) chunk + 4, 4) << " chunk at " << offset << std::endl;
+            return false;
+        }
+
+        if (std::memcmp(chunk + 4, "IHDR", 4) == 0 && sizeBytes >= 13) {
+            parseIHDR(chunk + 8, image.ihdrData);
+            seenIHDR = true;
+        } else if (isIDAT) {
+            image.idatSpans.push_back({offset + 8, sizeBytes});
+        } else if (std::memcmp(chunk + 4, "PLTE", 4) == 0 && seenIHDR) {
+            if (!parsePalette(chunk + 8, sizeBytes, image.ihdrData)) {
+                std::cerr << "Ignoring malformed PLTE chunk" << std::endl;
+            }
+        } else if (std::memcmp(chunk + 4, "tRNS", 4) == 0 && seenIHDR) {
+            if (!parseTransparency(chunk + 8, sizeBytes, image.ihdrData)) {
+                std::cerr << "Ignoring malformed tRNS chunk" << std::endl;
+            }
+        } else if (std::memcmp(chunk + 4, "yiDX", 4) == 0 && seenIHDR) {
+            if (!parseRestartIndex(chunk + 8, sizeBytes, image.ihdrData.height, image.restartPoints)) {
+                std::cerr << "Ignoring malformed yiDX chunk" << std::endl;
+            }
+        } else if (std::memcmp(chunk + 4, "IEND", 4) == 0) {
+            seenIEND = true;
             break;
         }
 
         offset += sizeBytes + 12; // 12 bytes reserved for chunk metadata (size, name, CRC)
     }
 
-    // ensure all IHDR values are initialized
-    if (ihdrData.width == -1 || ihdrData.height == -1 || ihdrData.channelDepth == -1 || ihdrData.colorType == -1 || ihdrData.compressionMethod == -1 || ihdrData.filterMethod == -1 || ihdrData.interlaceMethod == -1) {
-        std::cerr << "Failed to get metadata from IHDR" << std::endl;
+    if (!seenIHDR || !seenIEND || image.idatSpans.empty()) {
+        std::cerr << "Failed to find IHDR, IDAT and IEND chunks" << std::endl;
         return false;
     }
+    return checkFormat(image.ihdrData);
+}
+
+void unmapPNGImage(struct mappedPNG &image)
+{
+    if (image.base != NULL) {
+        munmap(const_cast<unsigned char *>(image.base), image.size);
+    }
+    image.base = NULL;
+    image.size = 0;
+    image.idatSpans.clear();
+    image.restartPoints.clear();
+}
 
-    // Temporary block since we currently cannot guarantee the code is built
-    // for color type 6, i.e. bytes/pixel != 4 (i.e. RGBA)
-    if (ihdrData.colorType != 6) {
-        std::cerr << "Unsupported color type. Only type 6 is supported!" << std::endl;
+// Reads the length and tag of the chunk at 'offset'.
+static bool readChunkHeader(int fd, size_t offset, size_t &sizeBytes, unsigned char tag[4]) {
+    unsigned char header[8];
+    if (pread(fd, header, 8, offset) != 8) {
         return false;
     }
+    sizeBytes = readBigEndian32(header);
+    std::memcpy(tag, header + 4, 4);
+    return true;
+}
 
-    printReadSummary(ihdrData);
+bool openPNGReader(const char *filename, struct pngReader &reader)
+{
+    TRACE_SCOPE("openPNGReader");
+    unsigned char signature[8], pngHeader[8] = PNG_HEADER;
+    bool seenIHDR = false;
+
+    reader.fd = open(filename, O_RDONLY);
+    reader.offset = 8;
+    reader.chunkRemaining = 0;
+    reader.idatBytesRead = 0;
+    reader.reachedEnd = false;
+    reader.chunkCRC = 0;
+
+    if (reader.fd == -1) {
+        std::cerr << "Error opening image file" << std::endl;
+        return false;
+    }
+    if (pread(reader.fd, signature, 8, 0) != 8 || std::memcmp(signature, pngHeader, 8) != 0) {
+        std::cerr << "Mismatching image headers" << std::endl;
+        closePNGReader(reader);
+        return false;
+    }
+
+    // The spec puts PLTE and tRNS before the first IDAT, so they are all read by the time it is reached.
+    while (1) {
+        size_t sizeBytes;
+        unsigned char tag[4];
 
+        if (!readChunkHeader(reader.fd, reader.offset, sizeBytes, tag)) {
+            std::cerr << "Error reading header of chunk" << std::endl;
+            closePNGReader(reader);
+            return false;
+        }
+
+        if (std::memcmp(tag, "IDAT", 4) == 0) {
+            reader.offset += 8;
+            reader.chunkRemaining = sizeBytes;
+            reader.chunkCRC = getChunkCRC(tag, NULL, 0);
+            break;
+        }
+        if (std::memcmp(tag, "IEND", 4) == 0) {
+            std::cerr << "No IDAT chunk before IEND" << std::endl;
+            closePNGReader(reader);
+            return false;
+        }
+
+        bool isIHDR = std::memcmp(tag, "IHDR", 4) == 0 && sizeBytes >= 13;
+        bool isPalette = std::memcmp(tag, "PLTE", 4) == 0 && seenIHDR;
+        bool isTransparency = std::memcmp(tag, "tRNS", 4) == 0 && seenIHDR;
+        if (isIHDR || isPalette || isTransparency || verifyChunkCRCs) {
+            std::vector<unsigned char> payload(sizeBytes);
+            if (pread(reader.fd, payload.data(), sizeBytes, reader.offset + 8) != (ssize_t) sizeBytes) {
+                std::cerr << "Error reading chunk at " << reader.offset << std::endl;
+                closePNGReader(reader);
+                return false;
+            }
+            if (verifyChunkCRCs && !checkStoredCRC(reader.fd, reader.offset + 8 + sizeBytes, getChunkCRC(tag, payload.data(), sizeBytes), tag)) {
+                closePNGReader(reader);
+                return false;
+            }
+            if (isIHDR) {
+                parseIHDR(payload.data(), reader.ihdrData);
+                seenIHDR = true;
+            } else if (!(isPalette ? parsePalette(payload.data(), sizeBytes, reader.ihdrData) : parseTransparency(payload.data(), sizeBytes, reader.ihdrData))) {
+                std::cerr << "Ignoring malformed " << (isPalette ? "PLTE" : "tRNS") << " chunk" << std::endl;
+            }
+        }
+
+        reader.offset += sizeBytes + 12; // 12 bytes reserved for chunk metadata (size, name, CRC)
+    }
+
+    if (!seenIHDR) {
+        std::cerr << "Failed to find the IHDR chunk" << std::endl;
+        closePNGReader(reader);
+        return false;
+    }
+    if (!checkFormat(reader.ihdrData)) {
+        closePNGReader(reader);
+        return false;
+    }
     return true;
 }
+
+long readIDATData(struct pngReader &reader, unsigned char *buffer, size_t size)
+{
+    TRACE_SCOPE("readIDATData");
+    size_t done = 0;
+
+    while (done < size && !reader.reachedEnd) {
+        if (reader.chunkRemaining == 0) {
+            // IDAT chunks are consecutive, so the data ends at the first chunk of another type
+            size_t sizeBytes;
+            unsigned char tag[4];
+            const unsigned char idatTag[4] = IDAT_HEADER;
+            if (verifyChunkCRCs && !checkStoredCRC(reader.fd, reader.offset, reader.chunkCRC, idatTag)) {
+                return -1;
+            }
+            size_t next = reader.offset + 4; // skip the CRC
+            if (!readChunkHeader(reader.fd, next, sizeBytes, tag) || std::memcmp(tag, "IDAT", 4) != 0) {
+                reader.reachedEnd = true;
+                break;
+            }
+            reader.offset = next + 8;
+            reader.chunkRemaining = sizeBytes;
+            reader.chunkCRC = getChunkCRC(tag, NULL, 0);
+            continue;
+        }
+
+        size_t wanted = std::min(size - done, reader.chunkRemaining);
+        ssize_t got = pread(reader.fd, buffer + done, wanted, reader.offset);
+        if (got <= 0) {
+            std::cerr << "Error reading IDAT data at " << reader.offset << std::endl;
+            return -1;
+        }
+        if (verifyChunkCRCs) {
+            reader.chunkCRC = crc32Update(reader.chunkCRC, buffer + done, got);
+        }
+        reader.offset += got;
+        reader.chunkRemaining -= got;
+        reader.idatBytesRead += got;
+        done += got;
+    }
+    return done;
+}
+
+void closePNGReader(struct pngReader &reader)
+{
+    if (reader.fd != -1) {
+        close(reader.fd);
+    }
+    reader.fd = -1;
+}
@@ -1,4 +1,10 @@
+#ifndef _READ_IMAGE_H_
+#define _READ_IMAGE_H_
+
 #include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
 
 // PNG chunk headers
 #define PNG_HEADER                                     \
@@ -17,6 +23,20 @@
     {                          \
         0x49, 0x45, 0x4e, 0x44 \
     }
+#define PLTE_HEADER            \
+    {                          \
+        0x50, 0x4c, 0x54, 0x45 \
+    }
+#define TRNS_HEADER            \
+    {                          \
+        0x74, 0x52, 0x4e, 0x53 \
+    }
+// Private restart index chunk ("yiDX"): ancillary, private, not safe to copy
+// since it describes byte offsets within the IDAT stream.
+#define YIDX_HEADER            \
+    {                          \
+        0x79, 0x69, 0x44, 0x58 \
+    }
 
 struct ihdr {
     int width;
@@ -26,8 +46,25 @@ struct ihdr {
     int compressionMethod;
     int filterMethod;
     int interlaceMethod;
+
+    // From the PLTE chunk, as RGBA. Alpha is 255 unless a tRNS chunk lowers it.
+    int paletteSize = 0;
+    unsigned char palette[256][4];
+    // tRNS colour key for greyscale (one sample) and truecolor (three samples) images,
+    // in the image's own sample depth. -1 when the image has none.
+    int transparentKey[3] = {-1, -1, -1};
 };
 
+// Whether readPNGImage, decompressIDAT and defilterIDAT print their summaries. Batch and benchmark callers turn this off.
+extern bool printSummaries;
+
+/**
+ * Whether chunk CRCs are checked; off by default. readPNGImage, mapPNGImage and openPNGReader
+ * then reject a file with a corrupted chunk. The IDAT chunks of a mapped file are checked by the
+ * decompressIDAT overloads that take its spans, on their own thread while inflate runs.
+*/
+extern bool verifyChunkCRCs;
+
 int compareHeaders(unsigned char header[], std::string headerType);
 
 int byteArrayToInt(unsigned char byteArr[], int len);
@@ -35,21 +72,159 @@ int byteArrayToInt(unsigned char byteArr[], int len);
 void printChunkInfo(int sizeBytes, int offset, unsigned char chunkHeader[]);
 
 /**
- * Appends IDAT chunk data into the provided vector.
- * 
- * Starts from the actual chunk start, i.e. including the IDAT chunk's metadata (byte size and IDAT tag). 
- * The provided size should NOT include the 4 CRC bytes at the end. PNG chunk size metadata does not count
- * the CRC bytes anyways.
- * 
- * @param fd The file descriptor of the png
- * @param start The starting point of the chunk including its header
- * @param imageRGBA The vector to append data to.
- * @return true if successful. false otherwise.
+ * A point at which the IDAT zlib stream can be inflated independently of what comes before it.
+ *
+ * Written by the indexPNG tool as a private "yiDX" chunk. The encoder issued a full flush
+ * (byte aligned, empty dictionary) right before 'firstRow', so a raw inflate started at
+ * 'offset' produces scanlines firstRow, firstRow + 1, ... up to the next restart point.
+ *
+ * yiDX payload, big endian: uint32 count, then 'count' pairs of (uint32 firstRow, uint32 offset).
+ * The first point is always row 0 at offset 2, directly after the zlib header.
 */
-bool readIDAT(int fd, int start, int size, std::vector<unsigned char> &imageRGBA);
+struct restartPoint {
+    int firstRow;
+    // byte offset into the concatenated IDAT data
+    size_t offset;
+};
 
-bool readIHDR(int fd, int start, int size, struct ihdr &ihdrData);
+/**
+ * Parses and validates a yiDX payload.
+ *
+ * @return false if the payload is malformed, in which case the index should be ignored.
+*/
+bool parseRestartIndex(const unsigned char *data, size_t size, int height, std::vector<restartPoint> &restartPoints);
+
+// The first read of a probe; enough for the signature, IHDR and the small chunks that usually follow.
+#define PROBE_FIRST_READ_BYTES 4096
+// Each further read of a probe, starting at a chunk header past the last read.
+#define PROBE_WINDOW_BYTES (64 * 1024)
+
+// Where one chunk sits in the file.
+struct chunkEntry {
+    char type[4];
+    // of the chunk's 4 byte length; the tag follows, then the payload at offset + 8
+    size_t offset;
+    // of the payload, not counting the length, tag or CRC
+    size_t length;
+    // of the 4 byte CRC after the payload
+    size_t crcOffset;
+};
+
+enum probeDepth {
+    // stop at IHDR
+    PROBE_HEADER,
+    // list every chunk up to IEND
+    PROBE_CHUNK_TABLE
+};
+
+struct pngProbe {
+    // IHDR fields only; PLTE and tRNS are listed in the table but not read
+    struct ihdr ihdrData;
+    size_t fileSize;
+    // in file order, up to IHDR or IEND depending on the depth
+    std::vector<chunkEntry> chunks;
+    // whether the table reaches IEND
+    bool complete;
+    // preads issued, and the bytes they returned
+    int reads;
+    size_t bytesRead;
+};
+
+/**
+ * Reads where the file's chunks are, and its IHDR metadata, without reading any payload but IHDR's.
+ * A header probe is a single PROBE_FIRST_READ_BYTES pread for any well formed PNG, which puts IHDR
+ * first. A chunk table adds a PROBE_WINDOW_BYTES pread for each header past the previous read: a
+ * few reads for a file written in large IDAT chunks, about one per window for small ones (libpng
+ * writes 8 KiB chunks by default).
+ *
+ * @return false if the file cannot be read, is not a PNG or has no IHDR, or (for the chunk table)
+ *         has a chunk running past its end or no IEND.
+*/
+bool probePNG(const char *filename, struct pngProbe &probe, enum probeDepth depth = PROBE_HEADER);
 
-bool readPNGImage(const char *filename, std::vector<unsigned char> &imageRGBA, struct ihdr &ihdrData);
+/**
+ * Reads the IHDR metadata and the concatenated IDAT data, taking the chunk table from a probe.
+ * Payload bytes the probe's windows already hold are copied from them, and only the rest is read,
+ * straight into place: a file written in small chunks is read about once in all.
+ *
+ * @param restartPoints If not NULL, receives the contents of a yiDX chunk if the file has a valid one,
+ * or is left empty otherwise.
+*/
+bool readPNGImage(const char *filename, std::vector<unsigned char> &imageRGBA, struct ihdr &ihdrData, std::vector<restartPoint> *restartPoints = NULL);
+
+// Location of one IDAT chunk's payload, relative to the start of the file.
+struct idatSpan {
+    size_t offset;
+    size_t length;
+};
+
+// A PNG file mapped read-only into memory, along with where its IDAT payloads sit.
+struct mappedPNG {
+    const unsigned char *base;
+    size_t size;
+    std::vector<idatSpan> idatSpans;
+    struct ihdr ihdrData;
+    // empty unless the file has a valid yiDX chunk
+    std::vector<restartPoint> restartPoints;
+};
+
+/**
+ * Maps the file with mmap (advised MADV_SEQUENTIAL) and records the IDAT payload spans
+ * without copying them. The spans can be handed straight to decompressIDAT / streamDecodeIDAT.
+ *
+ * @return true if successful. false otherwise, in which case nothing is left mapped.
+*/
+bool mapPNGImage(const char *filename, struct mappedPNG &image);
+
+/**
+ * Records the chunks of a PNG already in memory, as mapPNGImage does for a mapped one. 'image.base'
+ * then points into 'data', which the caller keeps alive and frees itself; do not unmapPNGImage it.
+*/
+bool indexPNGBuffer(const unsigned char *data, size_t size, struct mappedPNG &image);
+
+void unmapPNGImage(struct mappedPNG &image);
+
+/**
+ * Checks the CRC stored after each IDAT payload in 'spans' (relative to 'base', as mapPNGImage
+ * records them), in file order.
+ *
+ * @return false at the first corrupted chunk.
+*/
+bool verifyIDATSpans(const unsigned char *base, const std::vector<idatSpan> &spans);
+
+// A PNG read a piece at a time with pread: the chunks before the image data up front, then the
+// IDAT payload only as far as the caller asks for it.
+struct pngReader {
+    int fd;
+    struct ihdr ihdrData;
+    // file offset of the next unread IDAT payload byte, and what is left of its chunk
+    size_t offset;
+    size_t chunkRemaining;
+    // IDAT payload bytes handed out so far
+    size_t idatBytesRead;
+    bool reachedEnd;
+    // CRC of the current IDAT chunk so far, kept when verifyChunkCRCs is set
+    uint32_t chunkCRC;
+};
+
+/**
+ * Opens the file and reads its chunks up to the first IDAT (IHDR, PLTE, tRNS). Nothing from the
+ * first IDAT on is read yet.
+ *
+ * @return true if successful. false otherwise, in which case the file is already closed.
+*/
+bool openPNGReader(const char *filename, struct pngReader &reader);
+
+/**
+ * Reads up to 'size' bytes of IDAT payload into 'buffer', moving on to the next IDAT chunk when
+ * one runs out. With verifyChunkCRCs each IDAT chunk read to its end is checked before moving on;
+ * a chunk the caller stops partway through is not.
+ *
+ * @return the number of bytes read, 0 once the IDAT chunks are used up, -1 on a read error or a
+ *         CRC mismatch.
+*/
+long readIDATData(struct pngReader &reader, unsigned char *buffer, size_t size);
 
+void closePNGReader(struct pngReader &reader);
 
+#endif
@@ -0,0 +1,121 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+#include "regionDecode.h"
+#include "expandKernels.h"
+#include "trace.h"
+
+// Inflates the reader's IDAT data until 'size' bytes are out or the data ends.
+static bool inflateFromReader(struct pngReader &reader, unsigned char *out, size_t size, size_t &produced) {
+    TRACE_SCOPE("inflateRegion");
+    std::vector<unsigned char> input(REGION_READ_BYTES);
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = 0;
+    stream.next_in = Z_NULL;
+
+    if (inflateInit(&stream) != Z_OK) {
+        std::cerr << "Error initializing zlib inflate stream" << std::endl;
+        return false;
+    }
+
+    stream.next_out = out;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END && (size_t) (stream.next_out - out) < size) {
+        if (stream.avail_in == 0) {
+            long got = readIDATData(reader, input.data(), input.size());
+            if (got <= 0) {
+                break;
+            }
+            stream.next_in = input.data();
+            stream.avail_in = got;
+        }
+        stream.avail_out = (uInt) std::min(size - (stream.next_out - out), (size_t) 1 << 30);
+        ret = inflate(&stream, Z_NO_FLUSH);
+
+        if (ret < 0 && ret != Z_BUF_ERROR) {
+            std::cerr << "Error decompressing IDAT data, ret status: " << ret << std::endl;
+            inflateEnd(&stream);
+            return false;
+        }
+    }
+
+    produced = stream.next_out - out;
+    inflateEnd(&stream);
+    return true;
+}
+
+// Decodes the whole interlaced image in the output format, then copies the region out of it.
+static bool decodeInterlacedRegion(struct pngReader &reader, const struct regionOfInterest &region, const struct outputDescriptor &output, struct regionDecodeStats &stats) {
+    const struct ihdr &ihdrData = reader.ihdrData;
+    size_t inflatedSize = getInflatedSize(ihdrData);
+    std::vector<unsigned char> inflated(inflatedSize);
+
+    if (!inflateFromReader(reader, inflated.data(), inflatedSize, stats.inflatedBytes) || stats.inflatedBytes < inflatedSize) {
+        std::cerr << "Decompressed data too short for a " << ihdrData.width << " x " << ihdrData.height << " image" << std::endl;
+        return false;
+    }
+    stats.rowsDecoded = ihdrData.height;
+
+    int pixelBytes = getPixelFormatBytes(output.format);
+    size_t imageStride = (size_t) ihdrData.width * pixelBytes;
+    std::vector<unsigned char> image(imageStride * ihdrData.height);
+    struct outputDescriptor imageOutput = {image.data(), imageStride, output.format};
+    if (!defilterIDAT(inflated, ihdrData, std::vector<restartPoint>(), imageOutput)) {
+        return false;
+    }
+
+    for (int y = 0; y < region.height; y++) {
+        std::memcpy(output.pixels + y * output.stride, image.data() + (region.y + y) * imageStride + (size_t) region.x * pixelBytes, (size_t) region.width * pixelBytes);
+    }
+    return true;
+}
+
+bool decodeRegion(const char *filename, const struct regionOfInterest &region, const struct outputDescriptor &output, struct ihdr &ihdrData, struct regionDecodeStats *stats) {
+    TRACE_SCOPE("decodeRegion");
+    struct regionDecodeStats localStats;
+    struct regionDecodeStats &counts = stats != NULL ? *stats : localStats;
+    struct pngReader reader;
+
+    counts = regionDecodeStats();
+    if (!openPNGReader(filename, reader)) {
+        return false;
+    }
+    ihdrData = reader.ihdrData;
+
+    if (region.x < 0 || region.y < 0 || region.width <= 0 || region.height <= 0 ||
+        region.x > ihdrData.width - region.width || region.y > ihdrData.height - region.height) {
+        std::cerr << "Region " << region.width << " x " << region.height << " at (" << region.x << ", " << region.y << ") is not inside the "
+                  << ihdrData.width << " x " << ihdrData.height << " image" << std::endl;
+        closePNGReader(reader);
+        return false;
+    }
+
+    bool ok;
+    if (ihdrData.interlaceMethod == 1) {
+        ok = decodeInterlacedRegion(reader, region, output, counts);
+    } else {
+        int bitsPerPixel = getBitsPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+        int endRow = region.y + region.height;
+        // every row down to the region's last is needed: each can depend on the one above
+        size_t neededSize = (size_t) endRow * (getRowBytes(ihdrData.width, bitsPerPixel) + 1);
+        std::vector<unsigned char> inflated(neededSize);
+
+        ok = inflateFromReader(reader, inflated.data(), neededSize, counts.inflatedBytes);
+        if (ok && counts.inflatedBytes < neededSize) {
+            std::cerr << "IDAT data ended before row " << endRow << std::endl;
+            ok = false;
+        }
+        counts.rowsDecoded = endRow;
+        ok = ok && defilterRegion(inflated.data(), ihdrData, region, output);
+    }
+
+    counts.idatBytesRead = reader.idatBytesRead;
+    closePNGReader(reader);
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef _REGION_DECODE_H_
+#define _REGION_DECODE_H_
+
+#include <cstddef>
+
+#include "readImage.h"
+#include "processImage.h"
+
+// IDAT bytes read from the file per step while inflating a region.
+#define REGION_READ_BYTES (64 * 1024)
+
+// What a region decode had to touch, to compare against a full decode.
+struct regionDecodeStats {
+    // IDAT payload read from the file
+    size_t idatBytesRead = 0;
+    size_t inflatedBytes = 0;
+    // filtered rows inflated and defiltered
+    int rowsDecoded = 0;
+};
+
+/**
+ * Decodes only 'region' of the PNG 'filename' into 'output', which needs room for
+ * region.height rows of region.width pixels.
+ *
+ * The file is read with pread a piece at a time and inflated only down to the last row of the
+ * region; the IDAT data after that, and the rest of the file, is never read. Only the region's
+ * columns are converted and written. Interlaced images spread every row over all seven passes,
+ * so for them the whole image is decoded and the region copied out.
+ *
+ * @param ihdrData Receives the image's header.
+ * @return false if the file cannot be decoded or the region is not inside the image.
+*/
+bool decodeRegion(const char *filename, const struct regionOfInterest &region, const struct outputDescriptor &output, struct ihdr &ihdrData, struct regionDecodeStats *stats = NULL);
+
+#endif
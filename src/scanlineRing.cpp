@@ -0,0 +1,48 @@
+#include <thread>
+
+#include "scanlineRing.h"
+
+// Polls of the other side's counter before each yield.
+#define RING_SPINS 64
+
+ScanlineRing::ScanlineRing(size_t slotBytes, int slots) : storage(slotBytes * (slots > 0 ? slots : 1)), slotBytes(slotBytes), slots(slots > 0 ? slots : 1),
+                                                         written(0), read(0), stopped(false) {
+}
+
+unsigned char *ScanlineRing::acquireWrite() {
+    size_t next = written.load(std::memory_order_relaxed);
+    for (int spins = 0; next - read.load(std::memory_order_acquire) == (size_t) slots; spins++) {
+        if (isStopped()) {
+            return NULL;
+        }
+        if (spins >= RING_SPINS) {
+            std::this_thread::yield();
+        }
+    }
+    return isStopped() ? NULL : storage.data() + (next % slots) * slotBytes;
+}
+
+void ScanlineRing::commitWrite() {
+    written.store(written.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+const unsigned char *ScanlineRing::acquireRead() {
+    size_t next = read.load(std::memory_order_relaxed);
+    for (int spins = 0; written.load(std::memory_order_acquire) == next; spins++) {
+        if (isStopped()) {
+            return NULL;
+        }
+        if (spins >= RING_SPINS) {
+            std::this_thread::yield();
+        }
+    }
+    return isStopped() ? NULL : storage.data() + (next % slots) * slotBytes;
+}
+
+void ScanlineRing::commitRead() {
+    read.store(read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void ScanlineRing::stop() {
+    stopped.store(true, std::memory_order_release);
+}
@@ -0,0 +1,46 @@
+#ifndef _SCANLINE_RING_H_
+#define _SCANLINE_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Bounded ring of fixed size scanline slots passed from one producer thread to one consumer
+ * thread without locks. Each side owns one counter (rows written, rows read) and only reads the
+ * other's, so a slot changes hands through a single release store and acquire load. A side that
+ * finds the ring full (or empty) spins briefly and then yields, which is the backpressure.
+ *
+ * Either side can stop the ring, e.g. on a decode error; every wait then returns NULL.
+*/
+class ScanlineRing {
+public:
+    ScanlineRing(size_t slotBytes, int slots);
+
+    // Producer: the next free slot, waiting while the ring is full. NULL once stopped.
+    unsigned char *acquireWrite();
+    // Producer: hands the slot from acquireWrite to the consumer.
+    void commitWrite();
+
+    // Consumer: the oldest written slot, waiting while the ring is empty. NULL once stopped.
+    const unsigned char *acquireRead();
+    // Consumer: gives the slot from acquireRead back to the producer.
+    void commitRead();
+
+    void stop();
+    bool isStopped() const { return stopped.load(std::memory_order_acquire); }
+
+    int slotCount() const { return slots; }
+
+private:
+    std::vector<unsigned char> storage;
+    size_t slotBytes;
+    int slots;
+
+    // each counter on a cache line of its own, so the two threads do not share one
+    alignas(64) std::atomic<size_t> written;
+    alignas(64) std::atomic<size_t> read;
+    alignas(64) std::atomic<bool> stopped;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "threadPool.h"
+
+// The pool and worker index of the calling thread; set once when a worker starts.
+static thread_local WorkStealingPool *currentPool = NULL;
+static thread_local int currentWorkerIndex = -1;
+
+WorkStealingPool::WorkStealingPool(int threads) : nextQueue(0), pending(0), queued(0), stopping(false) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        queues.emplace_back(new WorkerQueue());
+    }
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+int WorkStealingPool::currentWorker() {
+    return currentWorkerIndex;
+}
+
+void WorkStealingPool::submit(std::function<void()> task) {
+    bool fromWorker = currentPool == this;
+    int target = fromWorker ? currentWorkerIndex : (int) (nextQueue++ % queues.size());
+
+    pending++;
+    {
+        std::lock_guard<std::mutex> guard(queues[target]->lock);
+        if (fromWorker) {
+            queues[target]->tasks.push_front(std::move(task));
+        } else {
+            queues[target]->tasks.push_back(std::move(task));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        queued++;
+    }
+    workAvailable.notify_one();
+}
+
+bool WorkStealingPool::popTask(int worker, std::function<void()> &task) {
+    // own work first, newest first
+    {
+        WorkerQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // then steal from the back of the others' deques, the end their owners leave alone, starting with the next worker along
+    for (size_t i = 1; i < queues.size(); i++) {
+        WorkerQueue &victim = *queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(int worker) {
+    currentPool = this;
+    currentWorkerIndex = worker;
+
+    while (true) {
+        std::function<void()> task;
+
+        if (popTask(worker, task)) {
+            queued--;
+            task();
+
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> guard(idleLock);
+                allDone.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(idleLock);
+        workAvailable.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> guard(idleLock);
+    allDone.wait(guard, [this] { return pending == 0; });
+}
@@ -0,0 +1,60 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed size thread pool with one task deque per worker.
+ *
+ * A task submitted from inside a worker goes to the front of that worker's own deque and is run
+ * next (LIFO, so sub-tasks of an image run while its data is still in cache). Tasks submitted
+ * from outside are dealt round-robin to the back of the deques. A worker whose deque is empty
+ * steals from the back of the other workers' deques, the end their owners do not take from: that
+ * is the most recent task dealt from outside, or failing that the owner's oldest sub-task.
+*/
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int threads);
+    ~WorkStealingPool();
+
+    void submit(std::function<void()> task);
+
+    // Blocks until every submitted task, including tasks submitted by tasks, has finished.
+    void wait();
+
+    int threadCount() const { return (int) workers.size(); }
+
+    // Index of the calling worker in its pool, or -1 when called from outside a pool.
+    static int currentWorker();
+
+private:
+    struct WorkerQueue {
+        std::mutex lock;
+        std::deque<std::function<void()> > tasks;
+    };
+
+    bool popTask(int worker, std::function<void()> &task);
+    void workerLoop(int worker);
+
+    std::vector<std::unique_ptr<WorkerQueue> > queues;
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> nextQueue;
+
+    // tasks submitted but not yet finished
+    std::atomic<long> pending;
+    // tasks sitting in a deque, used to put idle workers to sleep
+    std::atomic<long> queued;
+    bool stopping;
+    std::mutex idleLock;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+};
+
+#endif
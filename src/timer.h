@@ -10,17 +10,19 @@ GET_TIME(end);
 Then the elapsed time would be
 end-start
 
+The clock is CLOCK_MONOTONIC, so intervals are not affected by changes to the system time.
+
 */
 
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-#include <sys/time.h>
+#include <time.h>
 
 #define GET_TIME(now) { \
-   struct timeval t; \
-   gettimeofday(&t, NULL); \
-   now = t.tv_sec + t.tv_usec/1000000.0; \
+   struct timespec t; \
+   clock_gettime(CLOCK_MONOTONIC, &t); \
+   now = t.tv_sec + t.tv_nsec/1000000000.0; \
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include "trace.h"
+
+#ifdef ENABLE_TRACE
+
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+
+struct traceEvent {
+    const char *name;
+    // 'X' for a span, 'C' for counters
+    char phase;
+    uint64_t start;
+    uint64_t end;
+    // one optional argument for spans, up to TRACE_MAX_COUNTERS for counters
+    const char *const *argNames;
+    const char *argName;
+    long args[TRACE_MAX_COUNTERS];
+    int argCount;
+};
+
+// Written only by its own thread. 'count' is published with release so the exporter
+// sees complete events. When the thread exits its events are copied out into a
+// retiredEvents, and the buffer goes on a free list for the next thread to start.
+struct traceBuffer {
+    int threadIndex;
+    std::atomic<size_t> count;
+    std::atomic<size_t> dropped;
+    traceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+// The events of a thread that has exited, sized to what it recorded.
+struct retiredEvents {
+    int threadIndex;
+    size_t dropped;
+    std::vector<traceEvent> events;
+};
+
+// Returns the thread's buffer when it exits.
+struct localBufferHolder {
+    traceBuffer *buffer = nullptr;
+    ~localBufferHolder();
+};
+
+static std::mutex registryLock;
+// buffers of the threads still running
+static std::vector<traceBuffer*> registry;
+static std::vector<traceBuffer*> freeBuffers;
+static std::vector<retiredEvents> retired;
+static int threadCount = 0;
+static thread_local localBufferHolder localBuffer;
+static uint64_t traceEpoch = traceNow();
+
+uint64_t traceNow() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void exportAtExit() {
+    const char *path = getenv("TRACE_FILE");
+    traceExport(path != NULL ? path : "trace.json");
+}
+
+// The calling thread's buffer, registered on first use. Only this step takes a lock.
+static traceBuffer *getLocalBuffer() {
+    if (localBuffer.buffer == nullptr) {
+        std::lock_guard<std::mutex> guard(registryLock);
+        traceBuffer *buffer;
+        if (!freeBuffers.empty()) {
+            buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        } else {
+            buffer = new traceBuffer();
+        }
+        buffer->count = 0;
+        buffer->dropped = 0;
+
+        if (threadCount == 0) {
+            atexit(exportAtExit);
+        }
+        buffer->threadIndex = threadCount++;
+        registry.push_back(buffer);
+        localBuffer.buffer = buffer;
+    }
+    return localBuffer.buffer;
+}
+
+localBufferHolder::~localBufferHolder() {
+    if (buffer == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(registryLock);
+    size_t count = buffer->count.load(std::memory_order_acquire);
+    retired.push_back({buffer->threadIndex, buffer->dropped.load(), std::vector<traceEvent>(buffer->events, buffer->events + count)});
+    for (size_t i = 0; i < registry.size(); i++) {
+        if (registry[i] == buffer) {
+            registry.erase(registry.begin() + i);
+            break;
+        }
+    }
+    freeBuffers.push_back(buffer);
+    buffer = nullptr;
+}
+
+// Returns the next free event, or NULL if the buffer is full.
+static traceEvent *nextEvent(traceBuffer *buffer) {
+    size_t index = buffer->count.load(std::memory_order_relaxed);
+    if (index >= TRACE_BUFFER_EVENTS) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    return &buffer->events[index];
+}
+
+void traceSpan(const char *name, uint64_t start, uint64_t end, const char *argName, long argValue) {
+    traceBuffer *buffer = getLocalBuffer();
+    traceEvent *event = nextEvent(buffer);
+    if (event == NULL) {
+        return;
+    }
+
+    event->name = name;
+    event->phase = 'X';
+    event->start = start;
+    event->end = end;
+    event->argNames = NULL;
+    event->argName = argName;
+    event->args[0] = argValue;
+    event->argCount = argName != nullptr ? 1 : 0;
+    buffer->count.fetch_add(1, std::memory_order_release);
+}
+
+void traceCounters(const char *name, const char *const *counterNames, const long *values, int count) {
+    traceBuffer *buffer = getLocalBuffer();
+    traceEvent *event = nextEvent(buffer);
+    if (event == NULL) {
+        return;
+    }
+
+    event->name = name;
+    event->phase = 'C';
+    event->start = event->end = traceNow();
+    event->argNames = counterNames;
+    event->argName = NULL;
+    event->argCount = count < TRACE_MAX_COUNTERS ? count : TRACE_MAX_COUNTERS;
+    for (int i = 0; i < event->argCount; i++) {
+        event->args[i] = values[i];
+    }
+    buffer->count.fetch_add(1, std::memory_order_release);
+}
+
+bool traceExport(const char *path) {
+    std::lock_guard<std::mutex> guard(registryLock);
+    std::ofstream out(path);
+    size_t dropped = 0;
+    int pid = getpid();
+    bool first = true;
+
+    if (!out) {
+        std::cerr << "Cannot write trace " << path << std::endl;
+        return false;
+    }
+
+    // timestamps are in microseconds
+    out << "{\"traceEvents\": [";
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    auto writeEvents = [&](int threadIndex, const traceEvent *events, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            const traceEvent &event = events[i];
+            out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"" << event.phase << "\", \"pid\": " << pid
+                << ", \"tid\": " << threadIndex << ", \"ts\": " << (event.start - traceEpoch) / 1000.0;
+            if (event.phase == 'X') {
+                out << ", \"dur\": " << (event.end - event.start) / 1000.0;
+            }
+            out << ", \"args\": {";
+            for (int arg = 0; arg < event.argCount; arg++) {
+                out << (arg ? ", " : "") << "\"" << (event.argNames != NULL ? event.argNames[arg] : event.argName) << "\": " << event.args[arg];
+            }
+            out << "}}";
+            first = false;
+        }
+    };
+    for (traceBuffer *buffer : registry) {
+        dropped += buffer->dropped;
+        writeEvents(buffer->threadIndex, buffer->events, buffer->count.load(std::memory_order_acquire));
+    }
+    for (const retiredEvents &thread : retired) {
+        dropped += thread.dropped;
+        writeEvents(thread.threadIndex, thread.events.data(), thread.events.size());
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"droppedEvents\": " << dropped << "}}\n";
+
+    if (dropped > 0) {
+        std::cerr << "Trace buffers were full, " << dropped << " events dropped" << std::endl;
+    }
+    return out.good();
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+Hot path tracing, exported in the Chrome trace_event format (open the file in chrome://tracing
+or https://ui.perfetto.dev).
+
+Tracing is compiled in only when ENABLE_TRACE is defined (make TRACE=1); otherwise every macro
+below expands to nothing. When enabled, each thread records into its own fixed size buffer
+without locking; when the thread exits its events are copied out and the buffer is reused by
+the next thread to start. The trace is written when the program exits, to the file named by the
+TRACE_FILE environment variable or trace.json.
+
+TRACE_SCOPE("name");                     a span from here to the end of the enclosing block
+TRACE_SCOPE_ARG("name", "rows", count);  the same, with one integer argument
+TRACE_COUNTERS("name", names, values, n) a counter sample; names must be a static array
+
+Names must be string literals: only the pointer is stored.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#ifdef ENABLE_TRACE
+
+#include <cstdint>
+
+// Events each thread can record; later events are counted as dropped.
+#define TRACE_BUFFER_EVENTS (1 << 16)
+#define TRACE_MAX_COUNTERS 5
+
+// Nanoseconds on the monotonic clock.
+uint64_t traceNow();
+
+void traceSpan(const char *name, uint64_t start, uint64_t end, const char *argName, long argValue);
+
+void traceCounters(const char *name, const char *const *counterNames, const long *values, int count);
+
+// Writes every thread's events to 'path'. Called automatically at exit.
+bool traceExport(const char *path);
+
+class TraceScope {
+public:
+    TraceScope(const char *name, const char *argName = nullptr, long argValue = 0) : name(name), argName(argName), argValue(argValue), start(traceNow()) {}
+    ~TraceScope() {
+        traceSpan(name, start, traceNow(), argName, argValue);
+    }
+
+private:
+    const char *name;
+    const char *argName;
+    long argValue;
+    uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, argName, argValue) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name, argName, argValue)
+#define TRACE_COUNTERS(name, counterNames, values, count) traceCounters(name, counterNames, values, count)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_ARG(name, argName, argValue)
+#define TRACE_COUNTERS(name, counterNames, values, count)
+
+#endif
+
+#endif
@@ -0,0 +1,342 @@
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+// parallelization
+#include <omp.h>
+
+#include "writeImage.h"
+#include "processImage.h"
+
+// Target amount of filtered input per deflate band when encodeOptions.bandRows is 0.
+#define ENCODE_BAND_BYTES (256 * 1024)
+
+// zlib's maximum window; the dictionary handed to each band when bands are chained.
+#define DEFLATE_WINDOW_BYTES 32768
+
+// Largest IDAT payload written; the spec caps chunk lengths at 2^31 - 1 bytes.
+#define IDAT_CHUNK_MAX_BYTES ((size_t) 1 << 30)
+
+static void appendBigEndian32(std::vector<unsigned char> &out, size_t value) {
+    out.push_back((value >> 24) & 0xff);
+    out.push_back((value >> 16) & 0xff);
+    out.push_back((value >> 8) & 0xff);
+    out.push_back(value & 0xff);
+}
+
+// Appends a complete chunk: length, type, payload and the CRC over type + payload.
+static void appendChunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, size_t size) {
+    appendBigEndian32(out, size);
+    out.insert(out.end(), type, type + 4);
+    if (size > 0) {
+        out.insert(out.end(), data, data + size);
+    }
+
+    // crc32 treats a NULL buffer as a request for its initial value, so skip empty payloads
+    uLong crc = crc32(0L, (const Bytef *) type, 4);
+    if (size > 0) {
+        crc = crc32(crc, data, size);
+    }
+    appendBigEndian32(out, crc);
+}
+
+static int chooseThreads(const struct encodeOptions &options) {
+    return options.threads > 0 ? options.threads : omp_get_max_threads();
+}
+
+static int chooseBandRows(size_t colWidth, int height, const struct encodeOptions &options) {
+    int bandRows = options.bandRows > 0 ? options.bandRows : (int) std::max((size_t) 1, ENCODE_BAND_BYTES / colWidth);
+    return std::min(bandRows, std::max(height, 1));
+}
+
+// Applies one filter type to a row. 'prev' is the unfiltered row above, or NULL for the first row.
+static void filterRow(int filter, const unsigned char *row, const unsigned char *prev, int rowBytes, int bytesPerPixel, unsigned char *out) {
+    for (int i = 0; i < rowBytes; i++) {
+        int left = i < bytesPerPixel ? 0 : row[i - bytesPerPixel];
+        int up = prev == NULL ? 0 : prev[i];
+        int leftUp = (prev == NULL || i < bytesPerPixel) ? 0 : prev[i - bytesPerPixel];
+        int predictor;
+
+        switch (filter) {
+            case 1:
+                predictor = left;
+                break;
+            case 2:
+                predictor = up;
+                break;
+            case 3:
+                predictor = (left + up) >> 1;
+                break;
+            case 4: {
+                int pa = std::abs(up - leftUp), pb = std::abs(left - leftUp), pc = std::abs(left + up - 2 * leftUp);
+                predictor = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : leftUp);
+                break;
+            }
+            default:
+                predictor = 0;
+                break;
+        }
+        out[i] = row[i] - predictor;
+    }
+}
+
+// Sum of the filtered bytes read as signed values; smaller usually deflates better.
+static long filterCost(const unsigned char *filtered, int rowBytes) {
+    long cost = 0;
+    for (int i = 0; i < rowBytes; i++) {
+        cost += std::abs((int) (signed char) filtered[i]);
+    }
+    return cost;
+}
+
+void filterRows(const unsigned char *pixels, int width, int height, int bytesPerPixel, const std::vector<int> &independentRows, int threads, std::vector<unsigned char> &filtered) {
+    int rowBytes = width * bytesPerPixel;
+    size_t colWidth = rowBytes + 1;
+    std::vector<bool> independent(height, false);
+
+    for (int row : independentRows) {
+        if (row >= 0 && row < height) {
+            independent[row] = true;
+        }
+    }
+
+    filtered.resize(colWidth * height);
+
+    #pragma omp parallel num_threads(threads)
+    {
+        std::vector<unsigned char> candidate(rowBytes);
+
+        #pragma omp for schedule(static)
+        for (int row = 0; row < height; row++) {
+            const unsigned char *currRow = pixels + (size_t) row * rowBytes;
+            const unsigned char *prevRow = row == 0 ? NULL : currRow - rowBytes;
+            unsigned char *out = &filtered[row * colWidth];
+            int lastFilter = independent[row] ? 1 : 4;
+            long bestCost = -1;
+
+            for (int filter = 0; filter <= lastFilter; filter++) {
+                filterRow(filter, currRow, prevRow, rowBytes, bytesPerPixel, candidate.data());
+                long cost = filterCost(candidate.data(), rowBytes);
+                if (bestCost == -1 || cost < bestCost) {
+                    bestCost = cost;
+                    out[0] = filter;
+                    std::copy(candidate.begin(), candidate.end(), out + 1);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Raw-deflates one band. Every band except the last ends on a sync flush so the next band's
+ * output can be appended directly; the last band finishes the deflate stream.
+*/
+static bool deflateBand(const unsigned char *input, size_t inputSize, const unsigned char *dictionary, size_t dictionarySize, bool lastBand, int level, std::vector<unsigned char> &output) {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+
+    // negative window bits: raw deflate, the zlib header and trailer are written once for all bands
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    if (dictionarySize > 0 && deflateSetDictionary(&stream, dictionary, dictionarySize) != Z_OK) {
+        deflateEnd(&stream);
+        return false;
+    }
+
+    // deflateBound covers the data; the sync flush adds at most a few bytes of empty stored block
+    output.resize(deflateBound(&stream, inputSize) + 16);
+    stream.next_in = const_cast<unsigned char *>(input);
+    stream.avail_in = inputSize;
+    stream.next_out = output.data();
+    stream.avail_out = output.size();
+
+    int ret = deflate(&stream, lastBand ? Z_FINISH : Z_SYNC_FLUSH);
+    bool complete = lastBand ? ret == Z_STREAM_END : (ret == Z_OK && stream.avail_in == 0 && stream.avail_out > 0);
+
+    output.resize(output.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    return complete;
+}
+
+bool compressIDAT(const std::vector<unsigned char> &filteredData, int height, const struct encodeOptions &options, std::vector<unsigned char> &compressedData, std::vector<restartPoint> *restartPoints) {
+    if (height <= 0 || filteredData.size() % height != 0) {
+        std::cerr << "Filtered data does not divide into " << height << " rows" << std::endl;
+        return false;
+    }
+
+    size_t colWidth = filteredData.size() / height;
+    int bandRows = chooseBandRows(colWidth, height, options);
+    int bandCount = (height + bandRows - 1) / bandRows;
+    bool chained = restartPoints == NULL;
+    std::vector<std::vector<unsigned char> > bandOutput(bandCount);
+    std::vector<uLong> bandAdler(bandCount);
+    bool failed = false;
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(chooseThreads(options))
+    for (int band = 0; band < bandCount; band++) {
+        size_t begin = (size_t) band * bandRows * colWidth;
+        size_t end = std::min((size_t) (band + 1) * bandRows, (size_t) height) * colWidth;
+
+        // Like pigz, prime each band with the input just before it so matches can reach back
+        // across the boundary. Independent bands (for a restart index) start from nothing.
+        size_t dictionarySize = chained ? std::min(begin, (size_t) DEFLATE_WINDOW_BYTES) : 0;
+
+        if (!deflateBand(filteredData.data() + begin, end - begin, filteredData.data() + begin - dictionarySize, dictionarySize,
+                         band == bandCount - 1, options.compressionLevel, bandOutput[band])) {
+            #pragma omp atomic write
+            failed = true;
+            continue;
+        }
+        bandAdler[band] = adler32(adler32(0L, Z_NULL, 0), filteredData.data() + begin, end - begin);
+    }
+
+    if (failed) {
+        std::cerr << "Error compressing IDAT data" << std::endl;
+        return false;
+    }
+
+    // zlib header: deflate with a 32K window, FLEVEL from the compression level, FCHECK so the
+    // two bytes are a multiple of 31
+    int level = options.compressionLevel == Z_DEFAULT_COMPRESSION ? 6 : options.compressionLevel;
+    int flevel = level < 2 ? 0 : (level < 6 ? 1 : (level == 6 ? 2 : 3));
+    unsigned char cmf = 0x78;
+    unsigned char flg = flevel << 6;
+    flg += 31 - ((cmf << 8) | flg) % 31;
+
+    compressedData.clear();
+    compressedData.push_back(cmf);
+    compressedData.push_back(flg);
+
+    if (restartPoints != NULL) {
+        restartPoints->clear();
+    }
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (int band = 0; band < bandCount; band++) {
+        size_t bandInput = (std::min((band + 1) * bandRows, height) - band * bandRows) * colWidth;
+
+        if (restartPoints != NULL) {
+            restartPoints->push_back({band * bandRows, compressedData.size()});
+        }
+        compressedData.insert(compressedData.end(), bandOutput[band].begin(), bandOutput[band].end());
+        adler = adler32_combine(adler, bandAdler[band], bandInput);
+    }
+    appendBigEndian32(compressedData, adler);
+
+    return true;
+}
+
+bool encodePNG(const std::vector<unsigned char> &imageData, const struct ihdr &ihdrData, const struct encodeOptions &options, std::vector<unsigned char> &pngData) {
+    int bytesPerPixel = getBytesPerPixel(ihdrData.colorType, ihdrData.channelDepth);
+
+    if (bytesPerPixel == -1 || ihdrData.interlaceMethod != 0) {
+        std::cerr << "Only non-interlaced images with whole-byte pixels can be encoded" << std::endl;
+        return false;
+    }
+    if (ihdrData.width <= 0 || ihdrData.height <= 0 || imageData.size() != (size_t) ihdrData.width * ihdrData.height * bytesPerPixel) {
+        std::cerr << "Image data does not match a " << ihdrData.width << " x " << ihdrData.height << " image" << std::endl;
+        return false;
+    }
+    if (ihdrData.colorType == 3 && (ihdrData.paletteSize <= 0 || ihdrData.paletteSize > 256)) {
+        std::cerr << "Indexed color images need a palette of 1 to 256 entries" << std::endl;
+        return false;
+    }
+
+    size_t colWidth = (size_t) ihdrData.width * bytesPerPixel + 1;
+    std::vector<unsigned char> filteredData, compressedData;
+    std::vector<restartPoint> restartPoints;
+    std::vector<int> independentRows;
+
+    // with a restart index each band's first row must not depend on the previous band
+    if (options.restartIndex) {
+        int bandRows = chooseBandRows(colWidth, ihdrData.height, options);
+        for (int row = bandRows; row < ihdrData.height; row += bandRows) {
+            independentRows.push_back(row);
+        }
+    }
+
+    filterRows(imageData.data(), ihdrData.width, ihdrData.height, bytesPerPixel, independentRows, chooseThreads(options), filteredData);
+
+    if (!compressIDAT(filteredData, ihdrData.height, options, compressedData, options.restartIndex ? &restartPoints : NULL)) {
+        return false;
+    }
+
+    unsigned char pngHeader[8] = PNG_HEADER;
+    pngData.assign(pngHeader, pngHeader + 8);
+
+    std::vector<unsigned char> ihdrChunk;
+    appendBigEndian32(ihdrChunk, ihdrData.width);
+    appendBigEndian32(ihdrChunk, ihdrData.height);
+    ihdrChunk.push_back(ihdrData.channelDepth);
+    ihdrChunk.push_back(ihdrData.colorType);
+    ihdrChunk.push_back(0); // compression method: deflate
+    ihdrChunk.push_back(0); // filter method: adaptive
+    ihdrChunk.push_back(0); // interlace method: none
+    appendChunk(pngData, "IHDR", ihdrChunk.data(), ihdrChunk.size());
+
+    // PLTE, with a tRNS up to the last entry that is not opaque; or the colour key of greyscale and truecolor images
+    std::vector<unsigned char> transparency;
+    if (ihdrData.colorType == 3) {
+        std::vector<unsigned char> palette;
+        int alphaEntries = 0;
+        for (int i = 0; i < ihdrData.paletteSize; i++) {
+            palette.insert(palette.end(), ihdrData.palette[i], ihdrData.palette[i] + 3);
+            if (ihdrData.palette[i][3] != 255) {
+                alphaEntries = i + 1;
+            }
+        }
+        appendChunk(pngData, "PLTE", palette.data(), palette.size());
+        for (int i = 0; i < alphaEntries; i++) {
+            transparency.push_back(ihdrData.palette[i][3]);
+        }
+    } else if ((ihdrData.colorType == 0 || ihdrData.colorType == 2) && ihdrData.transparentKey[0] != -1) {
+        for (int c = 0; c < (ihdrData.colorType == 2 ? 3 : 1); c++) {
+            transparency.push_back((ihdrData.transparentKey[c] >> 8) & 0xff);
+            transparency.push_back(ihdrData.transparentKey[c] & 0xff);
+        }
+    }
+    if (!transparency.empty()) {
+        appendChunk(pngData, "tRNS", transparency.data(), transparency.size());
+    }
+
+    if (restartPoints.size() > 1) {
+        std::vector<unsigned char> index;
+        appendBigEndian32(index, restartPoints.size());
+        for (const restartPoint &point : restartPoints) {
+            appendBigEndian32(index, point.firstRow);
+            appendBigEndian32(index, point.offset);
+        }
+        appendChunk(pngData, "yiDX", index.data(), index.size());
+    }
+
+    // restart offsets count IDAT payload bytes only, so splitting the stream leaves them valid
+    for (size_t offset = 0; offset < compressedData.size(); offset += IDAT_CHUNK_MAX_BYTES) {
+        appendChunk(pngData, "IDAT", compressedData.data() + offset, std::min(IDAT_CHUNK_MAX_BYTES, compressedData.size() - offset));
+    }
+    appendChunk(pngData, "IEND", NULL, 0);
+
+    return true;
+}
+
+bool writePNGImage(const char *filename, const std::vector<unsigned char> &imageData, const struct ihdr &ihdrData, const struct encodeOptions &options) {
+    std::vector<unsigned char> pngData;
+
+    if (!encodePNG(imageData, ihdrData, options, pngData)) {
+        return false;
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.write((const char *) pngData.data(), pngData.size())) {
+        std::cerr << "Error writing " << filename << std::endl;
+        return false;
+    }
+
+    return true;
+}
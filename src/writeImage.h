@@ -0,0 +1,51 @@
+#ifndef _WRITE_IMAGE_H_
+#define _WRITE_IMAGE_H_
+
+#include <vector>
+#include <zlib.h>
+
+#include "readImage.h"
+
+struct encodeOptions {
+    // threads used for filtering and deflate, 0 for the OpenMP default
+    int threads = 0;
+    // scanlines per independently deflated band, 0 to size bands at roughly 256 KiB of input
+    int bandRows = 0;
+    int compressionLevel = Z_DEFAULT_COMPRESSION;
+    // Emit a yiDX restart index at the band boundaries. Bands are then compressed without
+    // the previous band's tail as a dictionary, which costs some compression ratio.
+    bool restartIndex = false;
+};
+
+/**
+ * Filters every scanline, choosing per row the filter type whose output has the smallest sum of
+ * absolute (signed) byte values. Rows are independent and are filtered in parallel.
+ *
+ * @param filtered Receives height * (width * bytesPerPixel + 1) bytes, each row prefixed by its filter type.
+ * @param independentRows Rows that must not depend on the row above; they are limited to None and Sub.
+*/
+void filterRows(const unsigned char *pixels, int width, int height, int bytesPerPixel, const std::vector<int> &independentRows, int threads, std::vector<unsigned char> &filtered);
+
+/**
+ * Compresses filtered scanlines into a single zlib stream, pigz style: bands of 'bandRows' rows are
+ * raw-deflated on separate threads, each ending on a sync flush (the last one finishing the stream).
+ * The zlib header, the concatenated bands and an adler32 trailer combined from the per-band
+ * checksums form the final stream.
+ *
+ * @param restartPoints If not NULL, bands are compressed independently and their starts are recorded here.
+*/
+bool compressIDAT(const std::vector<unsigned char> &filteredData, int height, const struct encodeOptions &options, std::vector<unsigned char> &compressedData, std::vector<restartPoint> *restartPoints);
+
+/**
+ * Encodes raw pixels as a complete PNG (signature, IHDR, PLTE and tRNS where needed, optional
+ * yiDX, IDAT, IEND) in memory. The pixel layout is given by the ihdr's color type and channel
+ * depth; only non-interlaced images with whole-byte pixels are supported. Indexed color images
+ * take their palette from the ihdr (paletteSize entries, with alpha written to tRNS), and
+ * greyscale and truecolor ones a colour key from transparentKey. The compressed data is split
+ * into IDAT chunks of at most 1 GiB.
+*/
+bool encodePNG(const std::vector<unsigned char> &imageData, const struct ihdr &ihdrData, const struct encodeOptions &options, std::vector<unsigned char> &pngData);
+
+bool writePNGImage(const char *filename, const std::vector<unsigned char> &imageData, const struct ihdr &ihdrData, const struct encodeOptions &options);
+
+#endif